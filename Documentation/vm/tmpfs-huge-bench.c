@@ -0,0 +1,95 @@
+/*
+ * tmpfs-huge-bench: time random accesses to a shared mapping of a tmpfs
+ * file, to compare the huge= mount options of tmpfs.
+ *
+ * Usage: tmpfs-huge-bench <file on tmpfs> [size in MB] [accesses]
+ *
+ * For example:
+ *	mount -t tmpfs -o huge=never none /mnt/small
+ *	mount -t tmpfs -o huge=always none /mnt/huge
+ *	./tmpfs-huge-bench /mnt/small/f 4096
+ *	./tmpfs-huge-bench /mnt/huge/f 4096
+ *
+ * The file is created, filled through the mapping, and removed again.
+ * grep thp_file /proc/vmstat shows whether huge pmds were used.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define DEFAULT_SIZE_MB		1024UL
+#define DEFAULT_ACCESSES	(64UL * 1024 * 1024)
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long size = DEFAULT_SIZE_MB;
+	unsigned long accesses = DEFAULT_ACCESSES;
+	unsigned long i, words, sum = 0;
+	unsigned long long x = 88172645463325252ULL;
+	struct timespec start, end;
+	unsigned long *addr;
+	double secs;
+	int fd;
+
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "usage: %s <file> [size MB] [accesses]\n",
+			argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		size = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		accesses = strtoul(argv[3], NULL, 0);
+	size <<= 20;
+	words = size / sizeof(*addr);
+
+	fd = open(argv[1], O_CREAT | O_RDWR | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	unlink(argv[1]);
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < words; i++)
+		addr[i] = i;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = elapsed(&start, &end);
+	printf("fill:   %lu MB in %.3f s\n", size >> 20, secs);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < accesses; i++) {
+		/* xorshift64, cheap enough not to hide the TLB misses */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sum += addr[x % words];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = elapsed(&start, &end);
+	printf("random: %lu reads in %.3f s, %.1f ns each (sum %lx)\n",
+	       accesses, secs, secs * 1e9 / accesses, sum);
+
+	munmap(addr, size);
+	close(fd);
+	return 0;
+}
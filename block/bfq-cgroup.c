@@ -65,6 +65,13 @@ static inline void bfq_group_init_entity(struct bfqio_cgroup *bgrp,
 	entity->ioprio_class = entity->new_ioprio_class = bgrp->ioprio_class;
 	entity->ioprio_changed = 1;
 	entity->my_sched_data = &bfqg->sched_data;
+
+	bfqg->max_bps = bgrp->max_bps;
+	bfqg->max_iops = bgrp->max_iops;
+	/* Start with a full bucket, not throttled for the first jiffy */
+	bfqg->bps_tokens = (s64)(bfqg->max_bps * BFQ_CAPS_BURST);
+	bfqg->iops_tokens = (s64)(bfqg->max_iops * BFQ_CAPS_BURST);
+	bfqg->caps_last_refill = jiffies;
 }
 
 static inline void bfq_group_set_parent(struct bfq_group *bfqg,
@@ -587,6 +594,188 @@ STORE_FUNCTION(ioprio, 0, IOPRIO_BE_NR - 1);
 STORE_FUNCTION(ioprio_class, IOPRIO_CLASS_RT, IOPRIO_CLASS_IDLE);
 #undef STORE_FUNCTION
 
+#define SHOW_CAP_FUNCTION(__VAR)					\
+static u64 bfqio_cgroup_##__VAR##_read(struct cgroup *cgroup,		\
+				       struct cftype *cftype)		\
+{									\
+	struct bfqio_cgroup *bgrp;					\
+	u64 ret;							\
+									\
+	if (!cgroup_lock_live_group(cgroup))				\
+		return -ENODEV;						\
+									\
+	bgrp = cgroup_to_bfqio(cgroup);					\
+	spin_lock_irq(&bgrp->lock);					\
+	ret = bgrp->__VAR;						\
+	spin_unlock_irq(&bgrp->lock);					\
+									\
+	cgroup_unlock();						\
+									\
+	return ret;							\
+}
+
+SHOW_CAP_FUNCTION(max_bps);
+SHOW_CAP_FUNCTION(max_iops);
+#undef SHOW_CAP_FUNCTION
+
+/*
+ * Caps are enforced by the groups themselves, as an eligibility
+ * condition in the scheduler (see bfq_caps_lookup_next_entity()); the
+ * new values are picked up by each group at its next dispatch.  The
+ * root cgroup cannot be capped, as it has no entity to be throttled,
+ * and caps above BFQ_CAPS_MAX would overflow the token buckets.
+ */
+#define STORE_CAP_FUNCTION(__VAR)					\
+static int bfqio_cgroup_##__VAR##_write(struct cgroup *cgroup,		\
+					struct cftype *cftype,		\
+					u64 val)			\
+{									\
+	struct bfqio_cgroup *bgrp;					\
+	struct bfq_group *bfqg;						\
+	struct hlist_node *n;						\
+	int was_capped, capped;						\
+									\
+	if (cgroup->parent == NULL || val > BFQ_CAPS_MAX)		\
+		return -EINVAL;						\
+									\
+	if (!cgroup_lock_live_group(cgroup))				\
+		return -ENODEV;						\
+									\
+	bgrp = cgroup_to_bfqio(cgroup);					\
+									\
+	spin_lock_irq(&bgrp->lock);					\
+	was_capped = bgrp->max_bps != 0 || bgrp->max_iops != 0;		\
+	bgrp->__VAR = val;						\
+	capped = bgrp->max_bps != 0 || bgrp->max_iops != 0;		\
+	hlist_for_each_entry(bfqg, n, &bgrp->group_data, group_node)	\
+		bfqg->__VAR = val;					\
+	spin_unlock_irq(&bgrp->lock);					\
+									\
+	if (capped && !was_capped)					\
+		atomic_inc(&bfqio_nr_capped);				\
+	else if (!capped && was_capped)					\
+		atomic_dec(&bfqio_nr_capped);				\
+									\
+	cgroup_unlock();						\
+									\
+	return 0;							\
+}
+
+STORE_CAP_FUNCTION(max_bps);
+STORE_CAP_FUNCTION(max_iops);
+#undef STORE_CAP_FUNCTION
+
+/**
+ * bfq_account_dispatch_latency - account the dispatch latency of @rq.
+ * @bfqq: the queue @rq is being dispatched from.
+ * @rq: the request being dispatched.
+ *
+ * Must be called under the queue lock.
+ */
+static void bfq_account_dispatch_latency(struct bfq_queue *bfqq,
+					 struct request *rq)
+{
+	struct bfq_group *bfqg = container_of(bfqq->entity.sched_data,
+					      struct bfq_group, sched_data);
+	struct bfq_lat_hist *hist = &bfqg->dispatch_lat[bfqq->raising_coeff > 1];
+	unsigned int lat = jiffies_to_msecs(jiffies - rq->start_time);
+
+	hist->buckets[min_t(int, fls(lat), BFQ_LAT_BUCKETS - 1)]++;
+	hist->samples++;
+	hist->total += lat;
+	if (lat > hist->max)
+		hist->max = lat;
+}
+
+static void bfqio_show_lat_hist(struct seq_file *m, const char *dev,
+				const char *name, struct bfq_lat_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%s %s", dev, name);
+	for (i = 0; i < BFQ_LAT_BUCKETS; i++)
+		seq_printf(m, " %llu", (unsigned long long)hist->buckets[i]);
+	seq_printf(m, " samples %llu total_ms %llu max_ms %llu\n",
+		   (unsigned long long)hist->samples,
+		   (unsigned long long)hist->total,
+		   (unsigned long long)hist->max);
+}
+
+/*
+ * Show the dispatch latency histograms of all the groups belonging to
+ * @cgroup, one line per device and per weight-raising state.  Bucket
+ * i counts the requests that waited in the scheduler for less than
+ * 2^i msecs (and at least 2^(i-1) msecs, for i > 0).
+ */
+static int bfqio_cgroup_dispatch_latency_read(struct cgroup *cgroup,
+					      struct cftype *cftype,
+					      struct seq_file *m)
+{
+	struct bfqio_cgroup *bgrp;
+	struct bfq_group *bfqg;
+	struct bfq_data *bfqd;
+	struct bfq_lat_hist hist[2];
+	struct hlist_node *n;
+	struct device *dev;
+	char name[32];
+	unsigned long flags;
+
+	if (!cgroup_lock_live_group(cgroup))
+		return -ENODEV;
+
+	bgrp = cgroup_to_bfqio(cgroup);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(bfqg, n, &bgrp->group_data, group_node) {
+		bfqd = bfq_get_bfqd_locked(&bfqg->bfqd, &flags);
+		if (bfqd == NULL)
+			continue;
+
+		memcpy(hist, bfqg->dispatch_lat, sizeof(hist));
+		dev = bfqd->queue->backing_dev_info.dev;
+		strlcpy(name, dev ? dev_name(dev) : "?", sizeof(name));
+		bfq_put_bfqd_unlock(bfqd, &flags);
+
+		bfqio_show_lat_hist(m, name, "normal", &hist[0]);
+		bfqio_show_lat_hist(m, name, "raised", &hist[1]);
+	}
+	rcu_read_unlock();
+
+	cgroup_unlock();
+
+	return 0;
+}
+
+static int bfqio_cgroup_dispatch_latency_reset(struct cgroup *cgroup,
+					       unsigned int event)
+{
+	struct bfqio_cgroup *bgrp;
+	struct bfq_group *bfqg;
+	struct bfq_data *bfqd;
+	struct hlist_node *n;
+	unsigned long flags;
+
+	if (!cgroup_lock_live_group(cgroup))
+		return -ENODEV;
+
+	bgrp = cgroup_to_bfqio(cgroup);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(bfqg, n, &bgrp->group_data, group_node) {
+		bfqd = bfq_get_bfqd_locked(&bfqg->bfqd, &flags);
+		if (bfqd == NULL)
+			continue;
+
+		memset(bfqg->dispatch_lat, 0, sizeof(bfqg->dispatch_lat));
+		bfq_put_bfqd_unlock(bfqd, &flags);
+	}
+	rcu_read_unlock();
+
+	cgroup_unlock();
+
+	return 0;
+}
+
 static struct cftype bfqio_files[] = {
 	{
 		.name = "weight",
@@ -603,6 +792,21 @@ static struct cftype bfqio_files[] = {
 		.read_u64 = bfqio_cgroup_ioprio_class_read,
 		.write_u64 = bfqio_cgroup_ioprio_class_write,
 	},
+	{
+		.name = "max_bps",
+		.read_u64 = bfqio_cgroup_max_bps_read,
+		.write_u64 = bfqio_cgroup_max_bps_write,
+	},
+	{
+		.name = "max_iops",
+		.read_u64 = bfqio_cgroup_max_iops_read,
+		.write_u64 = bfqio_cgroup_max_iops_write,
+	},
+	{
+		.name = "dispatch_latency",
+		.read_seq_string = bfqio_cgroup_dispatch_latency_read,
+		.trigger = bfqio_cgroup_dispatch_latency_reset,
+	},
 };
 
 static int bfqio_populate(struct cgroup_subsys *subsys, struct cgroup *cgroup)
@@ -711,6 +915,9 @@ static void bfqio_destroy(struct cgroup_subsys *subsys, struct cgroup *cgroup)
 
 	BUG_ON(!hlist_empty(&bgrp->group_data));
 
+	if (bgrp->max_bps != 0 || bgrp->max_iops != 0)
+		atomic_dec(&bfqio_nr_capped);
+
 	kfree(bgrp);
 }
 
@@ -748,6 +955,11 @@ static inline void bfq_bfqq_move(struct bfq_data *bfqd,
 {
 }
 
+static inline void bfq_account_dispatch_latency(struct bfq_queue *bfqq,
+						struct request *rq)
+{
+}
+
 static inline void bfq_disconnect_groups(struct bfq_data *bfqd)
 {
 	bfq_put_async_queues(bfqd, bfqd->root_group);
@@ -63,6 +63,9 @@
 #include "bfq.h"
 #include "blk.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/bfq.h>
+
 /* Max number of dispatches in one round of service. */
 static const int bfq_quantum = 4;
 
@@ -464,6 +467,10 @@ static void bfq_add_rq_rb(struct request *rq)
 				     bfqq->last_rais_start_finish,
 				     jiffies_to_msecs(bfqq->
 					raising_cur_max_time));
+			trace_bfq_weight_raise(bfqd->queue, bfqq->pid,
+				bfqq->raising_coeff,
+				jiffies_to_msecs(bfqq->raising_cur_max_time),
+				!idle_for_long_time);
 		} else if (old_raising_coeff > 1) {
 			if (idle_for_long_time)
 				bfqq->raising_cur_max_time =
@@ -478,6 +485,9 @@ static void bfq_add_rq_rb(struct request *rq)
 					     bfqq->last_rais_start_finish,
 					     jiffies_to_msecs(bfqq->
 						raising_cur_max_time));
+				trace_bfq_weight_raise(bfqd->queue, bfqq->pid,
+					1, jiffies_to_msecs(bfqq->
+						raising_cur_max_time), 0);
 				}
 		}
 		if (old_raising_coeff != bfqq->raising_coeff)
@@ -499,6 +509,10 @@ add_bfqq_busy:
 				     bfqq->last_rais_start_finish,
 				     jiffies_to_msecs(bfqq->
 					raising_cur_max_time));
+			trace_bfq_weight_raise(bfqd->queue, bfqq->pid,
+				bfqq->raising_coeff,
+				jiffies_to_msecs(bfqq->raising_cur_max_time),
+				0);
                 }
                 bfq_updated_next_req(bfqd, bfqq);
 	}
@@ -658,6 +672,10 @@ static void __bfq_set_active_queue(struct bfq_data *bfqd,
 
 		bfq_log_bfqq(bfqd, bfqq, "set_active_queue, cur-budget = %lu",
 			     bfqq->entity.budget);
+		trace_bfq_queue_activate(bfqd->queue, bfqq->pid,
+					 bfqq->entity.budget,
+					 bfqq->entity.weight,
+					 bfqq->raising_coeff);
 	}
 
 	bfqd->active_queue = bfqq;
@@ -900,6 +918,9 @@ static void bfq_dispatch_insert(struct request_queue *q, struct request *rq)
 	struct bfq_data *bfqd = q->elevator->elevator_data;
 	struct bfq_queue *bfqq = RQ_BFQQ(rq);
 
+	bfq_account_dispatch_latency(bfqq, rq);
+	bfq_caps_charge(bfqq, rq);
+
 	bfq_remove_request(rq);
 	bfqq->dispatched++;
 	elv_dispatch_sort(q, rq);
@@ -1040,9 +1061,9 @@ static void __bfq_bfqq_recalc_budget(struct bfq_data *bfqd,
 				     enum bfqq_expiration reason)
 {
 	struct request *next_rq;
-	unsigned long budget, min_budget;
+	unsigned long budget, min_budget, old_max_budget;
 
-	budget = bfqq->max_budget;
+	budget = old_max_budget = bfqq->max_budget;
 	min_budget = bfq_min_budget(bfqd);
 
 	BUG_ON(bfqq != bfqd->active_queue);
@@ -1119,6 +1140,11 @@ static void __bfq_bfqq_recalc_budget(struct bfq_data *bfqd,
 			 */
 			budget = min(budget * 4, bfqd->bfq_max_budget);
 			break;
+		case BFQ_BFQQ_THROTTLED:
+			/*
+			 * Being throttled by the caps of its groups
+			 * tells nothing about the queue behavior.
+			 */
 		case BFQ_BFQQ_NO_MORE_REQUESTS:
 		       /*
 			* Leave the budget unchanged.
@@ -1155,6 +1181,9 @@ static void __bfq_bfqq_recalc_budget(struct bfq_data *bfqd,
 	bfq_log_bfqq(bfqd, bfqq, "head sect: %u, new budget %lu",
 			next_rq != NULL ? blk_rq_sectors(next_rq) : 0,
 			bfqq->entity.budget);
+	trace_bfq_budget_update(bfqd->queue, bfqq->pid, reason,
+				old_max_budget, bfqq->max_budget,
+				bfqq->entity.budget);
 }
 
 static unsigned long bfq_calc_max_budget(u64 peak_rate, u64 timeout)
@@ -1182,7 +1211,7 @@ static unsigned long bfq_calc_max_budget(u64 peak_rate, u64 timeout)
 static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 				int compensate, enum bfqq_expiration reason)
 {
-	u64 bw, usecs, expected, timeout;
+	u64 bw, usecs, expected, timeout, measured_bw;
 	ktime_t delta;
 	int update = 0;
 
@@ -1205,6 +1234,7 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 	 */
 	bw = (u64)bfqq->entity.service << BFQ_RATE_SHIFT;
 	do_div(bw, (unsigned long)usecs);
+	measured_bw = bw;
 
 	timeout = jiffies_to_msecs(bfqd->bfq_timeout[BLK_RW_SYNC]);
 
@@ -1242,6 +1272,11 @@ static int bfq_update_peak_rate(struct bfq_data *bfqd, struct bfq_queue *bfqq,
 			bfq_log(bfqd, "new max_budget=%lu",
 				bfqd->bfq_max_budget);
 		}
+
+		if (update)
+			trace_bfq_peak_rate(bfqd->queue, measured_bw,
+					    bfqd->peak_rate,
+					    bfqd->bfq_max_budget);
 	}
 
 	/*
@@ -1348,6 +1383,9 @@ static void bfq_bfqq_expire(struct bfq_data *bfqd,
 	bfq_log_bfqq(bfqd, bfqq,
 		"expire (%d, slow %d, num_disp %d, idle_win %d)", reason, slow,
 		bfqq->dispatched, bfq_bfqq_idle_window(bfqq));
+	trace_bfq_queue_expire(bfqd->queue, bfqq->pid, reason, slow,
+			       bfqq->entity.service, bfqq->entity.budget,
+			       bfqq->raising_coeff);
 
 	/* Increase, decrease or leave budget unchanged according to reason */
 	__bfq_bfqq_recalc_budget(bfqd, bfqq, reason);
@@ -1408,6 +1446,17 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
 
 	bfq_log_bfqq(bfqd, bfqq, "select_queue: already active queue");
 
+	/*
+	 * If some group of the active queue exceeded its bandwidth or
+	 * IOPS cap, the queue cannot be served any more until the caps
+	 * allow it again.
+	 */
+	if (bfq_bfqq_throttled(bfqq)) {
+		bfq_clear_bfqq_wait_request(bfqq);
+		reason = BFQ_BFQQ_THROTTLED;
+		goto expire;
+	}
+
 	/*
          * If another queue has a request waiting within our mean seek
          * distance, let it run. The expire code will check for close
@@ -1416,6 +1465,8 @@ static struct bfq_queue *bfq_select_queue(struct bfq_data *bfqd)
          * new bfqq.
          */
         new_bfqq = bfq_close_cooperator(bfqd, bfqq);
+	if (new_bfqq != NULL && bfq_bfqq_throttled(new_bfqq))
+		new_bfqq = NULL;
         if (new_bfqq != NULL && bfqq->new_bfqq == NULL)
                 bfq_setup_merge(bfqq, new_bfqq);
 
@@ -1485,6 +1536,16 @@ new_queue:
 	bfqq = bfq_set_active_queue(bfqd, new_bfqq);
 	bfq_log(bfqd, "select_queue: new queue %d returned",
 		bfqq != NULL ? bfqq->pid : 0);
+	if (bfqq == NULL && bfqd->caps_wait != 0) {
+		/*
+		 * All the backlogged groups are throttled, restart
+		 * dispatching as soon as the first of them may be
+		 * served again.
+		 */
+		bfq_log(bfqd, "select_queue: throttled, wait %lu",
+			bfqd->caps_wait);
+		mod_timer(&bfqd->caps_timer, jiffies + bfqd->caps_wait);
+	}
 keep_queue:
 	return bfqq;
 }
@@ -1519,16 +1580,23 @@ static void update_raising_data(struct bfq_data *bfqd, struct bfq_queue *bfqq)
 				bfqq->soft_rt_next_start < jiffies;
 
 			bfqq->last_rais_start_finish = jiffies;
-			if (soft_rt)
+			if (soft_rt) {
 				bfqq->raising_cur_max_time =
 					bfqd->bfq_raising_rt_max_time;
-			else {
+				trace_bfq_weight_raise(bfqd->queue, bfqq->pid,
+					bfqq->raising_coeff,
+					jiffies_to_msecs(bfqq->
+						raising_cur_max_time), 1);
+			} else {
 				bfq_log_bfqq(bfqd, bfqq,
 					     "wrais ending at %llu msec,"
 					     "rais_max_time %u",
 					     bfqq->last_rais_start_finish,
 					     jiffies_to_msecs(bfqq->
 						raising_cur_max_time));
+				trace_bfq_weight_raise(bfqd->queue, bfqq->pid,
+					1, jiffies_to_msecs(bfqq->
+						raising_cur_max_time), 0);
 				bfqq->raising_coeff = 1;
 				entity->ioprio_changed = 1;
 				__bfq_entity_update_weight_prio(
@@ -2489,9 +2557,25 @@ schedule_dispatch:
 	spin_unlock_irqrestore(bfqd->queue->queue_lock, flags);
 }
 
+/*
+ * Handler of the expiration of the timer set when all the backlogged
+ * groups are throttled by their caps.
+ */
+static void bfq_caps_timer(unsigned long data)
+{
+	struct bfq_data *bfqd = (struct bfq_data *)data;
+	unsigned long flags;
+
+	spin_lock_irqsave(bfqd->queue->queue_lock, flags);
+	bfq_log(bfqd, "caps_timer expired");
+	bfq_schedule_dispatch(bfqd);
+	spin_unlock_irqrestore(bfqd->queue->queue_lock, flags);
+}
+
 static void bfq_shutdown_timer_wq(struct bfq_data *bfqd)
 {
 	del_timer_sync(&bfqd->idle_slice_timer);
+	del_timer_sync(&bfqd->caps_timer);
 	cancel_work_sync(&bfqd->unplug_work);
 }
 
@@ -2586,6 +2670,8 @@ static void *bfq_init_queue(struct request_queue *q)
 	bfqd->idle_slice_timer.function = bfq_idle_slice_timer;
 	bfqd->idle_slice_timer.data = (unsigned long)bfqd;
 
+	setup_timer(&bfqd->caps_timer, bfq_caps_timer, (unsigned long)bfqd);
+
 	bfqd->rq_pos_tree = RB_ROOT;
 
 	INIT_WORK(&bfqd->unplug_work, bfq_kick_queue);
@@ -53,6 +53,17 @@ static inline void bfq_check_next_active(struct bfq_sched_data *sd,
 {
 	BUG_ON(sd->next_active != entity);
 }
+
+/*
+ * Forget the throttled state cached by the groups from @entity up,
+ * as the backlog or the tokens of their subtrees changed.
+ */
+static inline void bfq_caps_invalidate(struct bfq_entity *entity)
+{
+	for_each_entity(entity)
+		container_of(entity, struct bfq_group,
+			     entity)->caps_cache_valid = 0;
+}
 #else
 #define for_each_entity(entity)	\
 	for (; entity != NULL; entity = NULL)
@@ -69,6 +80,10 @@ static inline void bfq_check_next_active(struct bfq_sched_data *sd,
 					 struct bfq_entity *entity)
 {
 }
+
+static inline void bfq_caps_invalidate(struct bfq_entity *entity)
+{
+}
 #endif
 
 /*
@@ -334,6 +349,8 @@ static void bfq_active_insert(struct bfq_service_tree *st,
 
 	if (bfqq != NULL)
 		list_add(&bfqq->bfqq_list, &bfqq->bfqd->active_list);
+
+	bfq_caps_invalidate(entity->parent);
 }
 
 /**
@@ -422,6 +439,8 @@ static void bfq_active_extract(struct bfq_service_tree *st,
 
 	if (bfqq != NULL)
 		list_del(&bfqq->bfqq_list);
+
+	bfq_caps_invalidate(entity->parent);
 }
 
 /**
@@ -850,6 +869,266 @@ left:
 	return first;
 }
 
+#ifdef CONFIG_CGROUP_BFQIO
+/*
+ * Bandwidth and IOPS caps.  Each capped group owns two token buckets,
+ * refilled at @max_bps bytes and @max_iops requests per second, and
+ * charged when a request of one of its queues is dispatched (tokens
+ * are scaled by HZ so that no fractional refill gets lost).  A group
+ * with an empty bucket is not eligible for service, and neither is a
+ * group all of whose backlogged children are not eligible.  Buckets
+ * may go negative, so that the caps are respected in the long term
+ * even if requests are larger than the available tokens.
+ */
+
+/* Maximum burst allowed to a capped group, in jiffies of service. */
+#define BFQ_CAPS_BURST		(HZ / 10)
+
+/*
+ * Largest cap accepted: a refill plus a full bucket, both scaled by up
+ * to BFQ_CAPS_BURST, must still fit the s64 token counters.
+ */
+#define BFQ_CAPS_MAX		(LLONG_MAX / (4 * BFQ_CAPS_BURST))
+
+/* Number of bfqio cgroups with at least one cap set. */
+static atomic_t bfqio_nr_capped = ATOMIC_INIT(0);
+
+static inline int bfq_caps_enabled(void)
+{
+	return atomic_read(&bfqio_nr_capped) != 0;
+}
+
+static inline int bfqg_capped(struct bfq_group *bfqg)
+{
+	return bfqg->max_bps != 0 || bfqg->max_iops != 0;
+}
+
+static void bfqg_caps_refill(struct bfq_group *bfqg)
+{
+	unsigned long elapsed = jiffies - bfqg->caps_last_refill;
+
+	if (elapsed == 0)
+		return;
+
+	bfqg->caps_last_refill = jiffies;
+	elapsed = min_t(unsigned long, elapsed, BFQ_CAPS_BURST);
+
+	bfqg->bps_tokens = min_t(s64, bfqg->bps_tokens +
+				 (s64)(bfqg->max_bps * elapsed),
+				 (s64)(bfqg->max_bps * BFQ_CAPS_BURST));
+	bfqg->iops_tokens = min_t(s64, bfqg->iops_tokens +
+				  (s64)(bfqg->max_iops * elapsed),
+				  (s64)(bfqg->max_iops * BFQ_CAPS_BURST));
+}
+
+/*
+ * Return the time (in jiffies) @bfqg has to wait before becoming
+ * eligible again according to its caps, 0 if it is eligible now.
+ */
+static unsigned long bfqg_caps_wait(struct bfq_group *bfqg)
+{
+	unsigned long wait = 0;
+
+	if (!bfqg_capped(bfqg))
+		return 0;
+
+	bfqg_caps_refill(bfqg);
+
+	if (bfqg->max_bps != 0 && bfqg->bps_tokens <= 0)
+		wait = div64_u64(-bfqg->bps_tokens, bfqg->max_bps) + 1;
+	if (bfqg->max_iops != 0 && bfqg->iops_tokens <= 0)
+		wait = max_t(unsigned long, wait,
+			     div64_u64(-bfqg->iops_tokens,
+				       bfqg->max_iops) + 1);
+
+	return wait;
+}
+
+static unsigned long bfq_entity_caps_wait(struct bfq_entity *entity);
+
+/*
+ * Return 0 if one of the backlogged children of @sd is not throttled,
+ * otherwise the minimum time one of them needs to become eligible.
+ */
+static unsigned long bfq_sched_data_caps_wait(struct bfq_sched_data *sd)
+{
+	struct rb_node *node;
+	unsigned long wait, min_wait = 0;
+	int i;
+
+	for (i = 0; i < BFQ_IOPRIO_CLASSES; i++) {
+		node = rb_first(&sd->service_tree[i].active);
+		for (; node != NULL; node = rb_next(node)) {
+			wait = bfq_entity_caps_wait(bfq_entity_of(node));
+			if (wait == 0)
+				return 0;
+			if (min_wait == 0 || wait < min_wait)
+				min_wait = wait;
+		}
+	}
+
+	return min_wait;
+}
+
+/*
+ * Return 0 if @entity is not throttled, otherwise the time it needs to
+ * become eligible again.  Queues are never throttled themselves; a
+ * group is throttled if it exceeded its caps or if all its backlogged
+ * children are throttled.  The result is cached in the group until the
+ * next jiffy, or until its subtree is charged for a dispatch or gains
+ * or loses a backlogged entity (see bfq_caps_invalidate()), so that
+ * each dispatch does not walk the whole hierarchy.
+ */
+static unsigned long bfq_entity_caps_wait(struct bfq_entity *entity)
+{
+	struct bfq_group *bfqg;
+	unsigned long wait;
+
+	if (entity->my_sched_data == NULL)
+		return 0;
+
+	bfqg = container_of(entity, struct bfq_group, entity);
+	if (bfqg->caps_cache_valid && bfqg->caps_cache_time == jiffies)
+		return bfqg->caps_cache_wait;
+
+	wait = bfqg_caps_wait(bfqg);
+	if (wait == 0)
+		wait = bfq_sched_data_caps_wait(entity->my_sched_data);
+
+	bfqg->caps_cache_wait = wait;
+	bfqg->caps_cache_time = jiffies;
+	bfqg->caps_cache_valid = 1;
+
+	return wait;
+}
+
+/**
+ * bfq_entity_throttled - check whether @entity is throttled by caps.
+ * @entity: the entity to check.
+ * @bfqd: if not %NULL, its @caps_wait is updated with the time @entity
+ *        needs to become eligible again.
+ */
+static int bfq_entity_throttled(struct bfq_entity *entity,
+				struct bfq_data *bfqd)
+{
+	unsigned long wait = bfq_entity_caps_wait(entity);
+
+	if (wait == 0)
+		return 0;
+
+	if (bfqd != NULL && (bfqd->caps_wait == 0 || wait < bfqd->caps_wait))
+		bfqd->caps_wait = wait;
+	return 1;
+}
+
+/**
+ * bfq_bfqq_throttled - check whether a group of @bfqq exceeded its caps.
+ * @bfqq: the queue to check.
+ */
+static int bfq_bfqq_throttled(struct bfq_queue *bfqq)
+{
+	struct bfq_entity *entity = bfqq->entity.parent;
+
+	if (!bfq_caps_enabled())
+		return 0;
+
+	for_each_entity(entity)
+		if (bfqg_caps_wait(container_of(entity, struct bfq_group,
+						entity)) != 0)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * bfq_caps_charge - charge the dispatch of @rq to the groups of @bfqq.
+ * @bfqq: the queue @rq is dispatched from.
+ * @rq: the request being dispatched.
+ */
+static void bfq_caps_charge(struct bfq_queue *bfqq, struct request *rq)
+{
+	struct bfq_entity *entity = bfqq->entity.parent;
+	struct bfq_group *bfqg;
+
+	if (!bfq_caps_enabled())
+		return;
+
+	bfq_caps_invalidate(entity);
+	for_each_entity(entity) {
+		bfqg = container_of(entity, struct bfq_group, entity);
+		if (!bfqg_capped(bfqg))
+			continue;
+
+		bfqg_caps_refill(bfqg);
+		bfqg->bps_tokens -= (s64)blk_rq_bytes(rq) * HZ;
+		bfqg->iops_tokens -= HZ;
+	}
+}
+
+/**
+ * bfq_caps_lookup_next_entity - skip the entities throttled by caps.
+ * @st: the service tree.
+ * @first: the first eligible entity in @st, according to B-WF2Q+.
+ * @bfqd: the device data.
+ *
+ * Return @first if it is not throttled, otherwise the first eligible
+ * and not throttled entity in @st, in finish time order.  If there is
+ * none, but there are non eligible and not throttled entities, do not
+ * leave the device idle: advance the vtime to the minimum start time
+ * among them and return that entity.
+ */
+static struct bfq_entity *
+bfq_caps_lookup_next_entity(struct bfq_service_tree *st,
+			    struct bfq_entity *first, struct bfq_data *bfqd)
+{
+	struct bfq_entity *entity, *best = NULL;
+	struct rb_node *node;
+
+	if (!bfq_entity_throttled(first, bfqd))
+		return first;
+
+	for (node = rb_first(&st->active); node != NULL; node = rb_next(node)) {
+		entity = bfq_entity_of(node);
+		if (entity == first || bfq_entity_throttled(entity, bfqd))
+			continue;
+
+		if (!bfq_gt(entity->start, st->vtime))
+			return entity;
+
+		if (best == NULL || bfq_gt(best->start, entity->start))
+			best = entity;
+	}
+
+	if (best != NULL) {
+		st->vtime = best->start;
+		bfq_forget_idle(st);
+	}
+
+	return best;
+}
+#else
+static inline int bfq_caps_enabled(void)
+{
+	return 0;
+}
+
+static inline int bfq_bfqq_throttled(struct bfq_queue *bfqq)
+{
+	return 0;
+}
+
+static inline void bfq_caps_charge(struct bfq_queue *bfqq, struct request *rq)
+{
+}
+
+static inline struct bfq_entity *
+bfq_caps_lookup_next_entity(struct bfq_service_tree *st,
+			    struct bfq_entity *first, struct bfq_data *bfqd)
+{
+	return first;
+}
+#endif
+
 /**
  * __bfq_lookup_next_entity - return the first eligible entity in @st.
  * @st: the service tree.
@@ -881,13 +1160,20 @@ static struct bfq_entity *__bfq_lookup_next_entity(struct bfq_service_tree *st)
  * absolutely no effort just returning the cached next_active value;
  * we prefer to do full lookups to test the consistency of * the data
  * structures.
+ *
+ * When extracting, the entities throttled by bandwidth/IOPS caps are
+ * skipped (see bfq_caps_lookup_next_entity()); as the caps depend on
+ * time, in that case the returned entity may differ from the cached
+ * next_active one.  The lookup may return %NULL only if all the
+ * backlogged entities are throttled.
  */
 static struct bfq_entity *bfq_lookup_next_entity(struct bfq_sched_data *sd,
 						 int extract,
 						 struct bfq_data *bfqd)
 {
 	struct bfq_service_tree *st = sd->service_tree;
-	struct bfq_entity *entity;
+	struct bfq_entity *entity, *first;
+	int caps = extract && bfqd != NULL && bfq_caps_enabled();
 	int i=0;
 
 	BUG_ON(sd->active_entity != NULL);
@@ -895,6 +1181,9 @@ static struct bfq_entity *bfq_lookup_next_entity(struct bfq_sched_data *sd,
 	if (bfqd != NULL &&
 	    jiffies - bfqd->bfq_class_idle_last_service > BFQ_CL_IDLE_TIMEOUT) {
 		entity = __bfq_lookup_next_entity(st + BFQ_IOPRIO_CLASSES - 1);
+		if (entity != NULL && caps)
+			entity = bfq_caps_lookup_next_entity(st +
+					BFQ_IOPRIO_CLASSES - 1, entity, bfqd);
 		if (entity != NULL) {
 			i = BFQ_IOPRIO_CLASSES - 1;
 			bfqd->bfq_class_idle_last_service = jiffies;
@@ -902,10 +1191,14 @@ static struct bfq_entity *bfq_lookup_next_entity(struct bfq_sched_data *sd,
 		}
 	}
 	for (; i < BFQ_IOPRIO_CLASSES; i++) {
-		entity = __bfq_lookup_next_entity(st + i);
+		entity = first = __bfq_lookup_next_entity(st + i);
+		if (entity != NULL && caps)
+			entity = bfq_caps_lookup_next_entity(st + i, first,
+							     bfqd);
 		if (entity != NULL) {
 			if (extract) {
-				bfq_check_next_active(sd, entity);
+				if (entity == first)
+					bfq_check_next_active(sd, entity);
 				bfq_active_extract(st + i, entity);
 				sd->active_entity = entity;
 				sd->next_active = NULL;
@@ -931,10 +1224,21 @@ static struct bfq_queue *bfq_get_next_queue(struct bfq_data *bfqd)
 	if (bfqd->busy_queues == 0)
 		return NULL;
 
+	bfqd->caps_wait = 0;
 	sd = &bfqd->root_group->sched_data;
 	for (; sd != NULL; sd = entity->my_sched_data) {
 		entity = bfq_lookup_next_entity(sd, 1, bfqd);
-		BUG_ON(entity == NULL);
+		if (entity == NULL) {
+			/*
+			 * All the backlogged groups are throttled by
+			 * their caps.  As caps only grow more permissive
+			 * with time, this can happen only at the root
+			 * level.
+			 */
+			BUG_ON(sd != &bfqd->root_group->sched_data ||
+			       bfqd->caps_wait == 0);
+			return NULL;
+		}
 		entity->service = 0;
 	}
 
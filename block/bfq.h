@@ -322,6 +322,11 @@ struct bfq_io_cq {
  * @bfq_raising_max_softrt_rate: max service-rate for a soft real-time queue,
  *			         sectors per seconds
  * @oom_bfqq: fallback dummy bfqq for extreme OOM conditions
+ * @caps_timer: timer set to restart dispatching when all the backlogged
+ *              groups are throttled by their bandwidth/IOPS caps.
+ * @caps_wait: minimum time (in jiffies) before one of the throttled
+ *             groups becomes eligible again, 0 if no group is throttled;
+ *             computed during the last queue selection.
  *
  * All the fields are protected by the @queue lock.
  */
@@ -383,6 +388,9 @@ struct bfq_data {
 	unsigned int bfq_raising_max_softrt_rate;
 
 	struct bfq_queue oom_bfqq;
+
+	struct timer_list caps_timer;
+	unsigned long caps_wait;
 };
 
 enum bfqq_state_flags {
@@ -439,9 +447,34 @@ enum bfqq_expiration {
 	BFQ_BFQQ_BUDGET_TIMEOUT,	/* budget took too long to be used */
 	BFQ_BFQQ_BUDGET_EXHAUSTED,	/* budget consumed */
 	BFQ_BFQQ_NO_MORE_REQUESTS,	/* the queue has no more requests */
+	BFQ_BFQQ_THROTTLED,		/* a group of the queue hit its caps */
 };
 
 #ifdef CONFIG_CGROUP_BFQIO
+/* Number of log2 buckets of the dispatch latency histograms, in msecs. */
+#define BFQ_LAT_BUCKETS	16
+
+/**
+ * struct bfq_lat_hist - dispatch latency histogram.
+ * @buckets: number of requests whose dispatch latency l (in msecs)
+ *           satisfies 2^(i-1) <= l < 2^i for bucket i, with bucket 0
+ *           collecting latencies below 1 msec and the last bucket
+ *           collecting all the latencies above its lower bound.
+ * @samples: total number of requests accounted.
+ * @total: sum of the latencies of all the accounted requests, in msecs.
+ * @max: maximum latency observed, in msecs.
+ *
+ * The dispatch latency of a request is the time elapsed from its
+ * allocation to its dispatch to the driver, i.e., the time it spent
+ * waiting for its queue to be served.
+ */
+struct bfq_lat_hist {
+	u64 buckets[BFQ_LAT_BUCKETS];
+	u64 samples;
+	u64 total;
+	u64 max;
+};
+
 /**
  * struct bfq_group - per (device, cgroup) data structure.
  * @entity: schedulable entity to insert into the parent group sched_data.
@@ -458,6 +491,18 @@ enum bfqq_expiration {
  * @async_idle_bfqq: async queue for the idle class (ioprio is ignored).
  * @my_entity: pointer to @entity, %NULL for the toplevel group; used
  *             to avoid too many special cases during group creation/migration.
+ * @dispatch_lat: dispatch latency histograms of the requests served
+ *                from the queues of the group, indexed by whether the
+ *                queue was weight-raised at dispatch time.
+ * @max_bps: bandwidth cap of the group, in bytes/sec (0 if unlimited).
+ * @max_iops: IOPS cap of the group (0 if unlimited).
+ * @bps_tokens: token bucket enforcing @max_bps, in bytes * HZ.
+ * @iops_tokens: token bucket enforcing @max_iops, in requests * HZ.
+ * @caps_last_refill: last time (in jiffies) the token buckets have been
+ *                    refilled.
+ * @caps_cache_wait: cached result of bfq_entity_caps_wait() for the group.
+ * @caps_cache_time: jiffies when @caps_cache_wait was computed.
+ * @caps_cache_valid: whether @caps_cache_wait can be used.
  *
  * Each (device, cgroup) pair has its own bfq_group, i.e., for each cgroup
  * there is a set of bfq_groups, each one collecting the lower-level
@@ -483,6 +528,14 @@ struct bfq_group {
 	struct bfq_queue *async_idle_bfqq;
 
 	struct bfq_entity *my_entity;
+
+	struct bfq_lat_hist dispatch_lat[2];
+
+	u64 max_bps, max_iops;
+	s64 bps_tokens, iops_tokens;
+	unsigned long caps_last_refill;
+	unsigned long caps_cache_wait, caps_cache_time;
+	int caps_cache_valid;
 };
 
 /**
@@ -491,16 +544,20 @@ struct bfq_group {
  * @weight: cgroup weight.
  * @ioprio: cgroup ioprio.
  * @ioprio_class: cgroup ioprio_class.
- * @lock: spinlock that protects @ioprio, @ioprio_class and @group_data.
+ * @max_bps: cgroup bandwidth cap, in bytes/sec (0 if unlimited).
+ * @max_iops: cgroup IOPS cap (0 if unlimited).
+ * @lock: spinlock that protects @ioprio, @ioprio_class, the caps and
+ *        @group_data.
  * @group_data: list containing the bfq_group belonging to this cgroup.
  *
  * @group_data is accessed using RCU, with @lock protecting the updates,
- * @ioprio and @ioprio_class are protected by @lock.
+ * @ioprio, @ioprio_class and the caps are protected by @lock.
  */
 struct bfqio_cgroup {
 	struct cgroup_subsys_state css;
 
 	unsigned short weight, ioprio, ioprio_class;
+	u64 max_bps, max_iops;
 
 	spinlock_t lock;
 	struct hlist_head group_data;
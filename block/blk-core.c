@@ -16,6 +16,7 @@
 #include <linux/backing-dev.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
 #include <linux/kernel_stat.h>
@@ -29,6 +30,7 @@
 #include <linux/fault-inject.h>
 #include <linux/list_sort.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/block.h>
@@ -56,7 +58,7 @@ struct kmem_cache *blk_requestq_cachep;
  */
 static struct workqueue_struct *kblockd_workqueue;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -287,6 +289,14 @@ void blk_sync_queue(struct request_queue *q)
 {
 	del_timer_sync(&q->timeout);
 	cancel_delayed_work_sync(&q->delay_work);
+
+	if (q->mq_ops) {
+		struct blk_mq_hw_ctx *hctx;
+		int i;
+
+		queue_for_each_hw_ctx(q, hctx, i)
+			cancel_delayed_work_sync(&hctx->run_work);
+	}
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -433,7 +443,9 @@ void blk_cleanup_queue(struct request_queue *q)
 	 * be trying to tear down @q before its elevator is initialized, in
 	 * which case we don't want to call into draining.
 	 */
-	if (q->elevator)
+	if (q->mq_ops)
+		blk_mq_drain_queue(q);
+	else if (q->elevator)
 		blk_drain_queue(q, true);
 
 	/* @q won't process any more request, flush async actions */
@@ -1246,7 +1258,7 @@ static bool bio_attempt_front_merge(struct request_queue *q,
 }
 
 /**
- * attempt_plug_merge - try to merge with %current's plugged list
+ * blk_attempt_plug_merge - try to merge with %current's plugged list
  * @q: request_queue new bio is being queued at
  * @bio: new bio being queued
  * @request_count: out parameter for number of traversed plugged requests
@@ -1262,11 +1274,12 @@ static bool bio_attempt_front_merge(struct request_queue *q,
  * reliable access to the elevator outside queue lock.  Only check basic
  * merging parameters without querying the elevator.
  */
-static bool attempt_plug_merge(struct request_queue *q, struct bio *bio,
-			       unsigned int *request_count)
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio,
+			    unsigned int *request_count)
 {
 	struct blk_plug *plug;
 	struct request *rq;
+	struct list_head *plug_list;
 	bool ret = false;
 
 	plug = current->plug;
@@ -1274,7 +1287,12 @@ static bool attempt_plug_merge(struct request_queue *q, struct bio *bio,
 		goto out;
 	*request_count = 0;
 
-	list_for_each_entry_reverse(rq, &plug->list, queuelist) {
+	if (q->mq_ops)
+		plug_list = &plug->mq_list;
+	else
+		plug_list = &plug->list;
+
+	list_for_each_entry_reverse(rq, plug_list, queuelist) {
 		int el_ret;
 
 		(*request_count)++;
@@ -1336,7 +1354,7 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	 * Check if we can merge with the plugged list before grabbing
 	 * any locks.
 	 */
-	if (attempt_plug_merge(q, bio, &request_count))
+	if (blk_attempt_plug_merge(q, bio, &request_count))
 		return;
 
 	spin_lock_irq(q->queue_lock);
@@ -1868,7 +1886,7 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+void blk_account_io_done(struct request *req)
 {
 	/*
 	 * Account IO completion.  flush_rq isn't accounted as a
@@ -2727,6 +2745,7 @@ void blk_start_plug(struct blk_plug *plug)
 
 	plug->magic = PLUG_MAGIC;
 	INIT_LIST_HEAD(&plug->list);
+	INIT_LIST_HEAD(&plug->mq_list);
 	INIT_LIST_HEAD(&plug->cb_list);
 	plug->should_sort = 0;
 
@@ -2816,6 +2835,10 @@ void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)
 	BUG_ON(plug->magic != PLUG_MAGIC);
 
 	flush_plug_callbacks(plug);
+
+	if (!list_empty(&plug->mq_list))
+		blk_mq_flush_plug_list(plug, from_schedule);
+
 	if (list_empty(&plug->list))
 		return;
 
@@ -2886,6 +2909,127 @@ void blk_finish_plug(struct blk_plug *plug)
 }
 EXPORT_SYMBOL(blk_finish_plug);
 
+/*
+ * Upper bound on the time blk_poll() spins, after its hybrid sleep.
+ */
+#define BLK_POLL_MAX_NSEC	NSEC_PER_MSEC
+
+static void blk_poll_account(struct request_queue *q, ktime_t start)
+{
+	u64 nsec = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket = min_t(int, fls64(nsec >> 10), BLK_POLL_LAT_BUCKETS - 1);
+
+	q->poll_stat.success++;
+	q->poll_stat.lat[bucket]++;
+
+	if (q->poll_nsec)
+		q->poll_nsec = (q->poll_nsec * 7 + nsec) >> 3;
+	else
+		q->poll_nsec = nsec;
+}
+
+/*
+ * Sleep for half the mean completion time (or io_poll_delay usecs), so
+ * that the CPU is only spent when completion is close.  The completion
+ * path may wake us up early.
+ */
+static void blk_poll_hybrid_sleep(struct request_queue *q,
+				  bool (*done)(void *), void *data)
+{
+	struct hrtimer_sleeper hs;
+	u64 nsec;
+
+	if (q->poll_delay < 0)
+		return;
+
+	if (q->poll_delay)
+		nsec = (u64)q->poll_delay * NSEC_PER_USEC;
+	else
+		nsec = q->poll_nsec >> 1;
+	if (!nsec)
+		return;
+
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_init_sleeper(&hs, current);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	hrtimer_start(&hs.timer, ns_to_ktime(nsec), HRTIMER_MODE_REL);
+	if (hs.task && !done(data))
+		io_schedule();
+	hrtimer_cancel(&hs.timer);
+	destroy_hrtimer_on_stack(&hs.timer);
+
+	__set_current_state(TASK_RUNNING);
+	q->poll_stat.slept++;
+}
+
+/**
+ * blk_poll - wait for I/O by polling the device instead of sleeping
+ * @q:		the queue the I/O was submitted to
+ * @done:	returns true once the caller's I/O has completed
+ * @data:	passed to @done
+ *
+ * Description:
+ *    Meant to be called by a synchronous waiter in place of io_schedule(),
+ *    with its task state already set.  If @q has polling enabled, reaps
+ *    completions through q->poll_fn() until @done is true, for a bounded
+ *    time.  Returns true with the task running if @done became true.
+ *    Returns false with the task state restored otherwise, the caller
+ *    then sleeps as usual and relies on the completion to wake it up.
+ **/
+bool blk_poll(struct request_queue *q, bool (*done)(void *), void *data)
+{
+	long state = current->state;
+	ktime_t start, spin_start;
+	u64 spin;
+
+	if (!q->poll_fn || !blk_queue_io_poll(q))
+		return false;
+
+	q->poll_stat.invoked++;
+	start = ktime_get();
+
+	blk_poll_hybrid_sleep(q, done, data);
+	__set_current_state(TASK_RUNNING);
+
+	if (q->poll_nsec)
+		spin = min_t(u64, q->poll_nsec * 4, BLK_POLL_MAX_NSEC);
+	else
+		spin = BLK_POLL_MAX_NSEC;
+
+	spin_start = ktime_get();
+	while (!need_resched()) {
+		if (done(data)) {
+			blk_poll_account(q, start);
+			return true;
+		}
+
+		if (q->poll_fn(q) < 0)
+			break;
+
+		if (ktime_to_ns(ktime_sub(ktime_get(), spin_start)) > spin)
+			break;
+
+		cpu_relax();
+	}
+
+	q->poll_stat.timeout++;
+
+	/*
+	 * The completion may have raced with restoring the task state,
+	 * in which case its wakeup was lost: recheck.
+	 */
+	set_current_state(state);
+	if (done(data)) {
+		__set_current_state(TASK_RUNNING);
+		blk_poll_account(q, start);
+		return true;
+	}
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
 int __init blk_dev_init(void)
 {
 	BUILD_BUG_ON(__REQ_NR_BITS > 8 *
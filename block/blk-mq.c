@@ -0,0 +1,785 @@
+/*
+ * Multi-queue request submission.
+ *
+ * Drivers opting in through blk_mq_init_queue() never see q->queue_lock
+ * or the elevator.  Requests are built from bios on a per-CPU software
+ * queue (struct blk_mq_ctx), optionally batched on the task plug, and
+ * moved to one of the driver's hardware queues (struct blk_mq_hw_ctx)
+ * which hands them to ->queue_rq().  Requests and their driver payload
+ * are preallocated per hardware queue and identified by a tag, so the
+ * submission path doesn't go through the request mempool either.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/list_sort.h>
+#include <linux/delay.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+/**
+ * blk_mq_map_queue - default CPU to hardware queue mapping
+ * @q:		the request queue
+ * @cpu:	the submitting CPU
+ *
+ * Drivers without topology knowledge can point ->map_queue here; CPUs
+ * are spread over the hardware queues in contiguous blocks, so that
+ * neighbouring CPUs (often sharing a cache) share a hardware queue.
+ */
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL_GPL(blk_mq_map_queue);
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+static void blk_mq_hctx_mark_pending(struct blk_mq_hw_ctx *hctx,
+				     struct blk_mq_ctx *ctx)
+{
+	if (!test_bit(ctx->index_hw, hctx->ctx_map))
+		set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+/*
+ * Tags double as indexes into hctx->rqs.  Each software queue starts
+ * its search at a different offset of the map, so CPUs sharing a
+ * hardware queue don't all fight over the first free bit.
+ */
+static int blk_mq_get_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx)
+{
+	unsigned int depth = hctx->queue_depth;
+	unsigned int start, tag;
+
+	start = ctx->index_hw * depth / hctx->nr_ctx;
+	do {
+		tag = find_next_zero_bit(hctx->tag_map, depth, start);
+		if (tag >= depth) {
+			tag = find_first_zero_bit(hctx->tag_map, depth);
+			if (tag >= depth)
+				return -1;
+		}
+	} while (test_and_set_bit_lock(tag, hctx->tag_map));
+
+	return tag;
+}
+
+static void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	clear_bit_unlock(tag, hctx->tag_map);
+	smp_mb__after_clear_bit();
+
+	if (waitqueue_active(&hctx->tag_wait))
+		wake_up(&hctx->tag_wait);
+}
+
+static struct request *__blk_mq_alloc_request(struct request_queue *q,
+					      struct blk_mq_hw_ctx *hctx,
+					      struct blk_mq_ctx *ctx)
+{
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx, ctx);
+	if (tag < 0)
+		return NULL;
+
+	/*
+	 * Pairs with queue_flag_set(QUEUE_FLAG_DEAD) in blk_cleanup_queue():
+	 * either the drain sees our tag, or we see the queue dead.
+	 */
+	if (unlikely(blk_queue_dead(q))) {
+		blk_mq_put_tag(hctx, tag);
+		return NULL;
+	}
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(q, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+
+	return rq;
+}
+
+/*
+ * Get a free request, sleeping until one is available.  Returns NULL
+ * only if @q is dead.
+ */
+static struct request *blk_mq_get_request(struct request_queue *q,
+					  struct blk_mq_hw_ctx *hctx,
+					  struct blk_mq_ctx *ctx,
+					  struct bio *bio)
+{
+	const int rw = bio_data_dir(bio);
+	struct request *rq;
+	DEFINE_WAIT(wait);
+
+	rq = __blk_mq_alloc_request(q, hctx, ctx);
+	if (likely(rq))
+		goto out;
+
+	trace_block_sleeprq(q, bio, rw);
+
+	/*
+	 * All tags are in flight or staged on the software queues, make
+	 * sure the latter get to the driver before going to sleep.  The
+	 * plug, if any, is flushed by io_schedule().
+	 */
+	blk_mq_run_hw_queue(hctx, false);
+
+	for (;;) {
+		prepare_to_wait(&hctx->tag_wait, &wait, TASK_UNINTERRUPTIBLE);
+		rq = __blk_mq_alloc_request(q, hctx, ctx);
+		if (rq || blk_queue_dead(q))
+			break;
+		io_schedule();
+	}
+	finish_wait(&hctx->tag_wait, &wait);
+
+	if (!rq)
+		return NULL;
+out:
+	trace_block_getrq(q, bio, rw);
+	return rq;
+}
+
+/**
+ * blk_mq_free_request - release a request back to its hardware queue
+ * @rq:		request to free
+ *
+ * Description:
+ *     Only needed by drivers completing requests without
+ *     blk_mq_end_io(), e.g. after having ended the bios themselves.
+ */
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct request_queue *q = rq->q;
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	ctx->rq_completed[rq_is_sync(rq)]++;
+	blk_mq_put_tag(hctx, rq->tag);
+
+	/*
+	 * Requests the driver bounced with BLK_MQ_RQ_QUEUE_BUSY are waiting
+	 * for resources, which we may just have freed.
+	 */
+	if (!list_empty_careful(&hctx->dispatch))
+		blk_mq_run_hw_queue(hctx, true);
+}
+EXPORT_SYMBOL_GPL(blk_mq_free_request);
+
+/**
+ * blk_mq_end_io - complete a request issued through ->queue_rq()
+ * @rq:		request to complete
+ * @error:	0 for success, < 0 for error
+ *
+ * Description:
+ *     Ends all bios of @rq, accounts the I/O and frees the request.
+ *     Doesn't need any lock and may be called from interrupt context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	blk_account_io_done(rq);
+	blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL_GPL(blk_mq_end_io);
+
+/*
+ * Move everything staged on the software queues and on the dispatch
+ * list to the driver.  Requests the driver can't take right now are
+ * parked on hctx->dispatch and retried first on the next run.
+ */
+static void blk_mq_dispatch(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	unsigned long flags;
+	LIST_HEAD(rq_list);
+	int bit, ret;
+
+	hctx->run++;
+
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		struct blk_mq_ctx *ctx = hctx->ctxs[bit];
+
+		clear_bit(bit, hctx->ctx_map);
+		spin_lock_irqsave(&ctx->lock, flags);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock_irqrestore(&ctx->lock, flags);
+	}
+
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock_irqsave(&hctx->lock, flags);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock_irqrestore(&hctx->lock, flags);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_entry_rq(rq_list.next);
+		list_del_init(&rq->queuelist);
+
+		if (!(rq->cmd_flags & REQ_STARTED)) {
+			rq->cmd_flags |= REQ_STARTED;
+			rq->mq_ctx->rq_dispatched[rq_is_sync(rq)]++;
+			trace_block_rq_issue(q, rq);
+		}
+
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (likely(ret == BLK_MQ_RQ_QUEUE_OK)) {
+			hctx->queued++;
+			continue;
+		}
+
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			list_add(&rq->queuelist, &rq_list);
+			hctx->busy++;
+			break;
+		}
+
+		WARN_ON_ONCE(ret != BLK_MQ_RQ_QUEUE_ERROR);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, -EIO);
+	}
+
+	if (!list_empty(&rq_list)) {
+		spin_lock_irqsave(&hctx->lock, flags);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock_irqrestore(&hctx->lock, flags);
+	}
+}
+
+/*
+ * BLK_MQ_S_RUNNING keeps ->queue_rq() calls for one hardware queue
+ * serialized.  Whoever loses the race leaves its requests to the
+ * current runner, which rechecks the software queues after dropping
+ * the bit.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	do {
+		if (test_and_set_bit_lock(BLK_MQ_S_RUNNING, &hctx->state))
+			return;
+
+		blk_mq_dispatch(hctx);
+
+		clear_bit_unlock(BLK_MQ_S_RUNNING, &hctx->state);
+		smp_mb__after_clear_bit();
+	} while (blk_mq_hctx_has_pending(hctx) &&
+		 !test_bit(BLK_MQ_S_STOPPED, &hctx->state));
+}
+
+/**
+ * blk_mq_run_hw_queue - push staged requests to the driver
+ * @hctx:	hardware queue to run
+ * @async:	punt the run to kblockd instead of doing it inline
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (async)
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 0);
+	else
+		__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL_GPL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!blk_mq_hctx_has_pending(hctx) &&
+		    list_empty_careful(&hctx->dispatch))
+			continue;
+
+		blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL_GPL(blk_mq_run_queues);
+
+/**
+ * blk_mq_stop_hw_queue - stop feeding requests to a hardware queue
+ * @hctx:	hardware queue to stop
+ *
+ * Description:
+ *     Typically called by the driver from ->queue_rq() before returning
+ *     BLK_MQ_RQ_QUEUE_BUSY, when it knows resources won't come back
+ *     through a request completion.  Restart with blk_mq_start_hw_queue().
+ */
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	__cancel_delayed_work(&hctx->run_work);
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL_GPL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+	blk_mq_run_hw_queue(hctx, true);
+}
+EXPORT_SYMBOL_GPL(blk_mq_start_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		blk_mq_start_hw_queue(hctx);
+	}
+}
+EXPORT_SYMBOL_GPL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+static void blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				  struct request *rq)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	unsigned long flags;
+
+	trace_block_rq_insert(hctx->queue, rq);
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	list_add_tail(&rq->queuelist, &ctx->rq_list);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	blk_mq_hctx_mark_pending(hctx, ctx);
+}
+
+static void blk_mq_insert_requests(struct request_queue *q,
+				   struct blk_mq_ctx *ctx,
+				   struct list_head *list,
+				   unsigned int depth, bool from_schedule)
+{
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, ctx->cpu);
+	struct request *rq;
+	unsigned long flags;
+
+	trace_block_unplug(q, depth, !from_schedule);
+
+	/*
+	 * Short-circuit if @q is dead
+	 */
+	if (unlikely(blk_queue_dead(q))) {
+		while (!list_empty(list)) {
+			rq = list_entry_rq(list->next);
+			list_del_init(&rq->queuelist);
+			blk_mq_end_io(rq, -ENODEV);
+		}
+		return;
+	}
+
+	list_for_each_entry(rq, list, queuelist)
+		trace_block_rq_insert(q, rq);
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	list_splice_tail_init(list, &ctx->rq_list);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	blk_mq_hctx_mark_pending(hctx, ctx);
+
+	/*
+	 * As in blk_flush_plug_list(), don't dive into the driver from
+	 * inside schedule().
+	 */
+	blk_mq_run_hw_queue(hctx, from_schedule);
+}
+
+/*
+ * Sort by software queue so each one is locked once per flush, and by
+ * sector within it so the driver sees ascending batches.
+ */
+static int plug_ctx_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct request *rqa = container_of(a, struct request, queuelist);
+	struct request *rqb = container_of(b, struct request, queuelist);
+
+	if (rqa->mq_ctx != rqb->mq_ctx)
+		return rqa->mq_ctx > rqb->mq_ctx;
+
+	return blk_rq_pos(rqa) > blk_rq_pos(rqb);
+}
+
+void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule)
+{
+	struct blk_mq_ctx *this_ctx;
+	struct request_queue *this_q;
+	struct request *rq;
+	LIST_HEAD(list);
+	LIST_HEAD(ctx_list);
+	unsigned int depth;
+
+	list_splice_init(&plug->mq_list, &list);
+	list_sort(NULL, &list, plug_ctx_cmp);
+
+	this_q = NULL;
+	this_ctx = NULL;
+	depth = 0;
+
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+		BUG_ON(!rq->q);
+		if (rq->mq_ctx != this_ctx) {
+			if (this_ctx)
+				blk_mq_insert_requests(this_q, this_ctx,
+						       &ctx_list, depth,
+						       from_schedule);
+			this_ctx = rq->mq_ctx;
+			this_q = rq->q;
+			depth = 0;
+		}
+
+		depth++;
+		list_add_tail(&rq->queuelist, &ctx_list);
+	}
+
+	if (this_ctx)
+		blk_mq_insert_requests(this_q, this_ctx, &ctx_list, depth,
+				       from_schedule);
+}
+
+/* Number of requests on the plug, when no merge attempt counted them */
+static unsigned int blk_mq_plug_count(struct blk_plug *plug)
+{
+	struct request *rq;
+	unsigned int count = 0;
+
+	list_for_each_entry(rq, &plug->mq_list, queuelist)
+		count++;
+	return count;
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct blk_plug *plug;
+	struct request *rq;
+	unsigned int request_count = 0;
+	bool merge;
+
+	blk_queue_bounce(q, &bio);
+
+	ctx = blk_mq_get_ctx(q);
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	/*
+	 * There's no elevator to merge into, only the plug.
+	 */
+	merge = (hctx->flags & BLK_MQ_F_SHOULD_MERGE) &&
+		!blk_queue_nomerges(q) && !(bio->bi_rw & (REQ_FLUSH | REQ_FUA));
+	if (merge && blk_attempt_plug_merge(q, bio, &request_count)) {
+		ctx->rq_merged++;
+		return;
+	}
+
+	rq = blk_mq_get_request(q, hctx, ctx, bio);
+	if (unlikely(!rq)) {
+		bio_endio(bio, -ENODEV);	/* @q is dead */
+		return;
+	}
+
+	/*
+	 * FLUSH/FUA are not sequenced here, they are handed to the driver
+	 * as flags on the request, together with any data.
+	 */
+	init_request_from_bio(rq, bio);
+
+	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
+		rq->cpu = raw_smp_processor_id();
+
+	drive_stat_acct(rq, 1);
+
+	plug = current->plug;
+	if (plug) {
+		if (!merge)
+			request_count = blk_mq_plug_count(plug);
+		if (list_empty(&plug->mq_list))
+			trace_block_plug(q);
+		else if (request_count >= BLK_MAX_REQUEST_COUNT) {
+			blk_flush_plug_list(plug, false);
+			trace_block_plug(q);
+		}
+		list_add_tail(&rq->queuelist, &plug->mq_list);
+		return;
+	}
+
+	blk_mq_insert_request(hctx, rq);
+	blk_mq_run_hw_queue(hctx, false);
+}
+
+/**
+ * blk_mq_drain_queue - wait for all requests of a multi-queue device
+ * @q:		the dead request queue
+ *
+ * Called by blk_cleanup_queue() once @q is marked DEAD: requests
+ * still staged get dispatched, new ones are refused and sleepers on
+ * the tag maps are woken up to notice the queue is gone.
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	while (true) {
+		struct blk_mq_hw_ctx *hctx;
+		bool drain = false;
+		int i;
+
+		queue_for_each_hw_ctx(q, hctx, i) {
+			wake_up_all(&hctx->tag_wait);
+			blk_mq_run_hw_queue(hctx, false);
+
+			drain |= find_first_bit(hctx->tag_map,
+					hctx->queue_depth) < hctx->queue_depth;
+		}
+
+		if (!drain)
+			break;
+		msleep(10);
+	}
+}
+
+static void blk_mq_free_hw_ctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+
+	kfree(hctx->tag_map);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	free_cpumask_var(hctx->cpumask);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hw_ctx(struct request_queue *q,
+						 struct blk_mq_reg *reg,
+						 void *driver_data,
+						 unsigned int index)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int node = reg->numa_node;
+	size_t rq_size;
+	unsigned int i;
+
+	hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, node);
+	if (!hctx)
+		return NULL;
+
+	if (!zalloc_cpumask_var(&hctx->cpumask, GFP_KERNEL)) {
+		kfree(hctx);
+		return NULL;
+	}
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_DELAYED_WORK(&hctx->run_work, blk_mq_run_work_fn);
+	init_waitqueue_head(&hctx->tag_wait);
+	hctx->queue = q;
+	hctx->driver_data = driver_data;
+	hctx->flags = reg->flags;
+	hctx->queue_num = index;
+	hctx->queue_depth = reg->queue_depth;
+	hctx->numa_node = node;
+
+	hctx->ctxs = kzalloc_node(nr_cpu_ids * sizeof(*hctx->ctxs),
+				  GFP_KERNEL, node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->tag_map = kzalloc_node(BITS_TO_LONGS(hctx->queue_depth) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->rqs = kzalloc_node(hctx->queue_depth * sizeof(*hctx->rqs),
+				 GFP_KERNEL, node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tag_map || !hctx->rqs)
+		goto fail;
+
+	/*
+	 * Keep each request and its driver payload on their own cachelines,
+	 * neighbouring tags are usually completed on different CPUs.
+	 */
+	rq_size = L1_CACHE_ALIGN(sizeof(struct request) + reg->cmd_size);
+	for (i = 0; i < hctx->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(rq_size, GFP_KERNEL, node);
+		if (!hctx->rqs[i])
+			goto fail;
+	}
+
+	return hctx;
+fail:
+	blk_mq_free_hw_ctx(hctx);
+	return NULL;
+}
+
+static void blk_mq_map_swqueues(struct request_queue *q,
+				struct blk_mq_reg *reg)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		q->mq_map[cpu] = cpu * q->nr_hw_queues / nr_cpu_ids;
+
+	for_each_possible_cpu(cpu) {
+		ctx = __blk_mq_get_ctx(q, cpu);
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = reg->ops->map_queue(q, cpu);
+		cpumask_set_cpu(cpu, hctx->cpumask);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+static void __blk_mq_free_queue(struct request_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nr_hw_queues; i++)
+		blk_mq_free_hw_ctx(q->queue_hw_ctx[i]);
+
+	kfree(q->queue_hw_ctx);
+	kfree(q->mq_map);
+	free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->nr_hw_queues = 0;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+}
+
+/**
+ * blk_mq_init_queue - allocate a multi-queue request queue
+ * @reg:	hardware queue layout and driver operations
+ * @driver_data: passed to ->init_hctx() and stored in hctx->driver_data
+ *
+ * Description:
+ *    Returns a request queue whose requests bypass q->queue_lock and
+ *    the elevator, and are instead handed to @reg->ops->queue_rq() from
+ *    per-CPU software queues.  The driver must complete them with
+ *    blk_mq_end_io().  Like blk_init_queue(), the queue must be torn
+ *    down with blk_cleanup_queue().  Returns %NULL on failure.
+ **/
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct request_queue *q;
+	unsigned int i;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->ops->map_queue || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return NULL;
+
+	if (reg->nr_hw_queues > nr_cpu_ids)
+		reg->nr_hw_queues = nr_cpu_ids;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return NULL;
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(*q->mq_map), GFP_KERNEL,
+				 reg->numa_node);
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues *
+				       sizeof(*q->queue_hw_ctx), GFP_KERNEL,
+				       reg->numa_node);
+	if (!q->queue_ctx || !q->mq_map || !q->queue_hw_ctx)
+		goto err_free;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = blk_mq_alloc_hw_ctx(q, reg, driver_data, i);
+		if (!hctx)
+			goto err_free;
+		q->queue_hw_ctx[i] = hctx;
+		q->nr_hw_queues++;
+	}
+
+	/*
+	 * ->mq_ops stays NULL until the driver hooks have run, so that
+	 * blk_cleanup_queue() on the error path treats @q as a plain queue.
+	 */
+	q->nr_queues = nr_cpu_ids;
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->queue_flags = QUEUE_FLAG_DEFAULT;
+	q->nr_requests = reg->queue_depth;
+
+	blk_mq_map_swqueues(q, reg);
+
+	for (i = 0; i < q->nr_hw_queues; i++) {
+		if (!reg->ops->init_hctx)
+			break;
+		if (reg->ops->init_hctx(q->queue_hw_ctx[i], driver_data, i))
+			goto err_exit;
+	}
+
+	q->mq_ops = reg->ops;
+	return q;
+
+err_exit:
+	while (i--) {
+		if (reg->ops->exit_hctx)
+			reg->ops->exit_hctx(q->queue_hw_ctx[i], i);
+	}
+err_free:
+	__blk_mq_free_queue(q);
+	blk_cleanup_queue(q);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(blk_mq_init_queue);
+
+/*
+ * Called from blk_release_queue() on the final put of a multi-queue @q.
+ */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		cancel_delayed_work_sync(&hctx->run_work);
+		if (q->mq_ops->exit_hctx)
+			q->mq_ops->exit_hctx(hctx, i);
+	}
+
+	__blk_mq_free_queue(q);
+}
@@ -0,0 +1,38 @@
+#ifndef BLK_MQ_INTERNAL_H
+#define BLK_MQ_INTERNAL_H
+
+/*
+ * Per-CPU software staging queue.  Submitters only ever touch the
+ * context of the CPU they run on, so ->lock is normally uncontended
+ * and replaces q->queue_lock on the submission side.
+ */
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+	struct request_queue	*queue;
+
+	/* statistics, not serialized */
+	unsigned long		rq_dispatched[2];
+	unsigned long		rq_merged;
+	unsigned long		rq_completed[2];
+} ____cacheline_aligned_in_smp;
+
+static inline struct blk_mq_ctx *__blk_mq_get_ctx(struct request_queue *q,
+						  unsigned int cpu)
+{
+	return per_cpu_ptr(q->queue_ctx, cpu);
+}
+
+/*
+ * The submitter may migrate after picking its context, that only costs
+ * us locality since everything on the ctx is protected by ctx->lock.
+ */
+static inline struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return __blk_mq_get_ctx(q, raw_smp_processor_id());
+}
+
+#endif
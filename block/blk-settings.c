@@ -81,6 +81,22 @@ void blk_queue_softirq_done(struct request_queue *q, softirq_done_fn *fn)
 }
 EXPORT_SYMBOL(blk_queue_softirq_done);
 
+/**
+ * blk_queue_poll_fn - set the driver's completion polling hook
+ * @q:		the request queue for the device
+ * @fn:		reaps completed I/O, returns the number of completions
+ *		found, or < 0 if polling can't make progress
+ *
+ * Description:
+ *    Setting the hook makes the io_poll queue attribute writable, synchronous
+ *    waiters then call @fn from blk_poll() instead of sleeping.
+ **/
+void blk_queue_poll_fn(struct request_queue *q, poll_fn *fn)
+{
+	q->poll_fn = fn;
+}
+EXPORT_SYMBOL_GPL(blk_queue_poll_fn);
+
 void blk_queue_rq_timeout(struct request_queue *q, unsigned int timeout)
 {
 	q->rq_timeout = timeout;
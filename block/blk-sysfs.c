@@ -6,6 +6,7 @@
 #include <linux/module.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/blktrace_api.h>
 
 #include "blk.h"
@@ -273,6 +274,93 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_io_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long poll_on;
+	ssize_t ret;
+
+	if (!q->poll_fn)
+		return -EINVAL;
+
+	ret = queue_var_store(&poll_on, page, count);
+
+	spin_lock_irq(q->queue_lock);
+	if (poll_on)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%d\n", q->poll_delay);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	long val;
+
+	if (strict_strtol(page, 10, &val) < 0 || val < -1 || val > INT_MAX)
+		return -EINVAL;
+
+	q->poll_delay = val;
+	return count;
+}
+
+/*
+ * Percentiles are reported as the upper bound, in usecs, of the
+ * histogram bucket they fall in.
+ */
+static unsigned int queue_poll_percentile(struct request_queue *q,
+					  unsigned int pct)
+{
+	unsigned long total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < BLK_POLL_LAT_BUCKETS; i++)
+		total += q->poll_stat.lat[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < BLK_POLL_LAT_BUCKETS - 1; i++) {
+		sum += q->poll_stat.lat[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+	return 1U << i;
+}
+
+static ssize_t queue_poll_stat_show(struct request_queue *q, char *page)
+{
+	struct blk_poll_stats *ps = &q->poll_stat;
+
+	return sprintf(page, "invoked=%lu success=%lu slept=%lu timeout=%lu "
+		       "mean_ns=%llu p50_us=%u p90_us=%u p99_us=%u\n",
+		       ps->invoked, ps->success, ps->slept, ps->timeout,
+		       (unsigned long long)q->poll_nsec,
+		       queue_poll_percentile(q, 50),
+		       queue_poll_percentile(q, 90),
+		       queue_poll_percentile(q, 99));
+}
+
+static ssize_t queue_poll_stat_store(struct request_queue *q,
+				     const char *page, size_t count)
+{
+	memset(&q->poll_stat, 0, sizeof(q->poll_stat));
+	q->poll_nsec = 0;
+	return count;
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -387,6 +475,24 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
+static struct queue_sysfs_entry queue_poll_stat_entry = {
+	.attr = {.name = "io_poll_stat", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_stat_show,
+	.store = queue_poll_stat_store,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -409,6 +515,9 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
+	&queue_poll_stat_entry.attr,
 	NULL,
 };
 
@@ -488,6 +597,9 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_throtl_exit(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
@@ -0,0 +1,403 @@
+/*
+ * Null block device: completes every I/O without touching any data,
+ * either right away or after a simulated device latency.  Useful to
+ * measure the overhead of the block layer itself, its elevators and
+ * its completion paths.
+ *
+ * Released under the GPL v2.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+};
+
+/*
+ * Pending completions of the timer irqmode.  Only ever touched on the
+ * owning CPU with interrupts off, the timer is pinned there.
+ */
+struct completion_queue {
+	struct bio_list bios;
+	struct list_head rqs;
+	struct hrtimer timer;
+};
+
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static int null_major;
+
+enum {
+	NULL_Q_BIO		= 0,
+	NULL_Q_RQ		= 1,
+	NULL_Q_MQ		= 2,
+};
+
+enum {
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+	NULL_IRQ_TIMER		= 2,
+};
+
+static int queue_mode = NULL_Q_RQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface: 0=make_request, 1=request_fn (default), 2=multi-queue");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "Completion: 0=inline, 1=softirq (default), 2=timer");
+
+static unsigned long completion_nsec = 10000;
+module_param(completion_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Simulated latency of irqmode=2, in ns. Default: 10,000ns");
+
+static int completion_cpu = -1;
+module_param(completion_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(completion_cpu, "Force softirq completions on this CPU. Default: -1, follow rq_affinity");
+
+static int hw_queue_depth = 64;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth of request based modes. Default: 64");
+
+static int submit_queues = 1;
+module_param(submit_queues, int, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of hardware queues in multi-queue mode. Default: 1");
+
+static int home_node = NUMA_NO_NODE;
+module_param(home_node, int, S_IRUGO);
+MODULE_PARM_DESC(home_node, "NUMA node to allocate queue data on. Default: any");
+
+static int gb = 250;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size of each device in GB. Default: 250");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Logical block size in bytes. Default: 512");
+
+static int nr_devices = 2;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register. Default: 2");
+
+static void null_end_rq(struct request *rq)
+{
+	if (queue_mode == NULL_Q_MQ)
+		blk_mq_end_io(rq, 0);
+	else
+		blk_end_request_all(rq, 0);
+}
+
+static int null_complete_cq(struct completion_queue *cq)
+{
+	struct request *rq;
+	struct bio *bio;
+	int nr = 0;
+
+	while ((bio = bio_list_pop(&cq->bios)) != NULL) {
+		bio_endio(bio, 0);
+		nr++;
+	}
+
+	while (!list_empty(&cq->rqs)) {
+		rq = list_entry_rq(cq->rqs.next);
+		list_del_init(&rq->queuelist);
+		null_end_rq(rq);
+		nr++;
+	}
+
+	return nr;
+}
+
+static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer)
+{
+	null_complete_cq(container_of(timer, struct completion_queue, timer));
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * blk_poll() hook: reap this CPU's completions once their simulated
+ * latency has elapsed, without waiting for the timer interrupt.
+ */
+static int null_poll(struct request_queue *q)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+	int nr = 0;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+
+	if (hrtimer_active(&cq->timer) &&
+	    ktime_to_ns(hrtimer_get_expires(&cq->timer)) <=
+	    ktime_to_ns(ktime_get()) &&
+	    hrtimer_try_to_cancel(&cq->timer) == 1)
+		nr = null_complete_cq(cq);
+
+	local_irq_restore(flags);
+	return nr;
+}
+
+/*
+ * Everything queued on this CPU while the timer is armed completes with
+ * it, like a device coalescing its interrupts.
+ */
+static void null_cmd_end_timer(struct bio *bio, struct request *rq)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+
+	if (bio)
+		bio_list_add(&cq->bios, bio);
+	else
+		list_add_tail(&rq->queuelist, &cq->rqs);
+
+	if (!hrtimer_active(&cq->timer))
+		hrtimer_start(&cq->timer, ktime_set(0, completion_nsec),
+			      HRTIMER_MODE_REL_PINNED);
+	local_irq_restore(flags);
+}
+
+static void null_softirq_done_fn(struct request *rq)
+{
+	null_end_rq(rq);
+}
+
+static void null_handle_rq(struct request *rq)
+{
+	switch (irqmode) {
+	case NULL_IRQ_SOFTIRQ:
+		if (completion_cpu >= 0)
+			rq->cpu = completion_cpu;
+		blk_complete_request(rq);
+		break;
+	case NULL_IRQ_TIMER:
+		null_cmd_end_timer(NULL, rq);
+		break;
+	default:
+		null_end_rq(rq);
+		break;
+	}
+}
+
+/*
+ * There is no request to hand to the softirq in make_request mode, so
+ * NULL_IRQ_SOFTIRQ degrades to an inline completion there.
+ */
+static void null_make_request(struct request_queue *q, struct bio *bio)
+{
+	if (irqmode == NULL_IRQ_TIMER)
+		null_cmd_end_timer(bio, NULL);
+	else
+		bio_endio(bio, 0);
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		spin_unlock_irq(q->queue_lock);
+		null_handle_rq(rq);
+		spin_lock_irq(q->queue_lock);
+	}
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	null_handle_rq(rq);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+};
+
+static const struct block_device_operations null_fops = {
+	.owner =	THIS_MODULE,
+};
+
+static struct request_queue *null_alloc_queue(void)
+{
+	struct request_queue *q;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ: {
+		struct blk_mq_reg reg = {
+			.ops		= &null_mq_ops,
+			.nr_hw_queues	= submit_queues,
+			.queue_depth	= hw_queue_depth,
+			.numa_node	= home_node,
+			.flags		= BLK_MQ_F_SHOULD_MERGE,
+		};
+
+		q = blk_mq_init_queue(&reg, NULL);
+		break;
+	}
+	case NULL_Q_RQ:
+		q = blk_init_queue_node(null_request_fn, NULL, home_node);
+		if (q)
+			q->nr_requests = hw_queue_depth;
+		break;
+	default:
+		q = blk_alloc_queue_node(GFP_KERNEL, home_node);
+		if (q)
+			blk_queue_make_request(q, null_make_request);
+		break;
+	}
+
+	if (!q)
+		return NULL;
+
+	if (queue_mode != NULL_Q_BIO) {
+		blk_queue_softirq_done(q, null_softirq_done_fn);
+		if (completion_cpu >= 0)
+			queue_flag_set_unlocked(QUEUE_FLAG_SAME_FORCE, q);
+	}
+
+	if (irqmode == NULL_IRQ_TIMER)
+		blk_queue_poll_fn(q, null_poll);
+
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, q);
+	blk_queue_logical_block_size(q, bs);
+	blk_queue_physical_block_size(q, bs);
+
+	return q;
+}
+
+static int null_add_dev(unsigned int index)
+{
+	struct nullb *nullb;
+	struct gendisk *disk;
+	sector_t size;
+
+	nullb = kzalloc_node(sizeof(*nullb), GFP_KERNEL, home_node);
+	if (!nullb)
+		return -ENOMEM;
+
+	nullb->index = index;
+	nullb->q = null_alloc_queue();
+	if (!nullb->q)
+		goto out_free_nullb;
+
+	disk = nullb->disk = alloc_disk_node(1, home_node);
+	if (!disk)
+		goto out_cleanup_queue;
+
+	size = (sector_t)gb * 1024 * 1024 * 1024ULL;
+	set_capacity(disk, size >> 9);
+
+	disk->flags |= GENHD_FL_EXT_DEVT | GENHD_FL_SUPPRESS_PARTITION_INFO;
+	disk->major		= null_major;
+	disk->first_minor	= index;
+	disk->fops		= &null_fops;
+	disk->private_data	= nullb;
+	disk->queue		= nullb->q;
+	sprintf(disk->disk_name, "nullb%d", index);
+
+	list_add_tail(&nullb->list, &nullb_list);
+	add_disk(disk);
+	return 0;
+
+out_cleanup_queue:
+	blk_cleanup_queue(nullb->q);
+out_free_nullb:
+	kfree(nullb);
+	return -ENOMEM;
+}
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del_init(&nullb->list);
+
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	put_disk(nullb->disk);
+	kfree(nullb);
+}
+
+static int __init null_init(void)
+{
+	struct nullb *nullb, *next;
+	unsigned int i;
+	int cpu;
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ ||
+	    irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_TIMER)
+		return -EINVAL;
+
+	if (bs > PAGE_SIZE || bs < 512 || !is_power_of_2(bs))
+		return -EINVAL;
+
+	if (hw_queue_depth < 1 || hw_queue_depth > BLK_MQ_MAX_DEPTH ||
+	    submit_queues < 1 || nr_devices < 1)
+		return -EINVAL;
+
+	if (completion_cpu >= 0 &&
+	    (completion_cpu >= nr_cpu_ids || !cpu_online(completion_cpu)))
+		return -EINVAL;
+
+	for_each_possible_cpu(cpu) {
+		struct completion_queue *cq = &per_cpu(completion_queues, cpu);
+
+		bio_list_init(&cq->bios);
+		INIT_LIST_HEAD(&cq->rqs);
+		hrtimer_init(&cq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		cq->timer.function = null_cmd_timer_expired;
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (null_add_dev(i))
+			goto out_free;
+	}
+
+	pr_info("null: module loaded\n");
+	return 0;
+
+out_free:
+	list_for_each_entry_safe(nullb, next, &nullb_list, list)
+		null_del_dev(nullb);
+	unregister_blkdev(null_major, "nullb");
+	return -ENOMEM;
+}
+
+static void __exit null_exit(void)
+{
+	struct nullb *nullb, *next;
+	int cpu;
+
+	list_for_each_entry_safe(nullb, next, &nullb_list, list)
+		null_del_dev(nullb);
+
+	unregister_blkdev(null_major, "nullb");
+
+	/* nothing can be queued anymore, the queues are drained */
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu(completion_queues, cpu).timer);
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
@@ -300,6 +300,8 @@ static void write_page(struct bitmap *bitmap, struct page *page, int wait)
 {
 	struct buffer_head *bh;
 
+	atomic_long_inc(&bitmap->page_writes);
+
 	if (bitmap->file == NULL) {
 		switch (write_sb_page(bitmap, page, wait)) {
 		case -EINVAL:
@@ -890,7 +892,43 @@ static void bitmap_file_set_bit(struct bitmap *bitmap, sector_t block)
 	pr_debug("set file bit %lu page %lu\n", bit, page->index);
 	/* record page number so it gets flushed to disk when unplug occurs */
 	set_page_attr(bitmap, page, BITMAP_PAGE_DIRTY);
+
+	if (!bitmap->batch_pending && bitmap->mddev->bitmap_info.batch_delay) {
+		bitmap->batch_pending = 1;
+		bitmap->batch_start = jiffies;
+		mod_timer(&bitmap->batch_timer, jiffies +
+			  bitmap->mddev->bitmap_info.batch_delay);
+	}
+}
+
+static void bitmap_batch_timeout(unsigned long data)
+{
+	struct bitmap *bitmap = (struct bitmap *)data;
+
+	md_wakeup_thread(bitmap->mddev->thread);
+}
+
+/*
+ * Writes to chunks whose bits have just been set must wait for the bitmap
+ * to be written, so a burst of small writes can each cost a bitmap write.
+ * With bitmap/batch_delay set, the personality holds those writes back
+ * until the first of the new bits has waited that long, so the bits for
+ * the whole burst go out together.  Returns 1 when they should go now.
+ */
+int bitmap_batch_ready(struct bitmap *bitmap)
+{
+	unsigned long delay;
+
+	if (!bitmap)
+		return 1;
+
+	delay = bitmap->mddev->bitmap_info.batch_delay;
+	if (!delay || !bitmap->batch_pending)
+		return 1;
+
+	return time_after_eq(jiffies, bitmap->batch_start + delay);
 }
+EXPORT_SYMBOL(bitmap_batch_ready);
 
 /* this gets called when the md device is ready to unplug its underlying
  * (slave) device queues -- before we let any writes go down, we need to
@@ -905,6 +943,11 @@ void bitmap_unplug(struct bitmap *bitmap)
 	if (!bitmap)
 		return;
 
+	/* every bit set before this point is written below */
+	spin_lock_irqsave(&bitmap->lock, flags);
+	bitmap->batch_pending = 0;
+	spin_unlock_irqrestore(&bitmap->lock, flags);
+
 	/* look at each page to see if there are any set bits that need to be
 	 * flushed out to disk */
 	for (i = 0; i < bitmap->file_pages; i++) {
@@ -1133,7 +1176,7 @@ static bitmap_counter_t *bitmap_get_counter(struct bitmap *bitmap,
 void bitmap_daemon_work(struct mddev *mddev)
 {
 	struct bitmap *bitmap;
-	unsigned long j;
+	unsigned long j, writes;
 	unsigned long flags;
 	struct page *page = NULL, *lastpage = NULL;
 	sector_t blocks;
@@ -1152,6 +1195,11 @@ void bitmap_daemon_work(struct mddev *mddev)
 			+ mddev->bitmap_info.daemon_sleep))
 		goto done;
 
+	writes = atomic_long_read(&bitmap->page_writes);
+	bitmap->page_writes_rate = (writes - bitmap->page_writes_last) * HZ /
+		(jiffies - bitmap->daemon_lastrun);
+	bitmap->page_writes_last = writes;
+
 	bitmap->daemon_lastrun = jiffies;
 	if (bitmap->allclean) {
 		mddev->thread->timeout = MAX_SCHEDULE_TIMEOUT;
@@ -1651,6 +1699,8 @@ static void bitmap_free(struct bitmap *bitmap)
 	if (!bitmap) /* there was no bitmap */
 		return;
 
+	del_timer_sync(&bitmap->batch_timer);
+
 	/* release the bitmap file and kill the daemon */
 	bitmap_file_put(bitmap);
 
@@ -1717,6 +1767,8 @@ int bitmap_create(struct mddev *mddev)
 	init_waitqueue_head(&bitmap->write_wait);
 	init_waitqueue_head(&bitmap->overflow_wait);
 	init_waitqueue_head(&bitmap->behind_wait);
+	setup_timer(&bitmap->batch_timer, bitmap_batch_timeout,
+		    (unsigned long)bitmap);
 
 	bitmap->mddev = mddev;
 
@@ -2104,6 +2156,70 @@ static struct md_sysfs_entry max_backlog_used =
 __ATTR(max_backlog_used, S_IRUGO | S_IWUSR,
        behind_writes_used_show, behind_writes_used_reset);
 
+static ssize_t
+batch_delay_show(struct mddev *mddev, char *page)
+{
+	return sprintf(page, "%u\n",
+		       jiffies_to_msecs(mddev->bitmap_info.batch_delay));
+}
+
+static ssize_t
+batch_delay_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	/* in milliseconds, can be changed at any time */
+	unsigned long msecs;
+	int rv = strict_strtoul(buf, 10, &msecs);
+	if (rv)
+		return rv;
+	if (msecs > MSEC_PER_SEC)
+		return -EINVAL;
+	mddev->bitmap_info.batch_delay = msecs_to_jiffies(msecs);
+	/* anything being held back may be able to go now */
+	md_wakeup_thread(mddev->thread);
+	return len;
+}
+
+static struct md_sysfs_entry bitmap_batch_delay =
+__ATTR(batch_delay, S_IRUGO|S_IWUSR, batch_delay_show, batch_delay_store);
+
+static ssize_t
+page_writes_show(struct mddev *mddev, char *page)
+{
+	if (mddev->bitmap == NULL)
+		return sprintf(page, "0\n");
+	return sprintf(page, "%lu\n",
+		       atomic_long_read(&mddev->bitmap->page_writes));
+}
+
+static struct md_sysfs_entry bitmap_page_writes =
+__ATTR(page_writes, S_IRUGO, page_writes_show, NULL);
+
+static ssize_t
+page_writes_rate_show(struct mddev *mddev, char *page)
+{
+	struct bitmap *bitmap = mddev->bitmap;
+	unsigned long rate, elapsed;
+
+	if (bitmap == NULL)
+		return sprintf(page, "0\n");
+
+	/*
+	 * The daemon samples the rate each time it runs.  It stops running
+	 * once the bitmap is clean, so if it's overdue average over the
+	 * time since it last ran instead.
+	 */
+	rate = bitmap->page_writes_rate;
+	elapsed = jiffies - bitmap->daemon_lastrun;
+	if (elapsed > mddev->bitmap_info.daemon_sleep)
+		rate = (atomic_long_read(&bitmap->page_writes) -
+			bitmap->page_writes_last) * HZ / elapsed;
+
+	return sprintf(page, "%lu\n", rate);
+}
+
+static struct md_sysfs_entry bitmap_page_writes_rate =
+__ATTR(page_writes_rate, S_IRUGO, page_writes_rate_show, NULL);
+
 static struct attribute *md_bitmap_attrs[] = {
 	&bitmap_location.attr,
 	&bitmap_timeout.attr,
@@ -2112,6 +2228,9 @@ static struct attribute *md_bitmap_attrs[] = {
 	&bitmap_metadata.attr,
 	&bitmap_can_clear.attr,
 	&max_backlog_used.attr,
+	&bitmap_batch_delay.attr,
+	&bitmap_page_writes.attr,
+	&bitmap_page_writes_rate.attr,
 	NULL
 };
 struct attribute_group md_bitmap_group = {
@@ -227,6 +227,18 @@ struct bitmap {
 	unsigned long last_end_sync; /* when we lasted called end_sync to
 				      * update bitmap with resync progress */
 
+	/*
+	 * newly set bits that are being held back so that more can be
+	 * written out with them, see bitmap_batch_ready()
+	 */
+	int batch_pending;
+	unsigned long batch_start; /* jiffies when the first one was set */
+	struct timer_list batch_timer; /* wakes the md thread to write them */
+
+	atomic_long_t page_writes; /* bitmap pages written out */
+	unsigned long page_writes_last; /* page_writes at the last daemon run */
+	unsigned long page_writes_rate; /* per second, between the last two */
+
 	atomic_t pending_writes; /* pending writes to the bitmap file */
 	wait_queue_head_t write_wait;
 	wait_queue_head_t overflow_wait;
@@ -262,6 +274,7 @@ void bitmap_close_sync(struct bitmap *bitmap);
 void bitmap_cond_end_sync(struct bitmap *bitmap, sector_t sector);
 
 void bitmap_unplug(struct bitmap *bitmap);
+int bitmap_batch_ready(struct bitmap *bitmap);
 void bitmap_daemon_work(struct mddev *mddev);
 #endif
 
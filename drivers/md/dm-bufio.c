@@ -15,6 +15,7 @@
 #include <linux/version.h>
 #include <linux/shrinker.h>
 #include <linux/module.h>
+#include <linux/rculist.h>
 
 #define DM_MSG_PREFIX "bufio"
 
@@ -84,6 +85,11 @@
  *	context), so some clean-not-writing buffers can be held on
  *	dirty_lru too.  They are later added to lru in the process
  *	context.
+ *
+ *	The hash chains are RCU lists and buffer structures are freed
+ *	after a grace period, so that cached buffers can be looked up and
+ *	pinned without c->lock, see __find_lockless.  Everything else is
+ *	still done under c->lock.
  */
 struct dm_bufio_client {
 	struct mutex lock;
@@ -107,6 +113,7 @@ struct dm_bufio_client {
 
 	struct hlist_head *cache_hash;
 	wait_queue_head_t free_buffer_wait;
+	atomic_t unheld_seq;	/* bumped by lockless drops to zero holds */
 
 	int async_write_error;
 
@@ -140,16 +147,24 @@ struct dm_buffer {
 	void *data;
 	enum data_mode data_mode;
 	unsigned char list_mode;		/* LIST_* */
-	unsigned hold_count;
+	atomic_t hold_count;
 	int read_error;
 	int write_error;
 	unsigned long state;
 	unsigned long last_accessed;
+	unsigned long accessed;			/* hit without c->lock */
 	struct dm_bufio_client *c;
+	struct rcu_head rcu;
 	struct bio bio;
 	struct bio_vec bio_vec[DM_BUFIO_INLINE_VECS];
 };
 
+/*
+ * hold_count of a buffer that is being evicted or moved under c->lock.
+ * Lockless lookups can't pin such a buffer.
+ */
+#define B_HOLD_CLAIMED	(-1)
+
 /*----------------------------------------------------------------*/
 
 static struct kmem_cache *dm_bufio_caches[PAGE_SHIFT - SECTOR_SHIFT];
@@ -398,7 +413,29 @@ static void free_buffer(struct dm_buffer *b)
 	adjust_total_allocated(b->data_mode, -(long)c->block_size);
 
 	free_buffer_data(c, b->data, b->data_mode);
-	kfree(b);
+	kfree_rcu(b, rcu);
+}
+
+/*
+ * Take an unheld buffer away from lockless lookups so that it can be
+ * evicted.  Called with c->lock held.
+ */
+static int __claim_buffer(struct dm_buffer *b)
+{
+	return atomic_cmpxchg(&b->hold_count, 0, B_HOLD_CLAIMED) == 0;
+}
+
+/*
+ * Drop a hold without c->lock.
+ */
+static void unhold_buffer(struct dm_buffer *b)
+{
+	struct dm_bufio_client *c = b->c;
+
+	if (atomic_dec_and_test(&b->hold_count)) {
+		atomic_inc(&c->unheld_seq);
+		wake_up(&c->free_buffer_wait);
+	}
 }
 
 /*
@@ -411,8 +448,10 @@ static void __link_buffer(struct dm_buffer *b, sector_t block, int dirty)
 	c->n_buffers[dirty]++;
 	b->block = block;
 	b->list_mode = dirty;
+	b->accessed = 0;
 	list_add(&b->lru_list, &c->lru[dirty]);
-	hlist_add_head(&b->hash_list, &c->cache_hash[DM_BUFIO_HASH(block)]);
+	hlist_add_head_rcu(&b->hash_list,
+			   &c->cache_hash[DM_BUFIO_HASH(block)]);
 	b->last_accessed = jiffies;
 }
 
@@ -426,7 +465,7 @@ static void __unlink_buffer(struct dm_buffer *b)
 	BUG_ON(!c->n_buffers[b->list_mode]);
 
 	c->n_buffers[b->list_mode]--;
-	hlist_del(&b->hash_list);
+	hlist_del_init_rcu(&b->hash_list);
 	list_del(&b->lru_list);
 }
 
@@ -631,7 +670,7 @@ static void __write_dirty_buffer(struct dm_buffer *b)
  */
 static void __make_buffer_clean(struct dm_buffer *b)
 {
-	BUG_ON(b->hold_count);
+	BUG_ON(atomic_read(&b->hold_count) != B_HOLD_CLAIMED);
 
 	if (!b->state)	/* fast case */
 		return;
@@ -644,16 +683,25 @@ static void __make_buffer_clean(struct dm_buffer *b)
 /*
  * Find some buffer that is not held by anybody, clean it, unlink it and
  * return it.
+ *
+ * Lockless hits don't reorder the LRU, they only mark the buffer
+ * accessed.  Such buffers get a second chance at the head of the list.
  */
 static struct dm_buffer *__get_unclaimed_buffer(struct dm_bufio_client *c)
 {
-	struct dm_buffer *b;
+	struct dm_buffer *b, *tmp;
 
-	list_for_each_entry_reverse(b, &c->lru[LIST_CLEAN], lru_list) {
+	list_for_each_entry_safe_reverse(b, tmp, &c->lru[LIST_CLEAN], lru_list) {
 		BUG_ON(test_bit(B_WRITING, &b->state));
 		BUG_ON(test_bit(B_DIRTY, &b->state));
 
-		if (!b->hold_count) {
+		if (b->accessed) {
+			b->accessed = 0;
+			__relink_lru(b, LIST_CLEAN);
+			continue;
+		}
+
+		if (__claim_buffer(b)) {
 			__make_buffer_clean(b);
 			__unlink_buffer(b);
 			return b;
@@ -664,7 +712,7 @@ static struct dm_buffer *__get_unclaimed_buffer(struct dm_bufio_client *c)
 	list_for_each_entry_reverse(b, &c->lru[LIST_DIRTY], lru_list) {
 		BUG_ON(test_bit(B_READING, &b->state));
 
-		if (!b->hold_count) {
+		if (__claim_buffer(b)) {
 			__make_buffer_clean(b);
 			__unlink_buffer(b);
 			return b;
@@ -679,10 +727,14 @@ static struct dm_buffer *__get_unclaimed_buffer(struct dm_bufio_client *c)
  * Wait until some other threads free some buffer or release hold count on
  * some buffer.
  *
+ * Hold counts are dropped without c->lock, so @seq is c->unheld_seq as
+ * sampled before the caller looked for a buffer: a release that raced
+ * with the search must not be slept through.
+ *
  * This function is entered with c->lock held, drops it and regains it
  * before exiting.
  */
-static void __wait_for_free_buffer(struct dm_bufio_client *c)
+static void __wait_for_free_buffer(struct dm_bufio_client *c, int seq)
 {
 	DECLARE_WAITQUEUE(wait, current);
 
@@ -690,7 +742,8 @@ static void __wait_for_free_buffer(struct dm_bufio_client *c)
 	set_task_state(current, TASK_UNINTERRUPTIBLE);
 	dm_bufio_unlock(c);
 
-	io_schedule();
+	if (atomic_read(&c->unheld_seq) == seq)
+		io_schedule();
 
 	set_task_state(current, TASK_RUNNING);
 	remove_wait_queue(&c->free_buffer_wait, &wait);
@@ -721,6 +774,8 @@ static struct dm_buffer *__alloc_buffer_wait_no_callback(struct dm_bufio_client
 	 * be allocated.
 	 */
 	while (1) {
+		int seq = atomic_read(&c->unheld_seq);
+
 		if (dm_bufio_cache_size_latch != 1) {
 			b = alloc_buffer(c, GFP_NOIO | __GFP_NORETRY | __GFP_NOMEMALLOC | __GFP_NOWARN);
 			if (b)
@@ -740,7 +795,7 @@ static struct dm_buffer *__alloc_buffer_wait_no_callback(struct dm_bufio_client
 		if (b)
 			return b;
 
-		__wait_for_free_buffer(c);
+		__wait_for_free_buffer(c, seq);
 	}
 }
 
@@ -862,6 +917,57 @@ static struct dm_buffer *__find(struct dm_bufio_client *c, sector_t block)
 	return NULL;
 }
 
+/*
+ * Find a buffer in the hash and pin it without c->lock.
+ *
+ * A buffer found on the chain may be evicted, reused for another block
+ * or moved by dm_bufio_release_move while we look at it.  Claimed
+ * buffers can't be pinned at all; for the rest, check again once the
+ * hold is taken that it is still hashed under the block we want.
+ * Buffers are hashed and named with c->lock held and their state is set
+ * before they are hashed.
+ */
+static struct dm_buffer *__find_lockless(struct dm_bufio_client *c,
+					 sector_t block)
+{
+	struct dm_buffer *b;
+	struct hlist_node *hn;
+	int hold;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(b, hn, &c->cache_hash[DM_BUFIO_HASH(block)],
+				 hash_list) {
+		if (b->block != block)
+			continue;
+
+		do {
+			hold = atomic_read(&b->hold_count);
+			if (hold < 0)
+				goto out;
+		} while (atomic_cmpxchg(&b->hold_count, hold, hold + 1) != hold);
+
+		if (hlist_unhashed(&b->hash_list))
+			goto unhold;
+		smp_rmb();
+		if (b->block != block)
+			goto unhold;
+
+		if (!b->accessed)
+			b->accessed = 1;
+
+		rcu_read_unlock();
+		return b;
+	}
+out:
+	rcu_read_unlock();
+	return NULL;
+
+unhold:
+	rcu_read_unlock();
+	unhold_buffer(b);
+	return NULL;
+}
+
 /*----------------------------------------------------------------
  * Getting a buffer
  *--------------------------------------------------------------*/
@@ -882,7 +988,7 @@ static struct dm_buffer *__bufio_new(struct dm_bufio_client *c, sector_t block,
 
 	b = __find(c, block);
 	if (b) {
-		b->hold_count++;
+		atomic_inc(&b->hold_count);
 		__relink_lru(b, test_bit(B_DIRTY, &b->state) ||
 			     test_bit(B_WRITING, &b->state));
 		return b;
@@ -900,7 +1006,7 @@ static struct dm_buffer *__bufio_new(struct dm_bufio_client *c, sector_t block,
 	b = __find(c, block);
 	if (b) {
 		__free_buffer_wake(new_b);
-		b->hold_count++;
+		atomic_inc(&b->hold_count);
 		__relink_lru(b, test_bit(B_DIRTY, &b->state) ||
 			     test_bit(B_WRITING, &b->state));
 		return b;
@@ -909,18 +1015,22 @@ static struct dm_buffer *__bufio_new(struct dm_bufio_client *c, sector_t block,
 	__check_watermark(c);
 
 	b = new_b;
-	b->hold_count = 1;
+	atomic_set(&b->hold_count, 1);
 	b->read_error = 0;
 	b->write_error = 0;
-	__link_buffer(b, block, LIST_CLEAN);
 
-	if (nf == NF_FRESH) {
+	/*
+	 * The state must be set up before the buffer is hashed, a lockless
+	 * lookup may find it right away.
+	 */
+	if (nf == NF_FRESH)
 		b->state = 0;
-		return b;
+	else {
+		b->state = 1 << B_READING;
+		*need_submit = 1;
 	}
 
-	b->state = 1 << B_READING;
-	*need_submit = 1;
+	__link_buffer(b, block, LIST_CLEAN);
 
 	return b;
 }
@@ -953,12 +1063,15 @@ static void read_endio(struct bio *bio, int error)
 static void *new_read(struct dm_bufio_client *c, sector_t block,
 		      enum new_flag nf, struct dm_buffer **bp)
 {
-	int need_submit;
+	int need_submit = 0;
 	struct dm_buffer *b;
 
-	dm_bufio_lock(c);
-	b = __bufio_new(c, block, nf, bp, &need_submit);
-	dm_bufio_unlock(c);
+	b = __find_lockless(c, block);
+	if (!b) {
+		dm_bufio_lock(c);
+		b = __bufio_new(c, block, nf, bp, &need_submit);
+		dm_bufio_unlock(c);
+	}
 
 	if (!b || IS_ERR(b))
 		return b;
@@ -1010,13 +1123,26 @@ void dm_bufio_release(struct dm_buffer *b)
 {
 	struct dm_bufio_client *c = b->c;
 
-	dm_bufio_lock(c);
-
 	BUG_ON(test_bit(B_READING, &b->state));
-	BUG_ON(!b->hold_count);
+	BUG_ON(atomic_read(&b->hold_count) <= 0);
+
+	/*
+	 * write_endio() sets write_error before it clears B_WRITING, so
+	 * once B_WRITING is seen clear the error fields are stable and the
+	 * buffer can be released without c->lock.  A write in flight may
+	 * still fail, take the lock and let the slow path decide.
+	 */
+	if (likely(!test_bit(B_WRITING, &b->state))) {
+		smp_rmb();
+		if (likely(!b->read_error && !b->write_error)) {
+			unhold_buffer(b);
+			return;
+		}
+	}
+
+	dm_bufio_lock(c);
 
-	b->hold_count--;
-	if (!b->hold_count) {
+	if (atomic_dec_and_test(&b->hold_count)) {
 		wake_up(&c->free_buffer_wait);
 
 		/*
@@ -1024,9 +1150,9 @@ void dm_bufio_release(struct dm_buffer *b)
 		 * to be written, free the buffer. There is no point in caching
 		 * invalid buffer.
 		 */
-		if ((b->read_error || b->write_error) &&
-		    !test_bit(B_WRITING, &b->state) &&
-		    !test_bit(B_DIRTY, &b->state)) {
+		if (!test_bit(B_WRITING, &b->state) &&
+		    !test_bit(B_DIRTY, &b->state) &&
+		    __claim_buffer(b)) {
 			__unlink_buffer(b);
 			__free_buffer_wake(b);
 		}
@@ -1087,13 +1213,13 @@ again:
 		if (test_bit(B_WRITING, &b->state)) {
 			if (buffers_processed < c->n_buffers[LIST_DIRTY]) {
 				dropped_lock = 1;
-				b->hold_count++;
+				atomic_inc(&b->hold_count);
 				dm_bufio_unlock(c);
 				wait_on_bit(&b->state, B_WRITING,
 					    do_io_schedule,
 					    TASK_UNINTERRUPTIBLE);
 				dm_bufio_lock(c);
-				b->hold_count--;
+				atomic_dec(&b->hold_count);
 			} else
 				wait_on_bit(&b->state, B_WRITING,
 					    do_io_schedule,
@@ -1174,16 +1300,18 @@ void dm_bufio_release_move(struct dm_buffer *b, sector_t new_block)
 {
 	struct dm_bufio_client *c = b->c;
 	struct dm_buffer *new;
+	int seq;
 
 	BUG_ON(dm_bufio_in_request());
 
 	dm_bufio_lock(c);
 
 retry:
+	seq = atomic_read(&c->unheld_seq);
 	new = __find(c, new_block);
 	if (new) {
-		if (new->hold_count) {
-			__wait_for_free_buffer(c);
+		if (!__claim_buffer(new)) {
+			__wait_for_free_buffer(c, seq);
 			goto retry;
 		}
 
@@ -1196,34 +1324,41 @@ retry:
 		__free_buffer_wake(new);
 	}
 
-	BUG_ON(!b->hold_count);
+	BUG_ON(atomic_read(&b->hold_count) <= 0);
 	BUG_ON(test_bit(B_READING, &b->state));
 
 	__write_dirty_buffer(b);
-	if (b->hold_count == 1) {
+
+	/*
+	 * Claim our own hold so that nobody can pin the buffer without
+	 * c->lock while it changes identity.
+	 */
+	if (atomic_cmpxchg(&b->hold_count, 1, B_HOLD_CLAIMED) == 1) {
 		wait_on_bit(&b->state, B_WRITING,
 			    do_io_schedule, TASK_UNINTERRUPTIBLE);
 		set_bit(B_DIRTY, &b->state);
 		__unlink_buffer(b);
 		__link_buffer(b, new_block, LIST_DIRTY);
+		atomic_set(&b->hold_count, 1);
 	} else {
 		sector_t old_block;
 		wait_on_bit_lock(&b->state, B_WRITING,
 				 do_io_schedule, TASK_UNINTERRUPTIBLE);
 		/*
-		 * Relink buffer to "new_block" so that write_callback
+		 * Rename buffer to "new_block" so that write_callback
 		 * sees "new_block" as a block number.
 		 * After the write, link the buffer back to old_block.
 		 * All this must be done in bufio lock, so that block number
-		 * change isn't visible to other threads.
+		 * change isn't visible to other threads.  The buffer stays
+		 * unhashed meanwhile, which hides it from lockless lookups.
 		 */
 		old_block = b->block;
 		__unlink_buffer(b);
-		__link_buffer(b, new_block, b->list_mode);
+		smp_wmb();
+		b->block = new_block;
 		submit_io(b, WRITE, new_block, write_endio);
 		wait_on_bit(&b->state, B_WRITING,
 			    do_io_schedule, TASK_UNINTERRUPTIBLE);
-		__unlink_buffer(b);
 		__link_buffer(b, old_block, b->list_mode);
 	}
 
@@ -1288,8 +1423,9 @@ static void drop_buffers(struct dm_bufio_client *c)
 
 	for (i = 0; i < LIST_SIZE; i++)
 		list_for_each_entry(b, &c->lru[i], lru_list)
-			DMERR("leaked buffer %llx, hold count %u, list %d",
-			      (unsigned long long)b->block, b->hold_count, i);
+			DMERR("leaked buffer %llx, hold count %d, list %d",
+			      (unsigned long long)b->block,
+			      atomic_read(&b->hold_count), i);
 
 	for (i = 0; i < LIST_SIZE; i++)
 		BUG_ON(!list_empty(&c->lru[i]));
@@ -1316,7 +1452,7 @@ static int __cleanup_old_buffer(struct dm_buffer *b, gfp_t gfp,
 			return 1;
 	}
 
-	if (b->hold_count)
+	if (!__claim_buffer(b))
 		return 1;
 
 	__make_buffer_clean(b);
@@ -1416,6 +1552,7 @@ struct dm_bufio_client *dm_bufio_client_create(struct block_device *bdev, unsign
 	c->need_reserved_buffers = reserved_buffers;
 
 	init_waitqueue_head(&c->free_buffer_wait);
+	atomic_set(&c->unheld_seq, 0);
 	c->async_write_error = 0;
 
 	c->dm_io = dm_io_client_create();
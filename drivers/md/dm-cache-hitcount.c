@@ -0,0 +1,440 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Hit count cache policy: an origin block is promoted once it has been
+ * hit a number of times, evicting the least recently used cache block.
+ * Long runs of sequential I/O bypass the cache, the origin is usually
+ * good at those and they would only flush out the hot blocks.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache-policy-hitcount"
+
+#define HITCOUNT_MIN_BUCKETS 16
+
+/* Contiguous I/Os before a stream counts as sequential. */
+#define DEFAULT_SEQUENTIAL_THRESHOLD 512
+
+/* Hits before an origin block is promoted. */
+#define DEFAULT_PROMOTE_THRESHOLD 4
+
+/*
+ * Every origin block we know of has an entry.  Resident entries are
+ * indexed by their cache block, the others only remember hit counts of
+ * promotion candidates and are recycled least recently used first.
+ */
+struct entry {
+	struct hlist_node hlist;
+	struct list_head list;
+	dm_block_t oblock;
+	unsigned hit_count;
+	unsigned resident:1;
+	unsigned pinned:1;
+};
+
+struct hitcount_policy {
+	dm_block_t cache_size;
+
+	struct entry *resident;		/* indexed by cblock */
+	struct list_head free;		/* unused cache blocks */
+	struct list_head lru;		/* resident, least recent first */
+	dm_block_t nr_resident;
+
+	struct entry *candidates;
+	struct list_head candidates_free;
+	struct list_head candidates_lru;
+
+	unsigned nr_buckets;
+	unsigned hash_bits;
+	struct hlist_head *table;
+
+	/* Sequential I/O detection */
+	sector_t last_end_sector;
+	unsigned nr_seq_ios;
+	unsigned long nr_seq_bypassed;
+
+	unsigned sequential_threshold;
+	unsigned promote_threshold;
+};
+
+/*----------------------------------------------------------------*/
+
+static struct hlist_head *bucket(struct hitcount_policy *hp, dm_block_t oblock)
+{
+	return hp->table + hash_64(oblock, hp->hash_bits);
+}
+
+static struct entry *lookup(struct hitcount_policy *hp, dm_block_t oblock)
+{
+	struct hlist_node *tmp;
+	struct entry *e;
+
+	hlist_for_each_entry(e, tmp, bucket(hp, oblock), hlist)
+		if (e->oblock == oblock)
+			return e;
+
+	return NULL;
+}
+
+static void insert(struct hitcount_policy *hp, struct entry *e)
+{
+	hlist_add_head(&e->hlist, bucket(hp, e->oblock));
+}
+
+static dm_block_t to_cblock(struct hitcount_policy *hp, struct entry *e)
+{
+	return e - hp->resident;
+}
+
+/*
+ * Only the end of the previous I/O is remembered, so interleaved
+ * streams look random.  That's fine, they're what the cache is for.
+ */
+static int is_sequential(struct hitcount_policy *hp, struct bio *bio)
+{
+	if (bio->bi_sector == hp->last_end_sector)
+		return hp->nr_seq_ios + 1 >= hp->sequential_threshold;
+
+	return 0;
+}
+
+static void update_sequential(struct hitcount_policy *hp, struct bio *bio)
+{
+	if (bio->bi_sector == hp->last_end_sector)
+		hp->nr_seq_ios++;
+	else
+		hp->nr_seq_ios = 0;
+
+	hp->last_end_sector = bio->bi_sector + bio_sectors(bio);
+}
+
+static void hit_candidate(struct hitcount_policy *hp, struct entry *e,
+			  dm_block_t oblock)
+{
+	if (e) {
+		e->hit_count++;
+		list_move_tail(&e->list, &hp->candidates_lru);
+		return;
+	}
+
+	if (!list_empty(&hp->candidates_free))
+		e = list_first_entry(&hp->candidates_free, struct entry, list);
+	else {
+		e = list_first_entry(&hp->candidates_lru, struct entry, list);
+		hlist_del(&e->hlist);
+	}
+
+	e->oblock = oblock;
+	e->hit_count = 1;
+	insert(hp, e);
+	list_move_tail(&e->list, &hp->candidates_lru);
+}
+
+static void drop_candidate(struct hitcount_policy *hp, struct entry *e)
+{
+	hlist_del(&e->hlist);
+	list_move(&e->list, &hp->candidates_free);
+}
+
+static struct entry *find_victim(struct hitcount_policy *hp)
+{
+	struct entry *e;
+
+	/*
+	 * Pinned blocks are the few still being migrated, and they're
+	 * near the recent end anyway.
+	 */
+	list_for_each_entry(e, &hp->lru, list)
+		if (!e->pinned)
+			return e;
+
+	return NULL;
+}
+
+static void make_resident(struct hitcount_policy *hp, struct entry *e,
+			  dm_block_t oblock)
+{
+	e->oblock = oblock;
+	e->hit_count = 0;
+	e->resident = 1;
+	insert(hp, e);
+	list_move_tail(&e->list, &hp->lru);
+}
+
+static int hitcount_map(struct dm_cache_policy *p, dm_block_t oblock,
+			int can_migrate, struct bio *bio,
+			struct policy_result *result)
+{
+	struct hitcount_policy *hp = p->context;
+	struct entry *e = lookup(hp, oblock), *victim = NULL;
+
+	if (e && e->resident) {
+		update_sequential(hp, bio);
+		e->hit_count++;
+		list_move_tail(&e->list, &hp->lru);
+		result->op = POLICY_HIT;
+		result->cblock = to_cblock(hp, e);
+		return 0;
+	}
+
+	if (is_sequential(hp, bio)) {
+		update_sequential(hp, bio);
+		hp->nr_seq_bypassed++;
+		result->op = POLICY_MISS;
+		return 0;
+	}
+
+	if ((e ? e->hit_count : 0) + 1 < hp->promote_threshold)
+		goto miss;
+
+	if (list_empty(&hp->free)) {
+		victim = find_victim(hp);
+		if (!victim)
+			goto miss;
+	}
+
+	if (!can_migrate)
+		return -EWOULDBLOCK;
+
+	update_sequential(hp, bio);
+	if (e)
+		drop_candidate(hp, e);
+
+	if (victim) {
+		result->op = POLICY_REPLACE;
+		result->old_oblock = victim->oblock;
+		hlist_del(&victim->hlist);
+		e = victim;
+	} else {
+		result->op = POLICY_NEW;
+		e = list_first_entry(&hp->free, struct entry, list);
+		hp->nr_resident++;
+	}
+
+	make_resident(hp, e, oblock);
+	e->pinned = 1;
+	result->cblock = to_cblock(hp, e);
+
+	return 0;
+
+miss:
+	update_sequential(hp, bio);
+	hit_candidate(hp, e, oblock);
+	result->op = POLICY_MISS;
+
+	return 0;
+}
+
+static void hitcount_migration_done(struct dm_cache_policy *p,
+				    dm_block_t oblock)
+{
+	struct hitcount_policy *hp = p->context;
+	struct entry *e = lookup(hp, oblock);
+
+	if (e && e->resident)
+		e->pinned = 0;
+}
+
+static int hitcount_load_mapping(struct dm_cache_policy *p, dm_block_t oblock,
+				 dm_block_t cblock)
+{
+	struct hitcount_policy *hp = p->context;
+	struct entry *e = lookup(hp, oblock);
+
+	if (cblock >= hp->cache_size || hp->resident[cblock].resident)
+		return -EINVAL;
+
+	if (e) {
+		if (e->resident)
+			return -EINVAL;
+		drop_candidate(hp, e);
+	}
+
+	make_resident(hp, hp->resident + cblock, oblock);
+	hp->nr_resident++;
+
+	return 0;
+}
+
+static void hitcount_remove_mapping(struct dm_cache_policy *p,
+				    dm_block_t oblock)
+{
+	struct hitcount_policy *hp = p->context;
+	struct entry *e = lookup(hp, oblock);
+
+	if (!e || !e->resident)
+		return;
+
+	hlist_del(&e->hlist);
+	e->resident = 0;
+	e->pinned = 0;
+	list_move(&e->list, &hp->free);
+	hp->nr_resident--;
+}
+
+static dm_block_t hitcount_residency(struct dm_cache_policy *p)
+{
+	struct hitcount_policy *hp = p->context;
+
+	return hp->nr_resident;
+}
+
+static int hitcount_status(struct dm_cache_policy *p, status_type_t type,
+			   char *result, unsigned maxlen)
+{
+	struct hitcount_policy *hp = p->context;
+	unsigned sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%lu ", hp->nr_seq_bypassed);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("4 sequential_threshold %u promote_threshold %u ",
+		       hp->sequential_threshold, hp->promote_threshold);
+		break;
+	}
+
+	return 0;
+}
+
+/*----------------------------------------------------------------*/
+
+static int parse_policy_args(struct hitcount_policy *hp,
+			     unsigned argc, char **argv, char **error)
+{
+	unsigned value;
+
+	if (argc & 1) {
+		*error = "Policy arguments must be key value pairs";
+		return -EINVAL;
+	}
+
+	for (; argc; argc -= 2, argv += 2) {
+		if (kstrtouint(argv[1], 10, &value) || !value) {
+			*error = "Invalid policy argument value";
+			return -EINVAL;
+		}
+
+		if (!strcasecmp(argv[0], "sequential_threshold"))
+			hp->sequential_threshold = value;
+		else if (!strcasecmp(argv[0], "promote_threshold"))
+			hp->promote_threshold = value;
+		else {
+			*error = "Unrecognised policy argument";
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void free_hitcount(struct hitcount_policy *hp)
+{
+	vfree(hp->table);
+	vfree(hp->candidates);
+	vfree(hp->resident);
+	kfree(hp);
+}
+
+static int hitcount_create(struct dm_cache_policy *p, dm_block_t cache_size,
+			   unsigned argc, char **argv, char **error)
+{
+	struct hitcount_policy *hp;
+	dm_block_t i;
+	int r;
+
+	hp = kzalloc(sizeof(*hp), GFP_KERNEL);
+	if (!hp) {
+		*error = "Cannot allocate hitcount policy context";
+		return -ENOMEM;
+	}
+
+	hp->cache_size = cache_size;
+	hp->sequential_threshold = DEFAULT_SEQUENTIAL_THRESHOLD;
+	hp->promote_threshold = DEFAULT_PROMOTE_THRESHOLD;
+	INIT_LIST_HEAD(&hp->free);
+	INIT_LIST_HEAD(&hp->lru);
+	INIT_LIST_HEAD(&hp->candidates_free);
+	INIT_LIST_HEAD(&hp->candidates_lru);
+
+	r = parse_policy_args(hp, argc, argv, error);
+	if (r)
+		goto bad;
+
+	/*
+	 * As many candidates as cache blocks, so a working set that fits
+	 * in the cache gets a chance to build up its hit counts.
+	 */
+	r = -ENOMEM;
+	hp->resident = vzalloc(cache_size * sizeof(*hp->resident));
+	hp->candidates = vzalloc(cache_size * sizeof(*hp->candidates));
+	hp->nr_buckets = roundup_pow_of_two(max_t(dm_block_t, cache_size / 2,
+						  HITCOUNT_MIN_BUCKETS));
+	hp->hash_bits = ffs(hp->nr_buckets) - 1;
+	hp->table = vzalloc(hp->nr_buckets * sizeof(*hp->table));
+	if (!hp->resident || !hp->candidates || !hp->table) {
+		*error = "Cannot allocate hitcount policy tables";
+		goto bad;
+	}
+
+	for (i = 0; i < cache_size; i++) {
+		list_add_tail(&hp->resident[i].list, &hp->free);
+		list_add_tail(&hp->candidates[i].list, &hp->candidates_free);
+	}
+
+	p->context = hp;
+
+	return 0;
+
+bad:
+	free_hitcount(hp);
+	return r;
+}
+
+static void hitcount_destroy(struct dm_cache_policy *p)
+{
+	free_hitcount(p->context);
+}
+
+static struct dm_cache_policy_type hitcount_policy_type = {
+	.name = "hitcount",
+	.module = THIS_MODULE,
+	.create = hitcount_create,
+	.destroy = hitcount_destroy,
+	.map = hitcount_map,
+	.migration_done = hitcount_migration_done,
+	.load_mapping = hitcount_load_mapping,
+	.remove_mapping = hitcount_remove_mapping,
+	.residency = hitcount_residency,
+	.status = hitcount_status,
+};
+
+static int __init hitcount_init(void)
+{
+	int r;
+
+	r = dm_cache_policy_register(&hitcount_policy_type);
+	if (r)
+		DMERR("register failed %d", r);
+
+	return r;
+}
+
+static void __exit hitcount_exit(void)
+{
+	dm_cache_policy_unregister(&hitcount_policy_type);
+}
+
+module_init(hitcount_init);
+module_exit(hitcount_exit);
+
+MODULE_DESCRIPTION(DM_NAME " hit count cache policy");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,695 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-metadata.h"
+#include "persistent-data/dm-btree.h"
+#include "persistent-data/dm-space-map.h"
+#include "persistent-data/dm-transaction-manager.h"
+
+#include <linux/device-mapper.h>
+
+/*--------------------------------------------------------------------------
+ * As far as the metadata goes, there is:
+ *
+ * - A superblock in block zero, taking up fewer than 512 bytes for
+ *   atomic writes.
+ *
+ * - A space map managing the metadata blocks.
+ *
+ * - A btree mapping cache blocks onto a 64-bit value holding the origin
+ *   block in the top 48 bits and flags in the low 16 bits.
+ *
+ * Unlike thin provisioning there is no data space map: cache blocks are
+ * handed out by the policy, the metadata only records what they hold.
+ *
+ * Dirty bits change on every write hit, so they aren't written as they
+ * change.  They're written in bulk before the target commits with the
+ * CLEAN_SHUTDOWN flag set, and if that flag is missing when we start up
+ * every mapped block has to be assumed dirty.
+ *--------------------------------------------------------------------------*/
+
+#define DM_MSG_PREFIX   "cache metadata"
+
+#define CACHE_SUPERBLOCK_MAGIC 6142003
+#define CACHE_SUPERBLOCK_LOCATION 0
+#define CACHE_VERSION 1
+#define CACHE_METADATA_CACHE_SIZE 64
+#define SECTOR_TO_BLOCK_SHIFT 3
+
+/* This should be plenty */
+#define SPACE_MAP_ROOT_SIZE 128
+
+enum superblock_flag_bits {
+	/* for spotting crashes that would invalidate the dirty bitset */
+	__CLEAN_SHUTDOWN,
+};
+
+#define CLEAN_SHUTDOWN (1 << __CLEAN_SHUTDOWN)
+
+enum mapping_bits {
+	/* the cache block holds the data of the origin block */
+	M_VALID = 1,
+
+	/* the data on the cache is different from that on the origin */
+	M_DIRTY = 2,
+};
+
+/*
+ * Little endian on-disk superblock.
+ */
+struct cache_disk_superblock {
+	__le32 csum;	/* Checksum of superblock except for this field. */
+	__le32 flags;
+	__le64 blocknr;	/* This block number, dm_block_t. */
+
+	__u8 uuid[16];
+	__le64 magic;
+	__le32 version;
+
+	__u8 metadata_space_map_root[SPACE_MAP_ROOT_SIZE];
+
+	/*
+	 * btree mapping cblock -> (oblock, flags)
+	 */
+	__le64 mapping_root;
+
+	__le32 data_block_size;		/* In 512-byte sectors. */
+
+	__le32 metadata_block_size;	/* In 512-byte sectors. */
+	__le64 metadata_nr_blocks;
+
+	__le64 cache_blocks;
+
+	__le32 compat_flags;
+	__le32 compat_ro_flags;
+	__le32 incompat_flags;
+} __packed;
+
+struct dm_cache_metadata {
+	struct block_device *bdev;
+	struct dm_block_manager *bm;
+	struct dm_space_map *metadata_sm;
+	struct dm_transaction_manager *tm;
+
+	struct dm_btree_info info;
+
+	struct rw_semaphore root_lock;
+	int need_commit;
+	int clean_when_opened;
+	dm_block_t root;
+	unsigned long flags;
+	sector_t data_block_size;
+	dm_block_t cache_blocks;
+};
+
+/*----------------------------------------------------------------
+ * superblock validator
+ *--------------------------------------------------------------*/
+
+#define SUPERBLOCK_CSUM_XOR 9031977
+
+static void sb_prepare_for_write(struct dm_block_validator *v,
+				 struct dm_block *b,
+				 size_t block_size)
+{
+	struct cache_disk_superblock *disk_super = dm_block_data(b);
+
+	disk_super->blocknr = cpu_to_le64(dm_block_location(b));
+	disk_super->csum = cpu_to_le32(dm_bm_checksum(&disk_super->flags,
+						      block_size - sizeof(__le32),
+						      SUPERBLOCK_CSUM_XOR));
+}
+
+static int sb_check(struct dm_block_validator *v,
+		    struct dm_block *b,
+		    size_t block_size)
+{
+	struct cache_disk_superblock *disk_super = dm_block_data(b);
+	__le32 csum_le;
+
+	if (dm_block_location(b) != le64_to_cpu(disk_super->blocknr)) {
+		DMERR("sb_check failed: blocknr %llu: "
+		      "wanted %llu", le64_to_cpu(disk_super->blocknr),
+		      (unsigned long long)dm_block_location(b));
+		return -ENOTBLK;
+	}
+
+	if (le64_to_cpu(disk_super->magic) != CACHE_SUPERBLOCK_MAGIC) {
+		DMERR("sb_check failed: magic %llu: "
+		      "wanted %llu", le64_to_cpu(disk_super->magic),
+		      (unsigned long long)CACHE_SUPERBLOCK_MAGIC);
+		return -EILSEQ;
+	}
+
+	csum_le = cpu_to_le32(dm_bm_checksum(&disk_super->flags,
+					     block_size - sizeof(__le32),
+					     SUPERBLOCK_CSUM_XOR));
+	if (csum_le != disk_super->csum) {
+		DMERR("sb_check failed: csum %u: wanted %u",
+		      le32_to_cpu(csum_le), le32_to_cpu(disk_super->csum));
+		return -EILSEQ;
+	}
+
+	return 0;
+}
+
+static struct dm_block_validator sb_validator = {
+	.name = "superblock",
+	.prepare_for_write = sb_prepare_for_write,
+	.check = sb_check
+};
+
+/*----------------------------------------------------------------
+ * Methods for the btree value type
+ *--------------------------------------------------------------*/
+
+static __le64 pack_value(dm_block_t block, unsigned flags)
+{
+	uint64_t value = block;
+
+	value <<= 16;
+	value = value | (flags & ((1 << 16) - 1));
+
+	return cpu_to_le64(value);
+}
+
+static void unpack_value(__le64 value_le, dm_block_t *block, unsigned *flags)
+{
+	uint64_t value = le64_to_cpu(value_le);
+
+	*block = value >> 16;
+	*flags = value & ((1 << 16) - 1);
+}
+
+/*----------------------------------------------------------------*/
+
+static int superblock_all_zeroes(struct dm_block_manager *bm, int *result)
+{
+	int r;
+	unsigned i;
+	struct dm_block *b;
+	__le64 *data_le, zero = cpu_to_le64(0);
+	unsigned block_size = dm_bm_block_size(bm) / sizeof(__le64);
+
+	/*
+	 * We can't use a validator here - it may be all zeroes.
+	 */
+	r = dm_bm_read_lock(bm, CACHE_SUPERBLOCK_LOCATION, NULL, &b);
+	if (r)
+		return r;
+
+	data_le = dm_block_data(b);
+	*result = 1;
+	for (i = 0; i < block_size; i++) {
+		if (data_le[i] != zero) {
+			*result = 0;
+			break;
+		}
+	}
+
+	return dm_bm_unlock(b);
+}
+
+static int init_cmd(struct dm_cache_metadata *cmd,
+		    struct dm_block_manager *bm, int create)
+{
+	int r;
+	struct dm_space_map *sm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *sblock;
+
+	if (create) {
+		r = dm_tm_create_with_sm(bm, CACHE_SUPERBLOCK_LOCATION,
+					 &sb_validator, &tm, &sm, &sblock);
+		if (r < 0) {
+			DMERR("tm_create_with_sm failed");
+			return r;
+		}
+	} else {
+		size_t space_map_root_offset =
+			offsetof(struct cache_disk_superblock, metadata_space_map_root);
+
+		r = dm_tm_open_with_sm(bm, CACHE_SUPERBLOCK_LOCATION,
+				       &sb_validator, space_map_root_offset,
+				       SPACE_MAP_ROOT_SIZE, &tm, &sm, &sblock);
+		if (r < 0) {
+			DMERR("tm_open_with_sm failed");
+			return r;
+		}
+	}
+
+	r = dm_tm_unlock(tm, sblock);
+	if (r < 0) {
+		DMERR("couldn't unlock superblock");
+		goto bad;
+	}
+
+	cmd->bm = bm;
+	cmd->metadata_sm = sm;
+	cmd->tm = tm;
+
+	cmd->info.tm = tm;
+	cmd->info.levels = 1;
+	cmd->info.value_type.context = NULL;
+	cmd->info.value_type.size = sizeof(__le64);
+	cmd->info.value_type.inc = NULL;
+	cmd->info.value_type.dec = NULL;
+	cmd->info.value_type.equal = NULL;
+
+	cmd->root = 0;
+
+	init_rwsem(&cmd->root_lock);
+	cmd->need_commit = 0;
+	cmd->clean_when_opened = 0;
+	cmd->flags = 0;
+
+	return 0;
+
+bad:
+	dm_tm_destroy(tm);
+	dm_sm_destroy(sm);
+
+	return r;
+}
+
+static int __begin_transaction(struct dm_cache_metadata *cmd)
+{
+	int r;
+	u32 features;
+	struct cache_disk_superblock *disk_super;
+	struct dm_block *sblock;
+
+	/*
+	 * __commit_transaction() resets these
+	 */
+	WARN_ON(cmd->need_commit);
+
+	r = dm_bm_read_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			    &sb_validator, &sblock);
+	if (r)
+		return r;
+
+	disk_super = dm_block_data(sblock);
+	cmd->root = le64_to_cpu(disk_super->mapping_root);
+	cmd->flags = le32_to_cpu(disk_super->flags);
+	cmd->data_block_size = le32_to_cpu(disk_super->data_block_size);
+	cmd->cache_blocks = le64_to_cpu(disk_super->cache_blocks);
+
+	features = le32_to_cpu(disk_super->incompat_flags) & ~CACHE_FEATURE_INCOMPAT_SUPP;
+	if (features) {
+		DMERR("could not access metadata due to "
+		      "unsupported optional features (%lx).",
+		      (unsigned long)features);
+		r = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * Check for read-only metadata to skip the following RDWR checks.
+	 */
+	if (get_disk_ro(cmd->bdev->bd_disk))
+		goto out;
+
+	features = le32_to_cpu(disk_super->compat_ro_flags) & ~CACHE_FEATURE_COMPAT_RO_SUPP;
+	if (features) {
+		DMERR("could not access metadata RDWR due to "
+		      "unsupported optional features (%lx).",
+		      (unsigned long)features);
+		r = -EINVAL;
+	}
+
+out:
+	dm_bm_unlock(sblock);
+	return r;
+}
+
+static int __commit_transaction(struct dm_cache_metadata *cmd,
+				int clean_shutdown)
+{
+	int r;
+	size_t metadata_len;
+	unsigned long flags;
+	struct cache_disk_superblock *disk_super;
+	struct dm_block *sblock;
+
+	/*
+	 * We need to know if the cache_disk_superblock exceeds a 512-byte sector.
+	 */
+	BUILD_BUG_ON(sizeof(struct cache_disk_superblock) > 512);
+
+	if (clean_shutdown)
+		flags = cmd->flags | CLEAN_SHUTDOWN;
+	else
+		flags = cmd->flags & ~CLEAN_SHUTDOWN;
+
+	/*
+	 * The superblock flags are part of the transaction too, a
+	 * change of them alone still has to be written.
+	 */
+	if (!cmd->need_commit && flags == cmd->flags)
+		return 0;
+
+	r = dm_tm_pre_commit(cmd->tm);
+	if (r < 0)
+		return r;
+
+	r = dm_sm_root_size(cmd->metadata_sm, &metadata_len);
+	if (r < 0)
+		return r;
+
+	r = dm_bm_write_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			     &sb_validator, &sblock);
+	if (r)
+		return r;
+
+	disk_super = dm_block_data(sblock);
+	disk_super->mapping_root = cpu_to_le64(cmd->root);
+	disk_super->flags = cpu_to_le32(flags);
+
+	r = dm_sm_copy_root(cmd->metadata_sm, &disk_super->metadata_space_map_root,
+			    metadata_len);
+	if (r < 0) {
+		dm_bm_unlock(sblock);
+		return r;
+	}
+
+	r = dm_tm_commit(cmd->tm, sblock);
+	if (r)
+		return r;
+
+	cmd->need_commit = 0;
+	cmd->flags = flags;
+
+	return 1;
+}
+
+static int __create_superblock(struct dm_cache_metadata *cmd,
+			       sector_t data_block_size,
+			       dm_block_t cache_blocks)
+{
+	int r;
+	struct cache_disk_superblock *disk_super;
+	struct dm_block *sblock;
+	sector_t bdev_size = i_size_read(cmd->bdev->bd_inode) >> SECTOR_SHIFT;
+
+	r = dm_bm_write_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			     &sb_validator, &sblock);
+	if (r)
+		return r;
+
+	disk_super = dm_block_data(sblock);
+	disk_super->magic = cpu_to_le64(CACHE_SUPERBLOCK_MAGIC);
+	disk_super->version = cpu_to_le32(CACHE_VERSION);
+	disk_super->metadata_block_size = cpu_to_le32(CACHE_METADATA_BLOCK_SIZE >> SECTOR_SHIFT);
+	disk_super->metadata_nr_blocks = cpu_to_le64(bdev_size >> SECTOR_TO_BLOCK_SHIFT);
+	disk_super->data_block_size = cpu_to_le32(data_block_size);
+	disk_super->cache_blocks = cpu_to_le64(cache_blocks);
+
+	r = dm_bm_unlock(sblock);
+	if (r < 0)
+		return r;
+
+	r = dm_btree_empty(&cmd->info, &cmd->root);
+	if (r < 0)
+		return r;
+
+	cmd->data_block_size = data_block_size;
+	cmd->cache_blocks = cache_blocks;
+	cmd->flags = 0;
+	cmd->need_commit = 1;
+
+	return 0;
+}
+
+struct dm_cache_metadata *dm_cache_metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 dm_block_t cache_blocks)
+{
+	int r;
+	struct dm_cache_metadata *cmd;
+	struct dm_block_manager *bm;
+	int create;
+
+	cmd = kmalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd) {
+		DMERR("could not allocate metadata struct");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/*
+	 * Max hex locks:
+	 *  3 for btree insert +
+	 *  2 for btree lookup used within space map
+	 */
+	bm = dm_block_manager_create(bdev, CACHE_METADATA_BLOCK_SIZE,
+				     CACHE_METADATA_CACHE_SIZE, 5);
+	if (!bm) {
+		DMERR("could not create block manager");
+		kfree(cmd);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	r = superblock_all_zeroes(bm, &create);
+	if (r) {
+		dm_block_manager_destroy(bm);
+		kfree(cmd);
+		return ERR_PTR(r);
+	}
+
+	r = init_cmd(cmd, bm, create);
+	if (r) {
+		dm_block_manager_destroy(bm);
+		kfree(cmd);
+		return ERR_PTR(r);
+	}
+	cmd->bdev = bdev;
+
+	if (create) {
+		r = __create_superblock(cmd, data_block_size, cache_blocks);
+		if (r < 0) {
+			DMERR("couldn't create superblock");
+			goto bad;
+		}
+
+		/*
+		 * Nothing is mapped yet, so there's no dirty state to lose.
+		 */
+		r = __commit_transaction(cmd, 1);
+		if (r < 0) {
+			DMERR("%s: __commit_transaction() failed, error = %d",
+			      __func__, r);
+			goto bad;
+		}
+	}
+
+	r = __begin_transaction(cmd);
+	if (r < 0)
+		goto bad;
+
+	if (cmd->data_block_size != data_block_size) {
+		DMERR("data block size (%llu) differs from the one in the metadata (%llu)",
+		      (unsigned long long)data_block_size,
+		      (unsigned long long)cmd->data_block_size);
+		r = -EINVAL;
+		goto bad;
+	}
+
+	if (cmd->cache_blocks != cache_blocks) {
+		DMERR("cache size (%llu blocks) differs from the one in the metadata (%llu blocks)",
+		      (unsigned long long)cache_blocks,
+		      (unsigned long long)cmd->cache_blocks);
+		r = -EINVAL;
+		goto bad;
+	}
+
+	cmd->clean_when_opened = !!(cmd->flags & CLEAN_SHUTDOWN);
+
+	return cmd;
+
+bad:
+	if (dm_cache_metadata_close(cmd) < 0)
+		DMWARN("%s: dm_cache_metadata_close() failed.", __func__);
+	return ERR_PTR(r);
+}
+
+/*
+ * Doesn't commit, dirty bits would have to be written first for the
+ * result to be of any use.  The target does that from postsuspend.
+ */
+int dm_cache_metadata_close(struct dm_cache_metadata *cmd)
+{
+	dm_tm_destroy(cmd->tm);
+	dm_block_manager_destroy(cmd->bm);
+	dm_sm_destroy(cmd->metadata_sm);
+	kfree(cmd);
+
+	return 0;
+}
+
+static int __lookup(struct dm_cache_metadata *cmd, dm_block_t cblock,
+		    dm_block_t *oblock, unsigned *flags)
+{
+	int r;
+	__le64 value;
+	uint64_t key = cblock;
+
+	r = dm_btree_lookup(&cmd->info, cmd->root, &key, &value);
+	if (r)
+		return r;
+
+	unpack_value(value, oblock, flags);
+
+	return 0;
+}
+
+static int __insert(struct dm_cache_metadata *cmd, dm_block_t cblock,
+		    dm_block_t oblock, unsigned flags)
+{
+	int r;
+	__le64 value = pack_value(oblock, flags);
+	uint64_t key = cblock;
+
+	__dm_bless_for_disk(&value);
+	r = dm_btree_insert(&cmd->info, cmd->root, &key, &value, &cmd->root);
+	if (!r)
+		cmd->need_commit = 1;
+
+	return r;
+}
+
+int dm_cache_insert_mapping(struct dm_cache_metadata *cmd,
+			    dm_block_t cblock, dm_block_t oblock)
+{
+	int r;
+
+	down_write(&cmd->root_lock);
+	r = __insert(cmd, cblock, oblock, M_VALID);
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_remove_mapping(struct dm_cache_metadata *cmd, dm_block_t cblock)
+{
+	int r;
+	uint64_t key = cblock;
+
+	down_write(&cmd->root_lock);
+	r = dm_btree_remove(&cmd->info, cmd->root, &key, &cmd->root);
+	if (!r)
+		cmd->need_commit = 1;
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_set_dirty(struct dm_cache_metadata *cmd,
+		       dm_block_t cblock, int dirty)
+{
+	int r;
+	dm_block_t oblock;
+	unsigned flags, new_flags;
+
+	down_write(&cmd->root_lock);
+
+	r = __lookup(cmd, cblock, &oblock, &flags);
+	if (r)
+		goto out;
+
+	/*
+	 * Avoid shadowing btree nodes for bits that haven't changed.
+	 */
+	new_flags = dirty ? (flags | M_DIRTY) : (flags & ~M_DIRTY);
+	if (new_flags != flags)
+		r = __insert(cmd, cblock, oblock, new_flags);
+
+out:
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_load_mappings(struct dm_cache_metadata *cmd,
+			   load_mapping_fn fn, void *context)
+{
+	int r = 0;
+	dm_block_t cblock, oblock;
+	unsigned flags;
+
+	down_read(&cmd->root_lock);
+
+	for (cblock = 0; cblock < cmd->cache_blocks; cblock++) {
+		r = __lookup(cmd, cblock, &oblock, &flags);
+		if (r == -ENODATA)
+			continue;
+		if (r)
+			break;
+
+		if (!(flags & M_VALID))
+			continue;
+
+		r = fn(context, oblock, cblock,
+		       !cmd->clean_when_opened || (flags & M_DIRTY));
+		if (r)
+			break;
+	}
+
+	up_read(&cmd->root_lock);
+
+	return r == -ENODATA ? 0 : r;
+}
+
+int dm_cache_commit(struct dm_cache_metadata *cmd, int clean_shutdown)
+{
+	int r;
+
+	down_write(&cmd->root_lock);
+
+	r = __commit_transaction(cmd, clean_shutdown);
+	if (r <= 0)
+		goto out;
+
+	/*
+	 * Open the next transaction.
+	 */
+	r = __begin_transaction(cmd);
+out:
+	up_write(&cmd->root_lock);
+	return r;
+}
+
+int dm_cache_changed_this_transaction(struct dm_cache_metadata *cmd)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = cmd->need_commit;
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_get_free_metadata_block_count(struct dm_cache_metadata *cmd,
+					   dm_block_t *result)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = dm_sm_get_nr_free(cmd->metadata_sm, result);
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_get_metadata_dev_size(struct dm_cache_metadata *cmd,
+				   dm_block_t *result)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = dm_sm_get_nr_blocks(cmd->metadata_sm, result);
+	up_read(&cmd->root_lock);
+
+	return r;
+}
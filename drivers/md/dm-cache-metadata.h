@@ -0,0 +1,75 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef DM_CACHE_METADATA_H
+#define DM_CACHE_METADATA_H
+
+#include "persistent-data/dm-block-manager.h"
+
+#define CACHE_METADATA_BLOCK_SIZE 4096
+
+/*----------------------------------------------------------------*/
+
+struct dm_cache_metadata;
+
+/*
+ * Reopens or creates a new, empty metadata volume.  An existing volume
+ * must have been created with the same @data_block_size and
+ * @cache_blocks.
+ */
+struct dm_cache_metadata *dm_cache_metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 dm_block_t cache_blocks);
+
+int dm_cache_metadata_close(struct dm_cache_metadata *cmd);
+
+/*
+ * Compat feature flags.  Any incompat flags beyond the ones
+ * specified below will prevent use of the cache metadata.
+ */
+#define CACHE_FEATURE_COMPAT_SUPP	  0UL
+#define CACHE_FEATURE_COMPAT_RO_SUPP	  0UL
+#define CACHE_FEATURE_INCOMPAT_SUPP	  0UL
+
+/*
+ * Mappings from cache block to origin block.  A new mapping is always
+ * clean, dirty state only reaches the disk via dm_cache_set_dirty().
+ */
+int dm_cache_insert_mapping(struct dm_cache_metadata *cmd,
+			    dm_block_t cblock, dm_block_t oblock);
+int dm_cache_remove_mapping(struct dm_cache_metadata *cmd, dm_block_t cblock);
+int dm_cache_set_dirty(struct dm_cache_metadata *cmd,
+		       dm_block_t cblock, int dirty);
+
+/*
+ * Calls @fn for every mapped cache block.  If the volume was not shut
+ * down cleanly the dirty bits on disk can't be trusted and every block
+ * is reported dirty.
+ */
+typedef int (*load_mapping_fn)(void *context, dm_block_t oblock,
+			       dm_block_t cblock, int dirty);
+int dm_cache_load_mappings(struct dm_cache_metadata *cmd,
+			   load_mapping_fn fn, void *context);
+
+/*
+ * Commits the current transaction.  @clean_shutdown marks the volume as
+ * cleanly shut down, which must only be done once all the dirty bits
+ * have been written.  Any commit without it clears the mark again.
+ */
+int dm_cache_commit(struct dm_cache_metadata *cmd, int clean_shutdown);
+
+/*
+ * Returns 1 if the transaction holds uncommitted changes.
+ */
+int dm_cache_changed_this_transaction(struct dm_cache_metadata *cmd);
+
+int dm_cache_get_free_metadata_block_count(struct dm_cache_metadata *cmd,
+					   dm_block_t *result);
+
+int dm_cache_get_metadata_dev_size(struct dm_cache_metadata *cmd,
+				   dm_block_t *result);
+
+/*----------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Cache policy registration.
+ */
+
+#include "dm-cache-policy.h"
+
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#define DM_MSG_PREFIX "cache-policy"
+
+static LIST_HEAD(_policies);
+static DECLARE_RWSEM(_policy_lock);
+
+static struct dm_cache_policy_type *__find_policy(const char *name)
+{
+	struct dm_cache_policy_type *t;
+
+	list_for_each_entry(t, &_policies, list)
+		if (!strcmp(t->name, name))
+			return t;
+
+	return NULL;
+}
+
+static struct dm_cache_policy_type *get_policy(const char *name)
+{
+	struct dm_cache_policy_type *t;
+
+	down_read(&_policy_lock);
+	t = __find_policy(name);
+	if (t && !try_module_get(t->module))
+		t = NULL;
+	up_read(&_policy_lock);
+
+	return t;
+}
+
+struct dm_cache_policy_type *dm_cache_policy_get(const char *name)
+{
+	struct dm_cache_policy_type *t;
+
+	if (!name)
+		return NULL;
+
+	t = get_policy(name);
+	if (!t) {
+		request_module("dm-cache-%s", name);
+		t = get_policy(name);
+	}
+
+	return t;
+}
+
+void dm_cache_policy_put(struct dm_cache_policy_type *t)
+{
+	if (t)
+		module_put(t->module);
+}
+
+int dm_cache_policy_register(struct dm_cache_policy_type *type)
+{
+	int r = 0;
+
+	down_write(&_policy_lock);
+
+	if (__find_policy(type->name)) {
+		DMWARN("attempt to register policy under duplicate name %s",
+		       type->name);
+		r = -EEXIST;
+	} else
+		list_add(&type->list, &_policies);
+
+	up_write(&_policy_lock);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_cache_policy_register);
+
+void dm_cache_policy_unregister(struct dm_cache_policy_type *type)
+{
+	down_write(&_policy_lock);
+	list_del_init(&type->list);
+	up_write(&_policy_lock);
+}
+EXPORT_SYMBOL_GPL(dm_cache_policy_unregister);
@@ -0,0 +1,106 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Cache policy registration.
+ */
+
+#ifndef DM_CACHE_POLICY_H
+#define DM_CACHE_POLICY_H
+
+#include "persistent-data/dm-block-manager.h" /* FIXME: for dm_block_t */
+
+#include <linux/device-mapper.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * The policy decides which origin blocks live on the cache device, and
+ * which cache block they occupy.  The target does the data movement and
+ * keeps the metadata in step with the policy's decisions.
+ *
+ * All methods are called with the target's lock held, so they must not
+ * block.
+ */
+enum policy_operation {
+	POLICY_HIT,	/* the block is on the cache, use result->cblock */
+	POLICY_MISS,	/* the block stays on the origin */
+	POLICY_NEW,	/* promote the block into the free result->cblock */
+	POLICY_REPLACE,	/* demote result->old_oblock from result->cblock,
+			   then promote the block into it */
+};
+
+struct policy_result {
+	enum policy_operation op;
+	dm_block_t old_oblock;
+	dm_block_t cblock;
+};
+
+struct dm_cache_policy_type;
+
+struct dm_cache_policy {
+	struct dm_cache_policy_type *type;
+	void *context;
+};
+
+struct dm_cache_policy_type {
+	char *name;
+	struct module *module;
+	struct list_head list;
+
+	/*
+	 * Constructs a policy for a cache of @cache_size blocks, taking
+	 * policy specific arguments.  Sets @error on failure.
+	 */
+	int (*create)(struct dm_cache_policy *p, dm_block_t cache_size,
+		      unsigned argc, char **argv, char **error);
+	void (*destroy)(struct dm_cache_policy *p);
+
+	/*
+	 * Decides where @bio, which is aimed at @oblock, should go.
+	 *
+	 * If @can_migrate is zero the policy must not return POLICY_NEW or
+	 * POLICY_REPLACE.  When it would have done it instead returns
+	 * -EWOULDBLOCK without updating any of its state, and the target
+	 * calls it again, with @can_migrate set, from a context where a
+	 * migration can be started.
+	 *
+	 * The destination of a POLICY_NEW or POLICY_REPLACE is pinned: it
+	 * won't be picked for demotion until migration_done() is called.
+	 */
+	int (*map)(struct dm_cache_policy *p, dm_block_t oblock,
+		   int can_migrate, struct bio *bio,
+		   struct policy_result *result);
+	void (*migration_done)(struct dm_cache_policy *p, dm_block_t oblock);
+
+	/*
+	 * Mapping changes the policy hasn't decided itself: populating the
+	 * policy from the metadata, and backing out of a failed migration.
+	 */
+	int (*load_mapping)(struct dm_cache_policy *p, dm_block_t oblock,
+			    dm_block_t cblock);
+	void (*remove_mapping)(struct dm_cache_policy *p, dm_block_t oblock);
+
+	/*
+	 * Number of cache blocks currently in use.
+	 */
+	dm_block_t (*residency)(struct dm_cache_policy *p);
+
+	int (*status)(struct dm_cache_policy *p, status_type_t type,
+		      char *result, unsigned maxlen);
+};
+
+/* Register a cache policy */
+int dm_cache_policy_register(struct dm_cache_policy_type *type);
+
+/* Unregister a cache policy */
+void dm_cache_policy_unregister(struct dm_cache_policy_type *type);
+
+/* Returns a registered cache policy type, loading its module if needed */
+struct dm_cache_policy_type *dm_cache_policy_get(const char *name);
+
+/* Releases a cache policy type */
+void dm_cache_policy_put(struct dm_cache_policy_type *type);
+
+/*----------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,1487 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-metadata.h"
+#include "dm-cache-policy.h"
+#include "dm-bio-prison.h"
+#include "dm-bio-record.h"
+
+#include <linux/device-mapper.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache"
+
+/*
+ * Tunable constants
+ */
+#define ENDIO_HOOK_POOL_SIZE 1024
+#define MIGRATION_POOL_SIZE 128
+#define WRITETHROUGH_POOL_SIZE 16
+#define PRISON_CELLS 1024
+#define COMMIT_PERIOD HZ
+#define MIGRATING_HASH_BITS 6
+#define MIGRATING_HASH_SIZE (1 << MIGRATING_HASH_BITS)
+
+/*
+ * The block size of the cache device must be between 32KB and 1GB.
+ */
+#define DATA_DEV_BLOCK_SIZE_MIN_SECTORS (32 * 1024 >> SECTOR_SHIFT)
+#define DATA_DEV_BLOCK_SIZE_MAX_SECTORS (1024 * 1024 * 1024 >> SECTOR_SHIFT)
+
+/*
+ * The metadata device is currently limited in size, see dm-thin.c.
+ */
+#define METADATA_DEV_MAX_SECTORS (255 * (1 << 14) * (CACHE_METADATA_BLOCK_SIZE / (1 << SECTOR_SHIFT)))
+
+/*
+ * How do we move blocks between the origin and the cache?
+ * ========================================================
+ *
+ * The policy decides, for every bio, whether its origin block (oblock)
+ * is on the cache and in which cache block (cblock).  Most of the time
+ * the answer is a plain hit or miss and the bio is remapped straight
+ * away from the map function.  When the policy wants a block promoted,
+ * possibly demoting another one to make room, the bio is handed to the
+ * worker which migrates the data with kcopyd:
+ *
+ * - The oblocks involved are locked in the bio prison, and entered in a
+ *   small hash the map function checks, so any bio for them waits for
+ *   the migration to complete.
+ *
+ * - All io already in flight is quiesced with a deferred set.  Bios to
+ *   other blocks carry on as normal.
+ *
+ * - A dirty victim is written back to the origin, then the old mapping
+ *   is removed and committed before anything else is copied into the
+ *   cache block.  Otherwise a crash could leave the metadata claiming
+ *   the victim's data is in a block that now holds something else.
+ *
+ * - The new block is copied to the cache and its mapping inserted.  It
+ *   reaches the disk with the next commit, at the latest on the next
+ *   REQ_FLUSH or once a second.
+ *
+ * In writeback mode write hits just go to the cache and mark the block
+ * dirty.  Dirty bits are only written to the metadata on suspend, after
+ * a crash every mapped block is treated as dirty.  In writethrough mode
+ * a write hit goes to the origin first and, once that's completed, to
+ * the cache, so no block ever becomes dirty.
+ */
+
+/*----------------------------------------------------------------*/
+
+struct dm_cache_migration;
+
+struct cache {
+	struct dm_target *ti;
+
+	struct dm_dev *metadata_dev;
+	struct dm_dev *cache_dev;
+	struct dm_dev *origin_dev;
+
+	sector_t sectors_per_block;
+	int block_shift;
+	sector_t offset_mask;
+	dm_block_t origin_blocks;
+	dm_block_t cache_blocks;
+
+	int writethrough;
+
+	struct dm_cache_metadata *cmd;
+	struct dm_cache_policy policy;
+
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+	struct bio_list deferred_flush_bios;
+	struct bio_list deferred_writethrough_bios;
+	struct list_head quiesced_migrations;
+	struct list_head completed_migrations;
+	struct hlist_head migrating[MIGRATING_HASH_SIZE];
+	atomic_t nr_migrations;
+	wait_queue_head_t migration_wait;
+
+	unsigned long *dirty_bitset;
+	atomic_t nr_dirty;
+
+	/*
+	 * Only touched by the worker.
+	 */
+	int commit_requested;
+	int need_cache_flush;
+
+	struct dm_kcopyd_client *copier;
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+
+	struct dm_bio_prison *prison;
+	struct dm_deferred_set *all_io_ds;
+
+	mempool_t *endio_hook_pool;
+	mempool_t *migration_pool;
+	mempool_t *writethrough_pool;
+	struct dm_cache_migration *next_migration;
+
+	atomic_t read_hit;
+	atomic_t read_miss;
+	atomic_t write_hit;
+	atomic_t write_miss;
+	atomic_t demotion;
+	atomic_t promotion;
+};
+
+struct endio_hook {
+	struct dm_deferred_entry *all_io_entry;
+	unsigned target_request_nr;
+
+	/*
+	 * Writethrough write hits only, while the origin write is in flight.
+	 */
+	dm_block_t cblock;
+	struct dm_bio_details *record;
+};
+
+/*
+ * An oblock under migration, hashed so the map function can find it
+ * without touching the prison.
+ */
+struct migrating_block {
+	struct hlist_node hlist;
+	dm_block_t oblock;
+};
+
+struct dm_cache_migration {
+	struct list_head list;
+	struct cache *cache;
+
+	struct migrating_block old;
+	struct migrating_block new;
+	dm_block_t cblock;
+
+	unsigned demote:1;
+	unsigned writeback:1;
+	unsigned promoting:1;
+	unsigned err:1;
+
+	struct dm_bio_prison_cell *old_ocell;
+	struct dm_bio_prison_cell *new_ocell;
+};
+
+/*----------------------------------------------------------------*/
+
+static dm_block_t get_bio_block(struct cache *cache, struct bio *bio)
+{
+	return bio->bi_sector >> cache->block_shift;
+}
+
+static void remap_to_origin(struct cache *cache, struct bio *bio)
+{
+	bio->bi_bdev = cache->origin_dev->bdev;
+}
+
+static void remap_to_cache(struct cache *cache, struct bio *bio,
+			   dm_block_t cblock)
+{
+	bio->bi_bdev = cache->cache_dev->bdev;
+	bio->bi_sector = (cblock << cache->block_shift) +
+		(bio->bi_sector & cache->offset_mask);
+}
+
+/*
+ * wake_worker() is used when new work is queued and when cache_resume is
+ * ready to continue deferred IO processing.
+ */
+static void wake_worker(struct cache *cache)
+{
+	queue_work(cache->wq, &cache->worker);
+}
+
+/*
+ * FLUSH/FUA bios may only be issued once the metadata describing the
+ * blocks they were remapped to has been committed.  The worker does that
+ * once for everything in deferred_flush_bios.
+ */
+static void issue(struct cache *cache, struct bio *bio)
+{
+	unsigned long flags;
+
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		bio_list_add(&cache->deferred_flush_bios, bio);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	} else
+		generic_make_request(bio);
+}
+
+static void defer_bio(struct cache *cache, struct bio *bio)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_add(&cache->deferred_bios, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void set_dirty(struct cache *cache, dm_block_t cblock)
+{
+	if (!test_and_set_bit(cblock, cache->dirty_bitset))
+		atomic_inc(&cache->nr_dirty);
+}
+
+static void clear_dirty(struct cache *cache, dm_block_t cblock)
+{
+	if (test_and_clear_bit(cblock, cache->dirty_bitset))
+		atomic_dec(&cache->nr_dirty);
+}
+
+/*----------------------------------------------------------------
+ * Blocks under migration
+ *--------------------------------------------------------------*/
+
+static struct hlist_head *migrating_bucket(struct cache *cache,
+					   dm_block_t oblock)
+{
+	return cache->migrating + hash_64(oblock, MIGRATING_HASH_BITS);
+}
+
+static int __is_migrating(struct cache *cache, dm_block_t oblock)
+{
+	struct hlist_node *tmp;
+	struct migrating_block *mb;
+
+	hlist_for_each_entry(mb, tmp, migrating_bucket(cache, oblock), hlist)
+		if (mb->oblock == oblock)
+			return 1;
+
+	return 0;
+}
+
+static void __add_migrating(struct cache *cache, struct dm_cache_migration *mg)
+{
+	hlist_add_head(&mg->new.hlist, migrating_bucket(cache, mg->new.oblock));
+	if (mg->demote)
+		hlist_add_head(&mg->old.hlist,
+			       migrating_bucket(cache, mg->old.oblock));
+}
+
+static void __del_migrating(struct dm_cache_migration *mg)
+{
+	hlist_del(&mg->new.hlist);
+	if (mg->demote)
+		hlist_del(&mg->old.hlist);
+}
+
+/*----------------------------------------------------------------
+ * Migrations
+ *--------------------------------------------------------------*/
+
+static void copy_complete(int read_err, unsigned long write_err, void *context)
+{
+	unsigned long flags;
+	struct dm_cache_migration *mg = context;
+	struct cache *cache = mg->cache;
+
+	if (read_err || write_err)
+		mg->err = 1;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_add_tail(&mg->list, &cache->completed_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void issue_copy(struct dm_cache_migration *mg, int to_cache)
+{
+	int r;
+	struct cache *cache = mg->cache;
+	struct dm_io_region o_region, c_region;
+
+	o_region.bdev = cache->origin_dev->bdev;
+	o_region.sector = (to_cache ? mg->new.oblock : mg->old.oblock) *
+		cache->sectors_per_block;
+	o_region.count = cache->sectors_per_block;
+
+	c_region.bdev = cache->cache_dev->bdev;
+	c_region.sector = mg->cblock * cache->sectors_per_block;
+	c_region.count = cache->sectors_per_block;
+
+	if (to_cache)
+		r = dm_kcopyd_copy(cache->copier, &o_region, 1, &c_region,
+				   0, copy_complete, mg);
+	else
+		r = dm_kcopyd_copy(cache->copier, &c_region, 1, &o_region,
+				   0, copy_complete, mg);
+	if (r < 0) {
+		DMERR("dm_kcopyd_copy() failed");
+		copy_complete(1, 0, mg);
+	}
+}
+
+static void cell_defer(struct cache *cache, struct dm_bio_prison_cell *cell,
+		       int holder)
+{
+	unsigned long flags;
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+	if (holder)
+		dm_cell_release(cell, &bios);
+	else
+		dm_cell_release_no_holder(cell, &bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&cache->deferred_bios, &bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+/*
+ * Every bio waiting on the migration goes back through the policy.
+ */
+static void free_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	__del_migrating(mg);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (mg->demote)
+		cell_defer(cache, mg->old_ocell, 0);
+	cell_defer(cache, mg->new_ocell, 1);
+
+	mempool_free(mg, cache->migration_pool);
+
+	if (atomic_dec_and_test(&cache->nr_migrations))
+		wake_up(&cache->migration_wait);
+}
+
+/*
+ * The victim's writeback or the commit removing it failed, so it stays
+ * where it is and the new block isn't promoted.
+ */
+static void abort_demotion(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+	int r;
+
+	r = dm_cache_insert_mapping(cache->cmd, mg->cblock, mg->old.oblock);
+	if (r)
+		DMERR("couldn't restore mapping of block %llu",
+		      (unsigned long long)mg->cblock);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->policy.type->remove_mapping(&cache->policy, mg->new.oblock);
+	r = cache->policy.type->load_mapping(&cache->policy, mg->old.oblock,
+					     mg->cblock);
+	spin_unlock_irqrestore(&cache->lock, flags);
+	if (r)
+		DMERR("couldn't restore policy mapping of block %llu",
+		      (unsigned long long)mg->cblock);
+
+	free_migration(mg);
+}
+
+static void abort_promotion(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->policy.type->remove_mapping(&cache->policy, mg->new.oblock);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	free_migration(mg);
+}
+
+static void promote(struct dm_cache_migration *mg)
+{
+	mg->promoting = 1;
+	issue_copy(mg, 1);
+}
+
+static void complete_promotion(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+	int r;
+
+	r = dm_cache_insert_mapping(cache->cmd, mg->cblock, mg->new.oblock);
+	if (r) {
+		DMERR("dm_cache_insert_mapping() failed, error = %d", r);
+		abort_promotion(mg);
+		return;
+	}
+
+	/*
+	 * The copy has to be on the cache device before the mapping
+	 * reaches the metadata.
+	 */
+	cache->need_cache_flush = 1;
+	atomic_inc(&cache->promotion);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->policy.type->migration_done(&cache->policy, mg->new.oblock);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	free_migration(mg);
+}
+
+static int commit(struct cache *cache, int clean_shutdown)
+{
+	int r;
+
+	if (cache->need_cache_flush) {
+		r = blkdev_issue_flush(cache->cache_dev->bdev, GFP_NOIO, NULL);
+		if (r)
+			return r;
+		cache->need_cache_flush = 0;
+	}
+
+	r = dm_cache_commit(cache->cmd, clean_shutdown);
+	if (r < 0)
+		DMERR("dm_cache_commit() failed, error = %d", r);
+
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Removes the mappings of all the demoted blocks with a single commit,
+ * after which their cache blocks may be reused.
+ */
+static void process_demotions(struct cache *cache, struct list_head *demoted)
+{
+	int r = 0, need_origin_flush = 0;
+	struct dm_cache_migration *mg, *tmp;
+
+	if (list_empty(demoted))
+		return;
+
+	list_for_each_entry(mg, demoted, list)
+		if (mg->writeback)
+			need_origin_flush = 1;
+
+	/*
+	 * Written back data must be safe on the origin before the
+	 * mapping that points at the only other copy goes.
+	 */
+	if (need_origin_flush)
+		r = blkdev_issue_flush(cache->origin_dev->bdev, GFP_NOIO, NULL);
+
+	list_for_each_entry(mg, demoted, list) {
+		if (r)
+			break;
+		r = dm_cache_remove_mapping(cache->cmd, mg->cblock);
+	}
+
+	if (!r)
+		r = commit(cache, 0);
+
+	list_for_each_entry_safe(mg, tmp, demoted, list) {
+		list_del(&mg->list);
+
+		if (r) {
+			abort_demotion(mg);
+			continue;
+		}
+
+		clear_dirty(cache, mg->cblock);
+		atomic_inc(&cache->demotion);
+		promote(mg);
+	}
+}
+
+static void process_migrations(struct cache *cache)
+{
+	unsigned long flags;
+	struct list_head quiesced, completed, demoted;
+	struct dm_cache_migration *mg, *tmp;
+
+	INIT_LIST_HEAD(&quiesced);
+	INIT_LIST_HEAD(&completed);
+	INIT_LIST_HEAD(&demoted);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_init(&cache->quiesced_migrations, &quiesced);
+	list_splice_init(&cache->completed_migrations, &completed);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	list_for_each_entry_safe(mg, tmp, &completed, list) {
+		list_del(&mg->list);
+
+		if (mg->promoting) {
+			if (mg->err)
+				abort_promotion(mg);
+			else
+				complete_promotion(mg);
+
+		} else if (mg->err)
+			abort_demotion(mg);
+		else
+			list_add_tail(&mg->list, &demoted);
+	}
+
+	list_for_each_entry_safe(mg, tmp, &quiesced, list) {
+		list_del(&mg->list);
+
+		if (mg->writeback)
+			issue_copy(mg, 0);
+		else if (mg->demote)
+			list_add_tail(&mg->list, &demoted);
+		else
+			promote(mg);
+	}
+
+	process_demotions(cache, &demoted);
+}
+
+/*
+ * Waits for all io to the blocks involved that was issued before they
+ * were marked as migrating.
+ */
+static void quiesce_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+	unsigned long flags;
+
+	if (!dm_deferred_set_add_work(cache->all_io_ds, &mg->list)) {
+		spin_lock_irqsave(&cache->lock, flags);
+		list_add_tail(&mg->list, &cache->quiesced_migrations);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+}
+
+static void quiesced(struct cache *cache, struct list_head *work)
+{
+	unsigned long flags;
+
+	if (list_empty(work))
+		return;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_tail(work, &cache->quiesced_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+/*----------------------------------------------------------------
+ * Bio processing
+ *--------------------------------------------------------------*/
+
+static void inc_hit_counter(struct cache *cache, struct bio *bio)
+{
+	atomic_inc(bio_data_dir(bio) == READ ?
+		   &cache->read_hit : &cache->write_hit);
+}
+
+static void inc_miss_counter(struct cache *cache, struct bio *bio)
+{
+	atomic_inc(bio_data_dir(bio) == READ ?
+		   &cache->read_miss : &cache->write_miss);
+}
+
+/*
+ * Called with cache->lock held once the policy has answered with a hit
+ * or a miss.  Takes the all_io entry that lets migrations wait for the
+ * bio.
+ */
+static void __account_bio(struct cache *cache, struct bio *bio,
+			  struct policy_result *result)
+{
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+	h->all_io_entry = dm_deferred_entry_inc(cache->all_io_ds);
+
+	if (result->op == POLICY_MISS) {
+		inc_miss_counter(cache, bio);
+		return;
+	}
+
+	inc_hit_counter(cache, bio);
+	if (bio_data_dir(bio) == WRITE && !cache->writethrough)
+		set_dirty(cache, result->cblock);
+}
+
+static void remap_bio(struct cache *cache, struct bio *bio,
+		      struct policy_result *result)
+{
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+	if (result->op == POLICY_MISS) {
+		remap_to_origin(cache, bio);
+		return;
+	}
+
+	if (bio_data_dir(bio) == WRITE && cache->writethrough) {
+		h->cblock = result->cblock;
+		h->record = mempool_alloc(cache->writethrough_pool, GFP_NOIO);
+		dm_bio_record(h->record, bio);
+		remap_to_origin(cache, bio);
+		return;
+	}
+
+	remap_to_cache(cache, bio, result->cblock);
+}
+
+/*
+ * Bios that never take part in a migration: flushes without data,
+ * and the partial block at the end of the origin which is never cached.
+ */
+static int remap_uncached(struct cache *cache, struct bio *bio)
+{
+	struct endio_hook *h = dm_get_mapinfo(bio)->ptr;
+
+	if (!bio->bi_size) {
+		if (h->target_request_nr)
+			remap_to_cache(cache, bio, 0);
+		else
+			remap_to_origin(cache, bio);
+		return 1;
+	}
+
+	if (get_bio_block(cache, bio) >= cache->origin_blocks) {
+		remap_to_origin(cache, bio);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void process_bio(struct cache *cache, struct bio *bio)
+{
+	int r;
+	unsigned long flags;
+	dm_block_t oblock = get_bio_block(cache, bio);
+	struct dm_cell_key key;
+	struct dm_bio_prison_cell *new_ocell, *old_ocell;
+	struct policy_result result;
+	struct dm_cache_migration *mg;
+
+	if (remap_uncached(cache, bio)) {
+		issue(cache, bio);
+		return;
+	}
+
+	key.virtual = 0;
+	key.dev = 0;
+	key.block = oblock;
+	if (dm_bio_detain(cache->prison, &key, bio, &new_ocell))
+		return;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	r = cache->policy.type->map(&cache->policy, oblock, 1, bio, &result);
+	if (r) {
+		spin_unlock_irqrestore(&cache->lock, flags);
+		DMERR("policy map failed, error = %d", r);
+		dm_cell_error(new_ocell);
+		return;
+	}
+
+	if (result.op == POLICY_HIT || result.op == POLICY_MISS) {
+		__account_bio(cache, bio, &result);
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		dm_cell_release_singleton(new_ocell, bio);
+		remap_bio(cache, bio, &result);
+		issue(cache, bio);
+		return;
+	}
+
+	mg = cache->next_migration;
+	cache->next_migration = NULL;
+
+	mg->cache = cache;
+	mg->new.oblock = oblock;
+	mg->cblock = result.cblock;
+	mg->demote = result.op == POLICY_REPLACE;
+	mg->old.oblock = result.old_oblock;
+	mg->writeback = mg->demote && test_bit(mg->cblock, cache->dirty_bitset);
+	mg->promoting = 0;
+	mg->err = 0;
+	mg->new_ocell = new_ocell;
+	mg->old_ocell = NULL;
+	__add_migrating(cache, mg);
+	atomic_inc(&cache->nr_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (mg->demote) {
+		/*
+		 * Only a migration ever holds a cell for longer than this
+		 * function, and the victim was neither being promoted
+		 * (pinned) nor demoted (no longer resident).  So the cell
+		 * is always free.
+		 */
+		key.block = mg->old.oblock;
+		dm_bio_detain(cache->prison, &key, NULL, &old_ocell);
+		mg->old_ocell = old_ocell;
+	}
+
+	quiesce_migration(mg);
+}
+
+static int ensure_next_migration(struct cache *cache)
+{
+	if (cache->next_migration)
+		return 0;
+
+	/*
+	 * Runs on the worker, so it may sleep. It must not recurse into
+	 * io though, as the worker is what completes our own io.
+	 */
+	cache->next_migration = mempool_alloc(cache->migration_pool, GFP_NOIO);
+
+	return cache->next_migration ? 0 : -ENOMEM;
+}
+
+static void process_deferred_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio *bio;
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_bios);
+	bio_list_init(&cache->deferred_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios))) {
+		/*
+		 * If we've got no free migration structs, and processing
+		 * this bio might require one, we pause until some of the
+		 * migrations in flight complete.
+		 */
+		if (ensure_next_migration(cache)) {
+			spin_lock_irqsave(&cache->lock, flags);
+			bio_list_merge(&cache->deferred_bios, &bios);
+			spin_unlock_irqrestore(&cache->lock, flags);
+
+			break;
+		}
+		process_bio(cache, bio);
+	}
+}
+
+static void process_deferred_writethrough_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio *bio;
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_writethrough_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+static void process_deferred_flush_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio *bio;
+	struct bio_list bios;
+	int r;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_flush_bios);
+	bio_list_init(&cache->deferred_flush_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (bio_list_empty(&bios) && !cache->commit_requested)
+		return;
+
+	cache->commit_requested = 0;
+	r = commit(cache, 0);
+	if (r) {
+		while ((bio = bio_list_pop(&bios)))
+			bio_io_error(bio);
+		return;
+	}
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(ws, struct cache, worker);
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	process_migrations(cache);
+	process_deferred_bios(cache);
+	process_deferred_writethrough_bios(cache);
+	process_deferred_flush_bios(cache);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * We want to commit periodically so that not too much
+ * unwritten metadata builds up.
+ */
+static void do_waker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(to_delayed_work(ws), struct cache, waker);
+
+	cache->commit_requested = 1;
+	wake_worker(cache);
+	queue_delayed_work(cache->wq, &cache->waker, COMMIT_PERIOD);
+}
+
+/*----------------------------------------------------------------
+ * Target methods
+ *--------------------------------------------------------------*/
+
+static void destroy(struct cache *cache)
+{
+	if (cache->next_migration)
+		mempool_free(cache->next_migration, cache->migration_pool);
+
+	if (cache->writethrough_pool)
+		mempool_destroy(cache->writethrough_pool);
+
+	if (cache->migration_pool)
+		mempool_destroy(cache->migration_pool);
+
+	if (cache->endio_hook_pool)
+		mempool_destroy(cache->endio_hook_pool);
+
+	if (cache->all_io_ds)
+		dm_deferred_set_destroy(cache->all_io_ds);
+
+	if (cache->prison)
+		dm_bio_prison_destroy(cache->prison);
+
+	if (cache->wq)
+		destroy_workqueue(cache->wq);
+
+	if (cache->copier)
+		dm_kcopyd_client_destroy(cache->copier);
+
+	if (cache->cmd)
+		dm_cache_metadata_close(cache->cmd);
+
+	if (cache->policy.type) {
+		cache->policy.type->destroy(&cache->policy);
+		dm_cache_policy_put(cache->policy.type);
+	}
+
+	vfree(cache->dirty_bitset);
+
+	if (cache->metadata_dev)
+		dm_put_device(cache->ti, cache->metadata_dev);
+
+	if (cache->origin_dev)
+		dm_put_device(cache->ti, cache->origin_dev);
+
+	if (cache->cache_dev)
+		dm_put_device(cache->ti, cache->cache_dev);
+
+	kfree(cache);
+}
+
+static void cache_dtr(struct dm_target *ti)
+{
+	destroy(ti->private);
+}
+
+static sector_t get_dev_size(struct dm_dev *dev)
+{
+	return i_size_read(dev->bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static int parse_features(struct dm_arg_set *as, struct cache *cache,
+			  char **error)
+{
+	int r;
+	unsigned argc;
+	const char *arg_name;
+
+	static struct dm_arg _args[] = {
+		{0, 1, "Invalid number of cache feature arguments"},
+	};
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return -EINVAL;
+
+	while (argc--) {
+		arg_name = dm_shift_arg(as);
+
+		if (!strcasecmp(arg_name, "writethrough"))
+			cache->writethrough = 1;
+
+		else if (!strcasecmp(arg_name, "writeback"))
+			cache->writethrough = 0;
+
+		else {
+			*error = "Unrecognised cache feature requested";
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int create_policy(struct dm_arg_set *as, struct cache *cache,
+			 char **error)
+{
+	int r;
+	unsigned argc;
+	const char *name;
+
+	static struct dm_arg _args[] = {
+		{0, 1024, "Invalid number of policy arguments"},
+	};
+
+	name = dm_shift_arg(as);
+	cache->policy.type = dm_cache_policy_get(name);
+	if (!cache->policy.type) {
+		*error = "Unknown cache policy";
+		return -EINVAL;
+	}
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r) {
+		dm_cache_policy_put(cache->policy.type);
+		cache->policy.type = NULL;
+		return -EINVAL;
+	}
+
+	r = cache->policy.type->create(&cache->policy, cache->cache_blocks,
+				       argc, as->argv, error);
+	if (r) {
+		dm_cache_policy_put(cache->policy.type);
+		cache->policy.type = NULL;
+		return r;
+	}
+
+	dm_consume_args(as, argc);
+
+	return 0;
+}
+
+/*
+ * Construct a cache device mapping:
+ *
+ * cache <metadata dev> <cache dev> <origin dev> <block size>
+ *       <#feature args> [<feature arg>]*
+ *       <policy> <#policy args> [<policy arg>]*
+ *
+ * metadata dev    : fast device holding the persistent metadata
+ * cache dev	   : fast device holding cached data blocks
+ * origin dev	   : slow device holding original data blocks
+ * block size      : cache unit size in sectors
+ *
+ * Optional feature arguments are:
+ *	writethrough  : write hits go to the origin as well as the cache
+ *	writeback     : write hits only go to the cache (default)
+ *
+ * policy	   : the replacement policy to use, e.g. hitcount
+ */
+static int cache_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r = -EINVAL;
+	unsigned i;
+	struct cache *cache;
+	struct dm_arg_set as;
+	unsigned long block_size;
+	sector_t cache_dev_size;
+
+	if (argc < 7) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+	as.argc = argc;
+	as.argv = argv;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		ti->error = "Cannot allocate cache context";
+		return -ENOMEM;
+	}
+	cache->ti = ti;
+	ti->private = cache;
+
+	r = dm_get_device(ti, argv[0], FMODE_READ | FMODE_WRITE,
+			  &cache->metadata_dev);
+	if (r) {
+		ti->error = "Error opening metadata device";
+		goto bad;
+	}
+
+	if (get_dev_size(cache->metadata_dev) > METADATA_DEV_MAX_SECTORS) {
+		ti->error = "Metadata device is too large";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	r = dm_get_device(ti, argv[1], FMODE_READ | FMODE_WRITE,
+			  &cache->cache_dev);
+	if (r) {
+		ti->error = "Error opening cache device";
+		goto bad;
+	}
+
+	r = dm_get_device(ti, argv[2], FMODE_READ | FMODE_WRITE,
+			  &cache->origin_dev);
+	if (r) {
+		ti->error = "Error opening origin device";
+		goto bad;
+	}
+
+	if (ti->len > get_dev_size(cache->origin_dev)) {
+		ti->error = "Device size larger than the origin";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	if (kstrtoul(argv[3], 10, &block_size) ||
+	    block_size < DATA_DEV_BLOCK_SIZE_MIN_SECTORS ||
+	    block_size > DATA_DEV_BLOCK_SIZE_MAX_SECTORS ||
+	    !is_power_of_2(block_size)) {
+		ti->error = "Invalid data block size";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	cache->sectors_per_block = block_size;
+	cache->block_shift = __ffs(block_size);
+	cache->offset_mask = block_size - 1;
+	cache->origin_blocks = ti->len >> cache->block_shift;
+
+	cache_dev_size = get_dev_size(cache->cache_dev);
+	cache->cache_blocks = cache_dev_size >> cache->block_shift;
+	if (!cache->cache_blocks) {
+		ti->error = "Cache device smaller than a block";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	dm_consume_args(&as, 4);
+
+	r = parse_features(&as, cache, &ti->error);
+	if (r)
+		goto bad;
+
+	if (!as.argc) {
+		ti->error = "No cache policy given";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	r = create_policy(&as, cache, &ti->error);
+	if (r)
+		goto bad;
+
+	if (as.argc) {
+		ti->error = "Too many arguments";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	spin_lock_init(&cache->lock);
+	bio_list_init(&cache->deferred_bios);
+	bio_list_init(&cache->deferred_flush_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	INIT_LIST_HEAD(&cache->quiesced_migrations);
+	INIT_LIST_HEAD(&cache->completed_migrations);
+	for (i = 0; i < MIGRATING_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(cache->migrating + i);
+	atomic_set(&cache->nr_migrations, 0);
+	init_waitqueue_head(&cache->migration_wait);
+	atomic_set(&cache->nr_dirty, 0);
+
+	r = -ENOMEM;
+	cache->dirty_bitset = vzalloc(BITS_TO_LONGS(cache->cache_blocks) *
+				      sizeof(unsigned long));
+	if (!cache->dirty_bitset) {
+		ti->error = "Cannot allocate dirty bitset";
+		goto bad;
+	}
+
+	cache->copier = dm_kcopyd_client_create();
+	if (IS_ERR(cache->copier)) {
+		ti->error = "Couldn't create kcopyd client";
+		r = PTR_ERR(cache->copier);
+		cache->copier = NULL;
+		goto bad;
+	}
+
+	/*
+	 * A single thread does all the metadata updates, so they
+	 * need no locking of their own.
+	 */
+	cache->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX, WQ_MEM_RECLAIM);
+	if (!cache->wq) {
+		ti->error = "Couldn't create workqueue for metadata object";
+		goto bad;
+	}
+	INIT_WORK(&cache->worker, do_worker);
+	INIT_DELAYED_WORK(&cache->waker, do_waker);
+
+	cache->prison = dm_bio_prison_create(PRISON_CELLS);
+	if (!cache->prison) {
+		ti->error = "Couldn't create bio prison";
+		goto bad;
+	}
+
+	cache->all_io_ds = dm_deferred_set_create();
+	if (!cache->all_io_ds) {
+		ti->error = "Couldn't create all_io deferred set";
+		goto bad;
+	}
+
+	cache->endio_hook_pool =
+		mempool_create_kmalloc_pool(ENDIO_HOOK_POOL_SIZE,
+					    sizeof(struct endio_hook));
+	cache->migration_pool =
+		mempool_create_kmalloc_pool(MIGRATION_POOL_SIZE,
+					    sizeof(struct dm_cache_migration));
+	cache->writethrough_pool =
+		mempool_create_kmalloc_pool(WRITETHROUGH_POOL_SIZE,
+					    sizeof(struct dm_bio_details));
+	if (!cache->endio_hook_pool || !cache->migration_pool ||
+	    !cache->writethrough_pool) {
+		ti->error = "Couldn't create mempools";
+		goto bad;
+	}
+
+	ti->split_io = cache->sectors_per_block;
+	ti->num_flush_requests = 2;
+	ti->num_discard_requests = 0;
+
+	return 0;
+
+bad:
+	destroy(cache);
+	return r;
+}
+
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		     union map_info *map_context)
+{
+	int r;
+	struct cache *cache = ti->private;
+	dm_block_t oblock = get_bio_block(cache, bio);
+	struct endio_hook *h;
+	struct policy_result result;
+	unsigned long flags;
+
+	h = mempool_alloc(cache->endio_hook_pool, GFP_NOIO);
+	h->all_io_entry = NULL;
+	h->target_request_nr = map_context->target_request_nr;
+	h->record = NULL;
+	map_context->ptr = h;
+
+	/*
+	 * FLUSH/FUA bios need the metadata committed before them, which
+	 * only the worker does.
+	 */
+	if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+		defer_bio(cache, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (remap_uncached(cache, bio))
+		return DM_MAPIO_REMAPPED;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (__is_migrating(cache, oblock))
+		r = -EWOULDBLOCK;
+	else
+		r = cache->policy.type->map(&cache->policy, oblock, 0,
+					    bio, &result);
+	if (!r)
+		__account_bio(cache, bio, &result);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (r) {
+		defer_bio(cache, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	remap_bio(cache, bio, &result);
+
+	return DM_MAPIO_REMAPPED;
+}
+
+static int cache_end_io(struct dm_target *ti, struct bio *bio,
+			int err, union map_info *map_context)
+{
+	struct cache *cache = ti->private;
+	struct endio_hook *h = map_context->ptr;
+	struct list_head work;
+	unsigned long flags;
+
+	if (h->record) {
+		dm_bio_restore(h->record, bio);
+		mempool_free(h->record, cache->writethrough_pool);
+		h->record = NULL;
+
+		/*
+		 * The origin has the data, now update the cache copy.
+		 * We can't submit io from here, leave it to the worker.
+		 */
+		if (!err) {
+			remap_to_cache(cache, bio, h->cblock);
+
+			spin_lock_irqsave(&cache->lock, flags);
+			bio_list_add(&cache->deferred_writethrough_bios, bio);
+			spin_unlock_irqrestore(&cache->lock, flags);
+
+			wake_worker(cache);
+			return DM_ENDIO_INCOMPLETE;
+		}
+	}
+
+	if (h->all_io_entry) {
+		INIT_LIST_HEAD(&work);
+		dm_deferred_entry_dec(h->all_io_entry, &work);
+		quiesced(cache, &work);
+	}
+
+	mempool_free(h, cache->endio_hook_pool);
+
+	return 0;
+}
+
+static void cache_postsuspend(struct dm_target *ti)
+{
+	int r;
+	dm_block_t cblock;
+	struct cache *cache = ti->private;
+
+	cancel_delayed_work_sync(&cache->waker);
+	wait_event(cache->migration_wait, !atomic_read(&cache->nr_migrations));
+	flush_workqueue(cache->wq);
+
+	if (!cache->cmd)
+		return;
+
+	for (cblock = 0; cblock < cache->cache_blocks; cblock++) {
+		r = dm_cache_set_dirty(cache->cmd, cblock,
+				       test_bit(cblock, cache->dirty_bitset));
+		if (r && r != -ENODATA) {
+			DMERR("could not write dirty bits, error = %d", r);
+			commit(cache, 0);
+			return;
+		}
+	}
+
+	commit(cache, 1);
+}
+
+static int load_mapping(void *context, dm_block_t oblock,
+			dm_block_t cblock, int dirty)
+{
+	int r;
+	struct cache *cache = context;
+
+	r = cache->policy.type->load_mapping(&cache->policy, oblock, cblock);
+	if (r)
+		return r;
+
+	if (dirty)
+		set_dirty(cache, cblock);
+
+	return 0;
+}
+
+/*
+ * The metadata is only opened when the first table using it is resumed,
+ * after any table it replaces has been suspended and has written its
+ * dirty bits.
+ */
+static int cache_preresume(struct dm_target *ti)
+{
+	int r;
+	struct cache *cache = ti->private;
+	struct dm_cache_metadata *cmd;
+
+	if (cache->cmd)
+		return commit(cache, 0);
+
+	cmd = dm_cache_metadata_open(cache->metadata_dev->bdev,
+				     cache->sectors_per_block,
+				     cache->cache_blocks);
+	if (IS_ERR(cmd)) {
+		DMERR("couldn't open metadata");
+		return PTR_ERR(cmd);
+	}
+	cache->cmd = cmd;
+
+	r = dm_cache_load_mappings(cmd, load_mapping, cache);
+	if (r) {
+		DMERR("couldn't load cache mappings");
+		return r;
+	}
+
+	/*
+	 * From now on the dirty bits on disk are stale.
+	 */
+	return commit(cache, 0);
+}
+
+static void cache_resume(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+
+	queue_delayed_work(cache->wq, &cache->waker, COMMIT_PERIOD);
+	wake_worker(cache);
+}
+
+/*
+ * Status format:
+ *
+ * <used metadata blocks>/<total metadata blocks>
+ * <read hits> <read misses> <write hits> <write misses>
+ * <demotions> <promotions> <resident blocks>/<cache blocks>
+ * <dirty blocks> <policy status>*
+ */
+static int cache_status(struct dm_target *ti, status_type_t type,
+			char *result, unsigned maxlen)
+{
+	int r;
+	unsigned sz = 0;
+	dm_block_t nr_free_blocks_metadata = 0;
+	dm_block_t nr_blocks_metadata = 0;
+	dm_block_t residency;
+	char buf[BDEVNAME_SIZE];
+	struct cache *cache = ti->private;
+	unsigned long flags;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		if (cache->cmd) {
+			r = dm_cache_get_free_metadata_block_count(cache->cmd,
+								   &nr_free_blocks_metadata);
+			if (r)
+				return r;
+
+			r = dm_cache_get_metadata_dev_size(cache->cmd,
+							   &nr_blocks_metadata);
+			if (r)
+				return r;
+		}
+
+		spin_lock_irqsave(&cache->lock, flags);
+		residency = cache->policy.type->residency(&cache->policy);
+		spin_unlock_irqrestore(&cache->lock, flags);
+
+		DMEMIT("%llu/%llu %u %u %u %u %u %u %llu/%llu %u ",
+		       (unsigned long long)(nr_blocks_metadata - nr_free_blocks_metadata),
+		       (unsigned long long)nr_blocks_metadata,
+		       (unsigned)atomic_read(&cache->read_hit),
+		       (unsigned)atomic_read(&cache->read_miss),
+		       (unsigned)atomic_read(&cache->write_hit),
+		       (unsigned)atomic_read(&cache->write_miss),
+		       (unsigned)atomic_read(&cache->demotion),
+		       (unsigned)atomic_read(&cache->promotion),
+		       (unsigned long long)residency,
+		       (unsigned long long)cache->cache_blocks,
+		       (unsigned)atomic_read(&cache->nr_dirty));
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s ", format_dev_t(buf, cache->metadata_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->cache_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->origin_dev->bdev->bd_dev));
+		DMEMIT("%llu 1 %s %s ",
+		       (unsigned long long)cache->sectors_per_block,
+		       cache->writethrough ? "writethrough" : "writeback",
+		       cache->policy.type->name);
+		break;
+	}
+
+	if (cache->policy.type->status) {
+		spin_lock_irqsave(&cache->lock, flags);
+		r = cache->policy.type->status(&cache->policy, type,
+					       result + sz, maxlen - sz);
+		spin_unlock_irqrestore(&cache->lock, flags);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+static int cache_iterate_devices(struct dm_target *ti,
+				 iterate_devices_callout_fn fn, void *data)
+{
+	int r;
+	struct cache *cache = ti->private;
+
+	r = fn(ti, cache->cache_dev, 0,
+	       cache->cache_blocks << cache->block_shift, data);
+	if (!r)
+		r = fn(ti, cache->origin_dev, 0, ti->len, data);
+
+	return r;
+}
+
+static void cache_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+	struct cache *cache = ti->private;
+
+	blk_limits_io_min(limits, 0);
+	blk_limits_io_opt(limits, cache->sectors_per_block << SECTOR_SHIFT);
+}
+
+static struct target_type cache_target = {
+	.name = "cache",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = cache_ctr,
+	.dtr = cache_dtr,
+	.map = cache_map,
+	.end_io = cache_end_io,
+	.postsuspend = cache_postsuspend,
+	.preresume = cache_preresume,
+	.resume = cache_resume,
+	.status = cache_status,
+	.iterate_devices = cache_iterate_devices,
+	.io_hints = cache_io_hints,
+};
+
+static int __init dm_cache_init(void)
+{
+	int r;
+
+	r = dm_register_target(&cache_target);
+	if (r)
+		DMERR("cache target registration failed: %d", r);
+
+	return r;
+}
+
+static void __exit dm_cache_exit(void)
+{
+	dm_unregister_target(&cache_target);
+}
+
+module_init(dm_cache_init);
+module_exit(dm_cache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache target");
+MODULE_LICENSE("GPL");
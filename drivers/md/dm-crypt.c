@@ -17,6 +17,8 @@
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/rbtree.h>
 #include <linux/backing-dev.h>
 #include <linux/percpu.h>
 #include <linux/atomic.h>
@@ -44,6 +46,7 @@ struct convert_context {
 	unsigned int idx_out;
 	sector_t sector;
 	atomic_t pending;
+	struct ablkcipher_request *req;
 };
 
 /*
@@ -59,7 +62,10 @@ struct dm_crypt_io {
 	atomic_t pending;
 	int error;
 	sector_t sector;
+	unsigned int size;	/* bytes of base_bio converted by this io */
 	struct dm_crypt_io *base_io;
+
+	struct rb_node rb_node;	/* in crypt_config->write_tree */
 };
 
 struct dm_crypt_request {
@@ -104,11 +110,16 @@ struct iv_lmk_private {
  */
 enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID };
 
+#define REQ_CACHE_SIZE	16
+
 /*
  * Duplicated per-CPU state for cipher.
  */
 struct crypt_cpu {
-	struct ablkcipher_request *req;
+	/* free crypto requests, see crypt_get_req() */
+	struct ablkcipher_request *reqs[REQ_CACHE_SIZE];
+	unsigned int nr_reqs;
+
 	/* ESSIV: struct crypto_cipher *essiv_tfm */
 	void *iv_private;
 	struct crypto_ablkcipher *tfms[0];
@@ -134,6 +145,11 @@ struct crypt_config {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
 
+	/* encrypted writes waiting for submission, sorted by sector */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_thread_wait;
+	struct rb_root write_tree;
+
 	char *cipher;
 	char *cipher_string;
 
@@ -177,15 +193,23 @@ struct crypt_config {
 #define MIN_IOS        16
 #define MIN_POOL_PAGES 32
 
+/* writes larger than this are encrypted by several CPUs at once */
+#define WRITE_BATCH_SECTORS 256
+
 static struct kmem_cache *_crypt_io_pool;
 
 static void clone_init(struct dm_crypt_io *, struct bio *);
 static void kcryptd_queue_crypt(struct dm_crypt_io *io);
 static u8 *iv_of_dmreq(struct crypt_config *cc, struct dm_crypt_request *dmreq);
 
+/*
+ * kcryptd is unbound, so the caller may migrate while using the result.
+ * That is fine: the transforms are reentrant and the per-CPU copies only
+ * exist for locality, anything else has to disable interrupts.
+ */
 static struct crypt_cpu *this_crypt_config(struct crypt_config *cc)
 {
-	return this_cpu_ptr(cc->cpu);
+	return __this_cpu_ptr(cc->cpu);
 }
 
 /*
@@ -665,9 +689,30 @@ static void crypt_convert_init(struct crypt_config *cc,
 	ctx->idx_in = bio_in ? bio_in->bi_idx : 0;
 	ctx->idx_out = bio_out ? bio_out->bi_idx : 0;
 	ctx->sector = sector + cc->iv_offset;
+	ctx->req = NULL;
 	init_completion(&ctx->restart);
 }
 
+/*
+ * Advance the input position of @ctx by @size bytes.
+ */
+static void crypt_convert_skip(struct convert_context *ctx, unsigned int size)
+{
+	struct bio_vec *bv;
+
+	while (size) {
+		bv = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
+		if (size < bv->bv_len - ctx->offset_in) {
+			ctx->offset_in += size;
+			break;
+		}
+
+		size -= bv->bv_len - ctx->offset_in;
+		ctx->offset_in = 0;
+		ctx->idx_in++;
+	}
+}
+
 static struct dm_crypt_request *dmreq_of_req(struct crypt_config *cc,
 					     struct ablkcipher_request *req)
 {
@@ -745,19 +790,68 @@ static int crypt_convert_block(struct crypt_config *cc,
 static void kcryptd_async_done(struct crypto_async_request *async_req,
 			       int error);
 
+/*
+ * Crypto requests are recycled through a small per-CPU cache, so that
+ * the CPUs encrypting in parallel do not all serialize on req_pool.
+ */
+static struct ablkcipher_request *crypt_get_req(struct crypt_config *cc)
+{
+	struct ablkcipher_request *req = NULL;
+	struct crypt_cpu *cpu_cc;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cpu_cc = this_crypt_config(cc);
+	if (cpu_cc->nr_reqs)
+		req = cpu_cc->reqs[--cpu_cc->nr_reqs];
+	local_irq_restore(flags);
+
+	if (!req)
+		req = mempool_alloc(cc->req_pool, GFP_NOIO);
+
+	return req;
+}
+
+static void crypt_put_req(struct crypt_config *cc,
+			  struct ablkcipher_request *req)
+{
+	struct crypt_cpu *cpu_cc;
+	unsigned long flags;
+
+	/*
+	 * Refill the mempool reserve first, forward progress must never
+	 * depend on requests sitting in the cache of another CPU.
+	 */
+	if (cc->req_pool->curr_nr < cc->req_pool->min_nr) {
+		mempool_free(req, cc->req_pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	cpu_cc = this_crypt_config(cc);
+	if (cpu_cc->nr_reqs < REQ_CACHE_SIZE) {
+		cpu_cc->reqs[cpu_cc->nr_reqs++] = req;
+		req = NULL;
+	}
+	local_irq_restore(flags);
+
+	if (req)
+		mempool_free(req, cc->req_pool);
+}
+
 static void crypt_alloc_req(struct crypt_config *cc,
 			    struct convert_context *ctx)
 {
 	struct crypt_cpu *this_cc = this_crypt_config(cc);
 	unsigned key_index = ctx->sector & (cc->tfms_count - 1);
 
-	if (!this_cc->req)
-		this_cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
+	if (!ctx->req)
+		ctx->req = crypt_get_req(cc);
 
-	ablkcipher_request_set_tfm(this_cc->req, this_cc->tfms[key_index]);
-	ablkcipher_request_set_callback(this_cc->req,
+	ablkcipher_request_set_tfm(ctx->req, this_cc->tfms[key_index]);
+	ablkcipher_request_set_callback(ctx->req,
 	    CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
-	    kcryptd_async_done, dmreq_of_req(cc, this_cc->req));
+	    kcryptd_async_done, dmreq_of_req(cc, ctx->req));
 }
 
 /*
@@ -766,8 +860,7 @@ static void crypt_alloc_req(struct crypt_config *cc,
 static int crypt_convert(struct crypt_config *cc,
 			 struct convert_context *ctx)
 {
-	struct crypt_cpu *this_cc = this_crypt_config(cc);
-	int r;
+	int r = 0;
 
 	atomic_set(&ctx->pending, 1);
 
@@ -778,7 +871,7 @@ static int crypt_convert(struct crypt_config *cc,
 
 		atomic_inc(&ctx->pending);
 
-		r = crypt_convert_block(cc, ctx, this_cc->req);
+		r = crypt_convert_block(cc, ctx, ctx->req);
 
 		switch (r) {
 		/* async */
@@ -787,8 +880,9 @@ static int crypt_convert(struct crypt_config *cc,
 			INIT_COMPLETION(ctx->restart);
 			/* fall through*/
 		case -EINPROGRESS:
-			this_cc->req = NULL;
+			ctx->req = NULL;
 			ctx->sector++;
+			r = 0;
 			continue;
 
 		/* sync */
@@ -801,11 +895,18 @@ static int crypt_convert(struct crypt_config *cc,
 		/* error */
 		default:
 			atomic_dec(&ctx->pending);
-			return r;
+			goto out;
 		}
 	}
 
-	return 0;
+out:
+	/* the last request was completed synchronously, recycle it */
+	if (ctx->req) {
+		crypt_put_req(cc, ctx->req);
+		ctx->req = NULL;
+	}
+
+	return r;
 }
 
 static void dm_crypt_bio_destructor(struct bio *bio)
@@ -894,6 +995,7 @@ static struct dm_crypt_io *crypt_io_alloc(struct dm_target *ti,
 	io->target = ti;
 	io->base_bio = bio;
 	io->sector = sector;
+	io->size = bio->bi_size;
 	io->error = 0;
 	io->base_io = NULL;
 	atomic_set(&io->pending, 0);
@@ -938,9 +1040,13 @@ static void crypt_dec_pending(struct dm_crypt_io *io)
  * Needed because it would be very unwise to do decryption in an
  * interrupt context.
  *
- * kcryptd performs the actual encryption or decryption.
+ * kcryptd performs the actual encryption or decryption.  It is unbound
+ * so that large writes, cut into batches by kcryptd_queue_write(), and
+ * reads completing on a single CPU are converted on all CPUs at once.
  *
- * kcryptd_io performs the IO submission.
+ * kcryptd_io performs the read IO submission.  Encrypted writes are
+ * handed to the per-device dmcrypt_write thread instead, which issues
+ * them in sector order whatever order the conversions finished in.
  *
  * They must be separated as otherwise the final stages could be
  * starved by new requests which can block in the first stages due
@@ -1023,17 +1129,65 @@ static void kcryptd_io_write(struct dm_crypt_io *io)
 	generic_make_request(clone);
 }
 
+#define crypt_io_from_node(node) rb_entry((node), struct dm_crypt_io, rb_node)
+
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct dm_crypt_io *io;
+	struct rb_root write_tree;
+	struct blk_plug plug;
+	DECLARE_WAITQUEUE(wait, current);
+
+	while (1) {
+		spin_lock_irq(&cc->write_thread_wait.lock);
+		while (RB_EMPTY_ROOT(&cc->write_tree)) {
+			__set_current_state(TASK_INTERRUPTIBLE);
+			__add_wait_queue(&cc->write_thread_wait, &wait);
+			spin_unlock_irq(&cc->write_thread_wait.lock);
+
+			if (unlikely(kthread_should_stop())) {
+				set_current_state(TASK_RUNNING);
+				remove_wait_queue(&cc->write_thread_wait, &wait);
+				return 0;
+			}
+
+			schedule();
+
+			set_current_state(TASK_RUNNING);
+			spin_lock_irq(&cc->write_thread_wait.lock);
+			__remove_wait_queue(&cc->write_thread_wait, &wait);
+		}
+
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_thread_wait.lock);
+
+		/*
+		 * Always take the leftmost node: walking the tree with
+		 * rb_next() is not possible, the io may be gone as soon as
+		 * its clone was submitted.
+		 */
+		blk_start_plug(&plug);
+		do {
+			io = crypt_io_from_node(rb_first(&write_tree));
+			rb_erase(&io->rb_node, &write_tree);
+			kcryptd_io_write(io);
+		} while (!RB_EMPTY_ROOT(&write_tree));
+		blk_finish_plug(&plug);
+	}
+
+	return 0;
+}
+
 static void kcryptd_io(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
-	if (bio_data_dir(io->base_bio) == READ) {
-		crypt_inc_pending(io);
-		if (kcryptd_io_read(io, GFP_NOIO))
-			io->error = -ENOMEM;
-		crypt_dec_pending(io);
-	} else
-		kcryptd_io_write(io);
+	crypt_inc_pending(io);
+	if (kcryptd_io_read(io, GFP_NOIO))
+		io->error = -ENOMEM;
+	crypt_dec_pending(io);
 }
 
 static void kcryptd_queue_io(struct dm_crypt_io *io)
@@ -1044,10 +1198,12 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
-static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int async)
+static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io)
 {
 	struct bio *clone = io->ctx.bio_out;
 	struct crypt_config *cc = io->target->private;
+	struct rb_node **rbp, *parent;
+	unsigned long flags;
 
 	if (unlikely(io->error < 0)) {
 		crypt_free_buffer_pages(cc, clone);
@@ -1061,10 +1217,21 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int async)
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
-		kcryptd_queue_io(io);
-	else
-		generic_make_request(clone);
+	spin_lock_irqsave(&cc->write_thread_wait.lock, flags);
+	rbp = &cc->write_tree.rb_node;
+	parent = NULL;
+	while (*rbp) {
+		parent = *rbp;
+		if (io->sector < crypt_io_from_node(parent)->sector)
+			rbp = &parent->rb_left;
+		else
+			rbp = &parent->rb_right;
+	}
+	rb_link_node(&io->rb_node, parent, rbp);
+	rb_insert_color(&io->rb_node, &cc->write_tree);
+
+	wake_up_locked(&cc->write_thread_wait);
+	spin_unlock_irqrestore(&cc->write_thread_wait.lock, flags);
 }
 
 static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
@@ -1074,15 +1241,18 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 	struct dm_crypt_io *new_io;
 	int crypt_finished;
 	unsigned out_of_pages = 0;
-	unsigned remaining = io->base_bio->bi_size;
+	unsigned remaining = io->size;
 	sector_t sector = io->sector;
 	int r;
 
 	/*
-	 * Prevent io from disappearing until this function completes.
+	 * io was queued with a reference that prevents it from
+	 * disappearing until this function completes.  Batches of a
+	 * split write start in the middle of base_bio.
 	 */
-	crypt_inc_pending(io);
 	crypt_convert_init(cc, &io->ctx, NULL, io->base_bio, sector);
+	crypt_convert_skip(&io->ctx, to_bytes(sector -
+			   dm_target_offset(io->target, io->base_bio->bi_sector)));
 
 	/*
 	 * The allocated buffers can be smaller than the whole bio,
@@ -1111,7 +1281,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 
 		/* Encryption was already finished, submit io now */
 		if (crypt_finished) {
-			kcryptd_crypt_write_io_submit(io, 0);
+			kcryptd_crypt_write_io_submit(io);
 
 			/*
 			 * If there was an error, do not try next fragments.
@@ -1119,8 +1289,6 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 			 */
 			if (unlikely(r < 0))
 				break;
-
-			io->sector = sector;
 		}
 
 		/*
@@ -1132,9 +1300,11 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 
 		/*
 		 * With async crypto it is unsafe to share the crypto context
-		 * between fragments, so switch to a new dm_crypt_io structure.
+		 * between fragments, and the io of a finished fragment may
+		 * still be queued for the write thread, so switch to a new
+		 * dm_crypt_io structure.
 		 */
-		if (unlikely(!crypt_finished && remaining)) {
+		if (unlikely(remaining)) {
 			new_io = crypt_io_alloc(io->target, io->base_bio,
 						sector);
 			crypt_inc_pending(new_io);
@@ -1206,7 +1376,7 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 	if (error < 0)
 		io->error = -EIO;
 
-	mempool_free(req_of_dmreq(cc, dmreq), cc->req_pool);
+	crypt_put_req(cc, req_of_dmreq(cc, dmreq));
 
 	if (!atomic_dec_and_test(&ctx->pending))
 		return;
@@ -1214,7 +1384,7 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 	if (bio_data_dir(io->base_bio) == READ)
 		kcryptd_crypt_read_done(io);
 	else
-		kcryptd_crypt_write_io_submit(io, 1);
+		kcryptd_crypt_write_io_submit(io);
 }
 
 static void kcryptd_crypt(struct work_struct *work)
@@ -1235,6 +1405,39 @@ static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 	queue_work(cc->crypt_queue, &io->work);
 }
 
+/*
+ * Queue a write for encryption.  A large write is cut into batches of
+ * WRITE_BATCH_SECTORS that are queued separately, so that kcryptd
+ * encrypts them on several CPUs; they complete the write through
+ * base_io like the fragments of kcryptd_crypt_write_convert().
+ *
+ * Every io queued here holds a reference that the conversion drops.
+ */
+static void kcryptd_queue_write(struct dm_crypt_io *io)
+{
+	struct dm_crypt_io *batch_io;
+	unsigned int batch = to_bytes(WRITE_BATCH_SECTORS);
+	unsigned int offset;
+
+	crypt_inc_pending(io);
+
+	if (num_online_cpus() > 1 && io->size > batch) {
+		for (offset = batch; offset < io->size; offset += batch) {
+			batch_io = crypt_io_alloc(io->target, io->base_bio,
+						  io->sector + to_sector(offset));
+			batch_io->size = min(batch, io->size - offset);
+			batch_io->base_io = io;
+			crypt_inc_pending(io);
+
+			crypt_inc_pending(batch_io);
+			kcryptd_queue_crypt(batch_io);
+		}
+		io->size = batch;
+	}
+
+	kcryptd_queue_crypt(io);
+}
+
 /*
  * Decode key from its hex representation
  */
@@ -1369,6 +1572,9 @@ static void crypt_dtr(struct dm_target *ti)
 	if (!cc)
 		return;
 
+	if (cc->write_thread)
+		kthread_stop(cc->write_thread);
+
 	if (cc->io_queue)
 		destroy_workqueue(cc->io_queue);
 	if (cc->crypt_queue)
@@ -1377,8 +1583,9 @@ static void crypt_dtr(struct dm_target *ti)
 	if (cc->cpu)
 		for_each_possible_cpu(cpu) {
 			cpu_cc = per_cpu_ptr(cc->cpu, cpu);
-			if (cpu_cc->req)
-				mempool_free(cpu_cc->req, cc->req_pool);
+			while (cpu_cc->nr_reqs)
+				mempool_free(cpu_cc->reqs[--cpu_cc->nr_reqs],
+					     cc->req_pool);
 			crypt_free_tfms(cc, cpu);
 		}
 
@@ -1690,15 +1897,27 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 
 	cc->crypt_queue = alloc_workqueue("kcryptd",
-					  WQ_NON_REENTRANT|
+					  WQ_UNBOUND|
 					  WQ_CPU_INTENSIVE|
 					  WQ_MEM_RECLAIM,
-					  1);
+					  num_online_cpus());
 	if (!cc->crypt_queue) {
 		ti->error = "Couldn't create kcryptd queue";
 		goto bad;
 	}
 
+	init_waitqueue_head(&cc->write_thread_wait);
+	cc->write_tree = RB_ROOT;
+
+	cc->write_thread = kthread_create(dmcrypt_write, cc, "dmcrypt_write");
+	if (IS_ERR(cc->write_thread)) {
+		ret = PTR_ERR(cc->write_thread);
+		cc->write_thread = NULL;
+		ti->error = "Couldn't spawn write thread";
+		goto bad;
+	}
+	wake_up_process(cc->write_thread);
+
 	ti->num_flush_requests = 1;
 	ti->discard_zeroes_data_unsupported = 1;
 
@@ -1734,7 +1953,7 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 		if (kcryptd_io_read(io, GFP_NOWAIT))
 			kcryptd_queue_io(io);
 	} else
-		kcryptd_queue_crypt(io);
+		kcryptd_queue_write(io);
 
 	return DM_MAPIO_SUBMITTED;
 }
@@ -0,0 +1,353 @@
+/*
+ * This file is released under the GPL.
+ *
+ * Latency oriented path selector: routes I/O to the path expected to
+ * complete it soonest, judging by the service times seen on each path.
+ */
+
+#include "dm.h"
+#include "dm-path-selector.h"
+
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+
+#define DM_MSG_PREFIX	"multipath latency"
+#define LAT_MIN_IO	1
+#define LAT_VERSION	"0.1.0"
+
+/* Each completion moves the estimate 1/2^weight_shift of the way. */
+#define LAT_DEFAULT_WEIGHT_SHIFT	3
+#define LAT_MAX_WEIGHT_SHIFT		10
+
+/* An idle path without a sample for this long is tried again. */
+#define LAT_DEFAULT_PROBE_MS		1000
+
+struct selector {
+	struct list_head valid_paths;
+	struct list_head failed_paths;
+
+	spinlock_t lock;		/* protects the path_info estimates */
+	unsigned weight_shift;
+	unsigned probe_ms;
+};
+
+struct path_info {
+	struct list_head list;
+	struct dm_path *path;
+	unsigned repeat_count;
+	atomic_t in_flight;
+	u64 latency;			/* moving average service time, ns */
+	u64 last_sample;		/* when latency was last updated, ns */
+};
+
+static struct selector *alloc_selector(void)
+{
+	struct selector *s = kmalloc(sizeof(*s), GFP_KERNEL);
+
+	if (s) {
+		INIT_LIST_HEAD(&s->valid_paths);
+		INIT_LIST_HEAD(&s->failed_paths);
+		spin_lock_init(&s->lock);
+		s->weight_shift = LAT_DEFAULT_WEIGHT_SHIFT;
+		s->probe_ms = LAT_DEFAULT_PROBE_MS;
+	}
+
+	return s;
+}
+
+static int lat_create(struct path_selector *ps, unsigned argc, char **argv)
+{
+	struct selector *s;
+	unsigned weight_shift = LAT_DEFAULT_WEIGHT_SHIFT;
+	unsigned probe_ms = LAT_DEFAULT_PROBE_MS;
+
+	/*
+	 * Arguments: [<weight_shift> [<probe_ms>]]
+	 *	<weight_shift>: Each new service time sample is given a
+	 *			weight of 1/2^<weight_shift> in the estimate.
+	 *	<probe_ms>: An idle path whose estimate is older than this
+	 *		    is sent the next I/O, so a path that was slow
+	 *		    once isn't avoided forever.
+	 */
+	if (argc > 2)
+		return -EINVAL;
+
+	if (argc && (sscanf(argv[0], "%u", &weight_shift) != 1 ||
+		     weight_shift > LAT_MAX_WEIGHT_SHIFT))
+		return -EINVAL;
+
+	if (argc == 2 && (sscanf(argv[1], "%u", &probe_ms) != 1 || !probe_ms))
+		return -EINVAL;
+
+	s = alloc_selector();
+	if (!s)
+		return -ENOMEM;
+
+	s->weight_shift = weight_shift;
+	s->probe_ms = probe_ms;
+
+	ps->context = s;
+	return 0;
+}
+
+static void free_paths(struct list_head *paths)
+{
+	struct path_info *pi, *next;
+
+	list_for_each_entry_safe(pi, next, paths, list) {
+		list_del(&pi->list);
+		kfree(pi);
+	}
+}
+
+static void lat_destroy(struct path_selector *ps)
+{
+	struct selector *s = ps->context;
+
+	free_paths(&s->valid_paths);
+	free_paths(&s->failed_paths);
+	kfree(s);
+	ps->context = NULL;
+}
+
+static int lat_status(struct path_selector *ps, struct dm_path *path,
+		      status_type_t type, char *result, unsigned maxlen)
+{
+	struct selector *s = ps->context;
+	unsigned sz = 0;
+	struct path_info *pi;
+	unsigned long flags;
+	u64 latency;
+
+	if (!path) {
+		switch (type) {
+		case STATUSTYPE_INFO:
+			DMEMIT("0 ");
+			break;
+		case STATUSTYPE_TABLE:
+			DMEMIT("2 %u %u ", s->weight_shift, s->probe_ms);
+			break;
+		}
+	} else {
+		pi = path->pscontext;
+
+		switch (type) {
+		case STATUSTYPE_INFO:
+			spin_lock_irqsave(&s->lock, flags);
+			latency = pi->latency;
+			spin_unlock_irqrestore(&s->lock, flags);
+
+			do_div(latency, NSEC_PER_USEC);
+			DMEMIT("%d %llu ", atomic_read(&pi->in_flight),
+			       (unsigned long long)latency);
+			break;
+		case STATUSTYPE_TABLE:
+			DMEMIT("%u ", pi->repeat_count);
+			break;
+		}
+	}
+
+	return sz;
+}
+
+static int lat_add_path(struct path_selector *ps, struct dm_path *path,
+			int argc, char **argv, char **error)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi;
+	unsigned repeat_count = LAT_MIN_IO;
+
+	/*
+	 * Arguments: [<repeat_count>]
+	 *	<repeat_count>: The number of I/Os before switching path.
+	 *			If not given, default (LAT_MIN_IO) is used.
+	 */
+	if (argc > 1) {
+		*error = "latency ps: incorrect number of arguments";
+		return -EINVAL;
+	}
+
+	if (argc && (sscanf(argv[0], "%u", &repeat_count) != 1)) {
+		*error = "latency ps: invalid repeat count";
+		return -EINVAL;
+	}
+
+	/* allocate the path */
+	pi = kzalloc(sizeof(*pi), GFP_KERNEL);
+	if (!pi) {
+		*error = "latency ps: Error allocating path context";
+		return -ENOMEM;
+	}
+
+	pi->path = path;
+	pi->repeat_count = repeat_count;
+	atomic_set(&pi->in_flight, 0);
+
+	path->pscontext = pi;
+
+	list_add_tail(&pi->list, &s->valid_paths);
+
+	return 0;
+}
+
+static void lat_fail_path(struct path_selector *ps, struct dm_path *path)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+
+	list_move(&pi->list, &s->failed_paths);
+}
+
+static int lat_reinstate_path(struct path_selector *ps, struct dm_path *path)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+	unsigned long flags;
+
+	/* Whatever made the path fail may also have made it slow. */
+	spin_lock_irqsave(&s->lock, flags);
+	pi->latency = 0;
+	pi->last_sample = 0;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	list_move_tail(&pi->list, &s->valid_paths);
+
+	return 0;
+}
+
+/*
+ * The time the incoming I/O is expected to take on this path: the I/Os
+ * already queued on it, and this one, each taking the average service
+ * time.
+ *
+ * A path without an estimate, either because it hasn't completed any
+ * I/O yet or because it has been idle for longer than probe_ms, is
+ * expected to be instant so it gets some I/O and a fresh sample.  It
+ * competes with the other such paths on queue length.
+ */
+static u64 lat_estimate(struct selector *s, struct path_info *pi,
+			unsigned in_flight, u64 now)
+{
+	if (!pi->last_sample)
+		return 0;
+
+	if (!in_flight &&
+	    now - pi->last_sample > (u64)s->probe_ms * NSEC_PER_MSEC)
+		return 0;
+
+	return pi->latency * (in_flight + 1);
+}
+
+static struct dm_path *lat_select_path(struct path_selector *ps,
+				       unsigned *repeat_count, size_t nr_bytes)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = NULL, *best = NULL;
+	unsigned in_flight, best_in_flight = 0;
+	u64 now = ktime_to_ns(ktime_get());
+	u64 estimate, best_estimate = 0;
+	unsigned long flags;
+
+	if (list_empty(&s->valid_paths))
+		return NULL;
+
+	/* Change preferred (first in list) path to evenly balance. */
+	list_move_tail(s->valid_paths.next, &s->valid_paths);
+
+	spin_lock_irqsave(&s->lock, flags);
+	list_for_each_entry(pi, &s->valid_paths, list) {
+		in_flight = atomic_read(&pi->in_flight);
+		estimate = lat_estimate(s, pi, in_flight, now);
+
+		if (!best || estimate < best_estimate ||
+		    (estimate == best_estimate && in_flight < best_in_flight)) {
+			best = pi;
+			best_estimate = estimate;
+			best_in_flight = in_flight;
+		}
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (!best)
+		return NULL;
+
+	*repeat_count = best->repeat_count;
+
+	return best->path;
+}
+
+static int lat_start_io(struct path_selector *ps, struct dm_path *path,
+			size_t nr_bytes)
+{
+	struct path_info *pi = path->pscontext;
+
+	atomic_inc(&pi->in_flight);
+
+	return 0;
+}
+
+static int lat_end_io(struct path_selector *ps, struct dm_path *path,
+		      size_t nr_bytes, u64 start_time)
+{
+	struct selector *s = ps->context;
+	struct path_info *pi = path->pscontext;
+	u64 now = ktime_to_ns(ktime_get());
+	u64 sample = now > start_time ? now - start_time : 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (!pi->last_sample)
+		pi->latency = sample;
+	else
+		pi->latency += (sample >> s->weight_shift) -
+			       (pi->latency >> s->weight_shift);
+	pi->last_sample = now;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	atomic_dec(&pi->in_flight);
+
+	return 0;
+}
+
+static struct path_selector_type lat_ps = {
+	.name		= "latency",
+	.module		= THIS_MODULE,
+	.table_args	= 1,
+	.info_args	= 2,
+	.create		= lat_create,
+	.destroy	= lat_destroy,
+	.status		= lat_status,
+	.add_path	= lat_add_path,
+	.fail_path	= lat_fail_path,
+	.reinstate_path	= lat_reinstate_path,
+	.select_path	= lat_select_path,
+	.start_io	= lat_start_io,
+	.end_io		= lat_end_io,
+};
+
+static int __init dm_lat_init(void)
+{
+	int r = dm_register_path_selector(&lat_ps);
+
+	if (r < 0)
+		DMERR("register failed %d", r);
+
+	DMINFO("version " LAT_VERSION " loaded");
+
+	return r;
+}
+
+static void __exit dm_lat_exit(void)
+{
+	int r = dm_unregister_path_selector(&lat_ps);
+
+	if (r < 0)
+		DMERR("unregister failed %d", r);
+}
+
+module_init(dm_lat_init);
+module_exit(dm_lat_exit);
+
+MODULE_DESCRIPTION(DM_NAME " latency oriented path selector");
+MODULE_LICENSE("GPL");
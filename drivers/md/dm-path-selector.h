@@ -78,8 +78,11 @@ struct path_selector_type {
 
 	int (*start_io) (struct path_selector *ps, struct dm_path *path,
 			 size_t nr_bytes);
+	/*
+	 * @start_time is the ktime, in ns, at which the I/O was mapped.
+	 */
 	int (*end_io) (struct path_selector *ps, struct dm_path *path,
-		       size_t nr_bytes);
+		       size_t nr_bytes, u64 start_time);
 };
 
 /* Register a path selector */
@@ -34,7 +34,8 @@
  *	o RAID5 with rotating parity (left+right, symmetric+asymmetric)
  *	o recovery of out of sync device for initial
  *	  RAID set creation or after dead drive replacement
- *	o run time optimization of xor algorithm used to calculate parity
+ *	o parity calculation via async_tx (DMA offload or the SIMD xor
+ *	  template) on parallel workers
  *
  *
  * Thanks to MD for:
@@ -67,6 +68,7 @@ static const char *version = "v0.2597k";
 #include <linux/kernel.h>
 #include <linux/vmalloc.h>
 #include <linux/raid/xor.h>
+#include <linux/async_tx.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 
@@ -113,6 +115,7 @@ static const char *version = "v0.2597k";
 
 #define	TARGET	"dm-raid45"
 #define	DAEMON	"kraid45d"
+#define	XOR_DAEMON	"kraid45xord"
 #define	DM_MSG_PREFIX	TARGET
 
 #define	SECTORS_PER_PAGE	(PAGE_SIZE >> SECTOR_SHIFT)
@@ -290,6 +293,14 @@ struct stripe {
 	 */
 	struct dm_mem_cache_object *obj;
 
+	/* Parity calculation on the xor workers (see do_flush()). */
+	struct {
+		struct work_struct ws;
+		struct list_head list;
+		unsigned long **data;	/* Temporary pointers for xor(). */
+		struct page **pages;	/* Scribble for xor_async_wrapper(). */
+	} xor;
+
 	/* Array of stripe sets (dynamically allocated). */
 	struct stripe_chunk chunk[0];
 };
@@ -481,14 +492,15 @@ static struct stats_map stats_map[] = {
  */
 #define	dm_rh_client	dm_region_hash
 enum count_type { IO_WORK = 0, IO_RECOVER, IO_NR_COUNT };
-typedef void (*xor_function_t)(unsigned count, unsigned long **data);
+typedef void (*xor_function_t)(unsigned count, unsigned long **data,
+			       struct page **pages);
 struct raid_set {
 	struct dm_target *ti;	/* Target pointer. */
 
 	struct {
 		unsigned long flags;	/* State flags. */
 		struct mutex in_lock;	/* Protects central input list below. */
-		struct mutex xor_lock;	/* Protects xor algorithm set. */
+		struct rw_semaphore xor_lock; /* Protects xor algorithm set. */
 		struct bio_list in;	/* Pending ios (central input list). */
 		struct bio_list work;	/* ios work set. */
 		wait_queue_head_t suspendq;	/* suspend synchronization. */
@@ -506,11 +518,19 @@ struct raid_set {
 
 	struct stripe_cache sc;	/* Stripe cache for this set. */
 
-	/* Xor optimization. */
+	/* Xor algorithm and parity workers. */
 	struct {
 		struct xor_func *f;
 		unsigned chunks;
 		unsigned speed;
+
+		struct workqueue_struct *wq;
+		atomic_t pending;	/* Stripes in flight to workers. */
+		struct completion done;	/* Workers drained. */
+
+		/* Parity throughput statistics. */
+		atomic64_t bytes;
+		atomic64_t nsecs;
 	} xor;
 
 	/* Recovery parameters. */
@@ -579,9 +599,6 @@ struct raid_set {
 	/* REMOVEME: devel stats counters. */
 	atomic_t stats[S_NR_STATS];
 
-	/* Dynamically allocated temporary pointers for xor(). */
-	unsigned long **data;
-
 	/* Dynamically allocated RAID devices. Alignment? */
 	struct raid_dev dev[0];
 };
@@ -649,6 +666,9 @@ static void stats_reset(struct raid_set *rs)
 
 	while (s--)
 		atomic_set(rs->stats + s, 0);
+
+	atomic64_set(&rs->xor.bytes, 0);
+	atomic64_set(&rs->xor.nsecs, 0);
 }
 
 /*----------------------------------------------------------------
@@ -1328,11 +1348,19 @@ static void stripe_allow_io(struct stripe *stripe)
 		SetChunkIo(CHUNK(stripe, p));
 }
 
+static void do_parity_xor(struct work_struct *ws);
+
 /* Initialize a stripe. */
 static void stripe_init(struct stripe_cache *sc, struct stripe *stripe)
 {
 	unsigned i, p = RS(sc)->set.raid_devs;
 
+	/* xor() pointer arrays follow the chunks (see stripe_size()). */
+	stripe->xor.data = (unsigned long **) (stripe->chunk + p);
+	stripe->xor.pages = (struct page **) (stripe->xor.data + p);
+	INIT_WORK(&stripe->xor.ws, do_parity_xor);
+	INIT_LIST_HEAD(&stripe->xor.list);
+
 	/* Work all io chunks. */
 	while (p--) {
 		struct stripe_chunk *chunk = CHUNK(stripe, p);
@@ -1395,7 +1423,9 @@ static void stripe_zero_chunk(struct stripe *stripe, int p)
 static size_t stripe_size(struct raid_set *rs)
 {
 	return sizeof(struct stripe) +
-		      rs->set.raid_devs * sizeof(struct stripe_chunk);
+		      rs->set.raid_devs * (sizeof(struct stripe_chunk) +
+					   sizeof(unsigned long *) +
+					   sizeof(struct page *));
 }
 
 /* Allocate a stripe and its memory object. */
@@ -1832,7 +1862,8 @@ struct { \
 	{ _xor8_ ## xors_per_run }, \
 }; \
 \
-static void xor_ ## xors_per_run(unsigned n, unsigned long **data) \
+static void xor_ ## xors_per_run(unsigned n, unsigned long **data, \
+				 struct page **pages) \
 { \
 	/* Call respective function for amount of chunks. */ \
 	xor_funcs ## xors_per_run[n].f(data); \
@@ -1851,16 +1882,46 @@ MAKE_XOR(64)
 #define	XOR_CHUNKS_MAX	(ARRAY_SIZE(xor_funcs8) - 1)
 
 /* xor_blocks wrapper to allow for using that crypto library function. */
-static void xor_blocks_wrapper(unsigned n, unsigned long **data)
+static void xor_blocks_wrapper(unsigned n, unsigned long **data,
+			       struct page **pages)
 {
 	BUG_ON(n < 2 || n > MAX_XOR_BLOCKS + 1);
 	xor_blocks(n - 1, XOR_SIZE, (void *) data[0], (void **) data + 1);
 }
 
+/*
+ * async_xor wrapper: offloads to a DMA engine if there is one, else
+ * runs the xor_blocks() template picked at boot, which uses the SIMD
+ * units of the CPU.  @data is left alone, as xor() reuses data[0] for
+ * further passes; the pages go to the stripe's own scribble array.
+ *
+ * xor() accumulates into the parity page, but a DMA engine only reads
+ * the destination when it is passed as a source, so it is passed as
+ * the first one and dropped again on the synchronous path, like
+ * ops_run_prexor() in raid5 does.
+ */
+static void xor_async_wrapper(unsigned n, unsigned long **data,
+			      struct page **pages)
+{
+	struct dma_async_tx_descriptor *tx;
+	struct async_submit_ctl submit;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		pages[i] = virt_to_page(data[i]);
+
+	init_async_submit(&submit, ASYNC_TX_XOR_DROP_DST, NULL,
+			  NULL, NULL, NULL);
+	tx = async_xor(pages[0], pages, 0, n, XOR_SIZE, &submit);
+	async_tx_quiesce(&tx);
+}
+
+/* First entry is the default. */
 struct xor_func {
 	xor_function_t f;
 	const char *name;
 } static xor_funcs[] = {
+	{ xor_async_wrapper, "async_xor" },
 	{ xor_64,  "xor_64" },
 	{ xor_32,  "xor_32" },
 	{ xor_16,  "xor_16" },
@@ -1909,7 +1970,7 @@ static void xor(struct stripe *stripe, unsigned pi, unsigned sector)
 	unsigned max_chunks = rs->xor.chunks, n = 1,
 		 o = sector / SECTORS_PER_PAGE, /* Offset into the page_list. */
 		 p = rs->set.raid_devs;
-	unsigned long **d = rs->data;
+	unsigned long **d = stripe->xor.data;
 	xor_function_t xor_f = rs->xor.f->f;
 
 	BUG_ON(sector > stripe->io.size);
@@ -1924,34 +1985,56 @@ static void xor(struct stripe *stripe, unsigned pi, unsigned sector)
 
 		/* If max chunks -> xor. */
 		if (n == max_chunks) {
-			mutex_lock(&rs->io.xor_lock);
-			xor_f(n, d);
-			mutex_unlock(&rs->io.xor_lock);
+			xor_f(n, d, stripe->xor.pages);
 			n = 1;
 		}
 	}
 
 	/* If chunks -> xor. */
-	if (n > 1) {
-		mutex_lock(&rs->io.xor_lock);
-		xor_f(n, d);
-		mutex_unlock(&rs->io.xor_lock);
-	}
+	if (n > 1)
+		xor_f(n, d, stripe->xor.pages);
 }
 
-/* Common xor loop through all stripe page lists. */
-static void common_xor(struct stripe *stripe, sector_t count,
-		       unsigned off, unsigned pi)
+/* Xor loop through all stripe page lists; returns # of pages xored. */
+static unsigned __common_xor(struct stripe *stripe, sector_t count,
+			     unsigned off, unsigned pi)
 {
-	unsigned sector;
+	unsigned sector, pages = 0;
 
 	BUG_ON(!count);
-	for (sector = off; sector < count; sector += SECTORS_PER_PAGE)
+	for (sector = off; sector < count; sector += SECTORS_PER_PAGE) {
 		xor(stripe, pi, sector);
+		pages++;
+	}
+
+	return pages;
+}
+
+/*
+ * Common xor of a stripe into chunk @pi, accounted in the xor statistics.
+ *
+ * May run on several xor workers at once for different stripes, so
+ * the algorithm lock is only taken shared.
+ */
+static void common_xor(struct stripe *stripe, sector_t count,
+		       unsigned off, unsigned pi)
+{
+	struct raid_set *rs = RS(stripe->sc);
+	unsigned pages;
+	ktime_t start;
+
+	down_read(&rs->io.xor_lock);
+	start = ktime_get();
+	pages = __common_xor(stripe, count, off, pi);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &rs->xor.nsecs);
+	up_read(&rs->io.xor_lock);
+	atomic64_add((u64) pages * PAGE_SIZE * rs->set.data_devs,
+		     &rs->xor.bytes);
 
 	/* Set parity page uptodate and clean. */
 	chunk_set(CHUNK(stripe, pi), CLEAN);
-	atomic_inc(RS(stripe->sc)->stats + S_XORS); /* REMOVEME: statistics. */
+	atomic_inc(rs->stats + S_XORS); /* REMOVEME: statistics. */
 }
 
 /*
@@ -2629,7 +2712,7 @@ prohibit_io:
 
 	/*
 	 * If we have all chunks up to date or overwrite them, we
-	 * just zero the parity chunk and let stripe_rw() recreate it.
+	 * just zero the parity chunk and let stripe_rw_prepare() recreate it.
 	 */
 	if (chunks_uptodate == rs->set.raid_devs ||
 	    chunks_overwrite == rs->set.data_devs) {
@@ -2704,11 +2787,16 @@ static void stripe_avoid_reads(struct stripe *stripe)
  * States to cover:
  *   o stripe to read and/or write
  *   o stripe with error to reconstruct
+ *
+ * Split in two halves around the parity update, so that do_flush()
+ * can hand the parity calculation of many stripes to the xor workers:
+ * stripe_rw_prepare() returns < 0 if there's nothing to do, 1 if
+ * writes got merged and parity_xor() has to run before
+ * stripe_rw_submit(), 0 otherwise.
  */
-static int stripe_rw(struct stripe *stripe)
+static int stripe_rw_prepare(struct stripe *stripe)
 {
 	int nosync, r;
-	struct raid_set *rs = RS(stripe->sc);
 
 	/*
  	 * Check, if a chunk needs to be reconstructed
@@ -2717,9 +2805,9 @@ static int stripe_rw(struct stripe *stripe)
 	nosync = stripe_check_reconstruct(stripe);
 	switch (nosync) {
 	case -EBUSY:
-		return 0; /* Wait for stripe reconstruction to finish. */
+		return -EBUSY; /* Wait for stripe reconstruction to finish. */
 	case -EPERM:
-		goto io;
+		return 0;
 	}
 
 	/*
@@ -2740,34 +2828,44 @@ static int stripe_rw(struct stripe *stripe)
 	if (StripeRBW(stripe)) {
 		r = stripe_merge_possible(stripe, nosync);
 		if (!r) { /* Merge possible. */
-			struct stripe_chunk *chunk;
-
 			/*
 			 * I rely on valid parity in order
 			 * to xor a fraction of chunks out
 			 * of parity and back in.
 			 */
 			stripe_merge_writes(stripe);	/* Merge writes in. */
-			parity_xor(stripe);		/* Update parity. */
-			ClearStripeReconstruct(stripe);	/* Reset xor enforce. */
-			SetStripeMerged(stripe);	/* Writes merged. */
-			ClearStripeRBW(stripe);		/* Disable RBW. */
-
-			/*
-			 * REMOVEME: sanity check on parity chunk
-			 * 	     states after writes got merged.
-			 */
-			chunk = CHUNK(stripe, stripe->idx.parity);
-			BUG_ON(ChunkLocked(chunk));
-			BUG_ON(!ChunkUptodate(chunk));
-			BUG_ON(!ChunkDirty(chunk));
-			BUG_ON(!ChunkIo(chunk));
+			return 1;			/* Update parity. */
 		}
 	} else if (!nosync && !StripeMerged(stripe))
 		/* Read avoidance if not degraded/resynchronizing/merged. */
 		stripe_avoid_reads(stripe);
 
-io:
+	return 0;
+}
+
+static int stripe_rw_submit(struct stripe *stripe, int merged)
+{
+	int r;
+	struct raid_set *rs = RS(stripe->sc);
+
+	if (merged) {
+		struct stripe_chunk *chunk;
+
+		ClearStripeReconstruct(stripe);	/* Reset xor enforce. */
+		SetStripeMerged(stripe);	/* Writes merged. */
+		ClearStripeRBW(stripe);		/* Disable RBW. */
+
+		/*
+		 * REMOVEME: sanity check on parity chunk
+		 * 	     states after writes got merged.
+		 */
+		chunk = CHUNK(stripe, stripe->idx.parity);
+		BUG_ON(ChunkLocked(chunk));
+		BUG_ON(!ChunkUptodate(chunk));
+		BUG_ON(!ChunkDirty(chunk));
+		BUG_ON(!ChunkIo(chunk));
+	}
+
 	/* Now submit any reads/writes for non-uptodate or dirty chunks. */
 	r = stripe_chunks_rw(stripe);
 	if (!r) {
@@ -3131,7 +3229,7 @@ static void _do_endios(struct raid_set *rs, struct stripe *stripe,
 
 		/*
 		 * (*3*) Now we reset StripeReconstruct() and flag
-		 * 	 StripeReconstructed() to show to stripe_rw(),
+		 * 	 StripeReconstructed() to show to stripe_rw_prepare(),
 		 * 	 that we have reconstructed a missing chunk.
 		 */
 		ClearStripeReconstruct(stripe);
@@ -3202,14 +3300,73 @@ static void do_endios(struct raid_set *rs)
 	list_splice(&flush_list, sc->lists + LIST_FLUSH);
 }
 
+/* Calculate parity of a stripe on an xor worker. */
+static void do_parity_xor(struct work_struct *ws)
+{
+	struct stripe *stripe = container_of(ws, struct stripe, xor.ws);
+	struct raid_set *rs = RS(stripe->sc);
+
+	parity_xor(stripe);
+
+	if (atomic_dec_and_test(&rs->xor.pending))
+		complete(&rs->xor.done);
+}
+
+/*
+ * Calculate parity of all stripes on @list in parallel.
+ *
+ * The daemon works the last stripe itself and waits for
+ * the xor workers to finish the others.
+ */
+static void parity_xor_stripes(struct raid_set *rs, struct list_head *list)
+{
+	struct stripe *stripe, *last = list_entry(list->prev, struct stripe,
+						  xor.list);
+
+	atomic_set(&rs->xor.pending, 1);
+	INIT_COMPLETION(rs->xor.done);
+
+	list_for_each_entry(stripe, list, xor.list) {
+		if (stripe == last)
+			break;
+
+		atomic_inc(&rs->xor.pending);
+		queue_work(rs->xor.wq, &stripe->xor.ws);
+	}
+
+	parity_xor(last);
+
+	if (!atomic_dec_and_test(&rs->xor.pending))
+		wait_for_completion(&rs->xor.done);
+}
+
 /* Flush any stripes on the io list. */
 static int do_flush(struct raid_set *rs)
 {
 	int r = 0;
-	struct stripe *stripe;
+	struct stripe *stripe, *tmp;
+	LIST_HEAD(xor_list);
+
+	while ((stripe = stripe_io_pop(&rs->sc))) {
+		switch (stripe_rw_prepare(stripe)) {
+		case 0:
+			r += stripe_rw_submit(stripe, 0); /* Read/write stripe. */
+			break;
+		case 1:
+			/* Collect stripes needing parity updates. */
+			list_add_tail(&stripe->xor.list, &xor_list);
+		}
+	}
+
+	if (list_empty(&xor_list))
+		return r;
 
-	while ((stripe = stripe_io_pop(&rs->sc)))
-		r += stripe_rw(stripe); /* Read/write stripe. */
+	parity_xor_stripes(rs, &xor_list);
+
+	list_for_each_entry_safe(stripe, tmp, &xor_list, xor.list) {
+		list_del_init(&stripe->xor.list);
+		r += stripe_rw_submit(stripe, 1); /* Write stripe. */
+	}
 
 	return r;
 }
@@ -3428,11 +3585,12 @@ static unsigned mbpers(struct raid_set *rs, unsigned io_size)
 /* Calculate speed of particular algorithm and # of chunks. */
 static unsigned xor_speed(struct stripe *stripe)
 {
+	struct raid_set *rs = RS(stripe->sc);
 	int ticks = XOR_SPEED_TICKS;
-	unsigned p = RS(stripe->sc)->set.raid_devs, r = 0;
+	unsigned p = rs->set.raid_devs, r = 0;
 	unsigned long j;
 
-	/* Set uptodate so that common_xor()->xor() will belabour chunks. */
+	/* Set uptodate so that __common_xor()->xor() will belabour chunks. */
 	while (p--)
 		SetChunkUptodate(CHUNK(stripe, p));
 
@@ -3445,7 +3603,10 @@ static unsigned xor_speed(struct stripe *stripe)
 
 		for (j = jiffies; j == jiffies; ) {
 			mb();
-			common_xor(stripe, stripe->io.size, 0, 0);
+			/* Not parity work, keep it out of the xor statistics. */
+			down_read(&rs->io.xor_lock);
+			__common_xor(stripe, stripe->io.size, 0, 0);
+			up_read(&rs->io.xor_lock);
 			mb();
 			xors++;
 			mb();
@@ -3458,78 +3619,6 @@ static unsigned xor_speed(struct stripe *stripe)
 	return r;
 }
 
-/* Define for xor multi recovery stripe optimization runs. */
-#define DMRAID45_XOR_TEST
-
-/* Optimize xor algorithm for this RAID set. */
-static unsigned xor_optimize(struct raid_set *rs)
-{
-	unsigned chunks_max = 2, speed_max = 0;
-	struct xor_func *f = ARRAY_END(xor_funcs), *f_max = NULL;
-	struct stripe *stripe;
-	unsigned io_size = 0, speed_hm = 0, speed_min = ~0, speed_xor_blocks = 0;
-
-	BUG_ON(list_empty(&rs->recover.stripes));
-#ifndef DMRAID45_XOR_TEST
-	stripe = list_first_entry(&rs->recover.stripes, struct stripe,
-				  lists[LIST_RECOVER]);
-#endif
-
-	/* Try all xor functions. */
-	while (f-- > xor_funcs) {
-		unsigned speed;
-
-#ifdef DMRAID45_XOR_TEST
-		list_for_each_entry(stripe, &rs->recover.stripes,
-				    lists[LIST_RECOVER]) {
-			io_size = stripe->io.size;
-#endif
-
-			/* Set actual xor function for common_xor(). */
-			rs->xor.f = f;
-			rs->xor.chunks = (f->f == xor_blocks_wrapper ?
-					  (MAX_XOR_BLOCKS + 1) :
-					  XOR_CHUNKS_MAX);
-			if (rs->xor.chunks > rs->set.raid_devs)
-				rs->xor.chunks = rs->set.raid_devs;
-
-			for ( ; rs->xor.chunks > 1; rs->xor.chunks--) {
-				speed = xor_speed(stripe);
-
-#ifdef DMRAID45_XOR_TEST
-				if (f->f == xor_blocks_wrapper) {
-					if (speed > speed_xor_blocks)
-						speed_xor_blocks = speed;
-				} else if (speed > speed_hm)
-					speed_hm = speed;
-
-				if (speed < speed_min)
-					speed_min = speed;
-#endif
-
-				if (speed > speed_max) {
-					speed_max = speed;
-					chunks_max = rs->xor.chunks;
-					f_max = f;
-				}
-			}
-#ifdef DMRAID45_XOR_TEST
-		}
-#endif
-	}
-
-	/* Memorize optimal parameters. */
-	rs->xor.f = f_max;
-	rs->xor.chunks = chunks_max;
-#ifdef DMRAID45_XOR_TEST
-	DMINFO("%s stripes=%u/size=%u min=%u xor_blocks=%u hm=%u max=%u",
-	       speed_max == speed_hm ? "HM" : "NB",
-	       rs->recover.recovery_stripes, io_size, speed_min,
-	       speed_xor_blocks, speed_hm, speed_max);
-#endif
-	return speed_max;
-}
-
 /*
  * Allocate a RAID context (a RAID set)
  */
@@ -3588,7 +3677,7 @@ context_alloc(struct raid_type *raid_type, struct variable_parms *p,
 		goto bad_recover_io_size;
 
 	/* Size and allocate the RAID set structure. */
-	len = sizeof(*rs->data) + sizeof(*rs->dev);
+	len = sizeof(*rs->dev);
 	if (dm_array_too_big(sizeof(*rs), len, raid_devs))
 		goto bad_array;
 
@@ -3602,9 +3691,6 @@ context_alloc(struct raid_type *raid_type, struct variable_parms *p,
 	atomic_set(&rs->io.in_process_max, 0);
 	rec->io_size = p->recover_io_size;
 
-	/* Pointer to data array. */
-	rs->data = (unsigned long **)
-		   ((void *) rs->dev + raid_devs * sizeof(*rs->dev));
 	rec->dl = dl;
 	rs->set.raid_devs = raid_devs;
 	rs->set.data_devs = raid_devs - raid_type->parity_devs;
@@ -3643,7 +3729,9 @@ context_alloc(struct raid_type *raid_type, struct variable_parms *p,
 
 	/* Initialize io lock and queues. */
 	mutex_init(&rs->io.in_lock);
-	mutex_init(&rs->io.xor_lock);
+	init_rwsem(&rs->io.xor_lock);
+	atomic_set(&rs->xor.pending, 0);
+	init_completion(&rs->xor.done);
 	bio_list_init(&rs->io.in);
 	bio_list_init(&rs->io.work);
 
@@ -3720,6 +3808,14 @@ static int rs_workqueue_init(struct raid_set *rs)
 	if (!rs->io.wq)
 		TI_ERR_RET("failed to create " DAEMON, -ENOMEM);
 
+	/* Parity calculation is spread over all CPUs. */
+	rs->xor.wq = alloc_workqueue(XOR_DAEMON, WQ_UNBOUND | WQ_MEM_RECLAIM,
+				     num_online_cpus());
+	if (!rs->xor.wq) {
+		destroy_workqueue(rs->io.wq);
+		TI_ERR_RET("failed to create " XOR_DAEMON, -ENOMEM);
+	}
+
 	INIT_DELAYED_WORK(&rs->io.dws_do_raid, do_raid);
 	INIT_WORK(&rs->io.ws_do_table_event, do_table_event);
 	return 0;
@@ -3760,12 +3856,16 @@ static void rs_log(struct raid_set *rs, unsigned io_size)
 				(p == rs->set.pi) ? " (parity)" : "");
 
 	DMINFO("%d/%d/%d sectors chunk/io/recovery size, %u stripes\n"
-	       "algorithm \"%s\", %u chunks with %uMB/s\n"
+	       "algorithm \"%s\", %u chunks\n"
 	       "%s set with net %u/%u devices",
 	       rs->set.chunk_size, rs->set.io_size, rs->recover.io_size,
 	       atomic_read(&rs->sc.stripes),
-	       rs->xor.f->name, rs->xor.chunks, mbpers(rs, io_size),
+	       rs->xor.f->name, rs->xor.chunks,
 	       rs->set.raid_type->descr, rs->set.data_devs, rs->set.raid_devs);
+
+	/* Only measured on request, see xor_set(). */
+	if (rs->xor.speed)
+		DMINFO("xor speed %uMB/s", mbpers(rs, io_size));
 }
 
 /* Get all devices and offsets. */
@@ -4138,16 +4238,19 @@ static int raid_ctr(struct dm_target *ti, unsigned argc, char **argv)
 			      2 /* # of stripes */);
 	rs_set_congested_fn(rs); /* Set congested function. */
 	SetRSCheckOverwrite(rs); /* Allow chunk overwrite checks. */
-	rs->xor.speed = xor_optimize(rs); /* Select best xor algorithm. */
+
+	/*
+	 * Default to async_xor, which uses the xor template
+	 * calibrated at boot or a DMA engine.
+	 */
+	rs->xor.f = xor_funcs;
+	rs->xor.chunks = rs->set.raid_devs;
 
 	/* Set for recovery of any nosync regions. */
 	if (parms.recovery)
 		SetRSRecover(rs);
 	else {
-		/*
-		 * Need to free recovery stripe(s) here in case
-		 * of nosync, because xor_optimize uses one.
-		 */
+		/* Need to free recovery stripe(s) here in case of nosync. */
 		set_start_recovery(rs);
 		set_end_recovery(rs);
 		stripe_recover_free(rs);
@@ -4190,6 +4293,7 @@ static void raid_dtr(struct dm_target *ti)
 	struct raid_set *rs = ti->private;
 
 	destroy_workqueue(rs->io.wq);
+	destroy_workqueue(rs->xor.wq);
 	context_free(rs, rs->set.raid_devs);
 }
 
@@ -4307,8 +4411,15 @@ static void raid_devel_stats(struct dm_target *ti, char *result,
 	struct recover *rec = &rs->recover;
 	struct timespec ts;
 
+	u64 xor_bytes = atomic64_read(&rs->xor.bytes),
+	    xor_us = div_u64(atomic64_read(&rs->xor.nsecs), NSEC_PER_USEC);
+
 	DMEMIT("%s %s=%u bw=%u\n",
 	       version, rs->xor.f->name, rs->xor.chunks, rs->recover.bandwidth);
+	/* Parity throughput; bytes per microsecond are MB/s. */
+	DMEMIT("xor_bytes=%llu xor_us=%llu xor_mbps=%llu\n",
+	       (unsigned long long) xor_bytes, (unsigned long long) xor_us,
+	       (unsigned long long) (xor_us ? div64_u64(xor_bytes, xor_us) : 0));
 	DMEMIT("act_ios=%d ", io_ref(rs));
 	DMEMIT("act_ios_max=%d\n", atomic_read(&rs->io.in_process_max));
 	DMEMIT("act_stripes=%d ", sc_active(&rs->sc));
@@ -4535,12 +4646,16 @@ static int xor_set(struct raid_set *rs, int argc, char **argv,
 		struct xor_func *f = ARRAY_END(xor_funcs);
 
 		if (sscanf(argv[1], "%d", &chunks) == 1 &&
-		    range_ok(chunks, 2, XOR_CHUNKS_MAX) &&
-		    chunks <= rs->set.raid_devs) {
+		    chunks >= 2 && chunks <= rs->set.raid_devs) {
 			while (f-- > xor_funcs) {
 				if (!strcmp(algorithm, f->name)) {
 					unsigned io_size = 0;
-					struct stripe *stripe = stripe_alloc(&rs->sc, rs->sc.mem_cache_client, SC_GROW);
+					struct stripe *stripe;
+
+					/* async_xor takes any # of chunks. */
+					if (f->f != xor_async_wrapper &&
+					    chunks > XOR_CHUNKS_MAX)
+						break;
 
 					DMINFO("xor: %s", f->name);
 					if (f->f == xor_blocks_wrapper &&
@@ -4550,11 +4665,13 @@ static int xor_set(struct raid_set *rs, int argc, char **argv,
 						break;
 					}
 
-					mutex_lock(&rs->io.xor_lock);
+					stripe = stripe_alloc(&rs->sc, rs->sc.mem_cache_client, SC_GROW);
+
+					down_write(&rs->io.xor_lock);
 					rs->xor.f = f;
 					rs->xor.chunks = chunks;
 					rs->xor.speed = 0;
-					mutex_unlock(&rs->io.xor_lock);
+					up_write(&rs->io.xor_lock);
 
 					if (stripe) {
 						rs->xor.speed = xor_speed(stripe);
@@ -1275,6 +1275,27 @@ out:
 	return r;
 }
 
+int dm_pool_changed_this_transaction(struct dm_pool_metadata *pmd)
+{
+	int r;
+	struct dm_thin_device *td;
+
+	if (!down_read_trylock(&pmd->root_lock))
+		return -EWOULDBLOCK;
+
+	r = pmd->need_commit;
+	list_for_each_entry(td, &pmd->thin_devices, list) {
+		if (td->changed) {
+			r = 1;
+			break;
+		}
+	}
+
+	up_read(&pmd->root_lock);
+
+	return r;
+}
+
 int dm_pool_get_free_block_count(struct dm_pool_metadata *pmd, dm_block_t *result)
 {
 	int r;
@@ -127,6 +127,15 @@ int dm_thin_remove_block(struct dm_thin_device *td, dm_block_t block);
 /*
  * Queries.
  */
+
+/*
+ * Returns:
+ *   -EWOULDBLOCK iff it can't tell without blocking.
+ *   1 iff the running transaction holds changes that need a commit.
+ *   0 otherwise
+ */
+int dm_pool_changed_this_transaction(struct dm_pool_metadata *pmd);
+
 int dm_thin_get_highest_mapped_block(struct dm_thin_device *td,
 				     dm_block_t *highest_mapped);
 
@@ -5079,6 +5079,7 @@ static void md_clean(struct mddev *mddev)
 	mddev->bitmap_info.chunksize = 0;
 	mddev->bitmap_info.daemon_sleep = 0;
 	mddev->bitmap_info.max_write_behind = 0;
+	mddev->bitmap_info.batch_delay = 0;
 }
 
 static void __md_stop_writes(struct mddev *mddev)
@@ -390,6 +390,10 @@ struct mddev {
 		unsigned long		chunksize;
 		unsigned long		daemon_sleep; /* how many jiffies between updates? */
 		unsigned long		max_write_behind; /* write-behind mode */
+		unsigned long		batch_delay; /* jiffies writes may wait
+						      * for more bits to be set
+						      * before the bitmap is
+						      * written out */
 		int			external;
 	} bitmap_info;
 
@@ -2125,7 +2125,9 @@ static void raid1d(struct mddev *mddev)
 	blk_start_plug(&plug);
 	for (;;) {
 
-		if (atomic_read(&mddev->plug_cnt) == 0)
+		if (atomic_read(&mddev->plug_cnt) == 0 &&
+		    (conf->pending_count >= max_queued_requests ||
+		     bitmap_batch_ready(mddev->bitmap)))
 			flush_pending_writes(conf);
 
 		spin_lock_irqsave(&conf->device_lock, flags);
@@ -2508,7 +2508,9 @@ static void raid10d(struct mddev *mddev)
 	blk_start_plug(&plug);
 	for (;;) {
 
-		flush_pending_writes(conf);
+		if (conf->pending_count >= max_queued_requests ||
+		    bitmap_batch_ready(mddev->bitmap))
+			flush_pending_writes(conf);
 
 		spin_lock_irqsave(&conf->device_lock, flags);
 		if (list_empty(head)) {
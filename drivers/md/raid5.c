@@ -53,6 +53,7 @@
 #include <linux/cpu.h>
 #include <linux/slab.h>
 #include <linux/ratelimit.h>
+#include <linux/list_sort.h>
 #include "md.h"
 #include "raid5.h"
 #include "raid0.h"
@@ -77,6 +78,39 @@ static inline struct hlist_head *stripe_hash(struct r5conf *conf, sector_t sect)
 	return &conf->stripe_hashtbl[hash];
 }
 
+static inline int stripe_hash_locks_hash(sector_t sect)
+{
+	return (sect >> STRIPE_SHIFT) & STRIPE_HASH_LOCKS_MASK;
+}
+
+static inline void lock_all_device_hash_locks_irq(struct r5conf *conf)
+{
+	int i;
+	local_irq_disable();
+	spin_lock(conf->hash_locks);
+	for (i = 1; i < NR_STRIPE_HASH_LOCKS; i++)
+		spin_lock_nest_lock(conf->hash_locks + i, conf->hash_locks);
+	spin_lock(&conf->device_lock);
+}
+
+static inline void unlock_all_device_hash_locks_irq(struct r5conf *conf)
+{
+	int i;
+	spin_unlock(&conf->device_lock);
+	for (i = NR_STRIPE_HASH_LOCKS; i; i--)
+		spin_unlock(conf->hash_locks + i - 1);
+	local_irq_enable();
+}
+
+/* Find the worker group (NUMA node) that handles stripes of @cpu */
+#define cpu_to_group(cpu) cpu_to_node(cpu)
+#define ANY_GROUP NUMA_NO_NODE
+
+/* Number of stripes handled per device_lock round trip */
+#define MAX_STRIPE_BATCH 8
+
+static struct workqueue_struct *raid5_wq;
+
 /* bio's attached to a stripe+device for I/O are linked together in bi_sector
  * order without overlap.  There may be several bio's per stripe+device, and
  * a bio could span several devices.
@@ -190,37 +224,128 @@ static int stripe_operations_active(struct stripe_head *sh)
 	       test_bit(STRIPE_COMPUTE_RUN, &sh->state);
 }
 
-static void __release_stripe(struct r5conf *conf, struct stripe_head *sh)
+/*
+ * Queue @sh on the handle_list of its worker group and kick enough
+ * workers to drain the list in MAX_STRIPE_BATCH sized batches.
+ * device_lock is held.
+ */
+static void raid5_wakeup_stripe_thread(struct stripe_head *sh)
 {
-	if (atomic_dec_and_test(&sh->count)) {
-		BUG_ON(!list_empty(&sh->lru));
-		BUG_ON(atomic_read(&conf->active_stripes)==0);
-		if (test_bit(STRIPE_HANDLE, &sh->state)) {
-			if (test_bit(STRIPE_DELAYED, &sh->state))
-				list_add_tail(&sh->lru, &conf->delayed_list);
-			else if (test_bit(STRIPE_BIT_DELAY, &sh->state) &&
-				   sh->bm_seq - conf->seq_write > 0)
-				list_add_tail(&sh->lru, &conf->bitmap_list);
-			else {
-				clear_bit(STRIPE_BIT_DELAY, &sh->state);
-				list_add_tail(&sh->lru, &conf->handle_list);
-			}
-			md_wakeup_thread(conf->mddev->thread);
-		} else {
-			BUG_ON(stripe_operations_active(sh));
-			if (test_and_clear_bit(STRIPE_PREREAD_ACTIVE, &sh->state)) {
-				atomic_dec(&conf->preread_active_stripes);
-				if (atomic_read(&conf->preread_active_stripes) < IO_THRESHOLD)
-					md_wakeup_thread(conf->mddev->thread);
-			}
-			atomic_dec(&conf->active_stripes);
-			if (!test_bit(STRIPE_EXPANDING, &sh->state)) {
-				list_add_tail(&sh->lru, &conf->inactive_list);
-				wake_up(&conf->wait_for_stripe);
-				if (conf->retry_read_aligned)
-					md_wakeup_thread(conf->mddev->thread);
+	struct r5conf *conf = sh->raid_conf;
+	struct r5worker_group *group;
+	int thread_cnt;
+	int i, cpu = sh->cpu;
+
+	if (!cpu_online(cpu)) {
+		cpu = cpumask_any(cpu_online_mask);
+		sh->cpu = cpu;
+	}
+
+	group = conf->worker_groups + cpu_to_group(cpu);
+	list_add_tail(&sh->lru, &group->handle_list);
+	group->stripes_cnt++;
+	sh->group = group;
+
+	group->workers[0].working = true;
+	/* at least one worker must run, it rechecks the list when done */
+	queue_work_on(cpu, raid5_wq, &group->workers[0].work);
+
+	thread_cnt = group->stripes_cnt / MAX_STRIPE_BATCH - 1;
+	for (i = 1; i < conf->worker_cnt_per_group && thread_cnt > 0; i++) {
+		if (!group->workers[i].working) {
+			group->workers[i].working = true;
+			queue_work_on(cpu, raid5_wq, &group->workers[i].work);
+			thread_cnt--;
+		}
+	}
+}
+
+/*
+ * Stripes that become idle are not put back on conf->inactive_list
+ * directly as that needs their hash_lock, which nests outside
+ * device_lock.  They are collected on @temp_inactive_list instead and
+ * handed back by release_inactive_stripe_list() once device_lock has
+ * been dropped.
+ */
+static void do_release_stripe(struct r5conf *conf, struct stripe_head *sh,
+			      struct list_head *temp_inactive_list)
+{
+	BUG_ON(!list_empty(&sh->lru));
+	BUG_ON(atomic_read(&conf->active_stripes)==0);
+	if (test_bit(STRIPE_HANDLE, &sh->state)) {
+		if (test_bit(STRIPE_DELAYED, &sh->state))
+			list_add_tail(&sh->lru, &conf->delayed_list);
+		else if (test_bit(STRIPE_BIT_DELAY, &sh->state) &&
+			   sh->bm_seq - conf->seq_write > 0)
+			list_add_tail(&sh->lru, &conf->bitmap_list);
+		else {
+			clear_bit(STRIPE_BIT_DELAY, &sh->state);
+			if (conf->worker_cnt_per_group) {
+				raid5_wakeup_stripe_thread(sh);
+				return;
 			}
+			list_add_tail(&sh->lru, &conf->handle_list);
+		}
+		md_wakeup_thread(conf->mddev->thread);
+	} else {
+		BUG_ON(stripe_operations_active(sh));
+		if (test_and_clear_bit(STRIPE_PREREAD_ACTIVE, &sh->state)) {
+			atomic_dec(&conf->preread_active_stripes);
+			if (atomic_read(&conf->preread_active_stripes) < IO_THRESHOLD)
+				md_wakeup_thread(conf->mddev->thread);
+		}
+		atomic_dec(&conf->active_stripes);
+		if (!test_bit(STRIPE_EXPANDING, &sh->state))
+			list_add_tail(&sh->lru, temp_inactive_list);
+	}
+}
+
+static void __release_stripe(struct r5conf *conf, struct stripe_head *sh,
+			     struct list_head *temp_inactive_list)
+{
+	if (atomic_dec_and_test(&sh->count))
+		do_release_stripe(conf, sh, temp_inactive_list);
+}
+
+/*
+ * @hash may be NR_STRIPE_HASH_LOCKS, in which case @temp_inactive_list
+ * is an array with one list per hash lock.  Otherwise it is the single
+ * list of stripes belonging to hash lock @hash.
+ */
+static void release_inactive_stripe_list(struct r5conf *conf,
+					 struct list_head *temp_inactive_list,
+					 int hash)
+{
+	int size;
+	bool do_wakeup = false;
+	unsigned long flags;
+
+	if (hash == NR_STRIPE_HASH_LOCKS) {
+		size = NR_STRIPE_HASH_LOCKS;
+		hash = NR_STRIPE_HASH_LOCKS - 1;
+	} else
+		size = 1;
+	while (size) {
+		struct list_head *list = &temp_inactive_list[size - 1];
+
+		/*
+		 * No lock held yet, get_active_stripe() may be taking
+		 * stripes off the list under hash_lock and device_lock.
+		 */
+		if (!list_empty_careful(list)) {
+			spin_lock_irqsave(conf->hash_locks + hash, flags);
+			list_splice_tail_init(list, conf->inactive_list + hash);
+			do_wakeup = true;
+			spin_unlock_irqrestore(conf->hash_locks + hash, flags);
 		}
+		size--;
+		hash--;
+	}
+
+	if (do_wakeup) {
+		wake_up(&conf->wait_for_stripe);
+		if (conf->retry_read_aligned)
+			md_wakeup_thread(conf->mddev->thread);
 	}
 }
 
@@ -228,10 +353,18 @@ static void release_stripe(struct stripe_head *sh)
 {
 	struct r5conf *conf = sh->raid_conf;
 	unsigned long flags;
+	struct list_head list;
+	int hash;
 
-	spin_lock_irqsave(&conf->device_lock, flags);
-	__release_stripe(conf, sh);
-	spin_unlock_irqrestore(&conf->device_lock, flags);
+	local_irq_save(flags);
+	if (atomic_dec_and_lock(&sh->count, &conf->device_lock)) {
+		INIT_LIST_HEAD(&list);
+		hash = sh->hash_lock_index;
+		do_release_stripe(conf, sh, &list);
+		spin_unlock(&conf->device_lock);
+		release_inactive_stripe_list(conf, &list, hash);
+	}
+	local_irq_restore(flags);
 }
 
 static inline void remove_hash(struct stripe_head *sh)
@@ -253,19 +386,22 @@ static inline void insert_hash(struct r5conf *conf, struct stripe_head *sh)
 }
 
 
-/* find an idle stripe, make sure it is unhashed, and return it. */
-static struct stripe_head *get_free_stripe(struct r5conf *conf)
+/* find an idle stripe, make sure it is unhashed, and return it.
+ * hash_locks[hash] is held.
+ */
+static struct stripe_head *get_free_stripe(struct r5conf *conf, int hash)
 {
 	struct stripe_head *sh = NULL;
 	struct list_head *first;
 
-	if (list_empty(&conf->inactive_list))
+	if (list_empty(conf->inactive_list + hash))
 		goto out;
-	first = conf->inactive_list.next;
+	first = conf->inactive_list[hash].next;
 	sh = list_entry(first, struct stripe_head, lru);
 	list_del_init(first);
 	remove_hash(sh);
 	atomic_inc(&conf->active_stripes);
+	BUG_ON(hash != sh->hash_lock_index);
 out:
 	return sh;
 }
@@ -324,6 +460,8 @@ static void init_stripe(struct stripe_head *sh, sector_t sector, int previous)
 	sh->sector = sector;
 	stripe_set_idx(sector, conf, previous, sh);
 	sh->state = 0;
+	sh->cpu = smp_processor_id();
+	set_bit(STRIPE_BATCH_READY, &sh->state);
 
 
 	for (i = sh->disks; i--; ) {
@@ -440,52 +578,57 @@ get_active_stripe(struct r5conf *conf, sector_t sector,
 		  int previous, int noblock, int noquiesce)
 {
 	struct stripe_head *sh;
+	int hash = stripe_hash_locks_hash(sector);
 
 	pr_debug("get_stripe, sector %llu\n", (unsigned long long)sector);
 
-	spin_lock_irq(&conf->device_lock);
+	spin_lock_irq(conf->hash_locks + hash);
 
 	do {
 		wait_event_lock_irq(conf->wait_for_stripe,
 				    conf->quiesce == 0 || noquiesce,
-				    conf->device_lock, /* nothing */);
+				    conf->hash_locks[hash], /* nothing */);
 		sh = __find_stripe(conf, sector, conf->generation - previous);
 		if (!sh) {
 			if (!conf->inactive_blocked)
-				sh = get_free_stripe(conf);
+				sh = get_free_stripe(conf, hash);
 			if (noblock && sh == NULL)
 				break;
 			if (!sh) {
 				conf->inactive_blocked = 1;
 				wait_event_lock_irq(conf->wait_for_stripe,
-						    !list_empty(&conf->inactive_list) &&
+						    !list_empty(conf->inactive_list + hash) &&
 						    (atomic_read(&conf->active_stripes)
 						     < (conf->max_nr_stripes *3/4)
 						     || !conf->inactive_blocked),
-						    conf->device_lock,
+						    conf->hash_locks[hash],
 						    );
 				conf->inactive_blocked = 0;
-			} else
-				init_stripe(sh, sector, previous);
-		} else {
-			if (atomic_read(&sh->count)) {
-				BUG_ON(!list_empty(&sh->lru)
-				    && !test_bit(STRIPE_EXPANDING, &sh->state));
 			} else {
+				init_stripe(sh, sector, previous);
+				atomic_inc(&sh->count);
+			}
+		} else if (!atomic_inc_not_zero(&sh->count)) {
+			/* idle: it sits on one of the lists, take it off */
+			spin_lock(&conf->device_lock);
+			if (!atomic_read(&sh->count)) {
 				if (!test_bit(STRIPE_HANDLE, &sh->state))
 					atomic_inc(&conf->active_stripes);
 				if (list_empty(&sh->lru) &&
 				    !test_bit(STRIPE_EXPANDING, &sh->state))
 					BUG();
 				list_del_init(&sh->lru);
+				if (sh->group) {
+					sh->group->stripes_cnt--;
+					sh->group = NULL;
+				}
 			}
+			atomic_inc(&sh->count);
+			spin_unlock(&conf->device_lock);
 		}
 	} while (sh == NULL);
 
-	if (sh)
-		atomic_inc(&sh->count);
-
-	spin_unlock_irq(&conf->device_lock);
+	spin_unlock_irq(conf->hash_locks + hash);
 	return sh;
 }
 
@@ -1396,7 +1539,7 @@ static void raid_run_ops(struct stripe_head *sh, unsigned long ops_request)
 #define raid_run_ops __raid_run_ops
 #endif
 
-static int grow_one_stripe(struct r5conf *conf)
+static int grow_one_stripe(struct r5conf *conf, int hash)
 {
 	struct stripe_head *sh;
 	sh = kmem_cache_zalloc(conf->slab_cache, GFP_KERNEL);
@@ -1404,6 +1547,7 @@ static int grow_one_stripe(struct r5conf *conf)
 		return 0;
 
 	sh->raid_conf = conf;
+	sh->hash_lock_index = hash;
 	#ifdef CONFIG_MULTICORE_RAID456
 	init_waitqueue_head(&sh->ops.wait_for_ops);
 	#endif
@@ -1417,6 +1561,7 @@ static int grow_one_stripe(struct r5conf *conf)
 	atomic_set(&sh->count, 1);
 	atomic_inc(&conf->active_stripes);
 	INIT_LIST_HEAD(&sh->lru);
+	INIT_LIST_HEAD(&sh->batch_list);
 	release_stripe(sh);
 	return 1;
 }
@@ -1425,6 +1570,7 @@ static int grow_stripes(struct r5conf *conf, int num)
 {
 	struct kmem_cache *sc;
 	int devs = max(conf->raid_disks, conf->previous_raid_disks);
+	int hash;
 
 	if (conf->mddev->gendisk)
 		sprintf(conf->cache_name[0],
@@ -1442,8 +1588,9 @@ static int grow_stripes(struct r5conf *conf, int num)
 		return 1;
 	conf->slab_cache = sc;
 	conf->pool_size = devs;
-	while (num--)
-		if (!grow_one_stripe(conf))
+	/* stripe i goes to inactive_list[i % NR_STRIPE_HASH_LOCKS] */
+	for (hash = 0; num--; hash = (hash + 1) % NR_STRIPE_HASH_LOCKS)
+		if (!grow_one_stripe(conf, hash))
 			return 1;
 	return 0;
 }
@@ -1502,6 +1649,7 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 	int err;
 	struct kmem_cache *sc;
 	int i;
+	int hash, cnt;
 
 	if (newsize <= conf->pool_size)
 		return 0; /* never bother to shrink */
@@ -1523,6 +1671,7 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 			break;
 
 		nsh->raid_conf = conf;
+		INIT_LIST_HEAD(&nsh->batch_list);
 		#ifdef CONFIG_MULTICORE_RAID456
 		init_waitqueue_head(&nsh->ops.wait_for_ops);
 		#endif
@@ -1543,20 +1692,30 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 	 * OK, we have enough stripes, start collecting inactive
 	 * stripes and copying them over
 	 */
+	hash = 0;
+	cnt = 0;
 	list_for_each_entry(nsh, &newstripes, lru) {
-		spin_lock_irq(&conf->device_lock);
+		spin_lock_irq(conf->hash_locks + hash);
 		wait_event_lock_irq(conf->wait_for_stripe,
-				    !list_empty(&conf->inactive_list),
-				    conf->device_lock,
+				    !list_empty(conf->inactive_list + hash),
+				    conf->hash_locks[hash],
 				    );
-		osh = get_free_stripe(conf);
-		spin_unlock_irq(&conf->device_lock);
+		osh = get_free_stripe(conf, hash);
+		spin_unlock_irq(conf->hash_locks + hash);
 		atomic_set(&nsh->count, 1);
 		for(i=0; i<conf->pool_size; i++)
 			nsh->dev[i].page = osh->dev[i].page;
 		for( ; i<newsize; i++)
 			nsh->dev[i].page = NULL;
+		nsh->hash_lock_index = hash;
 		kmem_cache_free(conf->slab_cache, osh);
+		/* inactive_list[hash] holds every NR_STRIPE_HASH_LOCKS'th stripe */
+		cnt++;
+		if (cnt >= conf->max_nr_stripes / NR_STRIPE_HASH_LOCKS +
+		    !!((conf->max_nr_stripes % NR_STRIPE_HASH_LOCKS) > hash)) {
+			hash++;
+			cnt = 0;
+		}
 	}
 	kmem_cache_destroy(conf->slab_cache);
 
@@ -1615,13 +1774,13 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 	return err;
 }
 
-static int drop_one_stripe(struct r5conf *conf)
+static int drop_one_stripe(struct r5conf *conf, int hash)
 {
 	struct stripe_head *sh;
 
-	spin_lock_irq(&conf->device_lock);
-	sh = get_free_stripe(conf);
-	spin_unlock_irq(&conf->device_lock);
+	spin_lock_irq(conf->hash_locks + hash);
+	sh = get_free_stripe(conf, hash);
+	spin_unlock_irq(conf->hash_locks + hash);
 	if (!sh)
 		return 0;
 	BUG_ON(atomic_read(&sh->count));
@@ -1633,8 +1792,11 @@ static int drop_one_stripe(struct r5conf *conf)
 
 static void shrink_stripes(struct r5conf *conf)
 {
-	while (drop_one_stripe(conf))
-		;
+	int hash;
+
+	for (hash = 0; hash < NR_STRIPE_HASH_LOCKS; hash++)
+		while (drop_one_stripe(conf, hash))
+			;
 
 	if (conf->slab_cache)
 		kmem_cache_destroy(conf->slab_cache);
@@ -2222,11 +2384,16 @@ schedule_reconstruction(struct stripe_head *sh, struct stripe_head_state *s,
 				s->locked++;
 			}
 		}
-		if (s->locked + conf->max_degraded == disks)
+		if (s->locked + conf->max_degraded == disks) {
 			if (!test_and_set_bit(STRIPE_FULL_WRITE, &sh->state))
 				atomic_inc(&conf->pending_full_writes);
+			if (!expand)
+				atomic_long_inc(&conf->full_stripe_writes);
+		} else if (!expand)
+			atomic_long_inc(&conf->rcw_writes);
 	} else {
 		BUG_ON(level == 6);
+		atomic_long_inc(&conf->rmw_writes);
 		BUG_ON(!(test_bit(R5_UPTODATE, &sh->dev[pd_idx].flags) ||
 			test_bit(R5_Wantcompute, &sh->dev[pd_idx].flags)));
 
@@ -3290,6 +3457,30 @@ static void analyse_stripe(struct stripe_head *sh, struct stripe_head_state *s)
 	rcu_read_unlock();
 }
 
+/*
+ * A stripe that is being handled can no longer head or join a batch.
+ * If @sh heads one, its members are moved to @batch to be handled right
+ * after it.  A member handled ahead of its head simply leaves the batch.
+ */
+static void stripe_leave_batch(struct stripe_head *sh, struct list_head *batch)
+{
+	struct r5conf *conf = sh->raid_conf;
+	struct stripe_head *member;
+
+	spin_lock_irq(&conf->device_lock);
+	if (sh->batch_head) {
+		list_del_init(&sh->batch_list);
+		sh->batch_head = NULL;
+		/* the batch reference, our caller still holds one */
+		atomic_dec(&sh->count);
+	} else {
+		list_for_each_entry(member, &sh->batch_list, batch_list)
+			member->batch_head = NULL;
+		list_splice_init(&sh->batch_list, batch);
+	}
+	spin_unlock_irq(&conf->device_lock);
+}
+
 static void handle_stripe(struct stripe_head *sh)
 {
 	struct stripe_head_state s;
@@ -3298,6 +3489,7 @@ static void handle_stripe(struct stripe_head *sh)
 	int prexor;
 	int disks = sh->disks;
 	struct r5dev *pdev, *qdev;
+	LIST_HEAD(batch);
 
 	clear_bit(STRIPE_HANDLE, &sh->state);
 	if (test_and_set_bit_lock(STRIPE_ACTIVE, &sh->state)) {
@@ -3307,6 +3499,9 @@ static void handle_stripe(struct stripe_head *sh)
 		return;
 	}
 
+	if (test_and_clear_bit(STRIPE_BATCH_READY, &sh->state))
+		stripe_leave_batch(sh, &batch);
+
 	if (test_and_clear_bit(STRIPE_SYNC_REQUESTED, &sh->state)) {
 		set_bit(STRIPE_SYNCING, &sh->state);
 		clear_bit(STRIPE_INSYNC, &sh->state);
@@ -3590,6 +3785,17 @@ finish:
 	return_io(s.return_bi);
 
 	clear_bit_unlock(STRIPE_ACTIVE, &sh->state);
+
+	/* the rest of the batch goes out right behind its head */
+	while (!list_empty(&batch)) {
+		struct stripe_head *member;
+
+		member = list_first_entry(&batch, struct stripe_head,
+					  batch_list);
+		list_del_init(&member->batch_list);
+		handle_stripe(member);
+		release_stripe(member);
+	}
 }
 
 static void raid5_activate_delayed(struct r5conf *conf)
@@ -3608,7 +3814,8 @@ static void raid5_activate_delayed(struct r5conf *conf)
 	}
 }
 
-static void activate_bit_delay(struct r5conf *conf)
+static void activate_bit_delay(struct r5conf *conf,
+			       struct list_head *temp_inactive_list)
 {
 	/* device_lock is held */
 	struct list_head head;
@@ -3618,13 +3825,15 @@ static void activate_bit_delay(struct r5conf *conf)
 		struct stripe_head *sh = list_entry(head.next, struct stripe_head, lru);
 		list_del_init(&sh->lru);
 		atomic_inc(&sh->count);
-		__release_stripe(conf, sh);
+		__release_stripe(conf, sh,
+				 &temp_inactive_list[sh->hash_lock_index]);
 	}
 }
 
 int md_raid5_congested(struct mddev *mddev, int bits)
 {
 	struct r5conf *conf = mddev->private;
+	int i;
 
 	/* No difference between reads and writes.  Just check
 	 * how busy the stripe_cache is
@@ -3634,8 +3843,9 @@ int md_raid5_congested(struct mddev *mddev, int bits)
 		return 1;
 	if (conf->quiesce)
 		return 1;
-	if (list_empty_careful(&conf->inactive_list))
-		return 1;
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
+		if (list_empty_careful(conf->inactive_list + i))
+			return 1;
 
 	return 0;
 }
@@ -3874,19 +4084,36 @@ static int chunk_aligned_read(struct mddev *mddev, struct bio * raid_bio)
  * stripe with in flight i/o.  The bypass_count will be reset when the
  * head of the hold_list has changed, i.e. the head was promoted to the
  * handle_list.
+ *
+ * With worker threads, @group selects the worker group whose handle_list
+ * is served; raid5d passes ANY_GROUP and helps out wherever work is queued.
  */
-static struct stripe_head *__get_priority_stripe(struct r5conf *conf)
+static struct stripe_head *__get_priority_stripe(struct r5conf *conf, int group)
 {
 	struct stripe_head *sh;
+	struct list_head *handle_list = NULL;
+
+	if (conf->worker_cnt_per_group == 0) {
+		handle_list = &conf->handle_list;
+	} else if (group != ANY_GROUP) {
+		handle_list = &conf->worker_groups[group].handle_list;
+	} else {
+		int i;
+		for (i = 0; i < conf->group_cnt; i++) {
+			handle_list = &conf->worker_groups[i].handle_list;
+			if (!list_empty(handle_list))
+				break;
+		}
+	}
 
 	pr_debug("%s: handle: %s hold: %s full_writes: %d bypass_count: %d\n",
 		  __func__,
-		  list_empty(&conf->handle_list) ? "empty" : "busy",
+		  list_empty(handle_list) ? "empty" : "busy",
 		  list_empty(&conf->hold_list) ? "empty" : "busy",
 		  atomic_read(&conf->pending_full_writes), conf->bypass_count);
 
-	if (!list_empty(&conf->handle_list)) {
-		sh = list_entry(conf->handle_list.next, typeof(*sh), lru);
+	if (!list_empty(handle_list)) {
+		sh = list_entry(handle_list->next, typeof(*sh), lru);
 
 		if (list_empty(&conf->hold_list))
 			conf->bypass_count = 0;
@@ -3915,9 +4142,151 @@ static struct stripe_head *__get_priority_stripe(struct r5conf *conf)
 	list_del_init(&sh->lru);
 	atomic_inc(&sh->count);
 	BUG_ON(atomic_read(&sh->count) != 1);
+	if (sh->group) {
+		sh->group->stripes_cnt--;
+		sh->group = NULL;
+	}
 	return sh;
 }
 
+/*
+ * Stripes touched by a plugged submitter are only released once the
+ * plug is flushed.  By then sequential writes have usually covered
+ * whole stripes, so none of them is handled half written and falls
+ * back to read-modify-write.  Adjacent full stripe writes are chained
+ * into batches on the way out, see stripe_leave_batch().
+ */
+struct raid5_plug_cb {
+	struct blk_plug_cb	cb;
+	struct mddev		*mddev;
+	struct list_head	list;
+	struct list_head	temp_inactive_list[NR_STRIPE_HASH_LOCKS];
+};
+
+static int cmp_stripe(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct stripe_head *sa = list_entry(a, struct stripe_head, lru);
+	struct stripe_head *sb = list_entry(b, struct stripe_head, lru);
+
+	if (sa->sector != sb->sector)
+		return sa->sector < sb->sector ? -1 : 1;
+	return 0;
+}
+
+/* Can @sh head or join a batch?  device_lock is held. */
+static int stripe_can_batch(struct r5conf *conf, struct stripe_head *sh)
+{
+	int i;
+
+	if (!test_bit(STRIPE_BATCH_READY, &sh->state) || sh->batch_head ||
+	    conf->reshape_progress != MaxSector)
+		return 0;
+
+	for (i = sh->disks; i--; ) {
+		struct r5dev *dev = &sh->dev[i];
+
+		if (dev->toread)
+			return 0;
+		if (i == sh->pd_idx || i == sh->qd_idx)
+			continue;
+		if (!dev->towrite || !test_bit(R5_OVERWRITE, &dev->flags))
+			return 0;
+	}
+	return 1;
+}
+
+static void raid5_unplug(struct blk_plug_cb *blk_cb)
+{
+	struct raid5_plug_cb *cb = container_of(blk_cb, struct raid5_plug_cb,
+						cb);
+	struct r5conf *conf = cb->mddev->private;
+	struct stripe_head *sh, *head = NULL, *last = NULL;
+
+	list_sort(NULL, &cb->list, cmp_stripe);
+
+	spin_lock_irq(&conf->device_lock);
+	while (!list_empty(&cb->list)) {
+		sh = list_first_entry(&cb->list, struct stripe_head, lru);
+		list_del_init(&sh->lru);
+		/*
+		 * Clear the bit only once ->lru is free again, another
+		 * submitter may want to put the stripe on its own list.
+		 */
+		smp_mb__before_clear_bit();
+		clear_bit(STRIPE_ON_UNPLUG_LIST, &sh->state);
+
+		if (!stripe_can_batch(conf, sh))
+			head = NULL;
+		else if (head && sh->generation == head->generation &&
+			 sh->sector == last->sector + STRIPE_SECTORS) {
+			/* the batch keeps a reference until its head runs */
+			atomic_inc(&sh->count);
+			sh->batch_head = head;
+			list_add_tail(&sh->batch_list, &head->batch_list);
+			atomic_long_inc(&conf->batched_stripes);
+		} else
+			head = sh;
+		last = sh;
+
+		__release_stripe(conf, sh,
+				 &cb->temp_inactive_list[sh->hash_lock_index]);
+	}
+	spin_unlock_irq(&conf->device_lock);
+
+	release_inactive_stripe_list(conf, cb->temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+	kfree(cb);
+}
+
+static void release_stripe_plug(struct mddev *mddev, struct stripe_head *sh)
+{
+	struct blk_plug *plug = current->plug;
+	struct blk_plug_cb *blk_cb;
+	struct raid5_plug_cb *cb = NULL;
+	int i;
+
+	if (!plug) {
+		release_stripe(sh);
+		return;
+	}
+
+	list_for_each_entry(blk_cb, &plug->cb_list, list) {
+		if (blk_cb->callback != raid5_unplug)
+			continue;
+		cb = container_of(blk_cb, struct raid5_plug_cb, cb);
+		if (cb->mddev == mddev)
+			break;
+		cb = NULL;
+	}
+
+	if (!cb) {
+		cb = kmalloc(sizeof(*cb), GFP_ATOMIC);
+		if (!cb) {
+			release_stripe(sh);
+			return;
+		}
+		cb->mddev = mddev;
+		cb->cb.callback = raid5_unplug;
+		INIT_LIST_HEAD(&cb->list);
+		for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
+			INIT_LIST_HEAD(cb->temp_inactive_list + i);
+		list_add(&cb->cb.list, &plug->cb_list);
+	} else if (&cb->cb.list != plug->cb_list.next) {
+		/*
+		 * Stay ahead of the md plugger, which kicks raid5d:
+		 * callbacks run from the head of the list, and
+		 * mddev_check_plugged() moves the plugger there on every
+		 * request.
+		 */
+		list_move(&cb->cb.list, &plug->cb_list);
+	}
+
+	if (!test_and_set_bit(STRIPE_ON_UNPLUG_LIST, &sh->state))
+		list_add_tail(&sh->lru, &cb->list);
+	else
+		release_stripe(sh);
+}
+
 static void make_request(struct mddev *mddev, struct bio * bi)
 {
 	struct r5conf *conf = mddev->private;
@@ -4052,7 +4421,7 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 			if ((bi->bi_rw & REQ_SYNC) &&
 			    !test_and_set_bit(STRIPE_PREREAD_ACTIVE, &sh->state))
 				atomic_inc(&conf->preread_active_stripes);
-			release_stripe(sh);
+			release_stripe_plug(mddev, sh);
 		} else {
 			/* cannot get stripe for read-ahead, just give-up */
 			clear_bit(BIO_UPTODATE, &bi->bi_flags);
@@ -4446,6 +4815,82 @@ static int  retry_aligned_read(struct r5conf *conf, struct bio *raid_bio)
 }
 
 
+/*
+ * Take up to MAX_STRIPE_BATCH stripes off the handle lists and handle
+ * them with device_lock dropped.  Called and returns with device_lock
+ * held, returns the number of stripes handled.
+ */
+static int handle_active_stripes(struct r5conf *conf, int group,
+				 struct list_head *temp_inactive_list)
+{
+	struct stripe_head *batch[MAX_STRIPE_BATCH], *sh;
+	int i, batch_size = 0;
+
+	while (batch_size < MAX_STRIPE_BATCH &&
+	       (sh = __get_priority_stripe(conf, group)) != NULL)
+		batch[batch_size++] = sh;
+
+	if (batch_size == 0)
+		return batch_size;
+	spin_unlock_irq(&conf->device_lock);
+
+	release_inactive_stripe_list(conf, temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+
+	for (i = 0; i < batch_size; i++)
+		handle_stripe(batch[i]);
+
+	cond_resched();
+
+	spin_lock_irq(&conf->device_lock);
+	for (i = 0; i < batch_size; i++)
+		__release_stripe(conf, batch[i],
+				 &temp_inactive_list[batch[i]->hash_lock_index]);
+	return batch_size;
+}
+
+static void raid5_do_work(struct work_struct *work)
+{
+	struct r5worker *worker = container_of(work, struct r5worker, work);
+	struct r5worker_group *group = worker->group;
+	struct r5conf *conf = group->conf;
+	int group_id;
+	int handled;
+	struct blk_plug plug;
+
+	pr_debug("+++ raid5worker active\n");
+
+	blk_start_plug(&plug);
+	handled = 0;
+	spin_lock_irq(&conf->device_lock);
+	/* group_thread_cnt may have been changed since we were queued */
+	if (group >= conf->worker_groups &&
+	    group < conf->worker_groups + conf->group_cnt)
+		group_id = group - conf->worker_groups;
+	else
+		group_id = ANY_GROUP;
+	while (1) {
+		int batch_size;
+
+		batch_size = handle_active_stripes(conf, group_id,
+						   worker->temp_inactive_list);
+		worker->working = false;
+		if (!batch_size)
+			break;
+		handled += batch_size;
+	}
+	pr_debug("%d stripes handled\n", handled);
+
+	spin_unlock_irq(&conf->device_lock);
+	release_inactive_stripe_list(conf, worker->temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+
+	async_tx_issue_pending_all();
+	blk_finish_plug(&plug);
+
+	pr_debug("--- raid5worker inactive\n");
+}
+
 /*
  * This is our raid5 kernel thread.
  *
@@ -4455,7 +4900,6 @@ static int  retry_aligned_read(struct r5conf *conf, struct bio *raid_bio)
  */
 static void raid5d(struct mddev *mddev)
 {
-	struct stripe_head *sh;
 	struct r5conf *conf = mddev->private;
 	int handled;
 	struct blk_plug plug;
@@ -4469,6 +4913,7 @@ static void raid5d(struct mddev *mddev)
 	spin_lock_irq(&conf->device_lock);
 	while (1) {
 		struct bio *bio;
+		int batch_size;
 
 		if (atomic_read(&mddev->plug_cnt) == 0 &&
 		    !list_empty(&conf->bitmap_list)) {
@@ -4478,7 +4923,7 @@ static void raid5d(struct mddev *mddev)
 			bitmap_unplug(mddev->bitmap);
 			spin_lock_irq(&conf->device_lock);
 			conf->seq_write = conf->seq_flush;
-			activate_bit_delay(conf);
+			activate_bit_delay(conf, conf->temp_inactive_list);
 		}
 		if (atomic_read(&mddev->plug_cnt) == 0)
 			raid5_activate_delayed(conf);
@@ -4493,25 +4938,23 @@ static void raid5d(struct mddev *mddev)
 			handled++;
 		}
 
-		sh = __get_priority_stripe(conf);
-
-		if (!sh)
+		batch_size = handle_active_stripes(conf, ANY_GROUP,
+						   conf->temp_inactive_list);
+		if (!batch_size)
 			break;
-		spin_unlock_irq(&conf->device_lock);
-		
-		handled++;
-		handle_stripe(sh);
-		release_stripe(sh);
-		cond_resched();
+		handled += batch_size;
 
-		if (mddev->flags & ~(1<<MD_CHANGE_PENDING))
+		if (mddev->flags & ~(1<<MD_CHANGE_PENDING)) {
+			spin_unlock_irq(&conf->device_lock);
 			md_check_recovery(mddev);
-
-		spin_lock_irq(&conf->device_lock);
+			spin_lock_irq(&conf->device_lock);
+		}
 	}
 	pr_debug("%d stripes handled\n", handled);
 
 	spin_unlock_irq(&conf->device_lock);
+	release_inactive_stripe_list(conf, conf->temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
 
 	async_tx_issue_pending_all();
 	blk_finish_plug(&plug);
@@ -4537,8 +4980,11 @@ raid5_set_cache_size(struct mddev *mddev, int size)
 
 	if (size <= 16 || size > 32768)
 		return -EINVAL;
+	/* keep the inactive lists balanced, see grow_stripes() */
 	while (size < conf->max_nr_stripes) {
-		if (drop_one_stripe(conf))
+		int hash = (conf->max_nr_stripes - 1) % NR_STRIPE_HASH_LOCKS;
+
+		if (drop_one_stripe(conf, hash))
 			conf->max_nr_stripes--;
 		else
 			break;
@@ -4547,7 +4993,9 @@ raid5_set_cache_size(struct mddev *mddev, int size)
 	if (err)
 		return err;
 	while (size > conf->max_nr_stripes) {
-		if (grow_one_stripe(conf))
+		int hash = conf->max_nr_stripes % NR_STRIPE_HASH_LOCKS;
+
+		if (grow_one_stripe(conf, hash))
 			conf->max_nr_stripes++;
 		else break;
 	}
@@ -4627,10 +5075,155 @@ stripe_cache_active_show(struct mddev *mddev, char *page)
 static struct md_sysfs_entry
 raid5_stripecache_active = __ATTR_RO(stripe_cache_active);
 
+#define RAID5_COUNTER_ATTR(_name)					\
+static ssize_t								\
+_name##_show(struct mddev *mddev, char *page)				\
+{									\
+	struct r5conf *conf = mddev->private;				\
+	if (conf)							\
+		return sprintf(page, "%ld\n",				\
+			       atomic_long_read(&conf->_name));		\
+	else								\
+		return 0;						\
+}									\
+static struct md_sysfs_entry						\
+raid5_##_name = __ATTR_RO(_name)
+
+RAID5_COUNTER_ATTR(rmw_writes);
+RAID5_COUNTER_ATTR(rcw_writes);
+RAID5_COUNTER_ATTR(full_stripe_writes);
+RAID5_COUNTER_ATTR(batched_stripes);
+
+static int alloc_thread_groups(struct r5conf *conf, int cnt,
+			       struct r5worker_group **worker_groups)
+{
+	struct r5worker_group *groups;
+	struct r5worker *workers;
+	int i, j, k;
+
+	*worker_groups = NULL;
+	if (cnt == 0)
+		return 0;
+
+	workers = kzalloc(nr_node_ids * cnt * sizeof(struct r5worker),
+			  GFP_NOIO);
+	groups = kzalloc(nr_node_ids * sizeof(struct r5worker_group),
+			 GFP_NOIO);
+	if (!workers || !groups) {
+		kfree(workers);
+		kfree(groups);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_node_ids; i++) {
+		struct r5worker_group *group = groups + i;
+
+		INIT_LIST_HEAD(&group->handle_list);
+		group->conf = conf;
+		group->workers = workers + i * cnt;
+
+		for (j = 0; j < cnt; j++) {
+			struct r5worker *worker = group->workers + j;
+
+			worker->group = group;
+			INIT_WORK(&worker->work, raid5_do_work);
+			for (k = 0; k < NR_STRIPE_HASH_LOCKS; k++)
+				INIT_LIST_HEAD(worker->temp_inactive_list + k);
+		}
+	}
+	*worker_groups = groups;
+	return 0;
+}
+
+static void free_thread_groups(struct r5worker_group *groups)
+{
+	if (!groups)
+		return;
+	flush_workqueue(raid5_wq);
+	kfree(groups[0].workers);
+	kfree(groups);
+}
+
+static ssize_t
+raid5_show_group_thread_cnt(struct mddev *mddev, char *page)
+{
+	struct r5conf *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->worker_cnt_per_group);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_group_thread_cnt(struct mddev *mddev, const char *page, size_t len)
+{
+	struct r5conf *conf = mddev->private;
+	struct r5worker_group *new_groups, *old_groups;
+	struct stripe_head *sh, *next;
+	unsigned long new;
+	int i, err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > nr_cpu_ids)
+		return -EINVAL;
+	if (new == conf->worker_cnt_per_group)
+		return len;
+
+	err = alloc_thread_groups(conf, new, &new_groups);
+	if (err)
+		return err;
+
+	mddev_suspend(mddev);
+
+	/*
+	 * The array is quiesced so the group handle_lists are normally
+	 * empty, but a reshape keeps going; move whatever is queued over.
+	 */
+	spin_lock_irq(&conf->device_lock);
+	old_groups = conf->worker_groups;
+	conf->worker_groups = new_groups;
+	conf->group_cnt = new ? nr_node_ids : 0;
+	conf->worker_cnt_per_group = new;
+	for (i = 0; old_groups && i < nr_node_ids; i++) {
+		list_for_each_entry_safe(sh, next, &old_groups[i].handle_list,
+					 lru) {
+			list_del_init(&sh->lru);
+			sh->group = NULL;
+			if (new)
+				raid5_wakeup_stripe_thread(sh);
+			else
+				list_add_tail(&sh->lru, &conf->handle_list);
+		}
+	}
+	spin_unlock_irq(&conf->device_lock);
+	md_wakeup_thread(mddev->thread);
+
+	free_thread_groups(old_groups);
+
+	mddev_resume(mddev);
+	return len;
+}
+
+static struct md_sysfs_entry
+raid5_group_thread_cnt = __ATTR(group_thread_cnt, S_IRUGO | S_IWUSR,
+				raid5_show_group_thread_cnt,
+				raid5_store_group_thread_cnt);
+
 static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
 	&raid5_preread_bypass_threshold.attr,
+	&raid5_group_thread_cnt.attr,
+	&raid5_rmw_writes.attr,
+	&raid5_rcw_writes.attr,
+	&raid5_full_stripe_writes.attr,
+	&raid5_batched_stripes.attr,
 	NULL,
 };
 static struct attribute_group raid5_attrs_group = {
@@ -4678,6 +5271,7 @@ static void raid5_free_percpu(struct r5conf *conf)
 
 static void free_conf(struct r5conf *conf)
 {
+	free_thread_groups(conf->worker_groups);
 	shrink_stripes(conf);
 	raid5_free_percpu(conf);
 	kfree(conf->disks);
@@ -4772,6 +5366,7 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	int raid_disk, memory, max_disks;
 	struct md_rdev *rdev;
 	struct disk_info *disk;
+	int i;
 
 	if (mddev->new_level != 5
 	    && mddev->new_level != 4
@@ -4812,7 +5407,11 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	INIT_LIST_HEAD(&conf->hold_list);
 	INIT_LIST_HEAD(&conf->delayed_list);
 	INIT_LIST_HEAD(&conf->bitmap_list);
-	INIT_LIST_HEAD(&conf->inactive_list);
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++) {
+		spin_lock_init(conf->hash_locks + i);
+		INIT_LIST_HEAD(conf->inactive_list + i);
+		INIT_LIST_HEAD(conf->temp_inactive_list + i);
+	}
 	atomic_set(&conf->active_stripes, 0);
 	atomic_set(&conf->preread_active_stripes, 0);
 	atomic_set(&conf->active_aligned_reads, 0);
@@ -5674,11 +6273,14 @@ static void raid5_quiesce(struct mddev *mddev, int state)
 		break;
 
 	case 1: /* stop all writes */
-		spin_lock_irq(&conf->device_lock);
 		/* '2' tells resync/reshape to pause so that all
-		 * active stripes can drain
+		 * active stripes can drain.  Every hash_lock is taken
+		 * so that no get_active_stripe() is half way through.
 		 */
+		lock_all_device_hash_locks_irq(conf);
 		conf->quiesce = 2;
+		unlock_all_device_hash_locks_irq(conf);
+		spin_lock_irq(&conf->device_lock);
 		wait_event_lock_irq(conf->wait_for_stripe,
 				    atomic_read(&conf->active_stripes) == 0 &&
 				    atomic_read(&conf->active_aligned_reads) == 0,
@@ -6007,6 +6609,10 @@ static struct md_personality raid4_personality =
 
 static int __init raid5_init(void)
 {
+	raid5_wq = alloc_workqueue("raid5wq",
+		WQ_UNBOUND|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 0);
+	if (!raid5_wq)
+		return -ENOMEM;
 	register_md_personality(&raid6_personality);
 	register_md_personality(&raid5_personality);
 	register_md_personality(&raid4_personality);
@@ -6018,6 +6624,7 @@ static void raid5_exit(void)
 	unregister_md_personality(&raid6_personality);
 	unregister_md_personality(&raid5_personality);
 	unregister_md_personality(&raid4_personality);
+	destroy_workqueue(raid5_wq);
 }
 
 module_init(raid5_init);
@@ -198,6 +198,16 @@ struct stripe_head {
 	struct hlist_node	hash;
 	struct list_head	lru;	      /* inactive_list or handle_list */
 	struct r5conf		*raid_conf;
+	struct r5worker_group	*group;		/* handle_list we are queued on,
+						 * NULL for conf->handle_list */
+	int			cpu;		/* cpu that activated the stripe */
+	int			hash_lock_index;
+	/* Adjacent full stripe writes are chained behind the first of
+	 * them, the batch head, and handled right after it.  Both fields
+	 * are protected by device_lock.
+	 */
+	struct stripe_head	*batch_head;	/* NULL unless a batch member */
+	struct list_head	batch_list;	/* head: members, member: link */
 	short			generation;	/* increments with every
 						 * reshape */
 	sector_t		sector;		/* sector of this row */
@@ -318,6 +328,8 @@ enum {
 	STRIPE_BIOFILL_RUN,
 	STRIPE_COMPUTE_RUN,
 	STRIPE_OPS_REQ_PENDING,
+	STRIPE_BATCH_READY,	/* not handled yet, may head or join a batch */
+	STRIPE_ON_UNPLUG_LIST,	/* release deferred until the plug is flushed */
 };
 
 /*
@@ -360,6 +372,34 @@ struct disk_info {
 	struct md_rdev	*rdev, *replacement;
 };
 
+/*
+ * The stripe cache is split in NR_STRIPE_HASH_LOCKS independently locked
+ * parts, each with its own inactive list, so that looking up and
+ * allocating stripes does not need conf->device_lock.
+ * Lock ordering: hash_locks[i] before device_lock.
+ */
+#define NR_STRIPE_HASH_LOCKS	8
+#define STRIPE_HASH_LOCKS_MASK	(NR_STRIPE_HASH_LOCKS - 1)
+
+/*
+ * Stripe handling can be spread over worker threads.  Workers are grouped
+ * per NUMA node; a stripe is queued to the group of the cpu that activated
+ * it, so the parity work stays close to the data.
+ */
+struct r5worker {
+	struct work_struct	work;
+	struct r5worker_group	*group;
+	struct list_head	temp_inactive_list[NR_STRIPE_HASH_LOCKS];
+	bool			working;
+};
+
+struct r5worker_group {
+	struct list_head	handle_list;
+	struct r5conf		*conf;
+	struct r5worker		*workers;
+	int			stripes_cnt;
+};
+
 struct r5conf {
 	struct hlist_head	*stripe_hashtbl;
 	struct mddev		*mddev;
@@ -399,6 +439,12 @@ struct r5conf {
 	int			bypass_threshold; /* preread nice */
 	struct list_head	*last_hold; /* detect hold_list promotions */
 
+	/* how writes have been turned into parity updates */
+	atomic_long_t		rmw_writes;	/* read-modify-write */
+	atomic_long_t		rcw_writes;	/* reconstruct-write */
+	atomic_long_t		full_stripe_writes; /* nothing to read */
+	atomic_long_t		batched_stripes; /* joined a batch */
+
 	atomic_t		reshape_stripes; /* stripes with pending writes for reshape */
 	/* unfortunately we need two cache names as we temporarily have
 	 * two caches.
@@ -435,7 +481,7 @@ struct r5conf {
 	 * Free stripes pool
 	 */
 	atomic_t		active_stripes;
-	struct list_head	inactive_list;
+	struct list_head	inactive_list[NR_STRIPE_HASH_LOCKS];
 	wait_queue_head_t	wait_for_stripe;
 	wait_queue_head_t	wait_for_overlap;
 	int			inactive_blocked;	/* release of inactive stripes blocked,
@@ -443,8 +489,15 @@ struct r5conf {
 							 */
 	int			pool_size; /* number of disks in stripeheads in pool */
 	spinlock_t		device_lock;
+	spinlock_t		hash_locks[NR_STRIPE_HASH_LOCKS];
+	/* stripes released by raid5d, waiting for their hash_lock */
+	struct list_head	temp_inactive_list[NR_STRIPE_HASH_LOCKS];
 	struct disk_info	*disks;
 
+	struct r5worker_group	*worker_groups;
+	int			group_cnt;
+	int			worker_cnt_per_group;
+
 	/* When taking over an array from a different personality, we store
 	 * the new thread here until we fully activate the array.
 	 */
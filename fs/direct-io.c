@@ -130,6 +130,7 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct request_queue *bio_queue; /* queue of the last bio, to poll */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -423,6 +424,8 @@ static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 	if (dio->is_async && dio->rw == READ)
 		bio_set_pages_dirty(bio);
 
+	dio->bio_queue = bdev_get_queue(bio->bi_bdev);
+
 	if (sdio->submit_io)
 		sdio->submit_io(dio->rw, bio, dio->inode,
 			       sdio->logical_offset_in_bio);
@@ -443,6 +446,13 @@ static inline void dio_cleanup(struct dio *dio, struct dio_submit *sdio)
 		page_cache_release(dio_get_page(dio, sdio));
 }
 
+static bool dio_bio_done(void *data)
+{
+	struct dio *dio = data;
+
+	return dio->refcount == 1 || dio->bio_list != NULL;
+}
+
 /*
  * Wait for the next BIO to complete.  Remove it and return it.  NULL is
  * returned once all BIOs have been completed.  This must only be called once
@@ -466,7 +476,9 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio->bio_queue ||
+		    !blk_poll(dio->bio_queue, dio_bio_done, dio))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
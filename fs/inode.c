@@ -542,6 +542,12 @@ static void evict(struct inode *inode)
 
 	inode_sb_list_del(inode);
 
+	/*
+	 * Reclaim must not leave shadow entries behind from now on, as
+	 * nothing would be left to remove them.
+	 */
+	mapping_set_exiting(&inode->i_data);
+
 	if (op->evict_inode) {
 		op->evict_inode(inode);
 	} else {
@@ -549,6 +555,9 @@ static void evict(struct inode *inode)
 			truncate_inode_pages(&inode->i_data, 0);
 		end_writeback(inode);
 	}
+	/* Not every ->evict_inode truncates a mapping without pages */
+	if (inode->i_data.nrshadows)
+		truncate_inode_pages(&inode->i_data, 0);
 	if (S_ISBLK(inode->i_mode) && inode->i_bdev)
 		bd_forget(inode);
 	if (S_ISCHR(inode->i_mode) && inode->i_cdev)
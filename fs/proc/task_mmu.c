@@ -63,6 +63,16 @@ void task_mem(struct seq_file *m, struct mm_struct *mm)
 		mm->stack_vm << (PAGE_SHIFT-10), text, lib,
 		(PTRS_PER_PTE*sizeof(pte_t)*mm->nr_ptes) >> 10,
 		swap << (PAGE_SHIFT-10));
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	seq_printf(m,
+		"THPCollapse:\t%lu attempted, %lu collapsed\n"
+		"THPCollapseFailed:\t%lu alloc, %lu charge, %lu vma, %lu busy\n",
+		mm->thp_collapse.attempts, mm->thp_collapse.collapsed,
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_ALLOC],
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_CHARGE],
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_VMA],
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_ISOLATE]);
+#endif
 }
 
 unsigned long task_vsize(struct mm_struct *mm)
@@ -404,10 +414,14 @@ static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 			spin_unlock(&walk->mm->page_table_lock);
 			wait_split_huge_page(vma->anon_vma, pmd);
 		} else {
+			/* tmpfs pages mapped by a huge pmd are not AnonHuge */
+			int anon = PageAnon(pmd_page(*pmd));
+
 			smaps_pte_entry(*(pte_t *)pmd, addr,
 					HPAGE_PMD_SIZE, walk);
 			spin_unlock(&walk->mm->page_table_lock);
-			mss->anonymous_thp += HPAGE_PMD_SIZE;
+			if (anon)
+				mss->anonymous_thp += HPAGE_PMD_SIZE;
 			return 0;
 		}
 	} else {
@@ -513,7 +527,7 @@ static int clear_refs_pte_range(pmd_t *pmd, unsigned long addr,
 	spinlock_t *ptl;
 	struct page *page;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(vma, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 
@@ -678,7 +692,7 @@ static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	pte_t *pte;
 	int err = 0;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd_mm(walk->mm, addr, pmd);
 	if (pmd_trans_unstable(pmd))
 		return 0;
 
@@ -0,0 +1,135 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+struct blk_mq_ctx;
+
+/*
+ * Hardware dispatch queue.  Requests submitted on the CPUs mapped to
+ * a hardware queue are staged on the per-CPU software queues (struct
+ * blk_mq_ctx) and moved from there to the driver by the hardware
+ * queue, without ever taking q->queue_lock.
+ */
+struct blk_mq_hw_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	dispatch;
+	} ____cacheline_aligned_in_smp;
+
+	unsigned long		state;		/* BLK_MQ_S_* flags */
+	unsigned int		flags;		/* BLK_MQ_F_* flags */
+	struct delayed_work	run_work;
+	cpumask_var_t		cpumask;
+
+	struct request_queue	*queue;
+	void			*driver_data;
+
+	/* software queues mapped to this hardware queue */
+	unsigned int		nr_ctx;
+	struct blk_mq_ctx	**ctxs;
+	unsigned long		*ctx_map;	/* software queues with work */
+
+	/* preallocated requests, indexed by tag */
+	unsigned int		queue_depth;
+	struct request		**rqs;
+	unsigned long		*tag_map;
+	wait_queue_head_t	tag_wait;
+
+	unsigned int		queue_num;
+	int			numa_node;
+
+	/* statistics, not serialized */
+	unsigned long		run;
+	unsigned long		queued;
+	unsigned long		busy;
+};
+
+struct blk_mq_ops;
+
+/*
+ * Registration data passed by drivers to blk_mq_init_queue().
+ */
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;	/* per hardware queue */
+	unsigned int		cmd_size;	/* per-request driver data */
+	int			numa_node;
+	unsigned int		flags;		/* BLK_MQ_F_* flags */
+};
+
+typedef int (queue_rq_fn)(struct blk_mq_hw_ctx *, struct request *);
+typedef struct blk_mq_hw_ctx *(map_queue_fn)(struct request_queue *,
+					     const int);
+typedef int (init_hctx_fn)(struct blk_mq_hw_ctx *, void *, unsigned int);
+typedef void (exit_hctx_fn)(struct blk_mq_hw_ctx *, unsigned int);
+
+struct blk_mq_ops {
+	/*
+	 * Queue a request to the hardware; must return one of the
+	 * BLK_MQ_RQ_QUEUE_* values.  Called without q->queue_lock, and
+	 * never concurrently for the same hardware queue.
+	 */
+	queue_rq_fn		*queue_rq;
+
+	/*
+	 * Map a CPU to a hardware queue, blk_mq_map_queue() is the
+	 * default spreading CPUs evenly over the hardware queues.
+	 */
+	map_queue_fn		*map_queue;
+
+	/* Optional hooks called when hardware queues are set up/torn down */
+	init_hctx_fn		*init_hctx;
+	exit_hctx_fn		*exit_hctx;
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_F_SHOULD_MERGE	= 1 << 0,	/* try plug merging */
+
+	BLK_MQ_S_STOPPED	= 0,
+	BLK_MQ_S_RUNNING	= 1,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data);
+void blk_mq_free_queue(struct request_queue *q);
+void blk_mq_drain_queue(struct request_queue *q);
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu);
+
+void blk_mq_end_io(struct request *rq, int error);
+void blk_mq_free_request(struct request *rq);
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async);
+void blk_mq_run_queues(struct request_queue *q, bool async);
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_stopped_hw_queues(struct request_queue *q);
+
+void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule);
+
+/*
+ * Driver command data is allocated right after the request.
+ */
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *)rq + sizeof(*rq);
+}
+
+static inline struct request *blk_mq_rq_from_pdu(void *pdu)
+{
+	return pdu - sizeof(struct request);
+}
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+#endif
@@ -29,6 +29,17 @@ extern int move_huge_pmd(struct vm_area_struct *vma,
 			 pmd_t *old_pmd, pmd_t *new_pmd);
 extern int change_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
 			unsigned long addr, pgprot_t newprot);
+extern int do_huge_pmd_file_page(struct mm_struct *mm,
+				 struct vm_area_struct *vma,
+				 unsigned long haddr, pmd_t *pmd,
+				 struct page *page);
+extern pmd_t *page_check_address_file_pmd(struct page *page,
+					  struct mm_struct *mm,
+					  unsigned long address);
+extern void split_file_pmd_page(struct page *page,
+				struct vm_area_struct *vma,
+				unsigned long address);
+extern void split_huge_file_vma(struct vm_area_struct *vma);
 
 enum transparent_hugepage_flag {
 	TRANSPARENT_HUGEPAGE_FLAG,
@@ -64,6 +75,13 @@ extern pmd_t *page_check_address_pmd(struct page *page,
 	   ((__vma)->vm_flags & VM_HUGEPAGE))) &&			\
 	 !((__vma)->vm_flags & VM_NOHUGEPAGE) &&			\
 	 !is_vma_temporary_stack(__vma))
+/*
+ * The vma's ->pmd_fault may map its file pages with huge pmds, as
+ * HPAGE_PMD_NR separate small pages.
+ */
+#define transparent_hugepage_file(__vma)				\
+	((__vma)->vm_ops && (__vma)->vm_ops->pmd_fault &&		\
+	 !((__vma)->vm_flags & VM_HUGETLB))
 #define transparent_hugepage_defrag(__vma)				\
 	((transparent_hugepage_flags &					\
 	  (1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)) ||			\
@@ -87,13 +105,17 @@ extern int handle_pte_fault(struct mm_struct *mm,
 			    struct vm_area_struct *vma, unsigned long address,
 			    pte_t *pte, pmd_t *pmd, unsigned int flags);
 extern int split_huge_page(struct page *page);
-extern void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd);
-#define split_huge_page_pmd(__mm, __pmd)				\
+extern void __split_huge_page_pmd(struct vm_area_struct *vma,
+				  unsigned long address, pmd_t *pmd);
+#define split_huge_page_pmd(__vma, __address, __pmd)			\
 	do {								\
 		pmd_t *____pmd = (__pmd);				\
 		if (unlikely(pmd_trans_huge(*____pmd)))			\
-			__split_huge_page_pmd(__mm, ____pmd);		\
+			__split_huge_page_pmd(__vma, __address,		\
+					      ____pmd);			\
 	}  while (0)
+extern void split_huge_page_pmd_mm(struct mm_struct *mm,
+				   unsigned long address, pmd_t *pmd);
 #define wait_split_huge_page(__anon_vma, __pmd)				\
 	do {								\
 		pmd_t *____pmd = (__pmd);				\
@@ -118,7 +140,8 @@ static inline void vma_adjust_trans_huge(struct vm_area_struct *vma,
 					 unsigned long end,
 					 long adjust_next)
 {
-	if (!vma->anon_vma || vma->vm_ops)
+	if ((!vma->anon_vma || vma->vm_ops) &&
+	    !transparent_hugepage_file(vma))
 		return;
 	__vma_adjust_trans_huge(vma, start, end, adjust_next);
 }
@@ -153,13 +176,16 @@ static inline struct page *compound_trans_head(struct page *page)
 #define hpage_nr_pages(x) 1
 
 #define transparent_hugepage_enabled(__vma) 0
+#define transparent_hugepage_file(__vma) 0
 
 #define transparent_hugepage_flags 0UL
 static inline int split_huge_page(struct page *page)
 {
 	return 0;
 }
-#define split_huge_page_pmd(__mm, __pmd)	\
+#define split_huge_page_pmd(__vma, __address, __pmd)	\
+	do { } while (0)
+#define split_huge_page_pmd_mm(__mm, __address, __pmd)	\
 	do { } while (0)
 #define wait_split_huge_page(__anon_vma, __pmd)	\
 	do { } while (0)
@@ -254,6 +254,10 @@ struct vm_area_struct {
 #ifdef CONFIG_NUMA
 	struct mempolicy *vm_policy;	/* NUMA policy for the VMA */
 #endif
+#ifdef CONFIG_SWAP
+	atomic_long_t swap_readahead_info;	/* last swapin fault, window
+						   and hits: see swap_state.c */
+#endif
 };
 
 struct core_thread {
@@ -261,6 +265,24 @@ struct core_thread {
 	struct core_thread *next;
 };
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/* Why khugepaged failed to collapse a hugepage */
+enum {
+	THP_COLLAPSE_FAIL_ALLOC,	/* no hugepage to collapse into */
+	THP_COLLAPSE_FAIL_CHARGE,	/* over the memcg limit */
+	THP_COLLAPSE_FAIL_VMA,		/* mapping changed while unlocked */
+	THP_COLLAPSE_FAIL_ISOLATE,	/* a small page was busy */
+	NR_THP_COLLAPSE_FAIL
+};
+
+/* Per-mm khugepaged collapse counters, shown in /proc/pid/status */
+struct thp_collapse_stats {
+	unsigned long attempts;
+	unsigned long collapsed;
+	unsigned long failed[NR_THP_COLLAPSE_FAIL];
+};
+#endif
+
 struct core_state {
 	atomic_t nr_threads;
 	struct core_thread dumper;
@@ -386,6 +408,7 @@ struct mm_struct {
 #endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	pgtable_t pmd_huge_pte; /* protected by page_table_lock */
+	struct thp_collapse_stats thp_collapse;
 #endif
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	struct cpumask cpumask_allocation;
@@ -107,6 +107,9 @@ enum zone_stat_item {
 	NR_SHMEM,		/* shmem pages (included tmpfs/GEM pages) */
 	NR_DIRTIED,		/* page dirtyings since bootup */
 	NR_WRITTEN,		/* page writings since bootup */
+	NR_SHADOW_ENTRIES,	/* evicted pages remembered in page cache */
+	WORKINGSET_REFAULT,	/* faults on remembered pages */
+	WORKINGSET_ACTIVATE,	/* refaults activated on their distance */
 #ifdef CONFIG_NUMA
 	NUMA_HIT,		/* allocated in intended node */
 	NUMA_MISS,		/* allocated in non intended node */
@@ -194,13 +197,21 @@ enum zone_watermarks {
 #define low_wmark_pages(z) (z->watermark[WMARK_LOW])
 #define high_wmark_pages(z) (z->watermark[WMARK_HIGH])
 
+/*
+ * The pcp lists hold pages up to PAGE_ALLOC_COSTLY_ORDER, one list per
+ * order and migrate type; vm.percpu_pagelist_high_order limits the
+ * orders actually used.
+ */
+#define NR_PCP_ORDERS		(PAGE_ALLOC_COSTLY_ORDER + 1)
+#define NR_PCP_LISTS		(MIGRATE_PCPTYPES * NR_PCP_ORDERS)
+
 struct per_cpu_pages {
-	int count;		/* number of pages in the list */
+	int count;		/* number of base pages in the lists */
 	int high;		/* high watermark, emptying needed */
 	int batch;		/* chunk size for buddy add/remove */
 
-	/* Lists of pages, one per migrate type stored on the pcp-lists */
-	struct list_head lists[MIGRATE_PCPTYPES];
+	/* Lists of pages, one per order and migrate type */
+	struct list_head lists[NR_PCP_LISTS];
 };
 
 struct per_cpu_pageset {
@@ -349,6 +360,13 @@ struct zone {
 #endif
 	struct free_area	free_area[MAX_ORDER];
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* Free huge pages held back from free_area, see thp_cache_pages */
+	spinlock_t		thp_cache_lock;
+	struct list_head	thp_cache;
+	int			thp_cache_count;
+#endif
+
 #ifndef CONFIG_SPARSEMEM
 	/*
 	 * Flags for a pageblock_nr_pages block. See pageblock-flags.h.
@@ -387,6 +405,11 @@ struct zone {
 	 */
 	unsigned int inactive_ratio;
 
+	/* Evictions and activations, the clock of refault distances */
+	atomic_long_t		inactive_age;
+	/* WORKINGSET_ACTIVATE when reclaim last finished here */
+	unsigned long		refaults;
+
 
 	ZONE_PADDING(_pad2_)
 	/* Rarely used or read-mostly fields */
@@ -633,6 +656,10 @@ extern struct page *mem_map;
  * per-zone basis.
  */
 struct bootmem_data;
+
+/* Upper limit of vm.kswapd_threads, the number of kswapds per node */
+#define MAX_KSWAPD_THREADS	16
+
 typedef struct pglist_data {
 	struct zone node_zones[MAX_NR_ZONES];
 	struct zonelist node_zonelists[MAX_ZONELISTS];
@@ -662,8 +689,12 @@ typedef struct pglist_data {
 					     range, including holes */
 	int node_id;
 	wait_queue_head_t kswapd_wait;
-	struct task_struct *kswapd;
+	struct task_struct *kswapd[MAX_KSWAPD_THREADS];	/* vm.kswapd_threads */
 	int kswapd_max_order;
+#ifdef CONFIG_COMPACTION
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;
+#endif
 	enum zone_type classzone_idx;
 } pg_data_t;
 
@@ -802,6 +833,16 @@ int lowmem_reserve_ratio_sysctl_handler(struct ctl_table *, int,
 					void __user *, size_t *, loff_t *);
 int percpu_pagelist_fraction_sysctl_handler(struct ctl_table *, int,
 					void __user *, size_t *, loff_t *);
+extern int percpu_pagelist_high_order;
+int percpu_pagelist_high_order_sysctl_handler(struct ctl_table *, int,
+					void __user *, size_t *, loff_t *);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/* Upper limit of vm.thp_cache_pages: cached huge pages are not free */
+#define MAX_THP_CACHE_PAGES	64
+extern int thp_cache_pages;
+int thp_cache_pages_sysctl_handler(struct ctl_table *, int,
+					void __user *, size_t *, loff_t *);
+#endif
 int sysctl_min_unmapped_ratio_sysctl_handler(struct ctl_table *, int,
 			void __user *, size_t *, loff_t *);
 int sysctl_min_slab_ratio_sysctl_handler(struct ctl_table *, int,
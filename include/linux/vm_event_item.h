@@ -35,10 +35,17 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		PGINODESTEAL, SLABS_SCANNED, KSWAPD_STEAL, KSWAPD_INODESTEAL,
 		KSWAPD_LOW_WMARK_HIT_QUICKLY, KSWAPD_HIGH_WMARK_HIT_QUICKLY,
 		KSWAPD_SKIP_CONGESTION_WAIT,
-		PAGEOUTRUN, ALLOCSTALL, PGROTATED,
+		PAGEOUTRUN, ALLOCSTALL,
+		/* log2 histogram of direct reclaim stall times */
+		ALLOCSTALL_LT_1MS, ALLOCSTALL_LT_2MS, ALLOCSTALL_LT_4MS,
+		ALLOCSTALL_LT_8MS, ALLOCSTALL_LT_16MS, ALLOCSTALL_LT_32MS,
+		ALLOCSTALL_LT_64MS, ALLOCSTALL_LT_128MS, ALLOCSTALL_LT_256MS,
+		ALLOCSTALL_LT_512MS, ALLOCSTALL_LT_1024MS, ALLOCSTALL_GE_1024MS,
+		PGROTATED,
 #ifdef CONFIG_COMPACTION
 		COMPACTBLOCKS, COMPACTPAGES, COMPACTPAGEFAILED,
 		COMPACTSTALL, COMPACTFAIL, COMPACTSUCCESS,
+		COMPACTDIRECTPAGES, COMPACTPROACTIVEPAGES, KCOMPACTD_WAKE,
 #endif
 #ifdef CONFIG_HUGETLB_PAGE
 		HTLB_BUDDY_PGALLOC, HTLB_BUDDY_PGALLOC_FAIL,
@@ -57,6 +64,12 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		THP_COLLAPSE_ALLOC,
 		THP_COLLAPSE_ALLOC_FAILED,
 		THP_SPLIT,
+		THP_FILE_ALLOC,
+		THP_FILE_MAPPED,
+#endif
+#ifdef CONFIG_SWAP
+		SWAP_RA,
+		SWAP_RA_HIT,
 #endif
 		NR_VM_EVENT_ITEMS
 };
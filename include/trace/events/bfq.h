@@ -0,0 +1,226 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bfq
+
+#if !defined(_TRACE_BFQ_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BFQ_H
+
+#include <linux/blkdev.h>
+#include <linux/backing-dev.h>
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+#define BFQ_DEV_NAME_LEN	32
+
+/* Must be kept in sync with enum bfqq_expiration in block/bfq.h. */
+#define show_bfq_expire_reason(reason)					\
+	__print_symbolic(reason,					\
+		{ 0,	"too_idle"		},			\
+		{ 1,	"budget_timeout"	},			\
+		{ 2,	"budget_exhausted"	},			\
+		{ 3,	"no_more_requests"	},			\
+		{ 4,	"throttled"		})
+
+#define bfq_trace_dev_name(entry, q)					\
+	do {								\
+		struct device *__dev = (q)->backing_dev_info.dev;	\
+		strlcpy((entry)->name, __dev ? dev_name(__dev) : "?",	\
+			BFQ_DEV_NAME_LEN);				\
+	} while (0)
+
+/**
+ * bfq_queue_activate - a bfq_queue is put in service
+ * @q: request queue of the device
+ * @pid: pid of the process owning the queue
+ * @budget: budget assigned to the queue for this round of service
+ * @weight: current (possibly raised) weight of the queue
+ * @raising_coeff: current weight-raising coefficient of the queue
+ */
+TRACE_EVENT(bfq_queue_activate,
+
+	TP_PROTO(struct request_queue *q, pid_t pid, unsigned long budget,
+		 unsigned short weight, unsigned int raising_coeff),
+
+	TP_ARGS(q, pid, budget, weight, raising_coeff),
+
+	TP_STRUCT__entry(
+		__array(char,		name,	BFQ_DEV_NAME_LEN)
+		__field(pid_t,		pid)
+		__field(unsigned long,	budget)
+		__field(unsigned short,	weight)
+		__field(unsigned int,	raising_coeff)
+	),
+
+	TP_fast_assign(
+		bfq_trace_dev_name(__entry, q);
+		__entry->pid		= pid;
+		__entry->budget		= budget;
+		__entry->weight		= weight;
+		__entry->raising_coeff	= raising_coeff;
+	),
+
+	TP_printk("bdi %s: pid=%d budget=%lu weight=%u raising_coeff=%u",
+		  __entry->name, __entry->pid, __entry->budget,
+		  __entry->weight, __entry->raising_coeff)
+);
+
+/**
+ * bfq_queue_expire - the in-service bfq_queue is expired
+ * @q: request queue of the device
+ * @pid: pid of the process owning the queue
+ * @reason: expiration reason, one of enum bfqq_expiration
+ * @slow: whether the queue has been considered slow (i.e., seeky)
+ * @service: service received by the queue, in sectors
+ * @budget: budget the queue had been assigned
+ * @raising_coeff: weight-raising coefficient at expiration time
+ */
+TRACE_EVENT(bfq_queue_expire,
+
+	TP_PROTO(struct request_queue *q, pid_t pid, int reason, int slow,
+		 unsigned long service, unsigned long budget,
+		 unsigned int raising_coeff),
+
+	TP_ARGS(q, pid, reason, slow, service, budget, raising_coeff),
+
+	TP_STRUCT__entry(
+		__array(char,		name,	BFQ_DEV_NAME_LEN)
+		__field(pid_t,		pid)
+		__field(int,		reason)
+		__field(int,		slow)
+		__field(unsigned long,	service)
+		__field(unsigned long,	budget)
+		__field(unsigned int,	raising_coeff)
+	),
+
+	TP_fast_assign(
+		bfq_trace_dev_name(__entry, q);
+		__entry->pid		= pid;
+		__entry->reason		= reason;
+		__entry->slow		= slow;
+		__entry->service	= service;
+		__entry->budget		= budget;
+		__entry->raising_coeff	= raising_coeff;
+	),
+
+	TP_printk("bdi %s: pid=%d reason=%s slow=%d service=%lu budget=%lu "
+		  "raising_coeff=%u",
+		  __entry->name, __entry->pid,
+		  show_bfq_expire_reason(__entry->reason), __entry->slow,
+		  __entry->service, __entry->budget, __entry->raising_coeff)
+);
+
+/**
+ * bfq_budget_update - budget feedback changed the max_budget of a queue
+ * @q: request queue of the device
+ * @pid: pid of the process owning the queue
+ * @reason: expiration reason that triggered the feedback
+ * @old_max_budget: max_budget before the update
+ * @new_max_budget: max_budget after the update
+ * @budget: budget assigned for the next round of service
+ */
+TRACE_EVENT(bfq_budget_update,
+
+	TP_PROTO(struct request_queue *q, pid_t pid, int reason,
+		 unsigned long old_max_budget, unsigned long new_max_budget,
+		 unsigned long budget),
+
+	TP_ARGS(q, pid, reason, old_max_budget, new_max_budget, budget),
+
+	TP_STRUCT__entry(
+		__array(char,		name,	BFQ_DEV_NAME_LEN)
+		__field(pid_t,		pid)
+		__field(int,		reason)
+		__field(unsigned long,	old_max_budget)
+		__field(unsigned long,	new_max_budget)
+		__field(unsigned long,	budget)
+	),
+
+	TP_fast_assign(
+		bfq_trace_dev_name(__entry, q);
+		__entry->pid		= pid;
+		__entry->reason		= reason;
+		__entry->old_max_budget	= old_max_budget;
+		__entry->new_max_budget	= new_max_budget;
+		__entry->budget		= budget;
+	),
+
+	TP_printk("bdi %s: pid=%d reason=%s max_budget=%lu->%lu budget=%lu",
+		  __entry->name, __entry->pid,
+		  show_bfq_expire_reason(__entry->reason),
+		  __entry->old_max_budget, __entry->new_max_budget,
+		  __entry->budget)
+);
+
+/**
+ * bfq_peak_rate - the device peak rate estimate has been updated
+ * @q: request queue of the device
+ * @bw: bandwidth measured over the last budget, fixed point sectors/usec
+ * @peak_rate: new filtered peak rate, same units as @bw
+ * @max_budget: device max_budget after the update
+ */
+TRACE_EVENT(bfq_peak_rate,
+
+	TP_PROTO(struct request_queue *q, u64 bw, u64 peak_rate,
+		 unsigned long max_budget),
+
+	TP_ARGS(q, bw, peak_rate, max_budget),
+
+	TP_STRUCT__entry(
+		__array(char,		name,	BFQ_DEV_NAME_LEN)
+		__field(u64,		bw)
+		__field(u64,		peak_rate)
+		__field(unsigned long,	max_budget)
+	),
+
+	TP_fast_assign(
+		bfq_trace_dev_name(__entry, q);
+		__entry->bw		= bw;
+		__entry->peak_rate	= peak_rate;
+		__entry->max_budget	= max_budget;
+	),
+
+	TP_printk("bdi %s: bw=%llu peak_rate=%llu max_budget=%lu",
+		  __entry->name, (unsigned long long)__entry->bw,
+		  (unsigned long long)__entry->peak_rate, __entry->max_budget)
+);
+
+/**
+ * bfq_weight_raise - a weight-raising period starts or ends for a queue
+ * @q: request queue of the device
+ * @pid: pid of the process owning the queue
+ * @raising_coeff: new weight-raising coefficient (1 means not raised)
+ * @max_time: duration of the raising period, in milliseconds
+ * @soft_rt: whether the queue has been deemed soft real-time
+ */
+TRACE_EVENT(bfq_weight_raise,
+
+	TP_PROTO(struct request_queue *q, pid_t pid, unsigned int raising_coeff,
+		 unsigned int max_time, int soft_rt),
+
+	TP_ARGS(q, pid, raising_coeff, max_time, soft_rt),
+
+	TP_STRUCT__entry(
+		__array(char,		name,	BFQ_DEV_NAME_LEN)
+		__field(pid_t,		pid)
+		__field(unsigned int,	raising_coeff)
+		__field(unsigned int,	max_time)
+		__field(int,		soft_rt)
+	),
+
+	TP_fast_assign(
+		bfq_trace_dev_name(__entry, q);
+		__entry->pid		= pid;
+		__entry->raising_coeff	= raising_coeff;
+		__entry->max_time	= max_time;
+		__entry->soft_rt	= soft_rt;
+	),
+
+	TP_printk("bdi %s: pid=%d %s raising_coeff=%u max_time=%ums soft_rt=%d",
+		  __entry->name, __entry->pid,
+		  __entry->raising_coeff > 1 ? "start" : "end",
+		  __entry->raising_coeff, __entry->max_time, __entry->soft_rt)
+);
+
+#endif /* _TRACE_BFQ_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -179,6 +179,34 @@ DEFINE_EVENT(mm_vmscan_direct_reclaim_end_template, mm_vmscan_memcg_softlimit_re
 	TP_ARGS(nr_reclaimed)
 );
 
+TRACE_EVENT(mm_vmscan_direct_reclaim_stall,
+
+	TP_PROTO(int order, gfp_t gfp_flags, unsigned long nr_reclaimed,
+		 u64 delay_us),
+
+	TP_ARGS(order, gfp_flags, nr_reclaimed, delay_us),
+
+	TP_STRUCT__entry(
+		__field(	int,		order		)
+		__field(	gfp_t,		gfp_flags	)
+		__field(	unsigned long,	nr_reclaimed	)
+		__field(	u64,		delay_us	)
+	),
+
+	TP_fast_assign(
+		__entry->order		= order;
+		__entry->gfp_flags	= gfp_flags;
+		__entry->nr_reclaimed	= nr_reclaimed;
+		__entry->delay_us	= delay_us;
+	),
+
+	TP_printk("order=%d gfp_flags=%s nr_reclaimed=%lu delay_us=%llu",
+		__entry->order,
+		show_gfp_flags(__entry->gfp_flags),
+		__entry->nr_reclaimed,
+		(unsigned long long)__entry->delay_us)
+);
+
 TRACE_EVENT(mm_shrink_slab_start,
 	TP_PROTO(struct shrinker *shr, struct shrink_control *sc,
 		long nr_objects_to_shrink, unsigned long pgs_scanned,
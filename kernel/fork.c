@@ -786,6 +786,7 @@ struct mm_struct *dup_mm(struct task_struct *tsk)
 
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	mm->pmd_huge_pte = NULL;
+	memset(&mm->thp_collapse, 0, sizeof(mm->thp_collapse));
 #endif
 
 	if (!mm_init(mm, tsk))
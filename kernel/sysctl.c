@@ -138,6 +138,11 @@ static unsigned long dirty_bytes_min = 2 * PAGE_SIZE;
 static int maxolduid = 65535;
 static int minolduid;
 static int min_percpu_pagelist_fract = 8;
+static int max_pcp_high_order = PAGE_ALLOC_COSTLY_ORDER;
+static int max_kswapd_threads = MAX_KSWAPD_THREADS;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static int max_thp_cache_pages = MAX_THP_CACHE_PAGES;
+#endif
 
 static int ngroups_max = NGROUPS_MAX;
 static const int cap_last_cap = CAP_LAST_CAP;
@@ -1095,6 +1100,17 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= proc_dointvec_minmax,
 		.extra1		= &zero,
 	},
+#ifdef CONFIG_SWAP
+	{
+		.procname	= "swap_vma_readahead",
+		.data		= &swap_vma_ra_enabled,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 	{
 		.procname	= "dirty_background_ratio",
 		.data		= &dirty_background_ratio,
@@ -1160,6 +1176,15 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &zero,
 		.extra2		= &one_hundred,
 	},
+	{
+		.procname	= "kswapd_threads",
+		.data		= &kswapd_threads,
+		.maxlen		= sizeof(kswapd_threads),
+		.mode		= 0644,
+		.proc_handler	= kswapd_threads_sysctl_handler,
+		.extra1		= &one,
+		.extra2		= &max_kswapd_threads,
+	},
 #ifdef CONFIG_HUGETLB_PAGE
 	{
 		.procname	= "nr_hugepages",
@@ -1238,6 +1263,15 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &min_extfrag_threshold,
 		.extra2		= &max_extfrag_threshold,
 	},
+	{
+		.procname	= "compaction_proactiveness",
+		.data		= &sysctl_compaction_proactiveness,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= sysctl_compaction_proactiveness_handler,
+		.extra1		= &zero,
+		.extra2		= &one_hundred,
+	},
 
 #endif /* CONFIG_COMPACTION */
 	{
@@ -1256,6 +1290,26 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= percpu_pagelist_fraction_sysctl_handler,
 		.extra1		= &min_percpu_pagelist_fract,
 	},
+	{
+		.procname	= "percpu_pagelist_high_order",
+		.data		= &percpu_pagelist_high_order,
+		.maxlen		= sizeof(percpu_pagelist_high_order),
+		.mode		= 0644,
+		.proc_handler	= percpu_pagelist_high_order_sysctl_handler,
+		.extra1		= &zero,
+		.extra2		= &max_pcp_high_order,
+	},
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	{
+		.procname	= "thp_cache_pages",
+		.data		= &thp_cache_pages,
+		.maxlen		= sizeof(thp_cache_pages),
+		.mode		= 0644,
+		.proc_handler	= thp_cache_pages_sysctl_handler,
+		.extra1		= &zero,
+		.extra2		= &max_thp_cache_pages,
+	},
+#endif
 #ifdef CONFIG_MMU
 	{
 		.procname	= "max_map_count",
@@ -14,6 +14,9 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/cpu.h>
 #include "internal.h"
 
 #define CREATE_TRACE_POINTS
@@ -34,6 +37,8 @@ struct compact_control {
 	unsigned long free_pfn;		/* isolate_freepages search base */
 	unsigned long migrate_pfn;	/* isolate_migratepages search base */
 	bool sync;			/* Synchronous migration */
+	bool direct_compaction;		/* Called from the allocator */
+	bool proactive_compaction;	/* Called from kcompactd */
 
 	unsigned int order;		/* order a direct compactor needs */
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
@@ -449,6 +454,50 @@ static void update_nr_listpages(struct compact_control *cc)
 	cc->nr_freepages = nr_freepages;
 }
 
+/*
+ * Huge pages are what proactive compaction is for: the order whose
+ * fragmentation it keeps down.
+ */
+#define COMPACTION_HPAGE_ORDER	pageblock_order
+
+/* Fragmentation score of a zone: extfrag_for_order() at huge page order */
+static unsigned int fragmentation_score_zone(struct zone *zone)
+{
+	return extfrag_for_order(zone, COMPACTION_HPAGE_ORDER);
+}
+
+/*
+ * Fragmentation score of a node: the scores of its zones, weighted by
+ * their share of the node so that the sum is between 0 and 100 too.
+ */
+static unsigned int fragmentation_score_node(pg_data_t *pgdat)
+{
+	unsigned long score = 0;
+	int zoneid;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (populated_zone(zone))
+			score += zone->present_pages *
+				fragmentation_score_zone(zone);
+	}
+	return score / (pgdat->node_present_pages + 1);
+}
+
+/*
+ * kcompactd starts compacting a node whose score is above the high mark
+ * and stops once it is down to the low one.  Both come down as
+ * vm.compaction_proactiveness goes up.
+ */
+static unsigned int fragmentation_score_wmark(bool low)
+{
+	unsigned int wmark_low;
+
+	wmark_low = max(100 - sysctl_compaction_proactiveness, 5);
+	return low ? wmark_low : min(wmark_low + 10, 100U);
+}
+
 static int compact_finished(struct zone *zone,
 			    struct compact_control *cc)
 {
@@ -462,6 +511,15 @@ static int compact_finished(struct zone *zone,
 	if (cc->free_pfn <= cc->migrate_pfn)
 		return COMPACT_COMPLETE;
 
+	/* Proactive compaction: stop at the low mark, or when told to */
+	if (cc->proactive_compaction) {
+		if (kthread_should_stop() ||
+		    fragmentation_score_zone(zone) <=
+				fragmentation_score_wmark(true))
+			return COMPACT_PARTIAL;
+		return COMPACT_CONTINUE;
+	}
+
 	/*
 	 * order == -1 is expected when compacting via
 	 * /proc/sys/vm/compact_memory
@@ -585,6 +643,12 @@ static int compact_zone(struct zone *zone, struct compact_control *cc)
 
 		count_vm_event(COMPACTBLOCKS);
 		count_vm_events(COMPACTPAGES, nr_migrate - nr_remaining);
+		if (cc->direct_compaction)
+			count_vm_events(COMPACTDIRECTPAGES,
+					nr_migrate - nr_remaining);
+		else if (cc->proactive_compaction)
+			count_vm_events(COMPACTPROACTIVEPAGES,
+					nr_migrate - nr_remaining);
 		if (nr_remaining)
 			count_vm_events(COMPACTPAGEFAILED, nr_remaining);
 		trace_mm_compaction_migratepages(nr_migrate - nr_remaining,
@@ -617,6 +681,7 @@ static unsigned long compact_zone_order(struct zone *zone,
 		.migratetype = allocflags_to_migratetype(gfp_mask),
 		.zone = zone,
 		.sync = sync,
+		.direct_compaction = true,
 	};
 	INIT_LIST_HEAD(&cc.freepages);
 	INIT_LIST_HEAD(&cc.migratepages);
@@ -745,6 +810,192 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * Proactive compaction.  Each node has a kcompactd thread that checks
+ * the node's fragmentation score every HPAGE_FRAG_CHECK_INTERVAL_MSEC and
+ * compacts it in the background when the score is too high, so that huge
+ * page allocations find free blocks rather than stalling in direct
+ * compaction.  It uses the same migrate and free scanners, migrating like
+ * synchronous direct compaction, but only while the zone has the free
+ * pages to spare, and backs off for a while when a run does not lower
+ * the score.  vm.compaction_proactiveness sets the target: 0 turns it
+ * off, higher values compact more aggressively towards lower scores.
+ */
+#define HPAGE_FRAG_CHECK_INTERVAL_MSEC	500
+
+int sysctl_compaction_proactiveness = 20;
+
+static void proactive_compact_node(pg_data_t *pgdat)
+{
+	int zoneid;
+	struct zone *zone;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct compact_control cc = {
+			.nr_freepages = 0,
+			.nr_migratepages = 0,
+			.order = -1,
+			.sync = true,
+			.proactive_compaction = true,
+		};
+		unsigned long watermark;
+
+		zone = &pgdat->node_zones[zoneid];
+		if (!populated_zone(zone))
+			continue;
+
+		/* Leave zones short of free pages to reclaim, as direct does */
+		watermark = low_wmark_pages(zone) +
+			(2UL << COMPACTION_HPAGE_ORDER);
+		if (!zone_watermark_ok(zone, 0, watermark, 0, 0))
+			continue;
+
+		if (fragmentation_score_zone(zone) <=
+		    fragmentation_score_wmark(true))
+			continue;
+
+		cc.zone = zone;
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		compact_zone(zone, &cc);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+	}
+}
+
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = p;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned int proactive_defer = 0;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		int proactiveness = sysctl_compaction_proactiveness;
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+		unsigned int prev_score, score;
+
+		if (proactiveness)
+			timeout = msecs_to_jiffies(HPAGE_FRAG_CHECK_INTERVAL_MSEC);
+		/* A change of vm.compaction_proactiveness wakes us early */
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+			kthread_should_stop() ||
+			sysctl_compaction_proactiveness != proactiveness,
+			timeout);
+
+		if (kthread_should_stop())
+			break;
+		if (!sysctl_compaction_proactiveness)
+			continue;
+		if (proactive_defer) {
+			proactive_defer--;
+			continue;
+		}
+
+		prev_score = fragmentation_score_node(pgdat);
+		if (prev_score <= fragmentation_score_wmark(false))
+			continue;
+
+		count_vm_event(KCOMPACTD_WAKE);
+		lru_add_drain();
+		proactive_compact_node(pgdat);
+
+		/* No progress: what is left is probably not movable */
+		score = fragmentation_score_node(pgdat);
+		if (score >= prev_score)
+			proactive_defer = 1 << COMPACT_MAX_DEFER_SHIFT;
+	}
+
+	return 0;
+}
+
+/*
+ * Called at boot and when memory is added to a node, like kswapd_run().
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	struct task_struct *tsk;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	tsk = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(tsk)) {
+		/* failure at boot is fatal */
+		BUG_ON(system_state == SYSTEM_BOOTING);
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		return -1;
+	}
+	pgdat->kcompactd = tsk;
+	return 0;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.
+ */
+void kcompactd_stop(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+
+	if (pgdat->kcompactd) {
+		kthread_stop(pgdat->kcompactd);
+		pgdat->kcompactd = NULL;
+	}
+}
+
+int sysctl_compaction_proactiveness_handler(struct ctl_table *table,
+			int write, void __user *buffer, size_t *length,
+			loff_t *ppos)
+{
+	int ret, nid;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write) {
+		for_each_node_state(nid, N_HIGH_MEMORY)
+			wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+	}
+
+	return ret;
+}
+
+/* Restore the node binding once one of its CPUs is back, as for kswapd */
+static int __devinit kcompactd_cpu_callback(struct notifier_block *nfb,
+				unsigned long action, void *hcpu)
+{
+	int nid;
+
+	if (action == CPU_ONLINE || action == CPU_ONLINE_FROZEN) {
+		for_each_node_state(nid, N_HIGH_MEMORY) {
+			pg_data_t *pgdat = NODE_DATA(nid);
+			const struct cpumask *mask;
+
+			mask = cpumask_of_node(pgdat->node_id);
+
+			if (pgdat->kcompactd &&
+			    cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+				set_cpus_allowed_ptr(pgdat->kcompactd, mask);
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	hotcpu_notifier(kcompactd_cpu_callback, 0);
+	return 0;
+}
+module_init(kcompactd_init)
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct device *dev,
 			struct device_attribute *attr,
@@ -210,6 +210,9 @@ SYSCALL_DEFINE5(remap_file_pages, unsigned long, start, unsigned long, size,
 			}
 			goto out;
 		}
+		/* nonlinear ptes can't hide under a huge pmd */
+		if (transparent_hugepage_file(vma))
+			split_huge_file_vma(vma);
 		mutex_lock(&mapping->i_mmap_mutex);
 		flush_dcache_mmap_lock(mapping);
 		vma->vm_flags |= VM_NONLINEAR;
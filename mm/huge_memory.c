@@ -17,6 +17,7 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/shmem_fs.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -40,12 +41,14 @@ unsigned long transparent_hugepage_flags __read_mostly =
 
 /* default scan 8*512 pte (or vmas) every 30 second */
 static unsigned int khugepaged_pages_to_scan __read_mostly = HPAGE_PMD_NR*8;
-static unsigned int khugepaged_pages_collapsed;
+static atomic_t khugepaged_pages_collapsed = ATOMIC_INIT(0);
 static unsigned int khugepaged_full_scans;
 static unsigned int khugepaged_scan_sleep_millisecs __read_mostly = 10000;
 /* during fragmentation poll the hugepage allocator once every minute */
 static unsigned int khugepaged_alloc_sleep_millisecs __read_mostly = 60000;
-static struct task_struct *khugepaged_thread __read_mostly;
+/* khugepaged threads, each working on a different mm */
+#define KHUGEPAGED_MAX_THREADS	16
+static unsigned int khugepaged_nr_threads __read_mostly = 1;
 static DEFINE_MUTEX(khugepaged_mutex);
 static DEFINE_SPINLOCK(khugepaged_mm_lock);
 static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
@@ -56,7 +59,18 @@ static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
  */
 static unsigned int khugepaged_max_ptes_none __read_mostly = HPAGE_PMD_NR-1;
 
-static int khugepaged(void *none);
+/*
+ * Scan credit: scanning a pmd of an mm costs HPAGE_PMD_NR / credit of a
+ * thread's pages_to_scan, so mms that asked for hugepages with
+ * MADV_HUGEPAGE, and those where collapsing keeps succeeding, are
+ * scanned that much faster.
+ */
+#define KHUGEPAGED_CREDIT_MIN	1
+#define KHUGEPAGED_CREDIT_MADV	4
+#define KHUGEPAGED_CREDIT_MAX	8
+
+static int khugepaged(void *arg);
+static void khugepaged_prioritize(struct mm_struct *mm);
 static int mm_slots_hash_init(void);
 static int khugepaged_slab_init(void);
 static void khugepaged_slab_free(void);
@@ -70,30 +84,60 @@ static struct kmem_cache *mm_slot_cache __read_mostly;
  * @hash: hash collision list
  * @mm_node: khugepaged scan list headed in khugepaged_scan.mm_head
  * @mm: the mm that this information is valid for
+ * @credit: how many times faster than the default this mm is scanned
+ * @collapsed: hugepages collapsed since the scan of this mm started
+ * @scanning: a khugepaged thread is working on this mm
+ * @madvised: this mm has MADV_HUGEPAGE vmas
+ * @last: the last mm of a pass, whose finished scan completes a full scan
+ *
+ * All but @hash, @mm_node and @mm are protected by khugepaged_mm_lock.
  */
 struct mm_slot {
 	struct hlist_node hash;
 	struct list_head mm_node;
 	struct mm_struct *mm;
+	unsigned int credit;
+	unsigned int collapsed;
+	unsigned int scanning:1;
+	unsigned int madvised:1;
+	unsigned int last:1;
 };
 
 /**
  * struct khugepaged_scan - cursor for scanning
  * @mm_head: the head of the mm list to scan
- * @mm_slot: the current mm_slot we are scanning
- * @address: the next address inside that to be scanned
+ * @mm_slot: the next mm_slot to hand to a khugepaged thread
  *
- * There is only the one khugepaged_scan instance of this cursor structure.
+ * There is only the one khugepaged_scan instance of this cursor structure,
+ * shared by all khugepaged threads.
  */
 struct khugepaged_scan {
 	struct list_head mm_head;
 	struct mm_slot *mm_slot;
-	unsigned long address;
 };
 static struct khugepaged_scan khugepaged_scan = {
 	.mm_head = LIST_HEAD_INIT(khugepaged_scan.mm_head),
 };
 
+/**
+ * struct khugepaged_worker - one khugepaged thread
+ * @task: the thread, NULL while it is not running
+ * @mm_slot: the mm_slot it is scanning, which the others leave alone
+ * @address: the next address inside that to be scanned
+ */
+struct khugepaged_worker {
+	struct task_struct *task;
+	struct mm_slot *mm_slot;
+	unsigned long address;
+};
+static struct khugepaged_worker khugepaged_workers[KHUGEPAGED_MAX_THREADS];
+
+/* Threads beyond nr_threads finish their scan and exit */
+static inline int khugepaged_worker_retired(struct khugepaged_worker *w)
+{
+	return w - khugepaged_workers >= khugepaged_nr_threads;
+}
+
 
 static int set_recommended_min_free_kbytes(void)
 {
@@ -139,20 +183,30 @@ static int start_khugepaged(void)
 {
 	int err = 0;
 	if (khugepaged_enabled()) {
+		struct task_struct *task;
+		unsigned long i;
 		int wakeup;
 		if (unlikely(!mm_slot_cache || !mm_slots_hash)) {
 			err = -ENOMEM;
 			goto out;
 		}
 		mutex_lock(&khugepaged_mutex);
-		if (!khugepaged_thread)
-			khugepaged_thread = kthread_run(khugepaged, NULL,
-							"khugepaged");
-		if (unlikely(IS_ERR(khugepaged_thread))) {
-			printk(KERN_ERR
-			       "khugepaged: kthread_run(khugepaged) failed\n");
-			err = PTR_ERR(khugepaged_thread);
-			khugepaged_thread = NULL;
+		for (i = 0; i < khugepaged_nr_threads; i++) {
+			if (khugepaged_workers[i].task)
+				continue;
+			if (i)
+				task = kthread_run(khugepaged, (void *)i,
+						   "khugepaged/%lu", i);
+			else
+				task = kthread_run(khugepaged, (void *)i,
+						   "khugepaged");
+			if (unlikely(IS_ERR(task))) {
+				printk(KERN_ERR
+				       "khugepaged: kthread_run(khugepaged) failed\n");
+				err = PTR_ERR(task);
+				break;
+			}
+			khugepaged_workers[i].task = task;
 		}
 		wakeup = !list_empty(&khugepaged_scan.mm_head);
 		mutex_unlock(&khugepaged_mutex);
@@ -317,6 +371,9 @@ static struct attribute *hugepage_attr[] = {
 	&defrag_attr.attr,
 #ifdef CONFIG_DEBUG_VM
 	&debug_cow_attr.attr,
+#endif
+#ifdef CONFIG_SHMEM
+	&shmem_enabled_attr.attr,
 #endif
 	NULL,
 };
@@ -408,7 +465,7 @@ static ssize_t pages_collapsed_show(struct kobject *kobj,
 				    struct kobj_attribute *attr,
 				    char *buf)
 {
-	return sprintf(buf, "%u\n", khugepaged_pages_collapsed);
+	return sprintf(buf, "%u\n", atomic_read(&khugepaged_pages_collapsed));
 }
 static struct kobj_attribute pages_collapsed_attr =
 	__ATTR_RO(pages_collapsed);
@@ -422,6 +479,38 @@ static ssize_t full_scans_show(struct kobject *kobj,
 static struct kobj_attribute full_scans_attr =
 	__ATTR_RO(full_scans);
 
+static ssize_t nr_threads_show(struct kobject *kobj,
+			       struct kobj_attribute *attr,
+			       char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_nr_threads);
+}
+static ssize_t nr_threads_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr_threads;
+
+	err = strict_strtoul(buf, 10, &nr_threads);
+	if (err || !nr_threads || nr_threads > KHUGEPAGED_MAX_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&khugepaged_mutex);
+	khugepaged_nr_threads = nr_threads;
+	mutex_unlock(&khugepaged_mutex);
+
+	err = start_khugepaged();
+	/* wakeup the threads to retire */
+	wake_up_interruptible(&khugepaged_wait);
+	if (err)
+		return err;
+
+	return count;
+}
+static struct kobj_attribute nr_threads_attr =
+	__ATTR(nr_threads, 0644, nr_threads_show, nr_threads_store);
+
 static ssize_t khugepaged_defrag_show(struct kobject *kobj,
 				      struct kobj_attribute *attr, char *buf)
 {
@@ -478,6 +567,7 @@ static struct attribute *khugepaged_attr[] = {
 	&pages_to_scan_attr.attr,
 	&pages_collapsed_attr.attr,
 	&full_scans_attr.attr,
+	&nr_threads_attr.attr,
 	&scan_sleep_millisecs_attr.attr,
 	&alloc_sleep_millisecs_attr.attr,
 	NULL,
@@ -748,6 +838,59 @@ out:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+/*
+ * Map the HPAGE_PMD_NR file pages starting at @page, naturally aligned
+ * and all locked in the page cache by the ->pmd_fault caller, with one
+ * huge pmd.  They stay separate small pages, each mapped once and
+ * keeping the reference the caller took: the pmd is split again into
+ * ptes, from the page table deposited here, whenever one of them has
+ * to be handled on its own.
+ *
+ * Returns 0 if the pages were mapped, else VM_FAULT_FALLBACK and the
+ * caller keeps its references.
+ */
+int do_huge_pmd_file_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			  unsigned long haddr, pmd_t *pmd, struct page *page)
+{
+	pgtable_t pgtable;
+	pmd_t entry;
+	int i;
+
+	pgtable = pte_alloc_one(mm, haddr);
+	if (unlikely(!pgtable))
+		return VM_FAULT_FALLBACK;
+
+	entry = mk_pmd(page, vma->vm_page_prot);
+	if ((vma->vm_flags & (VM_SHARED | VM_WRITE)) ==
+	    (VM_SHARED | VM_WRITE)) {
+		/*
+		 * Writes through the pmd take no fault to dirty the
+		 * pages, so they are dirtied up front.
+		 */
+		entry = pmd_mkwrite(pmd_mkdirty(entry));
+		for (i = 0; i < HPAGE_PMD_NR; i++)
+			set_page_dirty(page + i);
+	}
+	entry = pmd_mkhuge(entry);
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_none(*pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		pte_free(mm, pgtable);
+		return VM_FAULT_FALLBACK;
+	}
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		page_add_file_rmap(page + i);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	add_mm_counter(mm, MM_FILEPAGES, HPAGE_PMD_NR);
+	mm->nr_ptes++;
+	spin_unlock(&mm->page_table_lock);
+
+	count_vm_event(THP_FILE_MAPPED);
+	return 0;
+}
+
 int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		  pmd_t *dst_pmd, pmd_t *src_pmd, unsigned long addr,
 		  struct vm_area_struct *vma)
@@ -781,6 +924,12 @@ int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		goto out;
 	}
 	src_page = pmd_page(pmd);
+	if (!PageAnon(src_page)) {
+		/* the child faults file pages in again, as for ptes */
+		pte_free(dst_mm, pgtable);
+		ret = 0;
+		goto out_unlock;
+	}
 	VM_BUG_ON(!PageHead(src_page));
 	get_page(src_page);
 	page_dup_rmap(src_page);
@@ -996,6 +1145,7 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 				   unsigned int flags)
 {
 	struct page *page = NULL;
+	int anon;
 
 	assert_spin_locked(&mm->page_table_lock);
 
@@ -1003,7 +1153,9 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		goto out;
 
 	page = pmd_page(*pmd);
-	VM_BUG_ON(!PageHead(page));
+	/* file pages mapped by a huge pmd are not compound */
+	anon = PageAnon(page);
+	VM_BUG_ON(anon && !PageHead(page));
 	if (flags & FOLL_TOUCH) {
 		pmd_t _pmd;
 		/*
@@ -1018,7 +1170,7 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		set_pmd_at(mm, addr & HPAGE_PMD_MASK, pmd, _pmd);
 	}
 	page += (addr & ~HPAGE_PMD_MASK) >> PAGE_SHIFT;
-	VM_BUG_ON(!PageCompound(page));
+	VM_BUG_ON(anon && !PageCompound(page));
 	if (flags & FOLL_GET)
 		get_page_foll(page);
 
@@ -1026,6 +1178,39 @@ out:
 	return page;
 }
 
+/*
+ * Called by zap_huge_pmd() with page_table_lock held, which it drops.
+ */
+static void zap_huge_file_pmd(struct mmu_gather *tlb,
+			      struct vm_area_struct *vma,
+			      pmd_t *pmd, unsigned long addr,
+			      pgtable_t pgtable)
+{
+	struct mm_struct *mm = tlb->mm;
+	struct page *page;
+	pmd_t orig_pmd;
+	int i;
+
+	orig_pmd = pmdp_get_and_clear(mm, addr, pmd);
+	tlb_remove_pmd_tlb_entry(tlb, pmd, addr);
+	page = pmd_page(orig_pmd);
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		if (pmd_dirty(orig_pmd))
+			set_page_dirty(page + i);
+		if (pmd_young(orig_pmd) &&
+		    likely(!VM_SequentialReadHint(vma)))
+			mark_page_accessed(page + i);
+		page_remove_rmap(page + i);
+	}
+	add_mm_counter(mm, MM_FILEPAGES, -HPAGE_PMD_NR);
+	mm->nr_ptes--;
+	spin_unlock(&mm->page_table_lock);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		tlb_remove_page(tlb, page + i);
+	pte_free(mm, pgtable);
+}
+
 int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 		 pmd_t *pmd, unsigned long addr)
 {
@@ -1042,6 +1227,10 @@ int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 			pgtable_t pgtable;
 			pgtable = get_pmd_huge_pte(tlb->mm);
 			page = pmd_page(*pmd);
+			if (!PageAnon(page)) {
+				zap_huge_file_pmd(tlb, vma, pmd, addr, pgtable);
+				return 1;
+			}
 			pmd_clear(pmd);
 			tlb_remove_pmd_tlb_entry(tlb, pmd, addr);
 			page_remove_rmap(page);
@@ -1200,6 +1389,49 @@ out:
 	return ret;
 }
 
+static pmd_t *mm_find_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+
+	pmd = pmd_offset(pud, address);
+	if (!pmd_present(*pmd))
+		return NULL;
+	return pmd;
+}
+
+/*
+ * The rmap walk finds a file page mapped by a huge pmd at the address
+ * of the page itself, not of the pmd.  Returns that pmd with
+ * page_table_lock held, or NULL.
+ */
+pmd_t *page_check_address_file_pmd(struct page *page,
+				   struct mm_struct *mm,
+				   unsigned long address)
+{
+	pmd_t *pmd;
+
+	pmd = mm_find_pmd(mm, address);
+	if (!pmd || !pmd_trans_huge(*pmd))
+		return NULL;
+
+	spin_lock(&mm->page_table_lock);
+	if (likely(pmd_trans_huge(*pmd)) &&
+	    pmd_page(*pmd) + ((address & ~HPAGE_PMD_MASK) >> PAGE_SHIFT) == page)
+		return pmd;
+	spin_unlock(&mm->page_table_lock);
+	return NULL;
+}
+
 static int __split_huge_page_splitting(struct page *page,
 				       struct vm_area_struct *vma,
 				       unsigned long address)
@@ -1511,6 +1743,7 @@ int hugepage_madvise(struct vm_area_struct *vma,
 		 */
 		if (unlikely(khugepaged_enter_vma_merge(vma)))
 			return -ENOMEM;
+		khugepaged_prioritize(vma->vm_mm);
 		break;
 	case MADV_NOHUGEPAGE:
 		/*
@@ -1624,6 +1857,8 @@ int __khugepaged_enter(struct mm_struct *mm)
 		return 0;
 	}
 
+	mm_slot->credit = KHUGEPAGED_CREDIT_MIN;
+
 	spin_lock(&khugepaged_mm_lock);
 	insert_to_mm_slots_hash(mm, mm_slot);
 	/*
@@ -1641,6 +1876,45 @@ int __khugepaged_enter(struct mm_struct *mm)
 	return 0;
 }
 
+/*
+ * Move an mm that asked for hugepages with MADV_HUGEPAGE to the front of
+ * the queue, and scan it faster from now on.
+ */
+static void khugepaged_prioritize(struct mm_struct *mm)
+{
+	struct mm_slot *mm_slot;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (mm_slot) {
+		mm_slot->madvised = 1;
+		if (mm_slot->credit < KHUGEPAGED_CREDIT_MADV)
+			mm_slot->credit = KHUGEPAGED_CREDIT_MADV;
+		if (!mm_slot->scanning && khugepaged_scan.mm_slot != mm_slot) {
+			if (khugepaged_scan.mm_slot)
+				list_move_tail(&mm_slot->mm_node,
+					       &khugepaged_scan.mm_slot->mm_node);
+			else
+				list_move(&mm_slot->mm_node,
+					  &khugepaged_scan.mm_head);
+			khugepaged_scan.mm_slot = mm_slot;
+		}
+	}
+	spin_unlock(&khugepaged_mm_lock);
+}
+
+/* Keep the scan cursor off an mm_slot about to leave the list */
+static void khugepaged_skip_mm_slot(struct mm_slot *mm_slot)
+{
+	if (khugepaged_scan.mm_slot != mm_slot)
+		return;
+	if (mm_slot->mm_node.next != &khugepaged_scan.mm_head)
+		khugepaged_scan.mm_slot = list_entry(mm_slot->mm_node.next,
+						     struct mm_slot, mm_node);
+	else
+		khugepaged_scan.mm_slot = NULL;
+}
+
 int khugepaged_enter_vma_merge(struct vm_area_struct *vma)
 {
 	unsigned long hstart, hend;
@@ -1672,7 +1946,8 @@ void __khugepaged_exit(struct mm_struct *mm)
 
 	spin_lock(&khugepaged_mm_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && khugepaged_scan.mm_slot != mm_slot) {
+	if (mm_slot && !mm_slot->scanning) {
+		khugepaged_skip_mm_slot(mm_slot);
 		hlist_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
 		free = 1;
@@ -1846,9 +2121,12 @@ static void collapse_huge_page(struct mm_struct *mm,
 	struct page *new_page;
 	spinlock_t *ptl;
 	int isolated;
+	int fail = THP_COLLAPSE_FAIL_VMA;
 	unsigned long hstart, hend;
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
+	/* the khugepaged thread scanning mm is the only writer of these */
+	mm->thp_collapse.attempts++;
 #ifndef CONFIG_NUMA
 	up_read(&mm->mmap_sem);
 	VM_BUG_ON(!*hpage);
@@ -1875,6 +2153,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	up_read(&mm->mmap_sem);
 	if (unlikely(!new_page)) {
 		count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_ALLOC]++;
 		*hpage = ERR_PTR(-ENOMEM);
 		return;
 	}
@@ -1882,6 +2161,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 
 	count_vm_event(THP_COLLAPSE_ALLOC);
 	if (unlikely(mem_cgroup_newpage_charge(new_page, mm, GFP_KERNEL))) {
+		mm->thp_collapse.failed[THP_COLLAPSE_FAIL_CHARGE]++;
 #ifdef CONFIG_NUMA
 		put_page(new_page);
 #endif
@@ -1956,6 +2236,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 		set_pmd_at(mm, address, pmd, _pmd);
 		spin_unlock(&mm->page_table_lock);
 		anon_vma_unlock(vma->anon_vma);
+		fail = THP_COLLAPSE_FAIL_ISOLATE;
 		goto out;
 	}
 
@@ -1994,12 +2275,14 @@ static void collapse_huge_page(struct mm_struct *mm,
 #ifndef CONFIG_NUMA
 	*hpage = NULL;
 #endif
-	khugepaged_pages_collapsed++;
+	atomic_inc(&khugepaged_pages_collapsed);
+	mm->thp_collapse.collapsed++;
 out_up_write:
 	up_write(&mm->mmap_sem);
 	return;
 
 out:
+	mm->thp_collapse.failed[fail]++;
 	mem_cgroup_uncharge_page(new_page);
 #ifdef CONFIG_NUMA
 	put_page(new_page);
@@ -2087,6 +2370,7 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 
 	if (khugepaged_test_exit(mm)) {
 		/* free mm_slot */
+		khugepaged_skip_mm_slot(mm_slot);
 		hlist_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
 
@@ -2102,35 +2386,68 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 	}
 }
 
-static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
+/*
+ * Hand the next mm in the queue to a khugepaged thread, skipping those
+ * other threads are working on.  Coming back to the head of the queue
+ * twice in a row means there's nothing left for this thread to do.
+ */
+static struct mm_slot *khugepaged_next_mm_slot(unsigned int *pass_through_head)
+{
+	struct mm_slot *mm_slot = khugepaged_scan.mm_slot;
+
+	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
+
+	for (;;) {
+		if (!mm_slot) {
+			if (list_empty(&khugepaged_scan.mm_head) ||
+			    ++(*pass_through_head) >= 2)
+				return NULL;
+			mm_slot = list_entry(khugepaged_scan.mm_head.next,
+					     struct mm_slot, mm_node);
+		}
+
+		if (mm_slot->mm_node.next != &khugepaged_scan.mm_head)
+			khugepaged_scan.mm_slot = list_entry(
+				mm_slot->mm_node.next,
+				struct mm_slot, mm_node);
+		else {
+			khugepaged_scan.mm_slot = NULL;
+			mm_slot->last = 1;
+		}
+
+		if (!mm_slot->scanning) {
+			mm_slot->scanning = 1;
+			mm_slot->collapsed = 0;
+			return mm_slot;
+		}
+		mm_slot = khugepaged_scan.mm_slot;
+	}
+}
+
+static unsigned int khugepaged_scan_mm_slot(struct khugepaged_worker *w,
+					    unsigned int pages,
 					    struct page **hpage)
 	__releases(&khugepaged_mm_lock)
 	__acquires(&khugepaged_mm_lock)
 {
-	struct mm_slot *mm_slot;
-	struct mm_struct *mm;
+	struct mm_slot *mm_slot = w->mm_slot;
+	struct mm_struct *mm = mm_slot->mm;
 	struct vm_area_struct *vma;
+	unsigned long collapsed = mm->thp_collapse.collapsed;
+	unsigned int credit = mm_slot->credit;
+	int madvised = 0;
 	int progress = 0;
 
 	VM_BUG_ON(!pages);
 	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
-
-	if (khugepaged_scan.mm_slot)
-		mm_slot = khugepaged_scan.mm_slot;
-	else {
-		mm_slot = list_entry(khugepaged_scan.mm_head.next,
-				     struct mm_slot, mm_node);
-		khugepaged_scan.address = 0;
-		khugepaged_scan.mm_slot = mm_slot;
-	}
+	VM_BUG_ON(!mm_slot->scanning);
 	spin_unlock(&khugepaged_mm_lock);
 
-	mm = mm_slot->mm;
 	down_read(&mm->mmap_sem);
 	if (unlikely(khugepaged_test_exit(mm)))
 		vma = NULL;
 	else
-		vma = find_vma(mm, khugepaged_scan.address);
+		vma = find_vma(mm, w->address);
 
 	progress++;
 	for (; vma; vma = vma->vm_next) {
@@ -2164,27 +2481,26 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 		hend = vma->vm_end & HPAGE_PMD_MASK;
 		if (hstart >= hend)
 			goto skip;
-		if (khugepaged_scan.address > hend)
+		if (w->address > hend)
 			goto skip;
-		if (khugepaged_scan.address < hstart)
-			khugepaged_scan.address = hstart;
-		VM_BUG_ON(khugepaged_scan.address & ~HPAGE_PMD_MASK);
+		if (w->address < hstart)
+			w->address = hstart;
+		VM_BUG_ON(w->address & ~HPAGE_PMD_MASK);
+		if (vma->vm_flags & VM_HUGEPAGE)
+			madvised = 1;
 
-		while (khugepaged_scan.address < hend) {
+		while (w->address < hend) {
 			int ret;
 			cond_resched();
 			if (unlikely(khugepaged_test_exit(mm)))
 				goto breakouterloop;
 
-			VM_BUG_ON(khugepaged_scan.address < hstart ||
-				  khugepaged_scan.address + HPAGE_PMD_SIZE >
-				  hend);
-			ret = khugepaged_scan_pmd(mm, vma,
-						  khugepaged_scan.address,
-						  hpage);
+			VM_BUG_ON(w->address < hstart ||
+				  w->address + HPAGE_PMD_SIZE > hend);
+			ret = khugepaged_scan_pmd(mm, vma, w->address, hpage);
 			/* move to next address */
-			khugepaged_scan.address += HPAGE_PMD_SIZE;
-			progress += HPAGE_PMD_NR;
+			w->address += HPAGE_PMD_SIZE;
+			progress += HPAGE_PMD_NR / credit;
 			if (ret)
 				/* we released mmap_sem so break loop */
 				goto breakouterloop_mmap_sem;
@@ -2197,27 +2513,37 @@ breakouterloop:
 breakouterloop_mmap_sem:
 
 	spin_lock(&khugepaged_mm_lock);
-	VM_BUG_ON(khugepaged_scan.mm_slot != mm_slot);
+	VM_BUG_ON(w->mm_slot != mm_slot);
+	if (madvised)
+		mm_slot->madvised = 1;
+	/* Collapses pay for themselves: scan on faster while they last. */
+	if (mm->thp_collapse.collapsed != collapsed) {
+		mm_slot->collapsed += mm->thp_collapse.collapsed - collapsed;
+		mm_slot->credit = min_t(unsigned int, mm_slot->credit * 2,
+					KHUGEPAGED_CREDIT_MAX);
+	}
 	/*
 	 * Release the current mm_slot if this mm is about to die, or
 	 * if we scanned all vmas of this mm.
 	 */
 	if (khugepaged_test_exit(mm) || !vma) {
+		if (!mm_slot->collapsed)
+			mm_slot->credit = max_t(unsigned int,
+						mm_slot->credit / 2,
+						mm_slot->madvised ?
+						KHUGEPAGED_CREDIT_MADV :
+						KHUGEPAGED_CREDIT_MIN);
 		/*
 		 * Make sure that if mm_users is reaching zero while
 		 * khugepaged runs here, khugepaged_exit will find
-		 * mm_slot not pointing to the exiting mm.
+		 * mm_slot not busy.
 		 */
-		if (mm_slot->mm_node.next != &khugepaged_scan.mm_head) {
-			khugepaged_scan.mm_slot = list_entry(
-				mm_slot->mm_node.next,
-				struct mm_slot, mm_node);
-			khugepaged_scan.address = 0;
-		} else {
-			khugepaged_scan.mm_slot = NULL;
+		w->mm_slot = NULL;
+		mm_slot->scanning = 0;
+		if (mm_slot->last) {
+			mm_slot->last = 0;
 			khugepaged_full_scans++;
 		}
-
 		collect_mm_slot(mm_slot);
 	}
 
@@ -2230,13 +2556,14 @@ static int khugepaged_has_work(void)
 		khugepaged_enabled();
 }
 
-static int khugepaged_wait_event(void)
+static int khugepaged_wait_event(struct khugepaged_worker *w)
 {
 	return !list_empty(&khugepaged_scan.mm_head) ||
-		!khugepaged_enabled();
+		!khugepaged_enabled() || khugepaged_worker_retired(w);
 }
 
-static void khugepaged_do_scan(struct page **hpage)
+static void khugepaged_do_scan(struct khugepaged_worker *w,
+			       struct page **hpage)
 {
 	unsigned int progress = 0, pass_through_head = 0;
 	unsigned int pages = khugepaged_pages_to_scan;
@@ -2262,13 +2589,16 @@ static void khugepaged_do_scan(struct page **hpage)
 
 		if (unlikely(kthread_should_stop() || freezing(current)))
 			break;
+		if (khugepaged_worker_retired(w))
+			break;
 
 		spin_lock(&khugepaged_mm_lock);
-		if (!khugepaged_scan.mm_slot)
-			pass_through_head++;
-		if (khugepaged_has_work() &&
-		    pass_through_head < 2)
-			progress += khugepaged_scan_mm_slot(pages - progress,
+		if (!w->mm_slot && khugepaged_has_work()) {
+			w->mm_slot = khugepaged_next_mm_slot(&pass_through_head);
+			w->address = 0;
+		}
+		if (w->mm_slot && khugepaged_has_work())
+			progress += khugepaged_scan_mm_slot(w, pages - progress,
 							    hpage);
 		else
 			progress = pages;
@@ -2300,14 +2630,14 @@ static struct page *khugepaged_alloc_hugepage(void)
 }
 #endif
 
-static void khugepaged_loop(void)
+static void khugepaged_loop(struct khugepaged_worker *w)
 {
 	struct page *hpage;
 
 #ifdef CONFIG_NUMA
 	hpage = NULL;
 #endif
-	while (likely(khugepaged_enabled())) {
+	while (likely(khugepaged_enabled()) && !khugepaged_worker_retired(w)) {
 #ifndef CONFIG_NUMA
 		hpage = khugepaged_alloc_hugepage();
 		if (unlikely(!hpage))
@@ -2319,7 +2649,7 @@ static void khugepaged_loop(void)
 		}
 #endif
 
-		khugepaged_do_scan(&hpage);
+		khugepaged_do_scan(w, &hpage);
 #ifndef CONFIG_NUMA
 		if (hpage)
 			put_page(hpage);
@@ -2327,6 +2657,8 @@ static void khugepaged_loop(void)
 		try_to_freeze();
 		if (unlikely(kthread_should_stop()))
 			break;
+		if (khugepaged_worker_retired(w))
+			break;
 		if (khugepaged_has_work()) {
 			if (!khugepaged_scan_sleep_millisecs)
 				continue;
@@ -2334,12 +2666,13 @@ static void khugepaged_loop(void)
 			    msecs_to_jiffies(khugepaged_scan_sleep_millisecs));
 		} else if (khugepaged_enabled())
 			wait_event_freezable(khugepaged_wait,
-					     khugepaged_wait_event());
+					     khugepaged_wait_event(w));
 	}
 }
 
-static int khugepaged(void *none)
+static int khugepaged(void *arg)
 {
+	struct khugepaged_worker *w = &khugepaged_workers[(unsigned long)arg];
 	struct mm_slot *mm_slot;
 
 	set_freezable();
@@ -2350,32 +2683,105 @@ static int khugepaged(void *none)
 
 	for (;;) {
 		mutex_unlock(&khugepaged_mutex);
-		VM_BUG_ON(khugepaged_thread != current);
-		khugepaged_loop();
-		VM_BUG_ON(khugepaged_thread != current);
+		VM_BUG_ON(w->task != current);
+		khugepaged_loop(w);
+		VM_BUG_ON(w->task != current);
 
 		mutex_lock(&khugepaged_mutex);
 		if (!khugepaged_enabled())
 			break;
+		if (khugepaged_worker_retired(w))
+			break;
 		if (unlikely(kthread_should_stop()))
 			break;
 	}
 
 	spin_lock(&khugepaged_mm_lock);
-	mm_slot = khugepaged_scan.mm_slot;
-	khugepaged_scan.mm_slot = NULL;
-	if (mm_slot)
+	mm_slot = w->mm_slot;
+	w->mm_slot = NULL;
+	if (mm_slot) {
+		/* the scan of this mm was cut short: the pass isn't complete */
+		mm_slot->scanning = 0;
+		mm_slot->last = 0;
 		collect_mm_slot(mm_slot);
+	}
 	spin_unlock(&khugepaged_mm_lock);
 
-	khugepaged_thread = NULL;
+	w->task = NULL;
 	mutex_unlock(&khugepaged_mutex);
 
 	return 0;
 }
 
-void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
+/*
+ * File pages are mapped by a huge pmd as HPAGE_PMD_NR separate pages,
+ * so splitting the pmd only has to give each of them a pte, in the page
+ * table deposited when it was mapped: there is nothing to split in the
+ * pages themselves, and their mapcounts stay the same.  Called with
+ * page_table_lock held.
+ */
+static void __split_huge_file_pmd(struct vm_area_struct *vma,
+				  unsigned long haddr, pmd_t *pmd)
 {
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *page;
+	pgtable_t pgtable;
+	pmd_t _pmd, old_pmd;
+	int i;
+
+	/*
+	 * No small and huge TLB entries for the same address at once,
+	 * see __split_huge_page_map().  Once not present, the pmd's
+	 * dirty and young bits can't change any more either.
+	 */
+	set_pmd_at(mm, haddr, pmd, pmd_mknotpresent(*pmd));
+	flush_tlb_range(vma, haddr, haddr + HPAGE_PMD_SIZE);
+	old_pmd = *pmd;
+	page = pmd_page(old_pmd);
+
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		entry = mk_pte(page + i, vma->vm_page_prot);
+		if (pmd_write(old_pmd))
+			entry = pte_mkwrite(entry);
+		else
+			entry = pte_wrprotect(entry);
+		if (pmd_dirty(old_pmd))
+			entry = pte_mkdirty(entry);
+		if (!pmd_young(old_pmd))
+			entry = pte_mkold(entry);
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+}
+
+/*
+ * try_to_unmap_one() can only unmap a file page from a pte of its own.
+ */
+void split_file_pmd_page(struct page *page, struct vm_area_struct *vma,
+			 unsigned long address)
+{
+	pmd_t *pmd;
+
+	pmd = page_check_address_file_pmd(page, vma->vm_mm, address);
+	if (pmd) {
+		__split_huge_file_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&vma->vm_mm->page_table_lock);
+	}
+}
+
+void __split_huge_page_pmd(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
 	struct page *page;
 
 	spin_lock(&mm->page_table_lock);
@@ -2384,6 +2790,11 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 		return;
 	}
 	page = pmd_page(*pmd);
+	if (!PageAnon(page)) {
+		__split_huge_file_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
 	VM_BUG_ON(!page_count(page));
 	get_page(page);
 	spin_unlock(&mm->page_table_lock);
@@ -2394,31 +2805,42 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 	BUG_ON(pmd_trans_huge(*pmd));
 }
 
-static void split_huge_page_address(struct mm_struct *mm,
-				    unsigned long address)
+void split_huge_page_pmd_mm(struct mm_struct *mm, unsigned long address,
+			    pmd_t *pmd)
 {
-	pgd_t *pgd;
-	pud_t *pud;
-	pmd_t *pmd;
-
-	VM_BUG_ON(!(address & ~HPAGE_PMD_MASK));
+	struct vm_area_struct *vma;
 
-	pgd = pgd_offset(mm, address);
-	if (!pgd_present(*pgd))
-		return;
+	vma = find_vma(mm, address);
+	BUG_ON(vma == NULL);
+	split_huge_page_pmd(vma, address, pmd);
+}
 
-	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
-		return;
+static void split_huge_page_address(struct vm_area_struct *vma,
+				    unsigned long address)
+{
+	pmd_t *pmd;
 
-	pmd = pmd_offset(pud, address);
-	if (!pmd_present(*pmd))
+	pmd = mm_find_pmd(vma->vm_mm, address);
+	if (!pmd)
 		return;
 	/*
 	 * Caller holds the mmap_sem write mode, so a huge pmd cannot
 	 * materialize from under us.
 	 */
-	split_huge_page_pmd(mm, pmd);
+	split_huge_page_pmd(vma, address, pmd);
+}
+
+/*
+ * remap_file_pages() is about to make the vma nonlinear, and the
+ * nonlinear rmap walk only looks for ptes.
+ */
+void split_huge_file_vma(struct vm_area_struct *vma)
+{
+	unsigned long addr;
+
+	for (addr = ALIGN(vma->vm_start, HPAGE_PMD_SIZE);
+	     addr + HPAGE_PMD_SIZE <= vma->vm_end; addr += HPAGE_PMD_SIZE)
+		split_huge_page_address(vma, addr);
 }
 
 void __vma_adjust_trans_huge(struct vm_area_struct *vma,
@@ -2434,7 +2856,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (start & ~HPAGE_PMD_MASK &&
 	    (start & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (start & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, start);
+		split_huge_page_address(vma, start);
 
 	/*
 	 * If the new end address isn't hpage aligned and it could
@@ -2444,7 +2866,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (end & ~HPAGE_PMD_MASK &&
 	    (end & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (end & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, end);
+		split_huge_page_address(vma, end);
 
 	/*
 	 * If we're also updating the vma->vm_next->vm_start, if the new
@@ -2458,6 +2880,6 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 		if (nstart & ~HPAGE_PMD_MASK &&
 		    (nstart & HPAGE_PMD_MASK) >= next->vm_start &&
 		    (nstart & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= next->vm_end)
-			split_huge_page_address(next->vm_mm, nstart);
+			split_huge_page_address(next, nstart);
 	}
 }
@@ -78,36 +78,69 @@
  *    take 10 attempts to find a page in the unstable tree, once it is found,
  *    it is secured in the stable tree.  (When we scan a new page, we first
  *    compare it against the stable tree, and then against the unstable tree.)
+ *
+ * The scanning can be shared between several ksmd threads.  Each thread has
+ * its own cursor and its own share of the mm_slots, but they all search the
+ * same trees, so that identical pages are found whichever threads scan them.
+ * The unstable tree can only be flushed once every thread has completed its
+ * share: so a thread that finishes early waits for the others, and the last
+ * to finish flushes the tree and shares the mm_slots out afresh.
+ *
+ * Unless merge_across_nodes is set, there is a stable and an unstable tree
+ * for each NUMA node, and pages are only merged with others on the same
+ * node: accesses to a merged page from a distant node would cost more than
+ * the memory saved is worth.  Each node's trees have their own mutex, so
+ * threads working on different nodes don't serialize on each other.
  */
 
 /**
  * struct mm_slot - ksm information per mm that is being scanned
  * @link: link to the mm_slots hash list
- * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
+ * @mm_list: link into the mm_slots list, rooted in its scanner's mm_head
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @scan: the scanner this mm_slot is currently given to
+ * @nr_rmap_items: length of rmap_list, to share out the scanning evenly
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	struct ksm_scan *scan;
+	unsigned long nr_rmap_items;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
+ * @mm_head: head of the list of mm_slots given to this scanner
  * @mm_slot: the current mm_slot we are scanning
  * @address: the next address inside that to be scanned
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
- * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @stale_list: rmap_items unlinked under mmap_sem, to be freed after it
+ * @task: the ksmd thread which owns this cursor, NULL when not in use
+ * @done: this scanner has completed its share of the current full scan
+ * @nr_mm_slots: number of mm_slots on the mm_head list
+ * @pages_scanned: pages scanned so far in the current full scan
+ * @pages_merged: pages merged so far in the current full scan
+ * @scan_rate: pages scanned per second in the last full scan
+ * @yield: recent pages merged per thousand scanned, a moving average
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is one ksm_scan instance of this cursor structure for each ksmd.
  */
 struct ksm_scan {
+	struct mm_slot mm_head;
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
-	unsigned long seqnr;
+	struct rmap_item *stale_list;
+	struct task_struct *task;
+	int done;
+	unsigned int nr_mm_slots;
+	unsigned long pages_scanned;
+	unsigned long pages_merged;
+	unsigned long scan_rate;
+	unsigned long yield;
 };
 
 /**
@@ -115,11 +148,13 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @nid: the ksm_trees entry whose stable tree this node is in
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+	int nid;
 };
 
 /**
@@ -129,6 +164,7 @@ struct stable_node {
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
  * @oldchecksum: previous checksum of the page at that virtual address
+ * @nid: the ksm_trees entry whose tree this rmap_item is in, if any
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
@@ -139,6 +175,7 @@ struct rmap_item {
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+	int nid;			/* when stable or unstable */
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -152,36 +189,66 @@ struct rmap_item {
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
 
-/* The stable and unstable tree heads */
-static struct rb_root root_stable_tree = RB_ROOT;
-static struct rb_root root_unstable_tree = RB_ROOT;
+/**
+ * struct ksm_tree - a stable and unstable tree head, and their lock
+ * @mutex: serializes searches and changes of both trees
+ * @stable: root of the stable tree
+ * @unstable: root of the unstable tree
+ *
+ * ksm_trees has one of these for each NUMA node, indexed by nid; but when
+ * merge_across_nodes is set, only the first is used.
+ */
+struct ksm_tree {
+	struct mutex mutex;
+	struct rb_root stable;
+	struct rb_root unstable;
+};
+
+static struct ksm_tree *ksm_trees;
 
 #define MM_SLOTS_HASH_SHIFT 10
 #define MM_SLOTS_HASH_HEADS (1 << MM_SLOTS_HASH_SHIFT)
 static struct hlist_head mm_slots_hash[MM_SLOTS_HASH_HEADS];
 
-static struct mm_slot ksm_mm_head = {
-	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
-};
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
+#define KSM_MAX_THREADS	32
+static struct ksm_scan ksm_scans[KSM_MAX_THREADS];
+
+/* The number of ksmd threads scanning, and the number wanted */
+static unsigned int ksm_nr_threads;
+static unsigned int ksm_thread_count = 1;
+
+/* The number of threads which have completed the current full scan */
+static atomic_t ksm_scans_done = ATOMIC_INIT(0);
+
+/* Count of completed full scans (needed when removing unstable node) */
+static unsigned long ksm_seqnr;
+
+/* When the current full scan started, and how long the last one took */
+static unsigned long ksm_scan_start;
+static unsigned int ksm_full_scan_msecs;
+
+/* Pages scanned and merged in the last full scan */
+static unsigned long ksm_full_scan_pages;
+static unsigned long ksm_full_scan_merged;
+
+/* The number of mm_slots on all the scanners' lists */
+static unsigned long ksm_mm_slots;
 
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *mm_slot_cache;
 
 /* The number of nodes in the stable tree */
-static unsigned long ksm_pages_shared;
+static atomic_long_t ksm_pages_shared = ATOMIC_LONG_INIT(0);
 
 /* The number of page slots additionally sharing those nodes */
-static unsigned long ksm_pages_sharing;
+static atomic_long_t ksm_pages_sharing = ATOMIC_LONG_INIT(0);
 
 /* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
+static atomic_long_t ksm_pages_unshared = ATOMIC_LONG_INIT(0);
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
@@ -189,13 +256,36 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/*
+ * If set, the percentage of a cpu each ksmd may use: its sleep between
+ * batches is then sized to that, instead of sleep_millisecs.
+ */
+static unsigned int ksm_max_cpu_percent;
+
+/*
+ * While fewer pages than this (per thousand scanned) are being merged,
+ * ksmd uses proportionately less of max_cpu_percent, down to a tenth.
+ */
+#define KSM_YIELD_TARGET	10
+
+/* Hash one cache line in this many when checking if a page has changed */
+static unsigned int ksm_checksum_sample = 1;
+
+/* Whether pages on different NUMA nodes may be merged */
+static unsigned int ksm_merge_across_nodes = 1;
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
 static unsigned int ksm_run = KSM_RUN_STOP;
 
+/*
+ * ksm_thread_sem is held for read by each ksmd while it scans a batch,
+ * and for write to stop them all: to unmerge everything, to take memory
+ * offline, or at the end of a full scan to flush the unstable trees.
+ */
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+static DECLARE_RWSEM(ksm_thread_sem);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -240,13 +330,13 @@ static inline struct rmap_item *alloc_rmap_item(void)
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -297,6 +387,27 @@ static void insert_to_mm_slots_hash(struct mm_struct *mm,
 	hlist_add_head(&mm_slot->link, bucket);
 }
 
+/*
+ * Take mm_slot off its scanner's list and out of the hash:
+ * called with ksm_mmlist_lock held.
+ */
+static void remove_mm_slot(struct mm_slot *mm_slot)
+{
+	hlist_del(&mm_slot->link);
+	list_del(&mm_slot->mm_list);
+	mm_slot->scan->nr_mm_slots--;
+	ksm_mm_slots--;
+}
+
+/*
+ * Choose the ksm_trees entry for a page: the page's own node, unless pages
+ * are to be merged across nodes.
+ */
+static inline int get_page_nid(struct page *page)
+{
+	return ksm_merge_across_nodes ? 0 : page_to_nid(page);
+}
+
 static inline int in_stable_tree(struct rmap_item *rmap_item)
 {
 	return rmap_item->address & STABLE_FLAG;
@@ -450,15 +561,15 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
 
 	hlist_for_each_entry(rmap_item, hlist, &stable_node->hlist, hlist) {
 		if (rmap_item->hlist.next)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 		cond_resched();
 	}
 
-	rb_erase(&stable_node->node, &root_stable_tree);
+	rb_erase(&stable_node->node, &ksm_trees[stable_node->nid].stable);
 	free_stable_node(stable_node);
 }
 
@@ -480,7 +591,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
  * a page to put something that might look like our key in page->mapping.
  *
  * include/linux/pagemap.h page_cache_get_speculative() is a good reference,
- * but this is different - made simpler by ksm_thread_mutex being held, but
+ * but this is different - made simpler by the tree mutex being held, but
  * interesting for assuming that no other use of the struct page could ever
  * put our expected_mapping into page->mapping (or a field of the union which
  * coincides with page->mapping).  The RCU calls are not for KSM at all, but
@@ -519,8 +630,9 @@ stale:
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
+ * The caller holds the mutex of the tree the rmap_item is in.
  */
-static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+static void __remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
 	if (rmap_item->address & STABLE_FLAG) {
 		struct stable_node *stable_node;
@@ -537,9 +649,9 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		put_page(page);
 
 		if (stable_node->hlist.first)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
 
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
@@ -548,29 +660,79 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		unsigned char age;
 		/*
 		 * Usually ksmd can and must skip the rb_erase, because
-		 * root_unstable_tree was already reset to RB_ROOT.
+		 * the unstable tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
+		age = (unsigned char)(ksm_seqnr - rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
-			rb_erase(&rmap_item->node, &root_unstable_tree);
+			rb_erase(&rmap_item->node,
+				 &ksm_trees[rmap_item->nid].unstable);
 
-		ksm_pages_unshared--;
+		atomic_long_dec(&ksm_pages_unshared);
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
 	cond_resched();		/* we're called from many long loops */
 }
 
+/*
+ * Another ksmd can only reach this rmap_item through the tree it is in, and
+ * only with that tree's mutex held: nor can it move the rmap_item to another
+ * tree.  So if it's in no tree, there's nothing to remove; and if it is in
+ * one, rmap_item->nid stays put while we take the mutex.
+ */
+static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+{
+	struct mutex *mutex;
+
+	if (!(rmap_item->address & (STABLE_FLAG | UNSTABLE_FLAG))) {
+		cond_resched();
+		return;
+	}
+
+	mutex = &ksm_trees[rmap_item->nid].mutex;
+	mutex_lock(mutex);
+	__remove_rmap_item_from_tree(rmap_item);
+	mutex_unlock(mutex);
+}
+
 static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
 				       struct rmap_item **rmap_list)
 {
 	while (*rmap_list) {
 		struct rmap_item *rmap_item = *rmap_list;
 		*rmap_list = rmap_item->rmap_list;
+		mm_slot->nr_rmap_items--;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+}
+
+/*
+ * ksmd holds a tree mutex while it takes the mmap_sem of the mm it merges
+ * with, so must not take a tree mutex while holding mmap_sem itself: when
+ * scanning, rmap_items which are no longer wanted are unlinked from their
+ * mm_slot and put on the stale_list, then freed after mmap_sem is dropped.
+ */
+static void stale_rmap_item(struct ksm_scan *scan, struct mm_slot *mm_slot,
+			    struct rmap_item **rmap_list)
+{
+	struct rmap_item *rmap_item = *rmap_list;
+
+	*rmap_list = rmap_item->rmap_list;
+	mm_slot->nr_rmap_items--;
+	rmap_item->rmap_list = scan->stale_list;
+	scan->stale_list = rmap_item;
+}
+
+static void free_stale_rmap_items(struct ksm_scan *scan)
+{
+	while (scan->stale_list) {
+		struct rmap_item *rmap_item = scan->stale_list;
+		scan->stale_list = rmap_item->rmap_list;
 		remove_rmap_item_from_tree(rmap_item);
 		free_rmap_item(rmap_item);
 	}
@@ -612,68 +774,106 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
  */
 static int unmerge_and_remove_all_rmap_items(void)
 {
+	struct ksm_scan *scan;
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
+	unsigned int i;
 	int err = 0;
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	/*
+	 * Every cursor is taken back to its mm_head below, so whatever full
+	 * scan was in progress is abandoned: the next one starts afresh.
+	 */
+	for (i = 0; i < ksm_nr_threads; i++) {
+		ksm_scans[i].done = 0;
+		ksm_scans[i].pages_scanned = 0;
+		ksm_scans[i].pages_merged = 0;
+	}
+	atomic_set(&ksm_scans_done, 0);
+	ksm_scan_start = jiffies;
+
+	for (i = 0; i < ksm_nr_threads; i++) {
+		scan = &ksm_scans[i];
+
+		spin_lock(&ksm_mmlist_lock);
+		scan->mm_slot = list_entry(scan->mm_head.mm_list.next,
 						struct mm_slot, mm_list);
-	spin_unlock(&ksm_mmlist_lock);
+		spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
-		mm = mm_slot->mm;
-		down_read(&mm->mmap_sem);
-		for (vma = mm->mmap; vma; vma = vma->vm_next) {
-			if (ksm_test_exit(mm))
-				break;
-			if (!(vma->vm_flags & VM_MERGEABLE) || !vma->anon_vma)
-				continue;
-			err = unmerge_ksm_pages(vma,
+		for (mm_slot = scan->mm_slot; mm_slot != &scan->mm_head;
+						mm_slot = scan->mm_slot) {
+			mm = mm_slot->mm;
+			down_read(&mm->mmap_sem);
+			for (vma = mm->mmap; vma; vma = vma->vm_next) {
+				if (ksm_test_exit(mm))
+					break;
+				if (!(vma->vm_flags & VM_MERGEABLE) ||
+				    !vma->anon_vma)
+					continue;
+				err = unmerge_ksm_pages(vma,
 						vma->vm_start, vma->vm_end);
-			if (err)
-				goto error;
-		}
+				if (err)
+					goto error;
+			}
 
-		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
+			remove_trailing_rmap_items(mm_slot,
+						   &mm_slot->rmap_list);
 
-		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+			spin_lock(&ksm_mmlist_lock);
+			scan->mm_slot = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
-		if (ksm_test_exit(mm)) {
-			hlist_del(&mm_slot->link);
-			list_del(&mm_slot->mm_list);
-			spin_unlock(&ksm_mmlist_lock);
-
-			free_mm_slot(mm_slot);
-			clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-			up_read(&mm->mmap_sem);
-			mmdrop(mm);
-		} else {
-			spin_unlock(&ksm_mmlist_lock);
-			up_read(&mm->mmap_sem);
+			if (ksm_test_exit(mm)) {
+				remove_mm_slot(mm_slot);
+				spin_unlock(&ksm_mmlist_lock);
+
+				free_mm_slot(mm_slot);
+				clear_bit(MMF_VM_MERGEABLE, &mm->flags);
+				up_read(&mm->mmap_sem);
+				mmdrop(mm);
+			} else {
+				spin_unlock(&ksm_mmlist_lock);
+				up_read(&mm->mmap_sem);
+			}
 		}
 	}
 
-	ksm_scan.seqnr = 0;
+	ksm_seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	scan->mm_slot = &scan->mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
 #endif /* CONFIG_SYSFS */
 
-static u32 calc_checksum(struct page *page)
+/*
+ * The checksum only has to show whether the page has changed since the
+ * last scan, and a page which is being written to is rarely written to in
+ * just one place: so with checksum_sample set, only one cache line in that
+ * many is hashed.  Which lines varies with the address, so that no part of
+ * a large area goes unwatched.
+ */
+static u32 calc_checksum(struct page *page, unsigned long address)
 {
+	unsigned int sample = ACCESS_ONCE(ksm_checksum_sample);
+	unsigned int offset, stride;
 	u32 checksum;
 	void *addr = kmap_atomic(page, KM_USER0);
-	checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+
+	if (sample <= 1)
+		checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+	else {
+		checksum = 17;
+		stride = sample * L1_CACHE_BYTES;
+		offset = ((address >> PAGE_SHIFT) % sample) * L1_CACHE_BYTES;
+		for (; offset < PAGE_SIZE; offset += stride)
+			checksum = jhash2(addr + offset, L1_CACHE_BYTES / 4,
+					  checksum);
+	}
 	kunmap_atomic(addr, KM_USER0);
 	return checksum;
 }
@@ -983,9 +1183,9 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, int nid)
 {
-	struct rb_node *node = root_stable_tree.rb_node;
+	struct rb_node *node = ksm_trees[nid].stable.rb_node;
 	struct stable_node *stable_node;
 
 	stable_node = page_stable_node(page);
@@ -1012,6 +1212,11 @@ static struct page *stable_tree_search(struct page *page)
 		} else if (ret > 0) {
 			put_page(tree_page);
 			node = node->rb_right;
+		} else if (!ksm_merge_across_nodes &&
+			   page_to_nid(tree_page) != nid) {
+			/* ksm page has been migrated to another node since */
+			put_page(tree_page);
+			return NULL;
 		} else
 			return tree_page;
 	}
@@ -1026,9 +1231,9 @@ static struct page *stable_tree_search(struct page *page)
  * This function returns the stable tree node just allocated on success,
  * NULL otherwise.
  */
-static struct stable_node *stable_tree_insert(struct page *kpage)
+static struct stable_node *stable_tree_insert(struct page *kpage, int nid)
 {
-	struct rb_node **new = &root_stable_tree.rb_node;
+	struct rb_node **new = &ksm_trees[nid].stable.rb_node;
 	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
 
@@ -1065,11 +1270,12 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 		return NULL;
 
 	rb_link_node(&stable_node->node, parent, new);
-	rb_insert_color(&stable_node->node, &root_stable_tree);
+	rb_insert_color(&stable_node->node, &ksm_trees[nid].stable);
 
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
+	stable_node->nid = nid;
 	set_page_stable_node(kpage, stable_node);
 
 	return stable_node;
@@ -1092,10 +1298,11 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 					      struct page *page,
-					      struct page **tree_pagep)
+					      struct page **tree_pagep,
+					      int nid)
 
 {
-	struct rb_node **new = &root_unstable_tree.rb_node;
+	struct rb_node **new = &ksm_trees[nid].unstable.rb_node;
 	struct rb_node *parent = NULL;
 
 	while (*new) {
@@ -1117,6 +1324,15 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 			return NULL;
 		}
 
+		/*
+		 * Nor merge with a page which has been migrated to another
+		 * node since it was inserted.
+		 */
+		if (!ksm_merge_across_nodes && page_to_nid(tree_page) != nid) {
+			put_page(tree_page);
+			return NULL;
+		}
+
 		ret = memcmp_pages(page, tree_page);
 
 		parent = *new;
@@ -1133,11 +1349,12 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_seqnr & SEQNR_MASK);
+	rmap_item->nid = nid;
 	rb_link_node(&rmap_item->node, parent, new);
-	rb_insert_color(&rmap_item->node, &root_unstable_tree);
+	rb_insert_color(&rmap_item->node, &ksm_trees[nid].unstable);
 
-	ksm_pages_unshared++;
+	atomic_long_inc(&ksm_pages_unshared);
 	return NULL;
 }
 
@@ -1150,13 +1367,14 @@ static void stable_tree_append(struct rmap_item *rmap_item,
 			       struct stable_node *stable_node)
 {
 	rmap_item->head = stable_node;
+	rmap_item->nid = stable_node->nid;
 	rmap_item->address |= STABLE_FLAG;
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
 
 	if (rmap_item->hlist.next)
-		ksm_pages_sharing++;
+		atomic_long_inc(&ksm_pages_sharing);
 	else
-		ksm_pages_shared++;
+		atomic_long_inc(&ksm_pages_shared);
 }
 
 /*
@@ -1167,20 +1385,29 @@ static void stable_tree_append(struct rmap_item *rmap_item,
  *
  * @page: the page that we are searching identical page to.
  * @rmap_item: the reverse mapping into the virtual address of this page
+ *
+ * The trees are searched with their mutex held, but the checksum is
+ * calculated without it, so other ksmds can get on with their searches.
+ *
+ * Returns 1 if the page was merged, 0 otherwise.
  */
-static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
+static int cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 {
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
 	struct page *kpage;
 	unsigned int checksum;
+	int nid = get_page_nid(page);
+	struct mutex *mutex = &ksm_trees[nid].mutex;
+	int merged = 0;
 	int err;
 
 	remove_rmap_item_from_tree(rmap_item);
 
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	mutex_lock(mutex);
+	kpage = stable_tree_search(page, nid);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1191,10 +1418,13 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			lock_page(kpage);
 			stable_tree_append(rmap_item, page_stable_node(kpage));
 			unlock_page(kpage);
+			merged = 1;
 		}
+		mutex_unlock(mutex);
 		put_page(kpage);
-		return;
+		return merged;
 	}
+	mutex_unlock(mutex);
 
 	/*
 	 * If the hash value of the page has changed from the last time
@@ -1202,14 +1432,15 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = calc_checksum(page);
+	checksum = calc_checksum(page, rmap_item->address);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
-		return;
+		return 0;
 	}
 
+	mutex_lock(mutex);
 	tree_rmap_item =
-		unstable_tree_search_insert(rmap_item, page, &tree_page);
+		unstable_tree_search_insert(rmap_item, page, &tree_page, nid);
 	if (tree_rmap_item) {
 		kpage = try_to_merge_two_pages(rmap_item, page,
 						tree_rmap_item, tree_page);
@@ -1220,13 +1451,14 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 		 * tree, and insert it instead as new node in the stable tree.
 		 */
 		if (kpage) {
-			remove_rmap_item_from_tree(tree_rmap_item);
+			__remove_rmap_item_from_tree(tree_rmap_item);
 
 			lock_page(kpage);
-			stable_node = stable_tree_insert(kpage);
+			stable_node = stable_tree_insert(kpage, nid);
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node);
 				stable_tree_append(rmap_item, stable_node);
+				merged = 1;
 			}
 			unlock_page(kpage);
 
@@ -1242,9 +1474,12 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			}
 		}
 	}
+	mutex_unlock(mutex);
+	return merged;
 }
 
-static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
+static struct rmap_item *get_next_rmap_item(struct ksm_scan *scan,
+					    struct mm_slot *mm_slot,
 					    struct rmap_item **rmap_list,
 					    unsigned long addr)
 {
@@ -1256,9 +1491,7 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 			return rmap_item;
 		if (rmap_item->address > addr)
 			break;
-		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		stale_rmap_item(scan, mm_slot, rmap_list);
 	}
 
 	rmap_item = alloc_rmap_item();
@@ -1268,49 +1501,37 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 		rmap_item->address = addr;
 		rmap_item->rmap_list = *rmap_list;
 		*rmap_list = rmap_item;
+		mm_slot->nr_rmap_items++;
 	}
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_scan *scan,
+						 struct page **page)
 {
 	struct mm_struct *mm;
 	struct mm_slot *slot;
 	struct vm_area_struct *vma;
 	struct rmap_item *rmap_item;
 
-	if (list_empty(&ksm_mm_head.mm_list))
-		return NULL;
-
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
-		/*
-		 * A number of pages can hang around indefinitely on per-cpu
-		 * pagevecs, raised page count preventing write_protect_page
-		 * from merging them.  Though it doesn't really matter much,
-		 * it is puzzling to see some stuck in pages_volatile until
-		 * other activity jostles them out, and they also prevented
-		 * LTP's KSM test from succeeding deterministically; so drain
-		 * them here (here rather than on entry to ksm_do_scan(),
-		 * so we don't IPI too often when pages_to_scan is set low).
-		 */
-		lru_add_drain_all();
-
-		root_unstable_tree = RB_ROOT;
+	if (list_empty(&scan->mm_head.mm_list))
+		goto done;
 
+	slot = scan->mm_slot;
+	if (slot == &scan->mm_head) {
 		spin_lock(&ksm_mmlist_lock);
 		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
+		scan->mm_slot = slot;
 		spin_unlock(&ksm_mmlist_lock);
 		/*
 		 * Although we tested list_empty() above, a racing __ksm_exit
 		 * of the last mm on the list may have removed it since then.
 		 */
-		if (slot == &ksm_mm_head)
-			return NULL;
+		if (slot == &scan->mm_head)
+			goto done;
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1318,60 +1539,62 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (scan->address < vma->vm_start)
+			scan->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			scan->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (scan->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, scan->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				scan->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page) ||
 			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, scan->address);
 				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+				rmap_item = get_next_rmap_item(scan, slot,
+					scan->rmap_list, scan->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					scan->rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					scan->address += PAGE_SIZE;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
+				free_stale_rmap_items(scan);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			scan->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	while (*scan->rmap_list)
+		stale_rmap_item(scan, slot, scan->rmap_list);
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
+	scan->mm_slot = list_entry(slot->mm_list.next,
 						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (scan->address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1381,72 +1604,243 @@ next_mm:
 		 * or when all VM_MERGEABLE areas have been unmapped (and
 		 * mmap_sem then protects against race with MADV_MERGEABLE).
 		 */
-		hlist_del(&slot->link);
-		list_del(&slot->mm_list);
+		remove_mm_slot(slot);
 		spin_unlock(&ksm_mmlist_lock);
 
 		free_mm_slot(slot);
 		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
 		up_read(&mm->mmap_sem);
+		/* the stale rmap_items still point to mm */
+		free_stale_rmap_items(scan);
 		mmdrop(mm);
 	} else {
 		spin_unlock(&ksm_mmlist_lock);
 		up_read(&mm->mmap_sem);
+		free_stale_rmap_items(scan);
 	}
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
+	slot = scan->mm_slot;
+	if (slot != &scan->mm_head)
 		goto next_mm;
 
-	ksm_scan.seqnr++;
+done:
+	/* This ksmd's share of the full scan is complete */
+	scan->scan_rate = scan->pages_scanned * HZ /
+			  max_t(unsigned long, jiffies - ksm_scan_start, 1);
+	scan->done = 1;
 	return NULL;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @scan - the cursor of the ksmd calling.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_scan *scan, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
+	unsigned long scanned = 0, merged = 0;
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(scan, &page);
 		if (!rmap_item)
-			return;
+			break;
+		scan->pages_scanned++;
+		scanned++;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
-			cmp_and_merge_page(page, rmap_item);
+			merged += cmp_and_merge_page(page, rmap_item);
 		put_page(page);
 	}
+
+	scan->pages_merged += merged;
+	if (scanned)
+		scan->yield = (scan->yield * 7 + merged * 1000 / scanned) / 8;
+}
+
+/*
+ * How long ksmd should sleep after a batch which took busy nanoseconds of
+ * cpu: sleep_millisecs, unless max_cpu_percent is set.  Then each ksmd is
+ * allowed that share of a cpu while it is finding pages to merge, falling
+ * to a tenth of that share as its yield falls to nothing.
+ */
+static unsigned long ksm_sleep_jiffies(struct ksm_scan *scan, u64 busy)
+{
+	unsigned int percent = ACCESS_ONCE(ksm_max_cpu_percent);
+	unsigned long yield = min_t(unsigned long, scan->yield,
+				    KSM_YIELD_TARGET);
+
+	if (!percent)
+		return msecs_to_jiffies(ksm_thread_sleep_millisecs);
+
+	percent = percent / 10 + percent * 9 * yield / (10 * KSM_YIELD_TARGET);
+	percent = max(percent, 1U);
+
+	return nsecs_to_jiffies(div_u64(busy * (100 - percent), percent));
 }
 
 static int ksmd_should_run(void)
 {
-	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
+	return (ksm_run & KSM_RUN_MERGE) && ksm_mm_slots;
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *data);
+
+/*
+ * Start or retire ksmds to match ksm_thread_count, then share the mm_slots
+ * out between them, trying to give each the same number of rmap_items to
+ * scan.  Called with ksm_thread_sem held for write, when no full scan is
+ * part way through, so every cursor is back at its mm_head.
+ */
+static void ksm_share_mm_slots(void)
 {
+	unsigned long load[KSM_MAX_THREADS];
+	unsigned int nr_threads = ksm_nr_threads;
+	unsigned int retired = 0;
+	struct mm_slot *mm_slot, *next;
+	struct task_struct *task;
+	struct ksm_scan *scan;
+	LIST_HEAD(mm_slots);
+	unsigned int i, least;
+
+	while (nr_threads < ksm_thread_count) {
+		scan = &ksm_scans[nr_threads];
+		task = kthread_create(ksm_scan_thread, scan,
+				      "ksmd/%u", nr_threads);
+		if (IS_ERR(task)) {
+			printk(KERN_ERR "ksm: creating kthread failed\n");
+			break;
+		}
+		scan->done = 0;
+		scan->pages_scanned = 0;
+		scan->pages_merged = 0;
+		scan->scan_rate = 0;
+		scan->yield = KSM_YIELD_TARGET;
+		scan->task = task;
+		wake_up_process(task);
+		nr_threads++;
+	}
+	/* A retired ksmd notices that it no longer owns its cursor, and exits */
+	while (nr_threads > ksm_thread_count) {
+		ksm_scans[--nr_threads].task = NULL;
+		retired++;
+	}
+
+	spin_lock(&ksm_mmlist_lock);
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		list_splice_init(&ksm_scans[i].mm_head.mm_list, &mm_slots);
+		ksm_scans[i].nr_mm_slots = 0;
+		load[i] = 0;
+	}
+
+	list_for_each_entry_safe(mm_slot, next, &mm_slots, mm_list) {
+		least = 0;
+		for (i = 1; i < nr_threads; i++)
+			if (load[i] < load[least])
+				least = i;
+		scan = &ksm_scans[least];
+		list_move_tail(&mm_slot->mm_list, &scan->mm_head.mm_list);
+		mm_slot->scan = scan;
+		scan->nr_mm_slots++;
+		load[least] += mm_slot->nr_rmap_items + 1;
+	}
+	ksm_nr_threads = nr_threads;
+	spin_unlock(&ksm_mmlist_lock);
+
+	/* Retired ksmds may be asleep waiting for work: let them see it */
+	if (retired)
+		wake_up_interruptible(&ksm_thread_wait);
+}
+
+/*
+ * Called by the last ksmd to complete its share of a full scan, while the
+ * others wait for it: flush the unstable trees and start the next scan.
+ */
+static void ksm_end_full_scan(void)
+{
+	unsigned int i;
+	int nid;
+
+	/*
+	 * A number of pages can hang around indefinitely on per-cpu
+	 * pagevecs, raised page count preventing write_protect_page
+	 * from merging them.  Though it doesn't really matter much,
+	 * it is puzzling to see some stuck in pages_volatile until
+	 * other activity jostles them out, and they also prevented
+	 * LTP's KSM test from succeeding deterministically; so drain
+	 * them here (here rather than on entry to ksm_do_scan(),
+	 * so we don't IPI too often when pages_to_scan is set low).
+	 */
+	lru_add_drain_all();
+
+	down_write(&ksm_thread_sem);
+	for (nid = 0; nid < nr_node_ids; nid++)
+		ksm_trees[nid].unstable = RB_ROOT;
+	ksm_seqnr++;
+
+	ksm_full_scan_msecs = jiffies_to_msecs(jiffies - ksm_scan_start);
+	ksm_scan_start = jiffies;
+
+	ksm_full_scan_pages = 0;
+	ksm_full_scan_merged = 0;
+	for (i = 0; i < ksm_nr_threads; i++) {
+		ksm_full_scan_pages += ksm_scans[i].pages_scanned;
+		ksm_full_scan_merged += ksm_scans[i].pages_merged;
+		ksm_scans[i].pages_scanned = 0;
+		ksm_scans[i].pages_merged = 0;
+	}
+
+	ksm_share_mm_slots();
+
+	for (i = 0; i < ksm_nr_threads; i++)
+		ksm_scans[i].done = 0;
+	atomic_set(&ksm_scans_done, 0);
+	up_write(&ksm_thread_sem);
+
+	wake_up_interruptible(&ksm_thread_wait);
+}
+
+static int ksm_scan_should_stop(struct ksm_scan *scan)
+{
+	return kthread_should_stop() || scan->task != current;
+}
+
+static int ksm_scan_thread(void *data)
+{
+	struct ksm_scan *scan = data;
+	u64 busy;
+	int last;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
-	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
-		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+	while (!ksm_scan_should_stop(scan)) {
+		last = 0;
+		busy = task_sched_runtime(current);
+		down_read(&ksm_thread_sem);
+		if (ksmd_should_run() && !scan->done && scan->task == current) {
+			ksm_do_scan(scan, ksm_thread_pages_to_scan);
+			if (scan->done)
+				last = atomic_inc_return(&ksm_scans_done) ==
+							ksm_nr_threads;
+		}
+		up_read(&ksm_thread_sem);
+
+		if (last)
+			ksm_end_full_scan();
+		busy = task_sched_runtime(current) - busy;
 
 		try_to_freeze();
 
-		if (ksmd_should_run()) {
+		if (ksmd_should_run() && !scan->done) {
 			schedule_timeout_interruptible(
-				msecs_to_jiffies(ksm_thread_sleep_millisecs));
+				ksm_sleep_jiffies(scan, busy));
 		} else {
 			wait_event_freezable(ksm_thread_wait,
-				ksmd_should_run() || kthread_should_stop());
+				(ksmd_should_run() && !scan->done) ||
+				ksm_scan_should_stop(scan));
 		}
 	}
 	return 0;
@@ -1498,6 +1892,8 @@ int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 int __ksm_enter(struct mm_struct *mm)
 {
 	struct mm_slot *mm_slot;
+	struct ksm_scan *scan;
+	unsigned int i;
 	int needs_wakeup;
 
 	mm_slot = alloc_mm_slot();
@@ -1505,16 +1901,24 @@ int __ksm_enter(struct mm_struct *mm)
 		return -ENOMEM;
 
 	/* Check ksm_run too?  Would need tighter locking */
-	needs_wakeup = list_empty(&ksm_mm_head.mm_list);
+	needs_wakeup = !ksm_mm_slots;
 
 	spin_lock(&ksm_mmlist_lock);
 	insert_to_mm_slots_hash(mm, mm_slot);
+	/* Give it to the ksmd with fewest mm_slots until the next full scan */
+	scan = &ksm_scans[0];
+	for (i = 1; i < ksm_nr_threads; i++)
+		if (ksm_scans[i].nr_mm_slots < scan->nr_mm_slots)
+			scan = &ksm_scans[i];
+	mm_slot->scan = scan;
+	scan->nr_mm_slots++;
+	ksm_mm_slots++;
 	/*
 	 * Insert just behind the scanning cursor, to let the area settle
 	 * down a little; when fork is followed by immediate exec, we don't
 	 * want ksmd to waste time setting up and tearing down an rmap_list.
 	 */
-	list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	list_add_tail(&mm_slot->mm_list, &scan->mm_slot->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -1542,14 +1946,13 @@ void __ksm_exit(struct mm_struct *mm)
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && mm_slot->scan->mm_slot != mm_slot) {
 		if (!mm_slot->rmap_list) {
-			hlist_del(&mm_slot->link);
-			list_del(&mm_slot->mm_list);
+			remove_mm_slot(mm_slot);
 			easy_to_free = 1;
 		} else {
 			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+				  &mm_slot->scan->mm_slot->mm_list);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -1764,14 +2167,18 @@ static struct stable_node *ksm_check_stable_tree(unsigned long start_pfn,
 						 unsigned long end_pfn)
 {
 	struct rb_node *node;
+	int nid;
 
-	for (node = rb_first(&root_stable_tree); node; node = rb_next(node)) {
-		struct stable_node *stable_node;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		for (node = rb_first(&ksm_trees[nid].stable); node;
+						node = rb_next(node)) {
+			struct stable_node *stable_node;
 
-		stable_node = rb_entry(node, struct stable_node, node);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			return stable_node;
+			stable_node = rb_entry(node, struct stable_node, node);
+			if (stable_node->kpfn >= start_pfn &&
+			    stable_node->kpfn < end_pfn)
+				return stable_node;
+		}
 	}
 	return NULL;
 }
@@ -1787,13 +2194,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/*
 		 * Keep it very simple for now: just lock out ksmd and
 		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
+		 * down_write_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_sem inside notifier chain
 		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * ksm_thread_sem to unlock it.   But that's safe because both
 		 * are inside mem_hotplug_mutex.
 		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
+		down_write_nested(&ksm_thread_sem, SINGLE_DEPTH_NESTING);
 		break;
 
 	case MEM_OFFLINE:
@@ -1808,7 +2215,7 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 	}
 	return NOTIFY_OK;
@@ -1872,6 +2279,52 @@ static ssize_t pages_to_scan_store(struct kobject *kobj,
 }
 KSM_ATTR(pages_to_scan);
 
+static ssize_t max_cpu_percent_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_max_cpu_percent);
+}
+
+static ssize_t max_cpu_percent_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long percent;
+	int err;
+
+	err = strict_strtoul(buf, 10, &percent);
+	if (err || percent > 100)
+		return -EINVAL;
+
+	ksm_max_cpu_percent = percent;
+
+	return count;
+}
+KSM_ATTR(max_cpu_percent);
+
+static ssize_t checksum_sample_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_checksum_sample);
+}
+
+static ssize_t checksum_sample_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long sample;
+	int err;
+
+	err = strict_strtoul(buf, 10, &sample);
+	if (err || !sample || sample > PAGE_SIZE / L1_CACHE_BYTES)
+		return -EINVAL;
+
+	ksm_checksum_sample = sample;
+
+	return count;
+}
+KSM_ATTR(checksum_sample);
+
 static ssize_t run_show(struct kobject *kobj, struct kobj_attribute *attr,
 			char *buf)
 {
@@ -1897,7 +2350,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	if (ksm_run != flags) {
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
@@ -1913,7 +2366,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -1922,24 +2375,97 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+static ssize_t nr_threads_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_thread_count);
+}
+
+static ssize_t nr_threads_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long nr_threads;
+	unsigned int i;
+	int err;
+
+	err = strict_strtoul(buf, 10, &nr_threads);
+	if (err || nr_threads < 1 || nr_threads > KSM_MAX_THREADS)
+		return -EINVAL;
+
+	down_write(&ksm_thread_sem);
+	ksm_thread_count = nr_threads;
+	/*
+	 * Normally the change waits for the current full scan to complete;
+	 * but if none has started yet, as before ksmd is first set running,
+	 * or after unmerging, there's no need to wait.
+	 */
+	for (i = 0; i < ksm_nr_threads; i++)
+		if (ksm_scans[i].done ||
+		    ksm_scans[i].mm_slot != &ksm_scans[i].mm_head)
+			break;
+	if (i == ksm_nr_threads)
+		ksm_share_mm_slots();
+	up_write(&ksm_thread_sem);
+
+	return count;
+}
+KSM_ATTR(nr_threads);
+
+#ifdef CONFIG_NUMA
+static ssize_t merge_across_nodes_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_merge_across_nodes);
+}
+
+static ssize_t merge_across_nodes_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned long knob;
+	int err;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	/*
+	 * Merged pages would be left in trees no longer searched: so only
+	 * allow a change when there are none, as after unmerging with run 2.
+	 */
+	down_write(&ksm_thread_sem);
+	if (ksm_merge_across_nodes != knob) {
+		if (atomic_long_read(&ksm_pages_shared))
+			err = -EBUSY;
+		else
+			ksm_merge_across_nodes = knob;
+	}
+	up_write(&ksm_thread_sem);
+
+	return err ? err : count;
+}
+KSM_ATTR(merge_across_nodes);
+#endif
+
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_shared));
 }
 KSM_ATTR_RO(pages_shared);
 
 static ssize_t pages_sharing_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_sharing));
 }
 KSM_ATTR_RO(pages_sharing);
 
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_unshared));
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -1948,8 +2474,10 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- atomic_long_read(&ksm_pages_shared)
+				- atomic_long_read(&ksm_pages_sharing)
+				- atomic_long_read(&ksm_pages_unshared);
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1963,19 +2491,66 @@ KSM_ATTR_RO(pages_volatile);
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	return sprintf(buf, "%lu\n", ksm_seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t full_scan_msecs_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_full_scan_msecs);
+}
+KSM_ATTR_RO(full_scan_msecs);
+
+static ssize_t full_scan_pages_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_full_scan_pages);
+}
+KSM_ATTR_RO(full_scan_pages);
+
+static ssize_t full_scan_merged_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_full_scan_merged);
+}
+KSM_ATTR_RO(full_scan_merged);
+
+static ssize_t scan_rate_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int i;
+
+	down_read(&ksm_thread_sem);
+	for (i = 0; i < ksm_nr_threads; i++)
+		len += sprintf(buf + len, "%s%lu", i ? " " : "",
+			       ksm_scans[i].scan_rate);
+	up_read(&ksm_thread_sem);
+
+	return len + sprintf(buf + len, "\n");
+}
+KSM_ATTR_RO(scan_rate);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
+	&max_cpu_percent_attr.attr,
+	&checksum_sample_attr.attr,
 	&run_attr.attr,
+	&nr_threads_attr.attr,
+#ifdef CONFIG_NUMA
+	&merge_across_nodes_attr.attr,
+#endif
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&full_scan_msecs_attr.attr,
+	&full_scan_pages_attr.attr,
+	&full_scan_merged_attr.attr,
+	&scan_rate_attr.attr,
 	NULL,
 };
 
@@ -1988,18 +2563,41 @@ static struct attribute_group ksm_attr_group = {
 static int __init ksm_init(void)
 {
 	struct task_struct *ksm_thread;
+	unsigned int i;
+	int nid;
 	int err;
 
+	ksm_trees = kcalloc(nr_node_ids, sizeof(*ksm_trees), GFP_KERNEL);
+	if (!ksm_trees) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		mutex_init(&ksm_trees[nid].mutex);
+		ksm_trees[nid].stable = RB_ROOT;
+		ksm_trees[nid].unstable = RB_ROOT;
+	}
+
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		INIT_LIST_HEAD(&ksm_scans[i].mm_head.mm_list);
+		ksm_scans[i].mm_slot = &ksm_scans[i].mm_head;
+		ksm_scans[i].yield = KSM_YIELD_TARGET;
+	}
+	ksm_scan_start = jiffies;
+
 	err = ksm_slab_init();
 	if (err)
-		goto out;
+		goto out_trees;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
+	ksm_thread = kthread_create(ksm_scan_thread, &ksm_scans[0], "ksmd");
 	if (IS_ERR(ksm_thread)) {
 		printk(KERN_ERR "ksm: creating kthread failed\n");
 		err = PTR_ERR(ksm_thread);
 		goto out_free;
 	}
+	ksm_scans[0].task = ksm_thread;
+	ksm_nr_threads = 1;
+	wake_up_process(ksm_thread);
 
 #ifdef CONFIG_SYSFS
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
@@ -2015,7 +2613,7 @@ static int __init ksm_init(void)
 
 #ifdef CONFIG_MEMORY_HOTREMOVE
 	/*
-	 * Choose a high priority since the callback takes ksm_thread_mutex:
+	 * Choose a high priority since the callback takes ksm_thread_sem:
 	 * later callbacks could only be taking locks which nest within that.
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
@@ -2024,6 +2622,8 @@ static int __init ksm_init(void)
 
 out_free:
 	ksm_slab_free();
+out_trees:
+	kfree(ksm_trees);
 out:
 	return err;
 }
@@ -106,6 +106,7 @@ unsigned long totalreserve_pages __read_mostly;
 unsigned long dirty_balance_reserve __read_mostly;
 
 int percpu_pagelist_fraction;
+int percpu_pagelist_high_order = PAGE_ALLOC_COSTLY_ORDER;
 gfp_t gfp_allowed_mask __read_mostly = GFP_BOOT_MASK;
 
 #ifdef CONFIG_PM_SLEEP
@@ -150,6 +151,8 @@ int pageblock_order __read_mostly;
 #endif
 
 static void __free_pages_ok(struct page *page, unsigned int order);
+static void __free_hot_cold_page(struct page *page, unsigned int order,
+				 int cold);
 
 /*
  * results with 256, 32 in the lowmem_reserve sysctl:
@@ -618,10 +621,26 @@ static inline int free_pages_check(struct page *page)
 	return 0;
 }
 
+static inline unsigned int order_to_pindex(int migratetype, unsigned int order)
+{
+	return order * MIGRATE_PCPTYPES + migratetype;
+}
+
+static inline unsigned int pindex_to_order(unsigned int pindex)
+{
+	return pindex / MIGRATE_PCPTYPES;
+}
+
+static inline bool pcp_allowed_order(unsigned int order)
+{
+	return order <= percpu_pagelist_high_order;
+}
+
 /*
  * Frees a number of pages from the PCP lists
- * Assumes all pages on list are in same zone, and of same order.
- * count is the number of pages to free.
+ * Assumes all pages on list are in same zone.
+ * count is the number of base pages to free; a higher order page at the
+ * end may take it a little further.  pcp->count is updated.
  *
  * If the zone was previously in an "all pages pinned" state then look to
  * see if this freeing clears that state.
@@ -632,17 +651,19 @@ static inline int free_pages_check(struct page *page)
 static void free_pcppages_bulk(struct zone *zone, int count,
 					struct per_cpu_pages *pcp)
 {
-	int migratetype = 0;
+	int pindex = 0;
 	int batch_free = 0;
 	int to_free = count;
+	int freed = 0;
 
 	spin_lock(&zone->lock);
 	zone->all_unreclaimable = 0;
 	zone->pages_scanned = 0;
 
-	while (to_free) {
+	while (to_free > 0) {
 		struct page *page;
 		struct list_head *list;
+		unsigned int order;
 
 		/*
 		 * Remove pages from lists in a round-robin fashion. A
@@ -653,25 +674,29 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 		 */
 		do {
 			batch_free++;
-			if (++migratetype == MIGRATE_PCPTYPES)
-				migratetype = 0;
-			list = &pcp->lists[migratetype];
+			if (++pindex == NR_PCP_LISTS)
+				pindex = 0;
+			list = &pcp->lists[pindex];
 		} while (list_empty(list));
 
 		/* This is the only non-empty list. Free them all. */
-		if (batch_free == MIGRATE_PCPTYPES)
+		if (batch_free == NR_PCP_LISTS)
 			batch_free = to_free;
 
+		order = pindex_to_order(pindex);
 		do {
 			page = list_entry(list->prev, struct page, lru);
 			/* must delete as __free_one_page list manipulates */
 			list_del(&page->lru);
 			/* MIGRATE_MOVABLE list may include MIGRATE_RESERVEs */
-			__free_one_page(page, zone, 0, page_private(page));
-			trace_mm_page_pcpu_drain(page, 0, page_private(page));
-		} while (--to_free && --batch_free && !list_empty(list));
+			__free_one_page(page, zone, order, page_private(page));
+			trace_mm_page_pcpu_drain(page, order, page_private(page));
+			to_free -= 1 << order;
+			freed += 1 << order;
+		} while (to_free > 0 && --batch_free && !list_empty(list));
 	}
-	__mod_zone_page_state(zone, NR_FREE_PAGES, count);
+	pcp->count -= freed;
+	__mod_zone_page_state(zone, NR_FREE_PAGES, freed);
 	spin_unlock(&zone->lock);
 }
 
@@ -687,6 +712,136 @@ static void free_one_page(struct zone *zone, struct page *page, int order,
 	spin_unlock(&zone->lock);
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Each zone keeps up to thp_cache_pages free movable huge pages aside
+ * instead of merging them back into free_area.  A huge page fault that
+ * follows a huge page free, as when processes come and go, takes one
+ * under its own lock and neither splits a larger block nor waits for
+ * compaction.  The pages are given back by drain_all_pages(), which
+ * reclaim and page isolation call before relying on free_area.
+ */
+int thp_cache_pages = 2;
+
+/* Called with interrupts disabled */
+static bool thp_cache_put(struct zone *zone, struct page *page,
+			  unsigned int order, int migratetype)
+{
+	bool cached = false;
+
+	if (order != HPAGE_PMD_ORDER || migratetype != MIGRATE_MOVABLE)
+		return false;
+
+	spin_lock(&zone->thp_cache_lock);
+	if (zone->thp_cache_count < thp_cache_pages) {
+		list_add(&page->lru, &zone->thp_cache);
+		zone->thp_cache_count++;
+		cached = true;
+	}
+	spin_unlock(&zone->thp_cache_lock);
+	return cached;
+}
+
+/* Called with interrupts disabled */
+static struct page *thp_cache_get(struct zone *zone, unsigned int order,
+				  int migratetype)
+{
+	struct page *page = NULL;
+
+	if (order != HPAGE_PMD_ORDER || migratetype != MIGRATE_MOVABLE ||
+	    !zone->thp_cache_count)
+		return NULL;
+
+	spin_lock(&zone->thp_cache_lock);
+	if (!list_empty(&zone->thp_cache)) {
+		page = list_first_entry(&zone->thp_cache, struct page, lru);
+		list_del(&page->lru);
+		zone->thp_cache_count--;
+	}
+	spin_unlock(&zone->thp_cache_lock);
+	return page;
+}
+
+/*
+ * Cached huge pages are not counted as free, so the watermark check
+ * would fail a huge page allocation that could be served from them.
+ */
+static inline bool thp_cache_ready(struct zone *zone, unsigned int order,
+				   int migratetype)
+{
+	return order == HPAGE_PMD_ORDER && migratetype == MIGRATE_MOVABLE &&
+		zone->thp_cache_count;
+}
+
+/* Give back all but @keep of the zone's cached huge pages */
+static void drain_thp_cache(struct zone *zone, int keep)
+{
+	struct page *page, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	if (zone->thp_cache_count <= keep)
+		return;
+
+	spin_lock_irqsave(&zone->thp_cache_lock, flags);
+	while (zone->thp_cache_count > keep) {
+		page = list_first_entry(&zone->thp_cache, struct page, lru);
+		list_move(&page->lru, &list);
+		zone->thp_cache_count--;
+	}
+	spin_unlock(&zone->thp_cache_lock);
+
+	/* The block may have been isolated meanwhile */
+	list_for_each_entry_safe(page, next, &list, lru) {
+		list_del(&page->lru);
+		free_one_page(zone, page, HPAGE_PMD_ORDER,
+			      get_pageblock_migratetype(page));
+	}
+	local_irq_restore(flags);
+}
+
+static void drain_thp_caches(int keep)
+{
+	struct zone *zone;
+
+	for_each_populated_zone(zone)
+		drain_thp_cache(zone, keep);
+}
+
+int thp_cache_pages_sysctl_handler(ctl_table *table, int write,
+	void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int ret;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write)
+		drain_thp_caches(thp_cache_pages);
+	return ret;
+}
+#else
+static inline bool thp_cache_put(struct zone *zone, struct page *page,
+				 unsigned int order, int migratetype)
+{
+	return false;
+}
+
+static inline struct page *thp_cache_get(struct zone *zone,
+					 unsigned int order, int migratetype)
+{
+	return NULL;
+}
+
+static inline bool thp_cache_ready(struct zone *zone, unsigned int order,
+				   int migratetype)
+{
+	return false;
+}
+
+static inline void drain_thp_caches(int keep)
+{
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 static bool free_pages_prepare(struct page *page, unsigned int order)
 {
 	int i;
@@ -697,6 +852,12 @@ static bool free_pages_prepare(struct page *page, unsigned int order)
 
 	if (PageAnon(page))
 		page->mapping = NULL;
+	/*
+	 * Pages kept on the pcp lists or in the thp cache skip
+	 * __free_one_page(), and prep_new_page() makes them compound again
+	 */
+	if (unlikely(PageCompound(page)))
+		bad += destroy_compound_page(page, order);
 	for (i = 0; i < (1 << order); i++)
 		bad += free_pages_check(page + i);
 	if (bad)
@@ -716,17 +877,25 @@ static bool free_pages_prepare(struct page *page, unsigned int order)
 static void __free_pages_ok(struct page *page, unsigned int order)
 {
 	unsigned long flags;
-	int wasMlocked = __TestClearPageMlocked(page);
+	int wasMlocked;
+	int migratetype;
 
+	if (pcp_allowed_order(order)) {
+		__free_hot_cold_page(page, order, 0);
+		return;
+	}
+
+	wasMlocked = __TestClearPageMlocked(page);
 	if (!free_pages_prepare(page, order))
 		return;
 
+	migratetype = get_pageblock_migratetype(page);
 	local_irq_save(flags);
 	if (unlikely(wasMlocked))
 		free_page_mlock(page);
 	__count_vm_events(PGFREE, 1 << order);
-	free_one_page(page_zone(page), page, order,
-					get_pageblock_migratetype(page));
+	if (!thp_cache_put(page_zone(page), page, order, migratetype))
+		free_one_page(page_zone(page), page, order, migratetype);
 	local_irq_restore(flags);
 }
 
@@ -1119,7 +1288,6 @@ void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp)
 	else
 		to_drain = pcp->count;
 	free_pcppages_bulk(zone, to_drain, pcp);
-	pcp->count -= to_drain;
 	local_irq_restore(flags);
 }
 #endif
@@ -1144,10 +1312,8 @@ static void drain_pages(unsigned int cpu)
 		pset = per_cpu_ptr(zone->pageset, cpu);
 
 		pcp = &pset->pcp;
-		if (pcp->count) {
+		if (pcp->count)
 			free_pcppages_bulk(zone, pcp->count, pcp);
-			pcp->count = 0;
-		}
 		local_irq_restore(flags);
 	}
 }
@@ -1161,11 +1327,13 @@ void drain_local_pages(void *arg)
 }
 
 /*
- * Spill all the per-cpu pages from all CPUs back into the buddy allocator
+ * Spill all the per-cpu pages from all CPUs, and the cached huge pages,
+ * back into the buddy allocator
  */
 void drain_all_pages(void)
 {
 	on_each_cpu(drain_local_pages, NULL, 1);
+	drain_thp_caches(0);
 }
 
 #ifdef CONFIG_HIBERNATION
@@ -1205,18 +1373,20 @@ void mark_free_pages(struct zone *zone)
 #endif /* CONFIG_PM */
 
 /*
- * Free a 0-order page
+ * Free a page of an order kept on the pcp lists
  * cold == 1 ? free a cold page : free a hot page
  */
-void free_hot_cold_page(struct page *page, int cold)
+static void __free_hot_cold_page(struct page *page, unsigned int order,
+				 int cold)
 {
 	struct zone *zone = page_zone(page);
 	struct per_cpu_pages *pcp;
+	struct list_head *list;
 	unsigned long flags;
 	int migratetype;
 	int wasMlocked = __TestClearPageMlocked(page);
 
-	if (!free_pages_prepare(page, 0))
+	if (!free_pages_prepare(page, order))
 		return;
 
 	migratetype = get_pageblock_migratetype(page);
@@ -1224,7 +1394,7 @@ void free_hot_cold_page(struct page *page, int cold)
 	local_irq_save(flags);
 	if (unlikely(wasMlocked))
 		free_page_mlock(page);
-	__count_vm_event(PGFREE);
+	__count_vm_events(PGFREE, 1 << order);
 
 	/*
 	 * We only track unmovable, reclaimable and movable on pcp lists.
@@ -1235,27 +1405,35 @@ void free_hot_cold_page(struct page *page, int cold)
 	 */
 	if (migratetype >= MIGRATE_PCPTYPES) {
 		if (unlikely(migratetype == MIGRATE_ISOLATE)) {
-			free_one_page(zone, page, 0, migratetype);
+			free_one_page(zone, page, order, migratetype);
 			goto out;
 		}
 		migratetype = MIGRATE_MOVABLE;
 	}
 
 	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	list = &pcp->lists[order_to_pindex(migratetype, order)];
 	if (cold)
-		list_add_tail(&page->lru, &pcp->lists[migratetype]);
+		list_add_tail(&page->lru, list);
 	else
-		list_add(&page->lru, &pcp->lists[migratetype]);
-	pcp->count++;
-	if (pcp->count >= pcp->high) {
+		list_add(&page->lru, list);
+	pcp->count += 1 << order;
+	if (pcp->count >= pcp->high)
 		free_pcppages_bulk(zone, pcp->batch, pcp);
-		pcp->count -= pcp->batch;
-	}
 
 out:
 	local_irq_restore(flags);
 }
 
+/*
+ * Free a 0-order page
+ * cold == 1 ? free a cold page : free a hot page
+ */
+void free_hot_cold_page(struct page *page, int cold)
+{
+	__free_hot_cold_page(page, 0, cold);
+}
+
 /*
  * Free a list of 0-order pages
  */
@@ -1356,18 +1534,32 @@ struct page *buffered_rmqueue(struct zone *preferred_zone,
 	struct page *page;
 	int cold = !!(gfp_flags & __GFP_COLD);
 
+	if (unlikely(gfp_flags & __GFP_NOFAIL)) {
+		/*
+		 * __GFP_NOFAIL is not to be used in new code.
+		 *
+		 * All __GFP_NOFAIL callers should be fixed so that they
+		 * properly detect and handle allocation failures.
+		 *
+		 * We most definitely don't want callers attempting to
+		 * allocate greater than order-1 page units with
+		 * __GFP_NOFAIL.
+		 */
+		WARN_ON_ONCE(order > 1);
+	}
+
 again:
-	if (likely(order == 0)) {
+	if (likely(pcp_allowed_order(order))) {
 		struct per_cpu_pages *pcp;
 		struct list_head *list;
 
 		local_irq_save(flags);
 		pcp = &this_cpu_ptr(zone->pageset)->pcp;
-		list = &pcp->lists[migratetype];
+		list = &pcp->lists[order_to_pindex(migratetype, order)];
 		if (list_empty(list)) {
-			pcp->count += rmqueue_bulk(zone, 0,
-					pcp->batch, list,
-					migratetype, cold);
+			pcp->count += rmqueue_bulk(zone, order,
+					max(pcp->batch >> order, 1), list,
+					migratetype, cold) << order;
 			if (unlikely(list_empty(list)))
 				goto failed;
 		}
@@ -1378,27 +1570,19 @@ again:
 			page = list_entry(list->next, struct page, lru);
 
 		list_del(&page->lru);
-		pcp->count--;
+		pcp->count -= 1 << order;
 	} else {
-		if (unlikely(gfp_flags & __GFP_NOFAIL)) {
-			/*
-			 * __GFP_NOFAIL is not to be used in new code.
-			 *
-			 * All __GFP_NOFAIL callers should be fixed so that they
-			 * properly detect and handle allocation failures.
-			 *
-			 * We most definitely don't want callers attempting to
-			 * allocate greater than order-1 page units with
-			 * __GFP_NOFAIL.
-			 */
-			WARN_ON_ONCE(order > 1);
+		local_irq_save(flags);
+		page = thp_cache_get(zone, order, migratetype);
+		if (!page) {
+			spin_lock(&zone->lock);
+			page = __rmqueue(zone, order, migratetype);
+			spin_unlock(&zone->lock);
+			if (!page)
+				goto failed;
+			__mod_zone_page_state(zone, NR_FREE_PAGES,
+					      -(1 << order));
 		}
-		spin_lock_irqsave(&zone->lock, flags);
-		page = __rmqueue(zone, order, migratetype);
-		spin_unlock(&zone->lock);
-		if (!page)
-			goto failed;
-		__mod_zone_page_state(zone, NR_FREE_PAGES, -(1 << order));
 	}
 
 	__count_zone_vm_events(PGALLOC, zone, 1 << order);
@@ -1765,6 +1949,8 @@ zonelist_scan:
 			if (zone_watermark_ok(zone, order, mark,
 				    classzone_idx, alloc_flags))
 				goto try_this_zone;
+			if (thp_cache_ready(zone, order, migratetype))
+				goto try_this_zone;
 
 			if (NUMA_BUILD && !did_zlc_setup && nr_online_nodes > 1) {
 				/*
@@ -3695,7 +3881,7 @@ static int zone_batchsize(struct zone *zone)
 static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 {
 	struct per_cpu_pages *pcp;
-	int migratetype;
+	int pindex;
 
 	memset(p, 0, sizeof(*p));
 
@@ -3703,8 +3889,8 @@ static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 	pcp->count = 0;
 	pcp->high = 6 * batch;
 	pcp->batch = max(1UL, 1 * batch);
-	for (migratetype = 0; migratetype < MIGRATE_PCPTYPES; migratetype++)
-		INIT_LIST_HEAD(&pcp->lists[migratetype]);
+	for (pindex = 0; pindex < NR_PCP_LISTS; pindex++)
+		INIT_LIST_HEAD(&pcp->lists[pindex]);
 }
 
 /*
@@ -4263,6 +4449,9 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat_resize_init(pgdat);
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+#endif
 	pgdat->kswapd_max_order = 0;
 	pgdat_page_cgroup_init(pgdat);
 	
@@ -4315,6 +4504,10 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 		zone->name = zone_names[j];
 		spin_lock_init(&zone->lock);
 		spin_lock_init(&zone->lru_lock);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		spin_lock_init(&zone->thp_cache_lock);
+		INIT_LIST_HEAD(&zone->thp_cache);
+#endif
 		zone_seqlock_init(zone);
 		zone->zone_pgdat = pgdat;
 
@@ -5179,6 +5372,22 @@ int percpu_pagelist_fraction_sysctl_handler(ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * percpu_pagelist_high_order - the highest order kept on the per cpu
+ * pagelists.  Pages of the orders no longer kept are drained.
+ */
+int percpu_pagelist_high_order_sysctl_handler(ctl_table *table, int write,
+	void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int old = percpu_pagelist_high_order;
+	int ret;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write && percpu_pagelist_high_order < old)
+		on_each_cpu(drain_local_pages, NULL, 1);
+	return ret;
+}
+
 int hashdist = HASHDIST_DEFAULT;
 
 #ifdef CONFIG_NUMA
@@ -0,0 +1,176 @@
+/*
+ *  linux/mm/page_alloc_bench.c
+ *
+ *  Page allocator microbenchmark.
+ *
+ *  Loading the module runs, for each order in orders=, one kernel thread
+ *  per online CPU (or threads=) that allocates batch= pages and frees
+ *  them again, loops= times.  The threads start together, so they
+ *  contend for the zone locks the way a busy system would, and the mean
+ *  time per allocation and free is printed for each order.  Orders above
+ *  PAGE_ALLOC_COSTLY_ORDER are allocated movable, like huge pages.
+ *
+ *	modprobe page_alloc_bench orders=0,1,2,3,9
+ *
+ *  The module then fails to load, so that it can be run again at once.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+
+static int orders[MAX_ORDER] = { 0, 1, 2, 3 };
+static unsigned int nr_orders = 4;
+module_param_array(orders, int, &nr_orders, 0444);
+MODULE_PARM_DESC(orders, "Orders to benchmark (default 0,1,2,3)");
+
+static int threads;
+module_param(threads, int, 0444);
+MODULE_PARM_DESC(threads, "Number of threads (default: online CPUs)");
+
+static int loops = 10000;
+module_param(loops, int, 0444);
+MODULE_PARM_DESC(loops, "Allocate and free rounds per thread");
+
+static int batch = 16;
+module_param(batch, int, 0444);
+MODULE_PARM_DESC(batch, "Pages held at once by each thread");
+
+struct bench_thread {
+	struct task_struct *task;
+	unsigned int order;
+	struct page **pages;
+	unsigned long nr_alloced;
+	unsigned long nr_failed;
+	u64 ns;
+	struct completion done;
+};
+
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *bt = data;
+	gfp_t gfp = GFP_KERNEL | __GFP_NOWARN;
+	ktime_t start;
+	int i, j;
+
+	if (bt->order > PAGE_ALLOC_COSTLY_ORDER)
+		gfp |= __GFP_MOVABLE | __GFP_NORETRY;
+
+	start = ktime_get();
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < batch; j++) {
+			bt->pages[j] = alloc_pages(gfp, bt->order);
+			if (bt->pages[j])
+				bt->nr_alloced++;
+			else
+				bt->nr_failed++;
+		}
+		for (j = 0; j < batch; j++)
+			if (bt->pages[j])
+				__free_pages(bt->pages[j], bt->order);
+		cond_resched();
+	}
+	bt->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&bt->done);
+	return 0;
+}
+
+static void bench_order(unsigned int order, int nr_threads)
+{
+	struct bench_thread *bts;
+	unsigned long alloced = 0, failed = 0;
+	u64 ns = 0;
+	int cpu, i, started;
+
+	bts = kcalloc(nr_threads, sizeof(*bts), GFP_KERNEL);
+	if (!bts)
+		return;
+
+	for (i = 0; i < nr_threads; i++) {
+		bts[i].pages = kcalloc(batch, sizeof(struct page *), GFP_KERNEL);
+		if (!bts[i].pages)
+			goto out;
+		bts[i].order = order;
+		init_completion(&bts[i].done);
+	}
+
+	/* Create them all first, so that they start at the same time */
+	i = 0;
+	for_each_online_cpu(cpu) {
+		struct task_struct *tsk;
+
+		if (i == nr_threads)
+			break;
+		tsk = kthread_create_on_node(bench_thread_fn, &bts[i],
+					     cpu_to_node(cpu),
+					     "page_alloc_bench/%d", cpu);
+		if (IS_ERR(tsk))
+			break;
+		kthread_bind(tsk, cpu);
+		bts[i++].task = tsk;
+	}
+	started = i;
+	for (i = 0; i < started; i++)
+		wake_up_process(bts[i].task);
+
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&bts[i].done);
+		alloced += bts[i].nr_alloced;
+		failed += bts[i].nr_failed;
+		ns += bts[i].ns;
+	}
+
+	if (alloced)
+		pr_info("order %u: %d threads, %lu pages, %lu failed, "
+			"%llu ns per alloc+free\n", order, started, alloced,
+			failed, (unsigned long long)div64_u64(ns, alloced));
+	else
+		pr_info("order %u: %d threads, no page allocated\n",
+			order, started);
+out:
+	for (i = 0; i < nr_threads; i++)
+		kfree(bts[i].pages);
+	kfree(bts);
+}
+
+static int __init page_alloc_bench_init(void)
+{
+	int nr_threads = threads;
+	int i;
+
+	if (nr_threads <= 0 || nr_threads > num_online_cpus())
+		nr_threads = num_online_cpus();
+	if (loops <= 0 || batch <= 0)
+		return -EINVAL;
+
+	for (i = 0; i < nr_orders; i++) {
+		if (orders[i] < 0 || orders[i] >= MAX_ORDER)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < nr_orders; i++)
+		bench_order(orders[i], nr_threads);
+
+	/* Nothing to keep loaded: failing unloads the module right away */
+	return -EAGAIN;
+}
+
+static void __exit page_alloc_bench_exit(void)
+{
+}
+
+module_init(page_alloc_bench_init);
+module_exit(page_alloc_bench_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Page allocator microbenchmark");
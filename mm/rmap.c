@@ -692,6 +692,52 @@ int page_mapped_in_vma(struct page *page, struct vm_area_struct *vma)
  * Subfunctions of page_referenced: page_referenced_one called
  * repeatedly from either page_referenced_anon or page_referenced_file.
  */
+/*
+ * A file page can also be mapped by a huge pmd, as one of HPAGE_PMD_NR
+ * small pages: the pmd's young bit stands for all of them.
+ */
+static int page_referenced_file_pmd(struct page *page,
+				    struct vm_area_struct *vma,
+				    unsigned long address,
+				    unsigned int *mapcount,
+				    unsigned long *vm_flags)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	int referenced = 0;
+	int young;
+	pmd_t *pmd;
+
+	pmd = page_check_address_file_pmd(page, mm, address);
+	if (!pmd)
+		return 0;
+
+	if (vma->vm_flags & VM_LOCKED) {
+		spin_unlock(&mm->page_table_lock);
+		*mapcount = 0;	/* break early from loop */
+		*vm_flags |= VM_LOCKED;
+		return 0;
+	}
+
+	/*
+	 * Reclaim checks each small page of the block in turn.  Only the
+	 * first one clears the shared young bit, or all but one page of
+	 * a hot block would look cold and get the pmd split for eviction.
+	 */
+	if (address & ~HPAGE_PMD_MASK)
+		young = pmd_young(*pmd);
+	else
+		young = pmdp_clear_flush_young_notify(vma, address, pmd);
+	if (young && likely(!VM_SequentialReadHint(vma)))
+		referenced++;
+	spin_unlock(&mm->page_table_lock);
+
+	(*mapcount)--;
+
+	if (referenced)
+		*vm_flags |= vma->vm_flags;
+	return referenced;
+}
+
 int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 			unsigned long address, unsigned int *mapcount,
 			unsigned long *vm_flags)
@@ -734,8 +780,12 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 		 * these out using page_check_address().
 		 */
 		pte = page_check_address(page, mm, address, &ptl, 0);
-		if (!pte)
+		if (!pte) {
+			if (transparent_hugepage_file(vma))
+				return page_referenced_file_pmd(page, vma,
+						address, mapcount, vm_flags);
 			goto out;
+		}
 
 		if (vma->vm_flags & VM_LOCKED) {
 			pte_unmap_unlock(pte, ptl);
@@ -1220,6 +1270,9 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	spinlock_t *ptl;
 	int ret = SWAP_AGAIN;
 
+	if (transparent_hugepage_file(vma) && !PageAnon(page))
+		split_file_pmd_page(page, vma, address);
+
 	pte = page_check_address(page, mm, address, &ptl, 0);
 	if (!pte)
 		goto out;
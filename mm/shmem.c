@@ -91,6 +91,12 @@ enum sgp_type {
 	SGP_WRITE,	/* may exceed i_size, may allocate page */
 };
 
+/* Values of shmem_sb_info.huge, the huge= mount option */
+#define SHMEM_HUGE_NEVER	0	/* small pages only */
+#define SHMEM_HUGE_ALWAYS	1	/* huge blocks wherever they fit */
+#define SHMEM_HUGE_WITHIN_SIZE	2	/* ... but only below i_size */
+#define SHMEM_HUGE_ADVISE	3	/* only for MADV_HUGEPAGE mappings */
+
 #ifdef CONFIG_TMPFS
 static unsigned long shmem_default_max_blocks(void)
 {
@@ -142,10 +148,11 @@ static inline void shmem_unacct_size(unsigned long flags, loff_t size)
  * shmem_getpage reports shmem_acct_block failure as -ENOSPC not -ENOMEM,
  * so that a failure on a sparse tmpfs mapping will give SIGBUS not OOM.
  */
-static inline int shmem_acct_block(unsigned long flags)
+static inline int shmem_acct_block(unsigned long flags, long pages)
 {
 	return (flags & VM_NORESERVE) ?
-		security_vm_enough_memory_kern(VM_ACCT(PAGE_CACHE_SIZE)) : 0;
+		security_vm_enough_memory_kern(pages *
+					       VM_ACCT(PAGE_CACHE_SIZE)) : 0;
 }
 
 static inline void shmem_unacct_blocks(unsigned long flags, long pages)
@@ -170,6 +177,15 @@ static struct backing_dev_info shmem_backing_dev_info  __read_mostly = {
 static LIST_HEAD(shmem_swaplist);
 static DEFINE_MUTEX(shmem_swaplist_mutex);
 
+/*
+ * Exceptional entries in a shmem mapping are swap entries, not the
+ * shadow entries reclaim leaves in other mappings.
+ */
+bool shmem_mapping(struct address_space *mapping)
+{
+	return mapping->backing_dev_info == &shmem_backing_dev_info;
+}
+
 static int shmem_reserve_inode(struct super_block *sb)
 {
 	struct shmem_sb_info *sbinfo = SHMEM_SB(sb);
@@ -855,6 +871,194 @@ static inline struct mempolicy *shmem_get_sbmpol(struct shmem_sb_info *sbinfo)
 }
 #endif
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * A huge block is HPAGE_PMD_NR small pages split from one naturally
+ * aligned allocation and inserted together at an aligned index, so a
+ * mapping of the block can use a single huge pmd (see shmem_pmd_fault).
+ * The pages are otherwise ordinary: they are swapped, truncated and
+ * migrated one at a time, and the pmd is split to ptes when that happens.
+ */
+#ifdef CONFIG_NUMA
+static struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	struct vm_area_struct pvma;
+
+	/* Create a pseudo vma that just contains the policy */
+	pvma.vm_start = 0;
+	pvma.vm_pgoff = index;
+	pvma.vm_ops = NULL;
+	pvma.vm_policy = mpol_shared_policy_lookup(&info->policy, index);
+
+	return alloc_pages_vma(gfp, HPAGE_PMD_ORDER, &pvma, 0, numa_node_id());
+}
+#else /* !CONFIG_NUMA */
+static inline struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	return alloc_pages(gfp, HPAGE_PMD_ORDER);
+}
+#endif /* CONFIG_NUMA */
+
+/*
+ * Whether the huge= option of the mount allows a huge block holding
+ * @index.  @vma is the mapping being faulted, or NULL for read, write
+ * and faults by index alone.
+ */
+static bool shmem_huge_enabled(struct inode *inode, pgoff_t index,
+			       struct vm_area_struct *vma)
+{
+	pgoff_t size;
+
+	index &= ~((pgoff_t)HPAGE_PMD_NR - 1);
+
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return true;
+	case SHMEM_HUGE_WITHIN_SIZE:
+		size = round_up(i_size_read(inode), PAGE_CACHE_SIZE);
+		return index + HPAGE_PMD_NR <= (size >> PAGE_CACHE_SHIFT);
+	case SHMEM_HUGE_ADVISE:
+		return vma && (vma->vm_flags & VM_HUGEPAGE);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Fill the empty block containing @index with the pages of one huge
+ * allocation.  Returns true if at least some of them were inserted, so
+ * that the caller should look the page up again; false if the block was
+ * not empty or no huge page could be had, when small pages are used.
+ */
+static bool shmem_alloc_huge_block(struct inode *inode, pgoff_t index,
+				   gfp_t gfp)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+	struct page *page;
+	pgoff_t start = index & ~((pgoff_t)HPAGE_PMD_NR - 1);
+	pgoff_t found;
+	int nr = 0;
+	int i;
+
+	if (start + HPAGE_PMD_NR - 1 > (MAX_LFS_FILESIZE >> PAGE_CACHE_SHIFT))
+		return false;
+	if (shmem_find_get_pages_and_swap(mapping, start, 1, &page, &found)) {
+		if (!radix_tree_exceptional_entry(page))
+			page_cache_release(page);
+		if (found < start + HPAGE_PMD_NR)
+			return false;
+	}
+
+	if (shmem_acct_block(info->flags, HPAGE_PMD_NR))
+		return false;
+	if (sbinfo->max_blocks) {
+		if (sbinfo->max_blocks < HPAGE_PMD_NR ||
+		    percpu_counter_compare(&sbinfo->used_blocks,
+				sbinfo->max_blocks - HPAGE_PMD_NR) > 0)
+			goto unacct;
+		percpu_counter_add(&sbinfo->used_blocks, HPAGE_PMD_NR);
+	}
+
+	/* A huge block is a bonus: don't try hard, or wake kswapd for it */
+	gfp |= __GFP_NORETRY | __GFP_NOWARN | __GFP_NO_KSWAPD;
+	if (!(transparent_hugepage_flags &
+	      (1 << TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)))
+		gfp &= ~__GFP_WAIT;
+	page = shmem_alloc_hugepage(gfp, info, start);
+	if (!page)
+		goto decused;
+	count_vm_event(THP_FILE_ALLOC);
+	split_page(page, HPAGE_PMD_ORDER);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		struct page *subpage = page + i;
+
+		SetPageSwapBacked(subpage);
+		__set_page_locked(subpage);
+		if (mem_cgroup_cache_charge(subpage, current->mm,
+					    gfp & GFP_RECLAIM_MASK) ||
+		    shmem_add_to_page_cache(subpage, mapping, start + i,
+					    gfp, NULL)) {
+			/* Leave what was inserted, free the rest */
+			for (; i < HPAGE_PMD_NR; i++) {
+				if (PageLocked(page + i))
+					unlock_page(page + i);
+				page_cache_release(page + i);
+			}
+			break;
+		}
+		lru_cache_add_anon(subpage);
+		clear_highpage(subpage);
+		flush_dcache_page(subpage);
+		SetPageUptodate(subpage);
+		unlock_page(subpage);
+		page_cache_release(subpage);
+		nr++;
+	}
+
+	if (nr) {
+		spin_lock(&info->lock);
+		info->alloced += nr;
+		inode->i_blocks += nr * BLOCKS_PER_PAGE;
+		shmem_recalc_inode(inode);
+		spin_unlock(&info->lock);
+	}
+	if (nr == HPAGE_PMD_NR)
+		return true;
+decused:
+	if (sbinfo->max_blocks)
+		percpu_counter_add(&sbinfo->used_blocks, nr - HPAGE_PMD_NR);
+unacct:
+	shmem_unacct_blocks(info->flags, HPAGE_PMD_NR - nr);
+	return nr != 0;
+}
+
+#if defined(CONFIG_TMPFS) || defined(CONFIG_SYSFS)
+static int shmem_parse_huge(const char *str)
+{
+	if (!strcmp(str, "never"))
+		return SHMEM_HUGE_NEVER;
+	if (!strcmp(str, "always"))
+		return SHMEM_HUGE_ALWAYS;
+	if (!strcmp(str, "within_size"))
+		return SHMEM_HUGE_WITHIN_SIZE;
+	if (!strcmp(str, "advise"))
+		return SHMEM_HUGE_ADVISE;
+	return -EINVAL;
+}
+
+static const char *shmem_format_huge(int huge)
+{
+	switch (huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return "always";
+	case SHMEM_HUGE_WITHIN_SIZE:
+		return "within_size";
+	case SHMEM_HUGE_ADVISE:
+		return "advise";
+	default:
+		return "never";
+	}
+}
+#endif
+#else /* !CONFIG_TRANSPARENT_HUGEPAGE */
+static inline bool shmem_huge_enabled(struct inode *inode, pgoff_t index,
+				      struct vm_area_struct *vma)
+{
+	return false;
+}
+
+static inline bool shmem_alloc_huge_block(struct inode *inode, pgoff_t index,
+					  gfp_t gfp)
+{
+	return false;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 /*
  * shmem_getpage_gfp - find page in cache, or get from swap, or allocate
  *
@@ -877,7 +1081,7 @@ static int shmem_getpage_gfp(struct inode *inode, pgoff_t index,
 		return -EFBIG;
 repeat:
 	swap.val = 0;
-	page = find_lock_page(mapping, index);
+	page = find_lock_entry(mapping, index);
 	if (radix_tree_exceptional_entry(page)) {
 		swap = radix_to_swp_entry(page);
 		page = NULL;
@@ -909,7 +1113,7 @@ repeat:
 
 	if (swap.val) {
 		/* Look it up and read it in.. */
-		page = lookup_swap_cache(swap);
+		page = lookup_swap_cache(swap, NULL, 0);
 		if (!page) {
 			/* here we actually do the io */
 			if (fault_type)
@@ -956,7 +1160,11 @@ repeat:
 		swap_free(swap);
 
 	} else {
-		if (shmem_acct_block(info->flags)) {
+		if (shmem_huge_enabled(inode, index, NULL) &&
+		    shmem_alloc_huge_block(inode, index, gfp))
+			goto repeat;
+
+		if (shmem_acct_block(info->flags, 1)) {
 			error = -ENOSPC;
 			goto failed;
 		}
@@ -1025,7 +1233,7 @@ unacct:
 	shmem_unacct_blocks(info->flags, 1);
 failed:
 	if (swap.val && error != -EINVAL) {
-		struct page *test = find_get_page(mapping, index);
+		struct page *test = find_get_entry(mapping, index);
 		if (test && !radix_tree_exceptional_entry(test))
 			page_cache_release(test);
 		/* Have another try if the entry has changed */
@@ -1065,6 +1273,156 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return ret;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Map a whole huge block with one pmd, if the block is in place or can
+ * be allocated.  Anything short of that - a partly swapped out or
+ * truncated block, pages from different allocations, a page locked by
+ * someone else - falls back to mapping small pages through shmem_fault.
+ */
+static int shmem_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd, unsigned int flags)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *head, *page;
+	pgoff_t index, size;
+	int i, nr = 0;
+	int ret = VM_FAULT_FALLBACK;
+
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	if (vma->vm_flags & (VM_NOHUGEPAGE | VM_NONLINEAR))
+		return VM_FAULT_FALLBACK;
+	/* A private write needs a copy of its page, not the shared block */
+	if ((flags & FAULT_FLAG_WRITE) && !(vma->vm_flags & VM_SHARED))
+		return VM_FAULT_FALLBACK;
+
+	index = ((haddr - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if (index & (HPAGE_PMD_NR - 1))
+		return VM_FAULT_FALLBACK;
+	if (!shmem_huge_enabled(inode, index, vma))
+		return VM_FAULT_FALLBACK;
+	size = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (index + HPAGE_PMD_NR > size)
+		return VM_FAULT_FALLBACK;
+
+	head = find_lock_entry(mapping, index);
+	if (!head) {
+		if (!shmem_alloc_huge_block(inode, index,
+					    mapping_gfp_mask(mapping)))
+			return VM_FAULT_FALLBACK;
+		head = find_lock_entry(mapping, index);
+	}
+	if (!head || radix_tree_exceptional_entry(head))
+		return VM_FAULT_FALLBACK;
+	nr = 1;
+	if (page_to_pfn(head) & (HPAGE_PMD_NR - 1))
+		goto out;
+
+	/*
+	 * Holding every page locked keeps truncation, reclaim and migration
+	 * away from the block until the pmd is in place; they then find it
+	 * through the rmap and split it.  Trylock, as we hold mmap_sem.
+	 */
+	for (; nr < HPAGE_PMD_NR; nr++) {
+		page = find_get_entry(mapping, index + nr);
+		if (page != head + nr) {
+			if (page && !radix_tree_exceptional_entry(page))
+				page_cache_release(page);
+			goto out;
+		}
+		if (!trylock_page(page)) {
+			page_cache_release(page);
+			goto out;
+		}
+		if (page->mapping != mapping || !PageUptodate(page) ||
+		    PageHWPoison(page)) {
+			unlock_page(page);
+			page_cache_release(page);
+			goto out;
+		}
+	}
+	if (!PageUptodate(head) || PageHWPoison(head))
+		goto out;
+
+	/* Perhaps the file has been truncated since we checked */
+	size = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	if (index + HPAGE_PMD_NR > size)
+		goto out;
+
+	if (!do_huge_pmd_file_page(vma->vm_mm, vma, haddr, pmd, head))
+		ret = 0;
+out:
+	for (i = 0; i < nr; i++) {
+		unlock_page(head + i);
+		if (ret)
+			page_cache_release(head + i);
+	}
+	return ret;
+}
+
+#ifdef CONFIG_SYSFS
+/*
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled: the huge= policy
+ * of the internal mount, used by SysV shm and shared anonymous memory.
+ */
+static ssize_t shmem_enabled_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	static const int values[] = {
+		SHMEM_HUGE_ALWAYS,
+		SHMEM_HUGE_WITHIN_SIZE,
+		SHMEM_HUGE_ADVISE,
+		SHMEM_HUGE_NEVER,
+	};
+	int huge, i, count;
+
+	if (IS_ERR(shm_mnt))
+		return -ENODEV;
+	huge = SHMEM_SB(shm_mnt->mnt_sb)->huge;
+	for (i = 0, count = 0; i < ARRAY_SIZE(values); i++) {
+		const char *fmt = values[i] == huge ? "[%s] " : "%s ";
+
+		count += sprintf(buf + count, fmt,
+				 shmem_format_huge(values[i]));
+	}
+	buf[count - 1] = '\n';
+	return count;
+}
+
+static ssize_t shmem_enabled_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	char tmp[16];
+	int huge;
+
+	if (IS_ERR(shm_mnt))
+		return -ENODEV;
+	if (count + 1 > sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, buf, count);
+	tmp[count] = '\0';
+	if (count && tmp[count - 1] == '\n')
+		tmp[count - 1] = '\0';
+
+	huge = shmem_parse_huge(tmp);
+	if (huge < 0)
+		return huge;
+	if (huge != SHMEM_HUGE_NEVER && !has_transparent_hugepage())
+		return -EINVAL;
+
+	SHMEM_SB(shm_mnt->mnt_sb)->huge = huge;
+	return count;
+}
+
+struct kobj_attribute shmem_enabled_attr =
+	__ATTR(shmem_enabled, 0644, shmem_enabled_show, shmem_enabled_store);
+#endif /* CONFIG_SYSFS */
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 #ifdef CONFIG_NUMA
 static int shmem_set_policy(struct vm_area_struct *vma, struct mempolicy *mpol)
 {
@@ -1108,6 +1466,87 @@ out_nomem:
 	return retval;
 }
 
+/*
+ * Place mappings of huge enabled files, and shared anonymous mappings if
+ * the internal mount is, so that file offsets and addresses agree modulo
+ * HPAGE_PMD_SIZE: otherwise no huge block could be mapped by a pmd.
+ */
+unsigned long shmem_get_unmapped_area(struct file *file,
+				      unsigned long uaddr, unsigned long len,
+				      unsigned long pgoff, unsigned long flags)
+{
+	unsigned long (*get_area)(struct file *,
+		unsigned long, unsigned long, unsigned long, unsigned long);
+	unsigned long addr;
+	unsigned long offset;
+	unsigned long inflated_len;
+	unsigned long inflated_addr;
+	unsigned long inflated_offset;
+	struct super_block *sb;
+
+	if (len > TASK_SIZE)
+		return -ENOMEM;
+
+	get_area = current->mm->get_unmapped_area;
+	addr = get_area(file, uaddr, len, pgoff, flags);
+
+	if (!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
+		return addr;
+	if (IS_ERR_VALUE(addr))
+		return addr;
+	if (addr & ~PAGE_MASK)
+		return addr;
+	if (addr > TASK_SIZE - len)
+		return addr;
+	if (len < HPAGE_PMD_SIZE)
+		return addr;
+	if (flags & MAP_FIXED)
+		return addr;
+	/*
+	 * Our priority is to support MAP_SHARED mapped hugely;
+	 * and support MAP_PRIVATE mapped hugely too, until it is COWed.
+	 * But if caller specified an address hint, respect that as before.
+	 */
+	if (uaddr)
+		return addr;
+
+	if (file)
+		sb = file->f_path.dentry->d_inode->i_sb;
+	else if (!IS_ERR(shm_mnt))
+		sb = shm_mnt->mnt_sb;
+	else
+		return addr;
+	if (SHMEM_SB(sb)->huge == SHMEM_HUGE_NEVER)
+		return addr;
+
+	offset = (pgoff << PAGE_SHIFT) & (HPAGE_PMD_SIZE - 1);
+	if (offset && offset + len < 2 * HPAGE_PMD_SIZE)
+		return addr;
+	if ((addr & (HPAGE_PMD_SIZE - 1)) == offset)
+		return addr;
+
+	inflated_len = len + HPAGE_PMD_SIZE - PAGE_SIZE;
+	if (inflated_len > TASK_SIZE)
+		return addr;
+	if (inflated_len < len)
+		return addr;
+
+	inflated_addr = get_area(NULL, 0, inflated_len, 0, flags);
+	if (IS_ERR_VALUE(inflated_addr))
+		return addr;
+	if (inflated_addr & ~PAGE_MASK)
+		return addr;
+
+	inflated_offset = inflated_addr & (HPAGE_PMD_SIZE - 1);
+	inflated_addr += offset - inflated_offset;
+	if (inflated_offset > offset)
+		inflated_addr += HPAGE_PMD_SIZE;
+
+	if (inflated_addr > TASK_SIZE - len)
+		return addr;
+	return inflated_addr;
+}
+
 static int shmem_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	file_accessed(file);
@@ -2090,6 +2529,17 @@ static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 		} else if (!strcmp(this_char,"mpol")) {
 			if (mpol_parse_str(value, &sbinfo->mpol, 1))
 				goto bad_val;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		} else if (!strcmp(this_char,"huge")) {
+			int huge = shmem_parse_huge(value);
+
+			if (huge < 0)
+				goto bad_val;
+			if (huge != SHMEM_HUGE_NEVER &&
+			    !has_transparent_hugepage())
+				goto bad_val;
+			sbinfo->huge = huge;
+#endif
 		} else {
 			printk(KERN_ERR "tmpfs: Bad mount option %s\n",
 			       this_char);
@@ -2135,6 +2585,7 @@ static int shmem_remount_fs(struct super_block *sb, int *flags, char *data)
 	sbinfo->max_blocks  = config.max_blocks;
 	sbinfo->max_inodes  = config.max_inodes;
 	sbinfo->free_inodes = config.max_inodes - inodes;
+	sbinfo->huge        = config.huge;
 
 	mpol_put(sbinfo->mpol);
 	sbinfo->mpol        = config.mpol;	/* transfers initial ref */
@@ -2158,6 +2609,10 @@ static int shmem_show_options(struct seq_file *seq, struct dentry *root)
 		seq_printf(seq, ",uid=%u", sbinfo->uid);
 	if (sbinfo->gid != 0)
 		seq_printf(seq, ",gid=%u", sbinfo->gid);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (sbinfo->huge)
+		seq_printf(seq, ",huge=%s", shmem_format_huge(sbinfo->huge));
+#endif
 	shmem_show_mpol(seq, sbinfo->mpol);
 	return 0;
 }
@@ -2301,6 +2756,7 @@ static const struct address_space_operations shmem_aops = {
 
 static const struct file_operations shmem_file_operations = {
 	.mmap		= shmem_mmap,
+	.get_unmapped_area = shmem_get_unmapped_area,
 #ifdef CONFIG_TMPFS
 	.llseek		= generic_file_llseek,
 	.read		= do_sync_read,
@@ -2374,6 +2830,9 @@ static const struct super_operations shmem_ops = {
 
 static const struct vm_operations_struct shmem_vm_ops = {
 	.fault		= shmem_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.pmd_fault	= shmem_pmd_fault,
+#endif
 #ifdef CONFIG_NUMA
 	.set_policy     = shmem_set_policy,
 	.get_policy     = shmem_get_policy,
@@ -2474,12 +2933,26 @@ void shmem_unlock_mapping(struct address_space *mapping)
 {
 }
 
+bool shmem_mapping(struct address_space *mapping)
+{
+	return false;
+}
+
 void shmem_truncate_range(struct inode *inode, loff_t lstart, loff_t lend)
 {
 	truncate_inode_pages_range(inode->i_mapping, lstart, lend);
 }
 EXPORT_SYMBOL_GPL(shmem_truncate_range);
 
+#ifdef CONFIG_MMU
+unsigned long shmem_get_unmapped_area(struct file *file,
+				      unsigned long addr, unsigned long len,
+				      unsigned long pgoff, unsigned long flags)
+{
+	return current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
+}
+#endif
+
 #define shmem_vm_ops				generic_file_vm_ops
 #define shmem_file_operations			ramfs_file_operations
 #define shmem_get_inode(sb, dir, mode, dev, flags)	ramfs_get_inode(sb, dir, mode, dev)
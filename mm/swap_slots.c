@@ -0,0 +1,233 @@
+/*
+ *  linux/mm/swap_slots.c
+ *
+ *  Per-cpu caches of swap slots.
+ *
+ *  Every get_swap_page() and every final swapcache_free() used to take
+ *  swap_lock, which with several CPUs reclaiming to a fast device made
+ *  it one of the hottest locks in the kernel.  Each CPU now keeps a
+ *  small cache of slots allocated in one go under a single swap_lock
+ *  hold, and a second one of slots waiting to be freed, which are also
+ *  handed back together.
+ *
+ *  Cached slots carry SWAP_HAS_CACHE in the swap map but have no page
+ *  in the swap cache, just like the slot add_to_swap() is about to use,
+ *  and they count as used swap.  So the caches are turned off while
+ *  free swap is short, and drained when a device is swapped off or a
+ *  CPU goes away.
+ */
+
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/init.h>
+
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+/*
+ * Caches are used while there is at least this much free swap per CPU,
+ * and the gap between the two keeps them from flapping.
+ */
+#define THRESHOLD_ACTIVATE_SWAP_SLOTS_CACHE	(5 * SWAP_SLOTS_CACHE_SIZE)
+#define THRESHOLD_DEACTIVATE_SWAP_SLOTS_CACHE	(2 * SWAP_SLOTS_CACHE_SIZE)
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* protects slots, cur, nr */
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	int		cur;
+	int		nr;
+	spinlock_t	free_lock;	/* protects slots_ret, n_ret */
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+	int		n_ret;
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+
+/* Off during swapoff, and until the first swapon */
+bool swap_slot_cache_enabled;
+/* Off while free swap is short */
+static bool swap_slot_cache_active;
+
+/* Serialises swapon and swapoff against each other's enable and disable */
+static DEFINE_MUTEX(swap_slots_cache_enable_mutex);
+/* Serialises changes to swap_slot_cache_active */
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+
+/*
+ * Both flags are changed before the caches are drained, and the drain
+ * takes every cache's locks, so a fast path testing this under one of
+ * them either runs before the drain or sees the caches turned off.
+ */
+static inline bool use_swap_slot_cache(void)
+{
+	return swap_slot_cache_enabled && swap_slot_cache_active;
+}
+
+static void drain_slots_cache_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->alloc_lock);
+	if (cache->nr) {
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->cur = 0;
+		cache->nr = 0;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	spin_lock(&cache->free_lock);
+	if (cache->n_ret) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	spin_unlock(&cache->free_lock);
+}
+
+static void drain_slots_caches(void)
+{
+	unsigned int cpu;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+		drain_slots_cache_cpu(cpu);
+	put_online_cpus();
+}
+
+/*
+ * Called from get_swap_page() before it takes its own cache's lock, so
+ * that turning the caches off can drain that one too.
+ */
+static bool check_cache_active(void)
+{
+	long pages;
+
+	if (!swap_slot_cache_enabled)
+		return false;
+
+	pages = nr_swap_pages;
+	if (!swap_slot_cache_active) {
+		if (pages > num_online_cpus() *
+			    THRESHOLD_ACTIVATE_SWAP_SLOTS_CACHE) {
+			mutex_lock(&swap_slots_cache_mutex);
+			swap_slot_cache_active = true;
+			mutex_unlock(&swap_slots_cache_mutex);
+		}
+	} else if (pages < num_online_cpus() *
+			   THRESHOLD_DEACTIVATE_SWAP_SLOTS_CACHE) {
+		mutex_lock(&swap_slots_cache_mutex);
+		if (swap_slot_cache_active) {
+			swap_slot_cache_active = false;
+			drain_slots_caches();
+		}
+		mutex_unlock(&swap_slots_cache_mutex);
+	}
+
+	return swap_slot_cache_active;
+}
+
+/* Called by swapon once a device has been added. */
+void enable_swap_slots_cache(void)
+{
+	mutex_lock(&swap_slots_cache_enable_mutex);
+	swap_slot_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_enable_mutex);
+}
+
+/*
+ * Called by swapoff before it starts pulling pages back in, so that no
+ * slot on the device is hidden in a cache, and none is cached while it
+ * runs.  Swapoffs are serialised until reenable_swap_slots_cache_unlock().
+ */
+void disable_swap_slots_cache_lock(void)
+{
+	mutex_lock(&swap_slots_cache_enable_mutex);
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slot_cache_enabled = false;
+	drain_slots_caches();
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+void reenable_swap_slots_cache_unlock(void)
+{
+	if (total_swap_pages)
+		swap_slot_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_enable_mutex);
+}
+
+/*
+ * Hand back a slot that has lost its last user along with its swap
+ * cache page.  Nothing can look the slot up any more, so it can wait in
+ * this CPU's cache with SWAP_HAS_CACHE still set and be freed along
+ * with others under one swap_lock hold.
+ */
+void free_swap_slot(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache;
+
+	/* The lock is what matters, not staying on this CPU */
+	cache = __this_cpu_ptr(&swp_slots);
+	spin_lock(&cache->free_lock);
+	if (!use_swap_slot_cache()) {
+		spin_unlock(&cache->free_lock);
+		swapcache_free_entries(&entry, 1);
+		return;
+	}
+	if (cache->n_ret >= SWAP_SLOTS_CACHE_SIZE) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	cache->slots_ret[cache->n_ret++] = entry;
+	spin_unlock(&cache->free_lock);
+}
+
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry;
+
+	if (check_cache_active()) {
+		cache = __this_cpu_ptr(&swp_slots);
+		mutex_lock(&cache->alloc_lock);
+		if (!cache->nr && use_swap_slot_cache()) {
+			cache->cur = 0;
+			cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE,
+						   cache->slots);
+		}
+		if (cache->nr) {
+			entry = cache->slots[cache->cur++];
+			cache->nr--;
+			mutex_unlock(&cache->alloc_lock);
+			return entry;
+		}
+		mutex_unlock(&cache->alloc_lock);
+	}
+
+	if (!get_swap_pages(1, &entry))
+		entry.val = 0;
+	return entry;
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_slots_cache_cpu((long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	struct swap_slots_cache *cache;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swp_slots, cpu);
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	return 0;
+}
+module_init(swap_slots_init)
@@ -17,6 +17,7 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/pfn.h>
 
 #include <asm/pgtable.h>
 
@@ -43,6 +44,36 @@ struct address_space swapper_space = {
 	.backing_dev_info = &swap_backing_dev_info,
 };
 
+/* Read ahead along the page table rather than by swap slot, if possible */
+int swap_vma_ra_enabled = 1;
+
+/*
+ * vma->swap_readahead_info packs the page aligned address of the last
+ * swapin fault in the vma with the readahead window used for it and
+ * the readahead hits since.
+ */
+#define SWAP_RA_WIN_SHIFT	(PAGE_SHIFT / 2)
+#define SWAP_RA_HITS_MASK	((1UL << SWAP_RA_WIN_SHIFT) - 1)
+#define SWAP_RA_HITS_MAX	SWAP_RA_HITS_MASK
+#define SWAP_RA_WIN_MASK	(~PAGE_MASK & ~SWAP_RA_HITS_MASK)
+
+#define SWAP_RA_HITS(v)		((v) & SWAP_RA_HITS_MASK)
+#define SWAP_RA_WIN(v)		(((v) & SWAP_RA_WIN_MASK) >> SWAP_RA_WIN_SHIFT)
+#define SWAP_RA_ADDR(v)		((v) & PAGE_MASK)
+
+#define SWAP_RA_VAL(addr, win, hits)				\
+	(((addr) & PAGE_MASK) |					\
+	 (((win) << SWAP_RA_WIN_SHIFT) & SWAP_RA_WIN_MASK) |	\
+	 ((hits) & SWAP_RA_HITS_MASK))
+
+/* The page table entries of the window are copied onto the stack */
+#ifdef CONFIG_64BIT
+#define SWAP_RA_ORDER_CEILING	5
+#else
+#define SWAP_RA_ORDER_CEILING	3
+#endif
+#define SWAP_RA_PTE_CACHE_SIZE	(1 << SWAP_RA_ORDER_CEILING)
+
 #define INC_CACHE_INFO(x)	do { swap_cache_info.x++; } while (0)
 
 static struct {
@@ -258,15 +289,30 @@ void free_pages_and_swap_cache(struct page **pages, int nr)
  * lock getting page table operations atomic even if we drop the page
  * lock before returning.
  */
-struct page * lookup_swap_cache(swp_entry_t entry)
+struct page *lookup_swap_cache(swp_entry_t entry, struct vm_area_struct *vma,
+				unsigned long addr)
 {
 	struct page *page;
+	unsigned long ra_val;
+	int readahead;
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
+	if (page) {
 		INC_CACHE_INFO(find_success);
 
+		readahead = TestClearPageReadahead(page);
+		if (readahead)
+			count_vm_event(SWAP_RA_HIT);
+		if (vma) {
+			ra_val = atomic_long_read(&vma->swap_readahead_info);
+			atomic_long_set(&vma->swap_readahead_info,
+				SWAP_RA_VAL(addr, SWAP_RA_WIN(ra_val),
+					min_t(unsigned long, SWAP_RA_HITS_MAX,
+					      SWAP_RA_HITS(ra_val) + readahead)));
+		}
+	}
+
 	INC_CACHE_INFO(find_total);
 	return page;
 }
@@ -276,13 +322,17 @@ struct page * lookup_swap_cache(swp_entry_t entry)
  * and reading the disk if it is not already cached.
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
+ * *page_allocated tells whether the page was added by this call, and its
+ * read started, rather than found in the swap cache.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+struct page *__read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			bool *page_allocated)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
 
+	*page_allocated = false;
 	do {
 		/*
 		 * First check the swap cache.  Since this is normally
@@ -315,6 +365,13 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/*
+			 * A slot without users is only cached by some CPU,
+			 * and may stay that way for a while: skip it rather
+			 * than wait for it to be used or freed.
+			 */
+			if (swap_slot_cache_enabled && !swp_swapcount(entry))
+				break;
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
@@ -333,6 +390,7 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			 */
 			lru_cache_add_anon(new_page);
 			swap_readpage(new_page);
+			*page_allocated = true;
 			return new_page;
 		}
 		radix_tree_preload_end();
@@ -350,6 +408,15 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	bool page_allocated;
+
+	return __read_swap_cache_async(entry, gfp_mask, vma, addr,
+				       &page_allocated);
+}
+
 /**
  * swapin_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
@@ -376,6 +443,7 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	struct page *page;
 	unsigned long offset;
 	unsigned long end_offset;
+	bool page_allocated;
 
 	/*
 	 * Get starting offset for readaround, and number of pages to read.
@@ -387,12 +455,141 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	nr_pages = valid_swaphandles(entry, &offset);
 	for (end_offset = offset + nr_pages; offset < end_offset; offset++) {
 		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
+		page = __read_swap_cache_async(
+				swp_entry(swp_type(entry), offset),
+				gfp_mask, vma, addr, &page_allocated);
 		if (!page)
-			break;
+			continue;
+		/* A page found in the swap cache was not read ahead by us */
+		if (page_allocated && offset != swp_offset(entry)) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
 		page_cache_release(page);
 	}
 	lru_add_drain();	/* Push any new pages onto the LRU now */
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/*
+ * Slot neighbours are only related if they were swapped out together,
+ * and reading ahead by page table costs misses that are cheap on a
+ * non-rotational device but seeks on a disk.
+ */
+bool swap_use_vma_readahead(void)
+{
+	return swap_vma_ra_enabled && !atomic_read(&nr_rotate_swap);
+}
+
+/*
+ * How many pages to read around a fault at pfn, the previous one in the
+ * vma having been at prev_pfn: the window grows with the readahead hits
+ * since then, and is kept for sequential faults which had no chance to
+ * hit yet.  It shrinks by half at most each time.
+ */
+static unsigned int swapin_nr_pages(unsigned long prev_pfn, unsigned long pfn,
+				    unsigned int hits, unsigned int max_win,
+				    unsigned int prev_win)
+{
+	unsigned int pages, roundup;
+
+	pages = hits + 2;
+	if (pages == 2) {
+		if (pfn != prev_pfn + 1 && pfn != prev_pfn - 1)
+			pages = 1;
+	} else {
+		roundup = 4;
+		while (roundup < pages)
+			roundup <<= 1;
+		pages = roundup;
+	}
+
+	if (pages > max_win)
+		pages = max_win;
+	if (pages < prev_win / 2)
+		pages = prev_win / 2;
+
+	return pages;
+}
+
+/**
+ * swap_vma_readahead - swap in pages around the fault in the vma
+ * @fentry: swap entry of the faulting page
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma the fault is in
+ * @addr: faulting address
+ * @pmd: pmd mapping the faulting address
+ *
+ * Returns the struct page for fentry and addr, after queueing swapin of
+ * the pages swapped out from the window around addr, which follows the
+ * direction of sequential faults.  The window doesn't leave the vma nor
+ * the page table of the fault.
+ *
+ * Caller must hold down_read on vma->vm_mm, which keeps the page table
+ * around while its entries are copied without the page table lock: a
+ * stale one only costs a pointless read.
+ */
+struct page *swap_vma_readahead(swp_entry_t fentry, gfp_t gfp_mask,
+				struct vm_area_struct *vma, unsigned long addr,
+				pmd_t *pmd)
+{
+	pte_t ptes[SWAP_RA_PTE_CACHE_SIZE], *pte;
+	unsigned long faddr = addr & PAGE_MASK;
+	unsigned long fpfn = PFN_DOWN(faddr);
+	unsigned long ra_val, prev_pfn, start, end;
+	unsigned int max_win, win, left, i, nr;
+	swp_entry_t entry;
+	struct page *page;
+	bool page_allocated;
+
+	max_win = 1 << min_t(unsigned int, page_cluster, SWAP_RA_ORDER_CEILING);
+	ra_val = atomic_long_read(&vma->swap_readahead_info);
+	prev_pfn = PFN_DOWN(SWAP_RA_ADDR(ra_val));
+	win = swapin_nr_pages(prev_pfn, fpfn, SWAP_RA_HITS(ra_val), max_win,
+			      SWAP_RA_WIN(ra_val));
+	atomic_long_set(&vma->swap_readahead_info, SWAP_RA_VAL(faddr, win, 0));
+
+	if (win == 1)
+		goto out;
+
+	if (fpfn == prev_pfn + 1)
+		left = 0;
+	else if (fpfn == prev_pfn - 1)
+		left = win - 1;
+	else
+		left = (win - 1) / 2;
+
+	start = max3(fpfn - left, PFN_DOWN(vma->vm_start),
+		     PFN_DOWN(faddr & PMD_MASK));
+	end = min3(fpfn - left + win, PFN_DOWN(vma->vm_end),
+		   PFN_DOWN((faddr & PMD_MASK) + PMD_SIZE));
+	if (start >= end)
+		goto out;
+
+	nr = end - start;
+	pte = pte_offset_map(pmd, start << PAGE_SHIFT);
+	for (i = 0; i < nr; i++)
+		ptes[i] = pte[i];
+	pte_unmap(pte);
+
+	for (i = 0, addr = start << PAGE_SHIFT; i < nr; i++, addr += PAGE_SIZE) {
+		if (pte_none(ptes[i]) || pte_present(ptes[i]) ||
+		    pte_file(ptes[i]))
+			continue;
+		entry = pte_to_swp_entry(ptes[i]);
+		if (unlikely(non_swap_entry(entry)))
+			continue;
+		page = __read_swap_cache_async(entry, gfp_mask, vma, addr,
+					       &page_allocated);
+		if (!page)
+			continue;
+		if (page_allocated && addr != faddr) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
+		page_cache_release(page);
+	}
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+out:
+	return read_swap_cache_async(fentry, gfp_mask, vma, faddr);
+}
@@ -46,6 +46,7 @@ static DEFINE_SPINLOCK(swap_lock);
 static unsigned int nr_swapfiles;
 long nr_swap_pages;
 long total_swap_pages;
+atomic_t nr_rotate_swap = ATOMIC_INIT(0);
 static int least_priority;
 
 static const char Bad_file[] = "Bad swap file entry ";
@@ -179,12 +180,82 @@ static int wait_for_discard(void *word)
 #define SWAPFILE_CLUSTER	256
 #define LATENCY_LIMIT		256
 
+/*
+ * Lock the cluster holding offset, with swap_lock held or the entry
+ * pinned.  Returns NULL when the device has no cluster_info, which is
+ * only so late in swapoff that all its entries are gone.
+ */
+static inline struct swap_cluster_info *lock_cluster(
+		struct swap_info_struct *si, unsigned long offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+
+	if (ci) {
+		ci += offset / SWAPFILE_CLUSTER;
+		spin_lock(&ci->lock);
+	}
+	return ci;
+}
+
+/*
+ * Lock the cluster holding offset without swap_lock, from inside
+ * rcu_read_lock_sched(): swapoff clears cluster_info, then waits for
+ * such callers before it lets go of swap_map.  Returns NULL if there
+ * is no such slot, for the caller to recheck under swap_lock.
+ */
+static inline struct swap_cluster_info *lock_cluster_check(
+		struct swap_info_struct *si, unsigned long offset)
+{
+	struct swap_cluster_info *ci = rcu_dereference_sched(si->cluster_info);
+
+	if (!ci || offset >= si->max)
+		return NULL;
+	ci += offset / SWAPFILE_CLUSTER;
+	spin_lock(&ci->lock);
+	return ci;
+}
+
+static inline void unlock_cluster(struct swap_cluster_info *ci)
+{
+	if (ci)
+		spin_unlock(&ci->lock);
+}
+
+/*
+ * A slot at offset was allocated or freed: keep count of the cluster's
+ * slots in use, and the empty clusters on free_clusters.  Called with
+ * swap_lock held.
+ */
+static void inc_cluster_info(struct swap_info_struct *si, unsigned long offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+
+	if (!ci)
+		return;
+	ci += offset / SWAPFILE_CLUSTER;
+	if (!ci->count++)
+		list_del_init(&ci->list);
+}
+
+static void dec_cluster_info(struct swap_info_struct *si, unsigned long offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+
+	if (!ci)
+		return;
+	ci += offset / SWAPFILE_CLUSTER;
+	VM_BUG_ON(!ci->count);
+	if (!--ci->count)
+		list_add_tail(&ci->list, &si->free_clusters);
+}
+
 static unsigned long scan_swap_map(struct swap_info_struct *si,
 				   unsigned char usage)
 {
 	unsigned long offset;
 	unsigned long scan_base;
 	unsigned long last_in_cluster = 0;
+	struct swap_cluster_info *ci;
 	int latency_ration = LATENCY_LIMIT;
 	int found_free_cluster = 0;
 
@@ -197,6 +268,8 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	 * overall disk seek times between swap pages.  -- sct
 	 * But we do now try to find an empty cluster.  -Andrea
 	 * And we let swap pages go all over an SSD partition.  Hugh
+	 * An SSD takes its empty clusters from free_clusters, least
+	 * recently freed first, instead of searching swap_map for one.
 	 */
 
 	si->flags += SWP_SCANNING;
@@ -207,6 +280,22 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 			si->cluster_nr = SWAPFILE_CLUSTER - 1;
 			goto checks;
 		}
+		/*
+		 * Discards keep to the search below, which discards the
+		 * cluster it finds while racing allocations are tracked.
+		 */
+		if ((si->flags & (SWP_SOLIDSTATE | SWP_DISCARDABLE)) ==
+		    SWP_SOLIDSTATE) {
+			si->cluster_nr = SWAPFILE_CLUSTER - 1;
+			if (!list_empty(&si->free_clusters)) {
+				ci = list_first_entry(&si->free_clusters,
+						struct swap_cluster_info, list);
+				offset = (ci - si->cluster_info) *
+					 SWAPFILE_CLUSTER;
+				scan_base = offset;
+			}
+			goto checks;
+		}
 		if (si->flags & SWP_DISCARDABLE) {
 			/*
 			 * Start range check on racing allocations, in case
@@ -311,7 +400,10 @@ checks:
 		si->lowest_bit = si->max;
 		si->highest_bit = 0;
 	}
+	ci = lock_cluster(si, offset);
 	si->swap_map[offset] = usage;
+	unlock_cluster(ci);
+	inc_cluster_info(si, offset);
 	si->cluster_next = offset + 1;
 	si->flags -= SWP_SCANNING;
 
@@ -408,17 +500,26 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to n slots for the swap cache under one swap_lock hold,
+ * all of them from the first device with room; the next batch moves on
+ * round-robin as single allocations used to.  Returns how many were
+ * allocated.
+ */
+int get_swap_pages(int n, swp_entry_t slots[])
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int n_ret = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
-	nr_swap_pages--;
+	if (n > nr_swap_pages)
+		n = nr_swap_pages;
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -436,18 +537,21 @@ swp_entry_t get_swap_page(void)
 
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (n_ret < n) {
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			slots[n_ret++] = swp_entry(type, offset);
 		}
+		if (n_ret)
+			break;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
+	nr_swap_pages += n - n_ret;
 noswap:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return n_ret;
 }
 
 /* The only caller of this function is now susupend routine */
@@ -472,7 +576,7 @@ swp_entry_t get_swap_page_of_type(int type)
 	return (swp_entry_t) {0};
 }
 
-static struct swap_info_struct *swap_info_get(swp_entry_t entry)
+static struct swap_info_struct *__swap_info_get(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
 	unsigned long offset, type;
@@ -490,7 +594,6 @@ static struct swap_info_struct *swap_info_get(swp_entry_t entry)
 		goto bad_offset;
 	if (!p->swap_map[offset])
 		goto bad_free;
-	spin_lock(&swap_lock);
 	return p;
 
 bad_free:
@@ -508,13 +611,25 @@ out:
 	return NULL;
 }
 
+static struct swap_info_struct *swap_info_get(swp_entry_t entry)
+{
+	struct swap_info_struct *p;
+
+	p = __swap_info_get(entry);
+	if (p)
+		spin_lock(&swap_lock);
+	return p;
+}
+
 static unsigned char swap_entry_free(struct swap_info_struct *p,
 				     swp_entry_t entry, unsigned char usage)
 {
 	unsigned long offset = swp_offset(entry);
+	struct swap_cluster_info *ci;
 	unsigned char count;
 	unsigned char has_cache;
 
+	ci = lock_cluster(p, offset);
 	count = p->swap_map[offset];
 	has_cache = count & SWAP_HAS_CACHE;
 	count &= ~SWAP_HAS_CACHE;
@@ -543,10 +658,12 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 
 	usage = count | has_cache;
 	p->swap_map[offset] = usage;
+	unlock_cluster(ci);
 
 	/* free if no reference */
 	if (!usage) {
 		struct gendisk *disk = p->bdev->bd_disk;
+		dec_cluster_info(p, offset);
 		if (offset < p->lowest_bit)
 			p->lowest_bit = offset;
 		if (offset > p->highest_bit)
@@ -564,6 +681,60 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 	return usage;
 }
 
+/*
+ * Drop a usage of entry holding only its cluster lock.  A slot losing
+ * its last usage keeps SWAP_HAS_CACHE and goes to free_swap_slot(), to
+ * be freed along with others under one swap_lock hold: nothing can
+ * look it up any more.  Returns the usage left, 0 for a slot handed to
+ * free_swap_slot(); or -EAGAIN, with nothing changed, when a swap count
+ * continuation or a corrupt count needs swap_entry_free() under
+ * swap_lock.
+ */
+static int swap_entry_put(struct swap_info_struct *p,
+			  swp_entry_t entry, unsigned char usage)
+{
+	unsigned long offset = swp_offset(entry);
+	struct swap_cluster_info *ci;
+	unsigned char count;
+	unsigned char has_cache;
+	int ret = -EAGAIN;
+
+	rcu_read_lock_sched();
+	ci = lock_cluster_check(p, offset);
+	if (!ci)
+		goto out;
+
+	count = p->swap_map[offset];
+	has_cache = count & SWAP_HAS_CACHE;
+	count &= ~SWAP_HAS_CACHE;
+
+	if (usage == SWAP_HAS_CACHE) {
+		if (!has_cache)
+			goto unlock;
+		has_cache = 0;
+	} else {
+		if (count == SWAP_MAP_SHMEM)
+			count = 0;
+		else if (count && count != COUNT_CONTINUED &&
+			 (count & ~COUNT_CONTINUED) <= SWAP_MAP_MAX)
+			count--;
+		else
+			goto unlock;
+		if (!count)
+			mem_cgroup_uncharge_swap(entry);
+	}
+
+	ret = count | has_cache;
+	p->swap_map[offset] = ret ? ret : SWAP_HAS_CACHE;
+unlock:
+	unlock_cluster(ci);
+out:
+	rcu_read_unlock_sched();
+	if (!ret)
+		free_swap_slot(entry);
+	return ret;
+}
+
 /*
  * Caller has made sure that the swapdevice corresponding to entry
  * is still around or has not been recycled.
@@ -572,8 +743,9 @@ void swap_free(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
 
-	p = swap_info_get(entry);
-	if (p) {
+	p = __swap_info_get(entry);
+	if (p && swap_entry_put(p, entry, 1) < 0) {
+		spin_lock(&swap_lock);
 		swap_entry_free(p, entry, 1);
 		spin_unlock(&swap_lock);
 	}
@@ -585,15 +757,57 @@ void swap_free(swp_entry_t entry)
 void swapcache_free(swp_entry_t entry, struct page *page)
 {
 	struct swap_info_struct *p;
-	unsigned char count;
+	int count;
 
-	p = swap_info_get(entry);
-	if (p) {
+	p = __swap_info_get(entry);
+	if (!p)
+		return;
+
+	count = swap_entry_put(p, entry, SWAP_HAS_CACHE);
+	if (count < 0) {
+		spin_lock(&swap_lock);
 		count = swap_entry_free(p, entry, SWAP_HAS_CACHE);
-		if (page)
-			mem_cgroup_uncharge_swapcache(page, entry, count != 0);
 		spin_unlock(&swap_lock);
 	}
+	if (page)
+		mem_cgroup_uncharge_swapcache(page, entry, count != 0);
+}
+
+/*
+ * Free slots handed back by the per-cpu slot caches: they have no users
+ * left, only SWAP_HAS_CACHE.
+ */
+void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	struct swap_info_struct *p;
+	int i;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++) {
+		p = swap_info[swp_type(entries[i])];
+		swap_entry_free(p, entries[i], SWAP_HAS_CACHE);
+	}
+	spin_unlock(&swap_lock);
+}
+
+/*
+ * How many users does a swap entry have, not counting the swap cache?
+ * Zero for an entry that is free or only sitting in a slot cache.
+ */
+int swp_swapcount(swp_entry_t entry)
+{
+	struct swap_info_struct *p;
+	pgoff_t offset = swp_offset(entry);
+	int count = 0;
+
+	spin_lock(&swap_lock);
+	if (swp_type(entry) < nr_swapfiles) {
+		p = swap_info[swp_type(entry)];
+		if ((p->flags & SWP_USED) && offset < p->max)
+			count = swap_count(p->swap_map[offset]);
+	}
+	spin_unlock(&swap_lock);
+	return count;
 }
 
 /*
@@ -605,13 +819,16 @@ static inline int page_swapcount(struct page *page)
 {
 	int count = 0;
 	struct swap_info_struct *p;
+	struct swap_cluster_info *ci;
 	swp_entry_t entry;
 
 	entry.val = page_private(page);
-	p = swap_info_get(entry);
+	p = __swap_info_get(entry);
 	if (p) {
+		/* the locked swap cache page pins entry and its device */
+		ci = lock_cluster(p, swp_offset(entry));
 		count = swap_count(p->swap_map[swp_offset(entry)]);
-		spin_unlock(&swap_lock);
+		unlock_cluster(ci);
 	}
 	return count;
 }
@@ -690,16 +907,22 @@ int free_swap_and_cache(swp_entry_t entry)
 	if (non_swap_entry(entry))
 		return 1;
 
-	p = swap_info_get(entry);
+	p = __swap_info_get(entry);
 	if (p) {
-		if (swap_entry_free(p, entry, 1) == SWAP_HAS_CACHE) {
+		int count = swap_entry_put(p, entry, 1);
+
+		if (count < 0) {
+			spin_lock(&swap_lock);
+			count = swap_entry_free(p, entry, 1);
+			spin_unlock(&swap_lock);
+		}
+		if (count == SWAP_HAS_CACHE) {
 			page = find_get_page(&swapper_space, entry.val);
 			if (page && !trylock_page(page)) {
 				page_cache_release(page);
 				page = NULL;
 			}
 		}
-		spin_unlock(&swap_lock);
 	}
 	if (page) {
 		/*
@@ -1517,7 +1740,8 @@ bad_bmap:
 }
 
 static void enable_swap_info(struct swap_info_struct *p, int prio,
-				unsigned char *swap_map)
+				unsigned char *swap_map,
+				struct swap_cluster_info *cluster_info)
 {
 	int i, prev;
 
@@ -1527,6 +1751,8 @@ static void enable_swap_info(struct swap_info_struct *p, int prio,
 	else
 		p->prio = --least_priority;
 	p->swap_map = swap_map;
+	/* lock_cluster_check() relies on swap_map being set first */
+	rcu_assign_pointer(p->cluster_info, cluster_info);
 	p->flags |= SWP_WRITEOK;
 	nr_swap_pages += p->pages;
 	total_swap_pages += p->pages;
@@ -1550,6 +1776,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 {
 	struct swap_info_struct *p = NULL;
 	unsigned char *swap_map;
+	struct swap_cluster_info *cluster_info;
 	struct file *swap_file, *victim;
 	struct address_space *mapping;
 	struct inode *inode;
@@ -1613,6 +1840,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	disable_swap_slots_cache_lock();
 	oom_score_adj = test_set_oom_score_adj(OOM_SCORE_ADJ_MAX);
 	err = try_to_unuse(type);
 	compare_swap_oom_score_adj(OOM_SCORE_ADJ_MAX, oom_score_adj);
@@ -1625,10 +1853,15 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		 * sys_swapoff for this swap_info_struct at this point.
 		 */
 		/* re-insert swap space back into swap_list */
-		enable_swap_info(p, p->prio, p->swap_map);
+		enable_swap_info(p, p->prio, p->swap_map, p->cluster_info);
+		/* after, so that total_swap_pages counts it again */
+		reenable_swap_slots_cache_unlock();
 		goto out_dput;
 	}
+	reenable_swap_slots_cache_unlock();
 
+	if (!(p->flags & SWP_SOLIDSTATE))
+		atomic_dec(&nr_rotate_swap);
 	destroy_swap_extents(p);
 	if (p->flags & SWP_CONTINUED)
 		free_swap_count_continuations(p);
@@ -1645,6 +1878,14 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		spin_lock(&swap_lock);
 	}
 
+	/* and for anyone who found its clusters without swap_lock */
+	cluster_info = p->cluster_info;
+	p->cluster_info = NULL;
+	INIT_LIST_HEAD(&p->free_clusters);
+	spin_unlock(&swap_lock);
+	synchronize_sched();
+	spin_lock(&swap_lock);
+
 	swap_file = p->swap_file;
 	p->swap_file = NULL;
 	p->max = 0;
@@ -1654,6 +1895,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	spin_unlock(&swap_lock);
 	mutex_unlock(&swapon_mutex);
 	vfree(swap_map);
+	vfree(cluster_info);
 	/* Destroy swap account informatin */
 	swap_cgroup_swapoff(type);
 
@@ -2003,6 +2245,40 @@ static int setup_swap_map_and_extents(struct swap_info_struct *p,
 	return nr_extents;
 }
 
+/*
+ * Count the slots of each cluster that are taken already, by the header,
+ * bad pages, or by being past the end of the device, and list the empty
+ * clusters starting from cluster_next, so that an SSD spreads its first
+ * allocations as it did before.
+ */
+static void setup_swap_clusters(struct swap_info_struct *p,
+				struct swap_cluster_info *cluster_info,
+				unsigned char *swap_map,
+				unsigned long maxpages)
+{
+	unsigned long nr_clusters = DIV_ROUND_UP(maxpages, SWAPFILE_CLUSTER);
+	unsigned long i, idx;
+
+	INIT_LIST_HEAD(&p->free_clusters);
+	for (i = 0; i < nr_clusters; i++) {
+		spin_lock_init(&cluster_info[i].lock);
+		INIT_LIST_HEAD(&cluster_info[i].list);
+	}
+	for (i = 0; i < nr_clusters * SWAPFILE_CLUSTER; i++) {
+		if (i >= maxpages || swap_map[i])
+			cluster_info[i / SWAPFILE_CLUSTER].count++;
+	}
+
+	idx = p->cluster_next / SWAPFILE_CLUSTER;
+	for (i = 0; i < nr_clusters; i++) {
+		if (!cluster_info[idx].count)
+			list_add_tail(&cluster_info[idx].list,
+				      &p->free_clusters);
+		if (++idx == nr_clusters)
+			idx = 0;
+	}
+}
+
 SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 {
 	struct swap_info_struct *p;
@@ -2017,6 +2293,7 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 	sector_t span;
 	unsigned long maxpages;
 	unsigned char *swap_map = NULL;
+	struct swap_cluster_info *cluster_info = NULL;
 	struct page *page = NULL;
 	struct inode *inode = NULL;
 
@@ -2086,6 +2363,12 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 		error = -ENOMEM;
 		goto bad_swap;
 	}
+	cluster_info = vzalloc(DIV_ROUND_UP(maxpages, SWAPFILE_CLUSTER) *
+			       sizeof(*cluster_info));
+	if (!cluster_info) {
+		error = -ENOMEM;
+		goto bad_swap;
+	}
 
 	error = swap_cgroup_swapon(p->type, maxpages);
 	if (error)
@@ -2106,13 +2389,14 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 		if (discard_swap(p) == 0 && (swap_flags & SWAP_FLAG_DISCARD))
 			p->flags |= SWP_DISCARDABLE;
 	}
+	setup_swap_clusters(p, cluster_info, swap_map, maxpages);
 
 	mutex_lock(&swapon_mutex);
 	prio = -1;
 	if (swap_flags & SWAP_FLAG_PREFER)
 		prio =
 		  (swap_flags & SWAP_FLAG_PRIO_MASK) >> SWAP_FLAG_PRIO_SHIFT;
-	enable_swap_info(p, prio, swap_map);
+	enable_swap_info(p, prio, swap_map, cluster_info);
 
 	printk(KERN_INFO "Adding %uk swap on %s.  "
 			"Priority:%d extents:%d across:%lluk %s%s\n",
@@ -2121,7 +2405,10 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 		(p->flags & SWP_SOLIDSTATE) ? "SS" : "",
 		(p->flags & SWP_DISCARDABLE) ? "D" : "");
 
+	if (!(p->flags & SWP_SOLIDSTATE))
+		atomic_inc(&nr_rotate_swap);
 	mutex_unlock(&swapon_mutex);
+	enable_swap_slots_cache();
 	atomic_inc(&proc_poll_event);
 	wake_up_interruptible(&proc_poll_wait);
 
@@ -2141,6 +2428,7 @@ bad_swap:
 	p->flags = 0;
 	spin_unlock(&swap_lock);
 	vfree(swap_map);
+	vfree(cluster_info);
 	if (swap_file) {
 		if (inode && S_ISREG(inode->i_mode)) {
 			mutex_unlock(&inode->i_mutex);
@@ -2178,41 +2466,21 @@ void si_swapinfo(struct sysinfo *val)
 }
 
 /*
- * Verify that a swap entry is valid and increment its swap map count.
- *
- * Returns error code in following case.
- * - success -> 0
- * - swp_entry is invalid -> EINVAL
- * - swp_entry is migration entry -> EINVAL
- * - swap-cache reference is requested but there is already one. -> EEXIST
- * - swap-cache reference is requested but the entry is not used. -> ENOENT
- * - swap-mapped reference requested but needs continued swap count. -> ENOMEM
+ * Increment the swap map count at offset, with its cluster locked.
+ * Carrying into a swap count continuation also needs swap_lock: without
+ * it -EAGAIN is returned and nothing is changed.
  */
-static int __swap_duplicate(swp_entry_t entry, unsigned char usage)
+static int __swap_duplicate_locked(struct swap_info_struct *p,
+				   unsigned long offset, unsigned char usage,
+				   bool swap_locked)
 {
-	struct swap_info_struct *p;
-	unsigned long offset, type;
 	unsigned char count;
 	unsigned char has_cache;
-	int err = -EINVAL;
-
-	if (non_swap_entry(entry))
-		goto out;
-
-	type = swp_type(entry);
-	if (type >= nr_swapfiles)
-		goto bad_file;
-	p = swap_info[type];
-	offset = swp_offset(entry);
-
-	spin_lock(&swap_lock);
-	if (unlikely(offset >= p->max))
-		goto unlock_out;
+	int err = 0;
 
 	count = p->swap_map[offset];
 	has_cache = count & SWAP_HAS_CACHE;
 	count &= ~SWAP_HAS_CACHE;
-	err = 0;
 
 	if (usage == SWAP_HAS_CACHE) {
 
@@ -2230,6 +2498,8 @@ static int __swap_duplicate(swp_entry_t entry, unsigned char usage)
 			count += usage;
 		else if ((count & ~COUNT_CONTINUED) > SWAP_MAP_MAX)
 			err = -EINVAL;
+		else if (!swap_locked)
+			return -EAGAIN;
 		else if (swap_count_continued(p, offset, count))
 			count = COUNT_CONTINUED;
 		else
@@ -2238,8 +2508,57 @@ static int __swap_duplicate(swp_entry_t entry, unsigned char usage)
 		err = -ENOENT;			/* unused swap entry */
 
 	p->swap_map[offset] = count | has_cache;
+	return err;
+}
 
-unlock_out:
+/*
+ * Verify that a swap entry is valid and increment its swap map count.
+ *
+ * Returns error code in following case.
+ * - success -> 0
+ * - swp_entry is invalid -> EINVAL
+ * - swp_entry is migration entry -> EINVAL
+ * - swap-cache reference is requested but there is already one. -> EEXIST
+ * - swap-cache reference is requested but the entry is not used. -> ENOENT
+ * - swap-mapped reference requested but needs continued swap count. -> ENOMEM
+ */
+static int __swap_duplicate(swp_entry_t entry, unsigned char usage)
+{
+	struct swap_info_struct *p;
+	struct swap_cluster_info *ci;
+	unsigned long offset, type;
+	int err = -EINVAL;
+
+	if (non_swap_entry(entry))
+		goto out;
+
+	type = swp_type(entry);
+	if (type >= nr_swapfiles)
+		goto bad_file;
+	p = swap_info[type];
+	offset = swp_offset(entry);
+
+	/*
+	 * Only carrying into a swap count continuation needs swap_lock,
+	 * the cluster lock is enough for everything else.
+	 */
+	rcu_read_lock_sched();
+	ci = lock_cluster_check(p, offset);
+	if (ci) {
+		err = __swap_duplicate_locked(p, offset, usage, false);
+		unlock_cluster(ci);
+	}
+	rcu_read_unlock_sched();
+	if (ci && err != -EAGAIN)
+		goto out;
+
+	err = -EINVAL;
+	spin_lock(&swap_lock);
+	if (likely(offset < p->max)) {
+		ci = lock_cluster(p, offset);
+		err = __swap_duplicate_locked(p, offset, usage, true);
+		unlock_cluster(ci);
+	}
 	spin_unlock(&swap_lock);
 out:
 	return err;
@@ -2360,6 +2679,7 @@ int add_swap_count_continuation(swp_entry_t entry, gfp_t gfp_mask)
 	struct page *head;
 	struct page *page;
 	struct page *list_page;
+	struct swap_cluster_info *ci;
 	pgoff_t offset;
 	unsigned char count;
 
@@ -2380,7 +2700,9 @@ int add_swap_count_continuation(swp_entry_t entry, gfp_t gfp_mask)
 	}
 
 	offset = swp_offset(entry);
+	ci = lock_cluster(si, offset);
 	count = si->swap_map[offset] & ~SWAP_HAS_CACHE;
+	unlock_cluster(ci);
 
 	if ((count & ~COUNT_CONTINUED) != SWAP_MAP_MAX) {
 		/*
@@ -2453,7 +2775,8 @@ outer:
  * into, carry if so, or else fail until a new continuation page is allocated;
  * when the original swap_map count is decremented from 0 with continuation,
  * borrow from the continuation and report whether it still holds more.
- * Called while __swap_duplicate() or swap_entry_free() holds swap_lock.
+ * Called while __swap_duplicate() or swap_entry_free() holds swap_lock,
+ * which is what protects the continuation pages, and the cluster lock.
  */
 static bool swap_count_continued(struct swap_info_struct *si,
 				 pgoff_t offset, unsigned char count)
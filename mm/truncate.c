@@ -22,6 +22,43 @@
 #include <linux/cleancache.h>
 #include "internal.h"
 
+/*
+ * Remove the shadow entries reclaim left in [start, end] of the mapping,
+ * which would otherwise outlive the file data they describe.
+ */
+static void clear_shadow_entries(struct address_space *mapping,
+				 pgoff_t start, pgoff_t end)
+{
+	void **slots[PAGEVEC_SIZE];
+	void *entries[PAGEVEC_SIZE];
+	pgoff_t indices[PAGEVEC_SIZE];
+	pgoff_t index = start;
+	unsigned int i, nr;
+
+	while (index <= end && mapping->nrshadows) {
+		spin_lock_irq(&mapping->tree_lock);
+		nr = radix_tree_gang_lookup_slot(&mapping->page_tree, slots,
+						 indices, index, PAGEVEC_SIZE);
+		/* Deleting may free nodes: read every slot beforehand */
+		for (i = 0; i < nr; i++)
+			entries[i] = radix_tree_deref_slot_protected(slots[i],
+							&mapping->tree_lock);
+		for (i = 0; i < nr && indices[i] <= end; i++) {
+			if (!radix_tree_exceptional_entry(entries[i]))
+				continue;
+			radix_tree_delete(&mapping->page_tree, indices[i]);
+			mapping->nrshadows--;
+			workingset_forget(entries[i]);
+		}
+		spin_unlock_irq(&mapping->tree_lock);
+
+		if (!nr || indices[nr - 1] >= end)
+			break;
+		index = indices[nr - 1] + 1;
+		cond_resched();
+	}
+}
+
 
 /**
  * do_invalidatepage - invalidate part or all of a page
@@ -214,7 +251,7 @@ void truncate_inode_pages_range(struct address_space *mapping,
 	int i;
 
 	cleancache_flush_inode(mapping);
-	if (mapping->nrpages == 0)
+	if (mapping->nrpages == 0 && mapping->nrshadows == 0)
 		return;
 
 	BUG_ON((lend & (PAGE_CACHE_SIZE - 1)) != (PAGE_CACHE_SIZE - 1));
@@ -292,6 +329,7 @@ void truncate_inode_pages_range(struct address_space *mapping,
 		mem_cgroup_uncharge_end();
 		index++;
 	}
+	clear_shadow_entries(mapping, start, end);
 	cleancache_flush_inode(mapping);
 }
 EXPORT_SYMBOL(truncate_inode_pages_range);
@@ -374,6 +412,7 @@ unsigned long invalidate_mapping_pages(struct address_space *mapping,
 		cond_resched();
 		index++;
 	}
+	clear_shadow_entries(mapping, start, end);
 	return count;
 }
 EXPORT_SYMBOL(invalidate_mapping_pages);
@@ -400,7 +439,7 @@ invalidate_complete_page2(struct address_space *mapping, struct page *page)
 
 	clear_page_mlock(page);
 	BUG_ON(page_has_private(page));
-	__delete_from_page_cache(page);
+	__delete_from_page_cache(page, NULL);
 	spin_unlock_irq(&mapping->tree_lock);
 	mem_cgroup_uncharge_cache_page(page);
 
@@ -500,6 +539,7 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 		cond_resched();
 		index++;
 	}
+	clear_shadow_entries(mapping, start, end);
 	cleancache_flush_inode(mapping);
 	return ret;
 }
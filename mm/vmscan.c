@@ -42,6 +42,8 @@
 #include <linux/sysctl.h>
 #include <linux/oom.h>
 #include <linux/prefetch.h>
+#include <linux/ktime.h>
+#include <linux/memory_hotplug.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -120,6 +122,18 @@ struct mem_cgroup_zone {
 	struct zone *zone;
 };
 
+/*
+ * kswapd isolates pages from the LRU lists in larger batches than direct
+ * reclaim, which wants to get back to its allocation quickly.  The
+ * lru_lock is still dropped every SWAP_CLUSTER_MAX pages of a batch.
+ */
+#define KSWAPD_CLUSTER_MAX	(4 * SWAP_CLUSTER_MAX)
+
+static inline unsigned long reclaim_batch(void)
+{
+	return current_is_kswapd() ? KSWAPD_CLUSTER_MAX : SWAP_CLUSTER_MAX;
+}
+
 #define lru_to_page(_head) (list_entry((_head)->prev, struct page, lru))
 
 #ifdef ARCH_HAS_PREFETCH
@@ -534,9 +548,12 @@ static pageout_t pageout(struct page *page, struct address_space *mapping,
 
 /*
  * Same as remove_mapping, but if the page is removed from the mapping, it
- * gets returned with a refcount of 0.
+ * gets returned with a refcount of 0.  @reclaimed is set when the page is
+ * being evicted by reclaim, rather than invalidated: a file page then
+ * leaves a shadow entry behind to detect its refault.
  */
-static int __remove_mapping(struct address_space *mapping, struct page *page)
+static int __remove_mapping(struct address_space *mapping, struct page *page,
+			    bool reclaimed)
 {
 	BUG_ON(!PageLocked(page));
 	BUG_ON(mapping != page_mapping(page));
@@ -582,10 +599,19 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 		swapcache_free(swap, page);
 	} else {
 		void (*freepage)(struct page *);
+		void *shadow = NULL;
 
 		freepage = mapping->a_ops->freepage;
 
-		__delete_from_page_cache(page);
+		/*
+		 * Once the final truncate of an inode has started, a shadow
+		 * left now would outlive it; the check is ordered against
+		 * truncation removing shadows by the tree_lock.
+		 */
+		if (reclaimed && page_is_file_cache(page) &&
+		    !mapping_exiting(mapping))
+			shadow = workingset_eviction(mapping, page);
+		__delete_from_page_cache(page, shadow);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
 
@@ -608,7 +634,7 @@ cannot_free:
  */
 int remove_mapping(struct address_space *mapping, struct page *page)
 {
-	if (__remove_mapping(mapping, page)) {
+	if (__remove_mapping(mapping, page, false)) {
 		/*
 		 * Unfreezing the refcount with 1 rather than 2 effectively
 		 * drops the pagecache ref for us without requiring another
@@ -979,7 +1005,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			}
 		}
 
-		if (!mapping || !__remove_mapping(mapping, page))
+		if (!mapping || !__remove_mapping(mapping, page, true))
 			goto keep_locked;
 
 		/*
@@ -1544,31 +1570,58 @@ shrink_inactive_list(unsigned long nr_to_scan, struct mem_cgroup_zone *mz,
 
 	spin_lock_irq(&zone->lru_lock);
 
-	nr_taken = isolate_lru_pages(nr_to_scan, mz, &page_list,
-				     &nr_scanned, sc->order,
-				     reclaim_mode, 0, file);
-	if (global_reclaim(sc)) {
-		zone->pages_scanned += nr_scanned;
-		if (current_is_kswapd())
-			__count_zone_vm_events(PGSCAN_KSWAPD, zone,
-					       nr_scanned);
-		else
-			__count_zone_vm_events(PGSCAN_DIRECT, zone,
-					       nr_scanned);
-	}
+	/*
+	 * Isolate SWAP_CLUSTER_MAX pages at a time, and give irqs and other
+	 * reclaimers a chance at the lock in between.  Each batch is
+	 * accounted before the lock is dropped, so that others never see
+	 * pages that are off the LRU but not in NR_ISOLATED.
+	 */
+	nr_taken = nr_scanned = nr_anon = nr_file = 0;
+	for (;;) {
+		LIST_HEAD(batch);
+		unsigned long batch_taken, batch_scanned;
+		unsigned long batch_anon, batch_file;
+
+		batch_taken = isolate_lru_pages(min_t(unsigned long,
+					nr_to_scan - nr_scanned,
+					SWAP_CLUSTER_MAX), mz, &batch,
+					&batch_scanned, sc->order,
+					reclaim_mode, 0, file);
+		if (global_reclaim(sc)) {
+			zone->pages_scanned += batch_scanned;
+			if (current_is_kswapd())
+				__count_zone_vm_events(PGSCAN_KSWAPD, zone,
+						       batch_scanned);
+			else
+				__count_zone_vm_events(PGSCAN_DIRECT, zone,
+						       batch_scanned);
+		}
+		if (batch_taken) {
+			update_isolated_counts(mz, &batch, &batch_anon,
+					       &batch_file);
+			__mod_zone_page_state(zone, NR_ISOLATED_ANON,
+					      batch_anon);
+			__mod_zone_page_state(zone, NR_ISOLATED_FILE,
+					      batch_file);
+			list_splice(&batch, &page_list);
+			nr_taken += batch_taken;
+			nr_anon += batch_anon;
+			nr_file += batch_file;
+		}
+		nr_scanned += batch_scanned;
+		if (!batch_scanned || nr_scanned >= nr_to_scan)
+			break;
 
-	if (nr_taken == 0) {
 		spin_unlock_irq(&zone->lru_lock);
-		return 0;
+		cond_resched();
+		spin_lock_irq(&zone->lru_lock);
 	}
 
-	update_isolated_counts(mz, &page_list, &nr_anon, &nr_file);
-
-	__mod_zone_page_state(zone, NR_ISOLATED_ANON, nr_anon);
-	__mod_zone_page_state(zone, NR_ISOLATED_FILE, nr_file);
-
 	spin_unlock_irq(&zone->lru_lock);
 
+	if (nr_taken == 0)
+		return 0;
+
 	nr_reclaimed = shrink_page_list(&page_list, mz, sc, priority,
 						&nr_dirty, &nr_writeback);
 
@@ -1710,20 +1763,39 @@ static void shrink_active_list(unsigned long nr_to_scan,
 
 	spin_lock_irq(&zone->lru_lock);
 
-	nr_taken = isolate_lru_pages(nr_to_scan, mz, &l_hold,
-				     &nr_scanned, sc->order,
-				     reclaim_mode, 1, file);
-	if (global_reclaim(sc))
-		zone->pages_scanned += nr_scanned;
-
-	reclaim_stat->recent_scanned[file] += nr_taken;
+	/* In batches, accounted before each unlock: see shrink_inactive_list */
+	nr_taken = nr_scanned = 0;
+	for (;;) {
+		unsigned long batch_taken, batch_scanned;
+
+		batch_taken = isolate_lru_pages(min_t(unsigned long,
+					nr_to_scan - nr_scanned,
+					SWAP_CLUSTER_MAX), mz, &l_hold,
+					&batch_scanned, sc->order,
+					reclaim_mode, 1, file);
+		if (global_reclaim(sc))
+			zone->pages_scanned += batch_scanned;
+
+		reclaim_stat->recent_scanned[file] += batch_taken;
+
+		__count_zone_vm_events(PGREFILL, zone, batch_scanned);
+		if (file)
+			__mod_zone_page_state(zone, NR_ACTIVE_FILE,
+					      -batch_taken);
+		else
+			__mod_zone_page_state(zone, NR_ACTIVE_ANON,
+					      -batch_taken);
+		__mod_zone_page_state(zone, NR_ISOLATED_ANON + file,
+				      batch_taken);
+		nr_taken += batch_taken;
+		nr_scanned += batch_scanned;
+		if (!batch_scanned || nr_scanned >= nr_to_scan)
+			break;
 
-	__count_zone_vm_events(PGREFILL, zone, nr_scanned);
-	if (file)
-		__mod_zone_page_state(zone, NR_ACTIVE_FILE, -nr_taken);
-	else
-		__mod_zone_page_state(zone, NR_ACTIVE_ANON, -nr_taken);
-	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, nr_taken);
+		spin_unlock_irq(&zone->lru_lock);
+		cond_resched();
+		spin_lock_irq(&zone->lru_lock);
+	}
 	spin_unlock_irq(&zone->lru_lock);
 
 	while (!list_empty(&l_hold)) {
@@ -1838,22 +1910,37 @@ static int inactive_file_is_low_global(struct zone *zone)
 	active = zone_page_state(zone, NR_ACTIVE_FILE);
 	inactive = zone_page_state(zone, NR_INACTIVE_FILE);
 
-	return (active > inactive);
+	/* A new working set is pushing in: make room for it */
+	if (zone_page_state(zone, WORKINGSET_ACTIVATE) != zone->refaults)
+		return active > 0;
+
+	return inactive * zone->inactive_ratio < active;
+}
+
+/*
+ * Reclaim of the zone is done for now: refault activations seen up to
+ * here have been given room, only new ones age the active list again.
+ */
+static void snapshot_refaults(struct zone *zone)
+{
+	zone->refaults = zone_page_state(zone, WORKINGSET_ACTIVATE);
 }
 
 /**
  * inactive_file_is_low - check if file pages need to be deactivated
  * @mz: memory cgroup and zone to check
  *
- * When the system is doing streaming IO, memory pressure here
- * ensures that active file pages get deactivated, until more
- * than half of the file pages are on the inactive list.
+ * Active file pages are deactivated, so that they have to prove
+ * themselves again on the inactive list, while refaults of recently
+ * evicted pages are being activated (see mm/workingset.c): the working
+ * set is changing, and the stale part of it should give way.
  *
- * Once we get to that situation, protect the system's working
- * set from being evicted by disabling active file page aging.
+ * Otherwise the working set is protected: only pages evicted from the
+ * inactive list come back, so the active list is kept up to
+ * inactive_ratio times the size of the inactive list, like anon.
  *
- * This uses a different ratio than the anonymous pages, because
- * the page cache uses a use-once replacement algorithm.
+ * Memory cgroups keep the old rule of deactivating until more than
+ * half of the file pages are on the inactive list.
  */
 static int inactive_file_is_low(struct mem_cgroup_zone *mz)
 {
@@ -2104,7 +2191,7 @@ restart:
 		for_each_evictable_lru(lru) {
 			if (nr[lru]) {
 				nr_to_scan = min_t(unsigned long,
-						   nr[lru], SWAP_CLUSTER_MAX);
+						   nr[lru], reclaim_batch());
 				nr[lru] -= nr_to_scan;
 
 				nr_reclaimed += shrink_list(lru, nr_to_scan,
@@ -2418,6 +2505,10 @@ out:
 	delayacct_freepages_end();
 	put_mems_allowed();
 
+	if (global_reclaim(sc))
+		for_each_zone_zonelist(zone, z, zonelist, gfp_zone(sc->gfp_mask))
+			snapshot_refaults(zone);
+
 	if (sc->nr_reclaimed)
 		return sc->nr_reclaimed;
 
@@ -2440,10 +2531,23 @@ out:
 	return 0;
 }
 
+static void count_direct_reclaim_stall(u64 delay_us)
+{
+	unsigned long msecs = delay_us / USEC_PER_MSEC;
+	int bucket = 0;
+
+	if (msecs)
+		bucket = min_t(int, ilog2(msecs) + 1,
+			       ALLOCSTALL_GE_1024MS - ALLOCSTALL_LT_1MS);
+	count_vm_event(ALLOCSTALL_LT_1MS + bucket);
+}
+
 unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 				gfp_t gfp_mask, nodemask_t *nodemask)
 {
 	unsigned long nr_reclaimed;
+	ktime_t start;
+	u64 delay_us;
 	struct scan_control sc = {
 		.gfp_mask = gfp_mask,
 		.may_writepage = !laptop_mode,
@@ -2462,8 +2566,13 @@ unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 				sc.may_writepage,
 				gfp_mask);
 
+	start = ktime_get();
 	nr_reclaimed = do_try_to_free_pages(zonelist, &sc, &shrink);
+	delay_us = ktime_us_delta(ktime_get(), start);
 
+	count_direct_reclaim_stall(delay_us);
+	trace_mm_vmscan_direct_reclaim_stall(order, gfp_mask, nr_reclaimed,
+					     delay_us);
 	trace_mm_vmscan_direct_reclaim_end(nr_reclaimed);
 
 	return nr_reclaimed;
@@ -2959,6 +3068,9 @@ out:
 	 * if another caller entered the allocator slow path while kswapd
 	 * was awake, order will remain at the higher level
 	 */
+	for (i = 0; i <= end_zone; i++)
+		snapshot_refaults(pgdat->node_zones + i);
+
 	*classzone_idx = end_zone;
 	return order;
 }
@@ -3069,6 +3181,7 @@ static int kswapd(void *p)
 		 */
 		if (balanced_classzone_idx >= new_classzone_idx &&
 					balanced_order == new_order) {
+			/* Shared by the node's kswapd threads: see kswapd_threads */
 			new_order = pgdat->kswapd_max_order;
 			new_classzone_idx = pgdat->classzone_idx;
 			pgdat->kswapd_max_order =  0;
@@ -3231,34 +3344,69 @@ static int __devinit cpu_callback(struct notifier_block *nfb,
 
 			mask = cpumask_of_node(pgdat->node_id);
 
-			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids) {
+				int i;
+
 				/* One of our CPUs online: restore mask */
-				set_cpus_allowed_ptr(pgdat->kswapd, mask);
+				for (i = 0; i < MAX_KSWAPD_THREADS; i++)
+					if (pgdat->kswapd[i])
+						set_cpus_allowed_ptr(
+							pgdat->kswapd[i], mask);
+			}
 		}
 	}
 	return NOTIFY_OK;
 }
 
 /*
- * This kswapd start function will be called by init and node-hot-add.
- * On node-hot-add, kswapd will moved to proper cpus if cpus are hot-added.
+ * Number of kswapd threads per node.  Large nodes with high allocation
+ * rates can need more than one to stay ahead of the allocators; they
+ * all wait on the node's kswapd_wait and reclaim from it together.
+ *
+ * The threads also share the node's kswapd_max_order and classzone_idx.
+ * Whichever thread reads a request first takes it and resets them, so a
+ * high-order or low-zone request is served by one thread, and the others
+ * balance the whole node for order 0 alongside it.
+ */
+int kswapd_threads = 1;
+static DEFINE_MUTEX(kswapd_threads_mutex);
+
+/*
+ * This kswapd start function will be called by init and node-hot-add,
+ * and when vm.kswapd_threads changes: it starts or stops threads until
+ * the node has kswapd_threads of them.  On node-hot-add, kswapd will
+ * moved to proper cpus if cpus are hot-added.
  */
 int kswapd_run(int nid)
 {
 	pg_data_t *pgdat = NODE_DATA(nid);
-	int ret = 0;
+	struct task_struct *tsk;
+	int i;
 
-	if (pgdat->kswapd)
-		return 0;
+	for (i = MAX_KSWAPD_THREADS - 1; i >= kswapd_threads; i--) {
+		if (pgdat->kswapd[i]) {
+			kthread_stop(pgdat->kswapd[i]);
+			pgdat->kswapd[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < kswapd_threads; i++) {
+		if (pgdat->kswapd[i])
+			continue;
 
-	pgdat->kswapd = kthread_run(kswapd, pgdat, "kswapd%d", nid);
-	if (IS_ERR(pgdat->kswapd)) {
-		/* failure at boot is fatal */
-		BUG_ON(system_state == SYSTEM_BOOTING);
-		printk("Failed to start kswapd on node %d\n",nid);
-		ret = -1;
+		if (i)
+			tsk = kthread_run(kswapd, pgdat, "kswapd%d:%d", nid, i);
+		else
+			tsk = kthread_run(kswapd, pgdat, "kswapd%d", nid);
+		if (IS_ERR(tsk)) {
+			/* failure at boot is fatal */
+			BUG_ON(system_state == SYSTEM_BOOTING);
+			printk("Failed to start kswapd on node %d\n",nid);
+			return -1;
+		}
+		pgdat->kswapd[i] = tsk;
 	}
-	return ret;
+	return 0;
 }
 
 /*
@@ -3266,10 +3414,60 @@ int kswapd_run(int nid)
  */
 void kswapd_stop(int nid)
 {
-	struct task_struct *kswapd = NODE_DATA(nid)->kswapd;
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int i;
+
+	for (i = 0; i < MAX_KSWAPD_THREADS; i++) {
+		if (pgdat->kswapd[i]) {
+			kthread_stop(pgdat->kswapd[i]);
+			pgdat->kswapd[i] = NULL;
+		}
+	}
+}
+
+/* kswapd_run() fills pgdat->kswapd[] from the bottom up */
+static int kswapd_nr_running(pg_data_t *pgdat)
+{
+	int i;
+
+	for (i = 0; i < MAX_KSWAPD_THREADS && pgdat->kswapd[i]; i++)
+		;
+	return i;
+}
 
-	if (kswapd)
-		kthread_stop(kswapd);
+int kswapd_threads_sysctl_handler(ctl_table *table, int write,
+	void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int old, ret, nid;
+
+	/* Serialises against nodes coming and going, then other writers */
+	lock_memory_hotplug();
+	mutex_lock(&kswapd_threads_mutex);
+	old = kswapd_threads;
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write && kswapd_threads != old) {
+		/* cpu_callback() must not see pgdat->kswapd[] change */
+		get_online_cpus();
+retry:
+		for_each_node_state(nid, N_HIGH_MEMORY) {
+			if (kswapd_run(nid) && kswapd_threads > 1) {
+				/*
+				 * Settle every node on the threads this one
+				 * could start, so kswapd_threads tells how
+				 * many are running.
+				 */
+				kswapd_threads = max(kswapd_nr_running(
+						NODE_DATA(nid)), 1);
+				ret = -ENOMEM;
+				goto retry;
+			}
+		}
+		put_online_cpus();
+	}
+	mutex_unlock(&kswapd_threads_mutex);
+	unlock_memory_hotplug();
+
+	return ret;
 }
 
 static int __init kswapd_init(void)
@@ -602,6 +602,25 @@ int fragmentation_index(struct zone *zone, unsigned int order)
 	fill_contig_page_info(zone, order, &info);
 	return __fragmentation_index(order, &info);
 }
+
+/*
+ * Percentage of a zone's free memory that is in blocks too small for an
+ * allocation of the given order: 0 if all of it would do, 100 if none.
+ * Unlike the fragmentation index, this means something while such
+ * allocations still succeed, which is what proactive compaction needs.
+ */
+unsigned int extfrag_for_order(struct zone *zone, unsigned int order)
+{
+	struct contig_page_info info;
+
+	fill_contig_page_info(zone, order, &info);
+	if (!info.free_pages)
+		return 0;
+
+	return div_u64((u64)(info.free_pages -
+			(info.free_blocks_suitable << order)) * 100,
+			info.free_pages);
+}
 #endif
 
 #if defined(CONFIG_PROC_FS) || defined(CONFIG_COMPACTION)
@@ -709,6 +728,9 @@ const char * const vmstat_text[] = {
 	"nr_shmem",
 	"nr_dirtied",
 	"nr_written",
+	"nr_shadow_entries",
+	"workingset_refault",
+	"workingset_activate",
 
 #ifdef CONFIG_NUMA
 	"numa_hit",
@@ -754,6 +776,18 @@ const char * const vmstat_text[] = {
 	"kswapd_skip_congestion_wait",
 	"pageoutrun",
 	"allocstall",
+	"allocstall_lt_1ms",
+	"allocstall_lt_2ms",
+	"allocstall_lt_4ms",
+	"allocstall_lt_8ms",
+	"allocstall_lt_16ms",
+	"allocstall_lt_32ms",
+	"allocstall_lt_64ms",
+	"allocstall_lt_128ms",
+	"allocstall_lt_256ms",
+	"allocstall_lt_512ms",
+	"allocstall_lt_1024ms",
+	"allocstall_ge_1024ms",
 
 	"pgrotated",
 
@@ -764,6 +798,9 @@ const char * const vmstat_text[] = {
 	"compact_stall",
 	"compact_fail",
 	"compact_success",
+	"compact_direct_pages_moved",
+	"compact_proactive_pages_moved",
+	"compact_daemon_wake",
 #endif
 
 #ifdef CONFIG_HUGETLB_PAGE
@@ -785,6 +822,12 @@ const char * const vmstat_text[] = {
 	"thp_collapse_alloc",
 	"thp_collapse_alloc_failed",
 	"thp_split",
+	"thp_file_alloc",
+	"thp_file_mapped",
+#endif
+#ifdef CONFIG_SWAP
+	"swap_ra",
+	"swap_ra_hit",
 #endif
 
 #endif /* CONFIG_VM_EVENTS_COUNTERS */
@@ -0,0 +1,142 @@
+/*
+ *  linux/mm/workingset.c
+ *
+ *  Working set detection for the page cache.
+ *
+ *  File pages start out on the inactive list and are only promoted to
+ *  the active list once they are accessed a second time while there.
+ *  This keeps a stream of use-once pages, like a backup reading every
+ *  file once, from displacing the pages that are really used.  But it
+ *  also means a page that is used over and over, just less often than
+ *  the inactive list is cycled, is evicted every time and never gets
+ *  a chance to be activated.
+ *
+ *  To tell the two apart, reclaim leaves a shadow entry in the page
+ *  cache slot of each file page it evicts.  The shadow records the
+ *  zone the page was in, and the value of the zone's inactive_age, a
+ *  counter advanced by every eviction and every activation, at the
+ *  time.  When the page is faulted back in, the difference between
+ *  inactive_age then and now - the refault distance - is how many more
+ *  slots the inactive list would have needed for the page to still be
+ *  there.  If that is no more than the size of the active list, the
+ *  page would have been kept had the active list given way for it, so
+ *  it is activated right away and has to compete with the active pages
+ *  on their own terms.  Otherwise it is added to the inactive list as
+ *  usual.
+ *
+ *  Shadow entries are removed when the page comes back, and by
+ *  truncation.  Since a shadow is only useful while its refault
+ *  distance can still be smaller than the zone, there are never more
+ *  than the zone has pages: evictions beyond that don't leave one.
+ *
+ *  Refaults and activations are counted in /proc/vmstat, and vmscan
+ *  uses the activations to size the inactive file list: while they
+ *  keep happening, a new working set is establishing itself and the
+ *  active list is aged freely, otherwise it is protected like the
+ *  active anon list.
+ */
+
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/swap.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/radix-tree.h>
+#include <linux/vmstat.h>
+
+#define EVICTION_SHIFT	(RADIX_TREE_EXCEPTIONAL_SHIFT + \
+			 ZONES_SHIFT + NODES_SHIFT)
+#define EVICTION_MASK	(~0UL >> EVICTION_SHIFT)
+
+static void *pack_shadow(unsigned long eviction, struct zone *zone)
+{
+	eviction = (eviction << NODES_SHIFT) | zone_to_nid(zone);
+	eviction = (eviction << ZONES_SHIFT) | zone_idx(zone);
+	eviction = (eviction << RADIX_TREE_EXCEPTIONAL_SHIFT);
+
+	return (void *)(eviction | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static struct zone *unpack_shadow(void *shadow, unsigned long *eviction)
+{
+	unsigned long entry = (unsigned long)shadow;
+	int zid, nid;
+
+	entry >>= RADIX_TREE_EXCEPTIONAL_SHIFT;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	nid = entry & ((1UL << NODES_SHIFT) - 1);
+	entry >>= NODES_SHIFT;
+	if (eviction)
+		*eviction = entry;
+
+	return NODE_DATA(nid)->node_zones + zid;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from memory
+ * @mapping: address space the page was backing
+ * @page: the page being evicted
+ *
+ * Returns a shadow entry to be stored in @page's slot in the page cache
+ * instead of it, or NULL if the zone already has enough of them.
+ * Called under @mapping's tree_lock.
+ */
+void *workingset_eviction(struct address_space *mapping, struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	if (zone_page_state(zone, NR_SHADOW_ENTRIES) >= zone->present_pages)
+		return NULL;
+
+	__inc_zone_state(zone, NR_SHADOW_ENTRIES);
+	return pack_shadow(eviction, zone);
+}
+
+/**
+ * workingset_forget - note the removal of a shadow entry
+ * @shadow: the shadow entry being removed from the page cache
+ *
+ * Called under the mapping's tree_lock.
+ */
+void workingset_forget(void *shadow)
+{
+	__dec_zone_state(unpack_shadow(shadow, NULL), NR_SHADOW_ENTRIES);
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @shadow: shadow entry of the evicted page
+ *
+ * Calculates the refault distance of the page and decides whether it
+ * should be activated right away.
+ *
+ * Returns %true if the page should be activated, %false otherwise.
+ */
+bool workingset_refault(void *shadow)
+{
+	unsigned long eviction, refault, distance;
+	struct zone *zone;
+
+	zone = unpack_shadow(shadow, &eviction);
+	refault = atomic_long_read(&zone->inactive_age);
+	distance = (refault - eviction) & EVICTION_MASK;
+
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+	if (distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
@@ -0,0 +1,250 @@
+/*
+ * Licensed under the terms of the GNU GPL License version 2
+ *
+ * Swap stress test: several threads dirty more anonymous memory than
+ * fits in RAM, so that they swap out and in against each other, and
+ * check that every page comes back with what was written to it.  A
+ * forked child checks its copy too, which duplicates and frees swap
+ * entries while the parent is still swapping.
+ *
+ * Reports swap-out throughput from pswpout in /proc/vmstat.  Skips,
+ * successfully, when no swap is enabled.
+ *
+ * Usage: run_test [-t threads] [-m total MB] [-p passes]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long *mem;
+	size_t pages;
+	unsigned long errors;
+};
+
+static long page_size;
+static unsigned long pass;
+
+static unsigned long pattern(int id, size_t page, unsigned long gen)
+{
+	return ((unsigned long)id << 48) ^ (page << 8) ^ gen;
+}
+
+static unsigned long meminfo(const char *name)
+{
+	char line[128];
+	unsigned long val = 0;
+	size_t len = strlen(name);
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, name, len) && line[len] == ':') {
+			val = strtoul(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return val;			/* kB */
+}
+
+static unsigned long pswpout(void)
+{
+	char line[128];
+	unsigned long val = 0;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "pswpout ", 8)) {
+			val = strtoul(line + 8, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return val;			/* pages */
+}
+
+/* Check what the previous pass wrote, then write this pass' pattern */
+static unsigned long touch(int id, unsigned long *mem, size_t pages,
+			   unsigned long gen)
+{
+	size_t words = page_size / sizeof(*mem);
+	unsigned long errors = 0;
+	size_t i;
+
+	for (i = 0; i < pages; i++) {
+		unsigned long *p = mem + i * words;
+
+		if (gen && p[0] != pattern(id, i, gen - 1)) {
+			if (!errors++)
+				fprintf(stderr, "thread %d page %zu: "
+					"found %lx expected %lx\n", id, i,
+					p[0], pattern(id, i, gen - 1));
+		}
+		p[0] = pattern(id, i, gen);
+		p[words - 1] = p[0];
+	}
+	return errors;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+
+	w->errors += touch(w->id, w->mem, w->pages, pass);
+	return NULL;
+}
+
+static int run_pass(struct worker *workers, int nr_threads)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			return -1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	return 0;
+}
+
+/* The child only reads its copy: the parent's next pass still checks */
+static int check_child(struct worker *workers, int nr_threads)
+{
+	size_t words = page_size / sizeof(unsigned long);
+	unsigned long errors = 0;
+	size_t j;
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		for (i = 0; i < nr_threads; i++)
+			for (j = 0; j < workers[i].pages; j++)
+				if (workers[i].mem[j * words] !=
+				    pattern(i, j, pass))
+					errors++;
+		if (errors)
+			fprintf(stderr, "child: %lu bad pages\n", errors);
+		_exit(errors ? 1 : 0);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long total_mb = 0, passes = 3, mem_kb, swap_kb;
+	unsigned long out_start, out, errors = 0;
+	int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct worker *workers;
+	struct timeval start, end;
+	double secs;
+	int i, opt, status;
+
+	while ((opt = getopt(argc, argv, "t:m:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'm':
+			total_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-m total MB] "
+				"[-p passes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (passes < 2)
+		passes = 2;
+
+	swap_kb = meminfo("SwapFree");
+	if (!meminfo("SwapTotal") || !swap_kb) {
+		printf("swap_stress: no free swap, skipping\n");
+		return 0;
+	}
+	/* More than fits in RAM, with swap to spare */
+	mem_kb = meminfo("MemTotal");
+	if (!total_mb)
+		total_mb = (mem_kb + swap_kb / 2) / 1024;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].pages = (total_mb << 20) / page_size / nr_threads;
+		workers[i].mem = mmap(NULL, workers[i].pages * page_size,
+				      PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (workers[i].mem == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+
+	printf("swap_stress: %d threads, %lu MB, %lu passes\n",
+	       nr_threads, total_mb, passes);
+
+	for (pass = 0; pass < passes; pass++) {
+		out_start = pswpout();
+		gettimeofday(&start, NULL);
+		if (run_pass(workers, nr_threads))
+			return 1;
+		gettimeofday(&end, NULL);
+		out = pswpout() - out_start;
+		secs = (end.tv_sec - start.tv_sec) +
+		       (end.tv_usec - start.tv_usec) / 1e6;
+		printf("pass %lu: %.2fs, %lu MB swapped out, %.1f MB/s\n",
+		       pass, secs, out * page_size >> 20,
+		       secs > 0 ? (out * page_size >> 20) / secs : 0.0);
+
+		/* Share the swap entries with a child for the next pass */
+		if (pass == 0) {
+			if (check_child(workers, nr_threads))
+				return 1;
+		}
+	}
+
+	if (wait(&status) > 0 &&
+	    (!WIFEXITED(status) || WEXITSTATUS(status)))
+		errors++;
+	for (i = 0; i < nr_threads; i++)
+		errors += workers[i].errors;
+
+	if (errors) {
+		printf("swap_stress: FAILED, %lu errors\n", errors);
+		return 1;
+	}
+	printf("swap_stress: PASSED\n");
+	return 0;
+}